@@ -94,6 +94,9 @@ typedef struct track_state_t {
     int next_index;    /* info[] is a ring. next bucket goes at this idx. */
     int num_used;
 
+    /* The application applied pushback. Not reading until EAGAIN is fine */
+    int pushback;
+
     read_status_t info[TRACK_BUCKET_COUNT];
 } track_state_t;
 
@@ -107,6 +110,7 @@ struct serf_bucket_alloc_t {
     void *unfreed_baton;
 
     apr_uint32_t num_alloc;
+    apr_size_t mem_used;        /* bytes in use, including node headers */
 
     node_header_t *freelist;    /* free STANDARD_NODE_SIZE blocks */
     apr_memnode_t *blocks;      /* blocks we allocated for subdividing */
@@ -190,6 +194,7 @@ serf_bucket_alloc_t *serf_bucket_allocator_create(
         track = allocator->track = apr_palloc(pool, sizeof(*allocator->track));
         track->next_index = 0;
         track->num_used = 0;
+        track->pushback = 0;
     }
 #endif
 
@@ -212,6 +217,20 @@ apr_pool_t *serf_bucket_allocator_get_pool(
 }
 
 
+apr_size_t serf__bucket_allocator_get_used(
+    const serf_bucket_alloc_t *allocator)
+{
+    return allocator->mem_used;
+}
+
+
+apr_uint32_t serf__bucket_allocator_get_count(
+    const serf_bucket_alloc_t *allocator)
+{
+    return allocator->num_alloc;
+}
+
+
 void *serf_bucket_mem_alloc(
     serf_bucket_alloc_t *allocator,
     apr_size_t size)
@@ -279,6 +298,8 @@ void *serf_bucket_mem_alloc(
         node->size = size;
     }
 
+    allocator->mem_used += node->size;
+
     block = ((char *)node) + SIZEOF_NODE_HEADER_T;
 
 #ifdef SERF__DEBUG_UNFREED_MEMORY
@@ -322,6 +343,8 @@ void serf_bucket_mem_free(
     node = (node_header_t *)((char *)block - SIZEOF_NODE_HEADER_T);
 
     if (node->size == STANDARD_NODE_SIZE) {
+        allocator->mem_used -= STANDARD_NODE_SIZE;
+
         /* put the node onto our free list */
         node->u.next = allocator->freelist;
         allocator->freelist = node;
@@ -336,6 +359,8 @@ void serf_bucket_mem_free(
 #endif
     }
     else {
+        allocator->mem_used -= node->size;
+
 #ifdef DEBUG_DOUBLE_FREE
         /* note that this thing was freed. */
         node->size = 0;
@@ -439,7 +464,7 @@ void serf_debug__entered_loop(serf_bucket_alloc_t *allocator)
     read_status_t *rs = &track->info[0];
 
     for ( ; track->num_used; --track->num_used, ++rs ) {
-        if (rs->last == APR_SUCCESS) {
+        if (rs->last == APR_SUCCESS && !track->pushback) {
             /* Somebody should have read this bucket again. */
             abort();
         }
@@ -449,6 +474,7 @@ void serf_debug__entered_loop(serf_bucket_alloc_t *allocator)
 
     /* num_used was reset. also need to reset the next index. */
     track->next_index = 0;
+    track->pushback = 0;
 
 #endif
 }
@@ -461,6 +487,18 @@ void serf_debug__closed_conn(serf_bucket_alloc_t *allocator)
     /* Just reset the number used so that we don't examine the info[] */
     allocator->track->num_used = 0;
     allocator->track->next_index = 0;
+    allocator->track->pushback = 0;
+
+#endif
+}
+
+
+void serf_debug__pushback(serf_bucket_alloc_t *allocator)
+{
+#ifdef SERF_DEBUG_BUCKET_USE
+
+    /* Pushback is a valid alternative to reading until APR_EAGAIN */
+    allocator->track->pushback = 1;
 
 #endif
 }
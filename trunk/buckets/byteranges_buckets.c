@@ -0,0 +1,302 @@
+/* ====================================================================
+ *    Licensed to the Apache Software Foundation (ASF) under one
+ *    or more contributor license agreements.  See the NOTICE file
+ *    distributed with this work for additional information
+ *    regarding copyright ownership.  The ASF licenses this file
+ *    to you under the Apache License, Version 2.0 (the
+ *    "License"); you may not use this file except in compliance
+ *    with the License.  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing,
+ *    software distributed under the License is distributed on an
+ *    "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ *    KIND, either express or implied.  See the License for the
+ *    specific language governing permissions and limitations
+ *    under the License.
+ * ====================================================================
+ */
+
+#include <stdlib.h>
+
+#include <apr_general.h>  /* for strcasecmp() */
+#include <apr_pools.h>
+#include <apr_strings.h>
+
+#include "serf.h"
+#include "serf_private.h"
+#include "serf_bucket_util.h"
+
+
+typedef struct byteranges_context_t {
+    serf_bucket_t *stream;
+    const char *boundary;
+    apr_size_t boundary_len;
+
+    enum {
+        STATE_BOUNDARY,     /* Looking for the next boundary line */
+        STATE_HEADERS,      /* Reading the headers of a part */
+        STATE_BODY,         /* Returning the data of a part */
+        STATE_DONE          /* Read the closing boundary */
+    } state;
+
+    serf_linebuf_t linebuf;
+
+    /* Range of the current part. START and END are both inclusive */
+    bool have_range;
+    apr_uint64_t start;
+    apr_uint64_t end;
+    apr_uint64_t total;
+    apr_uint64_t remaining;   /* In the data of the current part */
+} byteranges_context_t;
+
+
+apr_status_t serf__parse_content_range(const char *value,
+                                       apr_uint64_t *start,
+                                       apr_uint64_t *end,
+                                       apr_uint64_t *total)
+{
+    char *endp;
+
+    while (*value == ' ')
+        value++;
+
+    if (strncasecmp(value, "bytes ", 6) != 0)
+        return SERF_ERROR_BAD_HTTP_RESPONSE;
+    value += 6;
+
+    while (*value == ' ')
+        value++;
+
+    if (*value == '*') {
+        /* Unsatisfied range: "bytes * / TOTAL" */
+        *start = *end = SERF_LENGTH_UNKNOWN;
+        value++;
+    }
+    else {
+        *start = apr_strtoi64(value, &endp, 10);
+        if (endp == value || *endp != '-')
+            return SERF_ERROR_BAD_HTTP_RESPONSE;
+        value = endp + 1;
+
+        *end = apr_strtoi64(value, &endp, 10);
+        if (endp == value || *end < *start)
+            return SERF_ERROR_BAD_HTTP_RESPONSE;
+        value = endp;
+    }
+
+    if (*value != '/')
+        return SERF_ERROR_BAD_HTTP_RESPONSE;
+    value++;
+
+    if (*value == '*') {
+        *total = SERF_LENGTH_UNKNOWN;
+    }
+    else {
+        *total = apr_strtoi64(value, &endp, 10);
+        if (endp == value)
+            return SERF_ERROR_BAD_HTTP_RESPONSE;
+    }
+
+    return APR_SUCCESS;
+}
+
+serf_bucket_t *serf_bucket_byteranges_create(
+    serf_bucket_t *stream,
+    const char *boundary,
+    serf_bucket_alloc_t *allocator)
+{
+    byteranges_context_t *ctx;
+
+    ctx = serf_bucket_mem_calloc(allocator, sizeof(*ctx));
+    ctx->stream = stream;
+    ctx->boundary = boundary;
+    ctx->boundary_len = strlen(boundary);
+    ctx->state = STATE_BOUNDARY;
+    serf_linebuf_init(&ctx->linebuf);
+
+    return serf_bucket_create(&serf_bucket_type_byteranges, allocator, ctx);
+}
+
+apr_status_t serf_bucket_byteranges_get_range(
+    serf_bucket_t *bucket,
+    apr_uint64_t *start,
+    apr_uint64_t *end,
+    apr_uint64_t *total)
+{
+    byteranges_context_t *ctx = bucket->data;
+
+    if (!ctx->have_range)
+        return APR_EAGAIN;
+
+    *start = ctx->start;
+    *end = ctx->end;
+    *total = ctx->total;
+
+    return APR_SUCCESS;
+}
+
+/* Processes boundaries and part headers, until we are at the data of a part
+   or at the end */
+static apr_status_t fetch_part(serf_bucket_t *bucket)
+{
+    byteranges_context_t *ctx = bucket->data;
+    apr_status_t status;
+
+    while (ctx->state == STATE_BOUNDARY || ctx->state == STATE_HEADERS) {
+        const char *line;
+
+        status = serf_linebuf_fetch(&ctx->linebuf, ctx->stream,
+                                    SERF_NEWLINE_CRLF | SERF_NEWLINE_LF);
+        if (SERF_BUCKET_READ_ERROR(status))
+            return status;
+
+        if (ctx->linebuf.state != SERF_LINEBUF_READY) {
+            if (APR_STATUS_IS_EOF(status))
+                return SERF_ERROR_TRUNCATED_HTTP_RESPONSE;
+            return status;
+        }
+
+        line = ctx->linebuf.line;
+
+        if (ctx->state == STATE_BOUNDARY) {
+            /* Skip the preamble and the CRLF ending the previous part */
+            if (ctx->linebuf.used < ctx->boundary_len + 2
+                || line[0] != '-' || line[1] != '-'
+                || strncmp(line + 2, ctx->boundary, ctx->boundary_len) != 0) {
+
+                if (APR_STATUS_IS_EOF(status))
+                    return SERF_ERROR_TRUNCATED_HTTP_RESPONSE;
+                continue;
+            }
+
+            line += 2 + ctx->boundary_len;
+            if (line[0] == '-' && line[1] == '-') {
+                ctx->state = STATE_DONE;
+                return APR_EOF;
+            }
+
+            ctx->state = STATE_HEADERS;
+            ctx->have_range = false;
+        }
+        else if (ctx->linebuf.used == 0) {
+            /* End of the part headers */
+            if (!ctx->have_range)
+                return SERF_ERROR_BAD_HTTP_RESPONSE;
+
+            ctx->remaining = ctx->end - ctx->start + 1;
+            ctx->state = STATE_BODY;
+        }
+        else if (strncasecmp(line, "Content-Range:", 14) == 0) {
+            status = serf__parse_content_range(line + 14,
+                                               &ctx->start, &ctx->end,
+                                               &ctx->total);
+            if (status)
+                return status;
+            if (ctx->start == SERF_LENGTH_UNKNOWN)
+                return SERF_ERROR_BAD_HTTP_RESPONSE;
+
+            ctx->have_range = true;
+        }
+        /* Ignore other part headers, like Content-Type */
+
+        if (APR_STATUS_IS_EOF(status) && ctx->state != STATE_BODY)
+            return SERF_ERROR_TRUNCATED_HTTP_RESPONSE;
+    }
+
+    return (ctx->state == STATE_DONE) ? APR_EOF : APR_SUCCESS;
+}
+
+static apr_status_t serf_byteranges_read(serf_bucket_t *bucket,
+                                         apr_size_t requested,
+                                         const char **data, apr_size_t *len)
+{
+    byteranges_context_t *ctx = bucket->data;
+    apr_status_t status;
+
+    *len = 0;
+
+    if (ctx->state != STATE_BODY) {
+        status = fetch_part(bucket);
+        if (status)
+            return status;
+    }
+
+    if (requested == SERF_READ_ALL_AVAIL || requested > ctx->remaining)
+        requested = (apr_size_t)ctx->remaining;
+
+    status = serf_bucket_read(ctx->stream, requested, data, len);
+    if (SERF_BUCKET_READ_ERROR(status))
+        return status;
+
+    ctx->remaining -= *len;
+
+    if (ctx->remaining == 0) {
+        ctx->state = STATE_BOUNDARY;
+        /* Report EOF once we read the closing boundary */
+        return APR_STATUS_IS_EOF(status) ? SERF_ERROR_TRUNCATED_HTTP_RESPONSE
+                                         : APR_SUCCESS;
+    }
+    else if (APR_STATUS_IS_EOF(status)) {
+        return SERF_ERROR_TRUNCATED_HTTP_RESPONSE;
+    }
+
+    return status;
+}
+
+static apr_status_t serf_byteranges_peek(serf_bucket_t *bucket,
+                                         const char **data,
+                                         apr_size_t *len)
+{
+    byteranges_context_t *ctx = bucket->data;
+    apr_status_t status;
+
+    if (ctx->state == STATE_DONE) {
+        *len = 0;
+        return APR_EOF;
+    }
+    else if (ctx->state != STATE_BODY) {
+        *len = 0;
+        return APR_SUCCESS;
+    }
+
+    status = serf_bucket_peek(ctx->stream, data, len);
+    if (SERF_BUCKET_READ_ERROR(status))
+        return status;
+
+    if (*len > ctx->remaining)
+        *len = (apr_size_t)ctx->remaining;
+
+    return APR_SUCCESS;
+}
+
+static void serf_byteranges_destroy(serf_bucket_t *bucket)
+{
+    byteranges_context_t *ctx = bucket->data;
+
+    serf_bucket_destroy(ctx->stream);
+    serf_default_destroy_and_data(bucket);
+}
+
+static apr_status_t serf_byteranges_set_config(serf_bucket_t *bucket,
+                                               serf_config_t *config)
+{
+    byteranges_context_t *ctx = bucket->data;
+
+    return serf_bucket_set_config(ctx->stream, config);
+}
+
+const serf_bucket_type_t serf_bucket_type_byteranges = {
+    "BYTERANGES",
+    serf_byteranges_read,
+    serf_default_readline,
+    serf_default_read_iovec,
+    serf_default_read_for_sendfile,
+    serf_buckets_are_v2,
+    serf_byteranges_peek,
+    serf_byteranges_destroy,
+    serf_default_read_bucket,
+    serf_default_get_remaining,
+    serf_byteranges_set_config,
+};
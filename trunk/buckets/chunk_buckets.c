@@ -40,6 +40,9 @@ typedef struct chunk_context_t {
 
     char chunk_hdr[20];
 
+    /* Headers bucket to send after the last chunk, or NULL */
+    serf_bucket_t *trailers;
+
     serf_config_t *config;
 } chunk_context_t;
 
@@ -53,11 +56,24 @@ serf_bucket_t *serf_bucket_chunk_create(
     ctx->state = STATE_FETCH;
     ctx->chunk = serf_bucket_aggregate_create(allocator);
     ctx->stream = stream;
+    ctx->trailers = NULL;
     ctx->config = NULL;
 
     return serf_bucket_create(&serf_bucket_type_chunk, allocator, ctx);
 }
 
+void serf_bucket_chunk_set_trailers(
+    serf_bucket_t *bucket,
+    serf_bucket_t *trailers)
+{
+    chunk_context_t *ctx = bucket->data;
+
+    if (ctx->trailers)
+        serf_bucket_destroy(ctx->trailers);
+
+    ctx->trailers = trailers;
+}
+
 #define CRLF "\r\n"
 
 static apr_status_t create_chunk(serf_bucket_t *bucket)
@@ -118,8 +134,15 @@ static apr_status_t create_chunk(serf_bucket_t *bucket)
     /* We've reached the end of the line for the stream. */
     if (APR_STATUS_IS_EOF(ctx->last_status)) {
         /* Insert the chunk footer. */
-        vecs[vecs_read].iov_base = "0" CRLF CRLF;
-        vecs[vecs_read++].iov_len = sizeof("0" CRLF CRLF) - 1;
+        if (ctx->trailers) {
+            /* The trailers end with the final CRLF */
+            vecs[vecs_read].iov_base = "0" CRLF;
+            vecs[vecs_read++].iov_len = sizeof("0" CRLF) - 1;
+        }
+        else {
+            vecs[vecs_read].iov_base = "0" CRLF CRLF;
+            vecs[vecs_read++].iov_len = sizeof("0" CRLF CRLF) - 1;
+        }
 
         ctx->state = STATE_EOF;
     }
@@ -130,6 +153,11 @@ static apr_status_t create_chunk(serf_bucket_t *bucket)
 
     serf_bucket_aggregate_append_iovec(ctx->chunk, vecs, vecs_read);
 
+    if (ctx->state == STATE_EOF && ctx->trailers) {
+        serf_bucket_aggregate_append(ctx->chunk, ctx->trailers);
+        ctx->trailers = NULL;
+    }
+
     return APR_SUCCESS;
 }
 
@@ -229,6 +257,8 @@ static void serf_chunk_destroy(serf_bucket_t *bucket)
 
     serf_bucket_destroy(ctx->stream);
     serf_bucket_destroy(ctx->chunk);
+    if (ctx->trailers)
+        serf_bucket_destroy(ctx->trailers);
 
     serf_default_destroy_and_data(bucket);
 }
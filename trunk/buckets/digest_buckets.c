@@ -0,0 +1,328 @@
+/* ====================================================================
+ *    Licensed to the Apache Software Foundation (ASF) under one
+ *    or more contributor license agreements.  See the NOTICE file
+ *    distributed with this work for additional information
+ *    regarding copyright ownership.  The ASF licenses this file
+ *    to you under the Apache License, Version 2.0 (the
+ *    "License"); you may not use this file except in compliance
+ *    with the License.  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing,
+ *    software distributed under the License is distributed on an
+ *    "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ *    KIND, either express or implied.  See the License for the
+ *    specific language governing permissions and limitations
+ *    under the License.
+ * ====================================================================
+ */
+
+#include <apr_pools.h>
+#include <apr_base64.h>
+#include <apr_strings.h>
+
+#include <openssl/evp.h>
+
+#include "serf.h"
+#include "serf_private.h"
+#include "serf_bucket_util.h"
+
+#if defined(OPENSSL_VERSION_NUMBER) && OPENSSL_VERSION_NUMBER < 0x10100000L
+#define EVP_MD_CTX_new EVP_MD_CTX_create
+#define EVP_MD_CTX_free EVP_MD_CTX_destroy
+#endif
+
+#define DIGEST_COUNT 3
+
+static const struct digest_info_t {
+    int algorithm;
+    const char *name;      /* As used in the Digest header (RFC 3230) */
+} digest_info[DIGEST_COUNT] = {
+    { SERF_DIGEST_MD5, "MD5" },
+    { SERF_DIGEST_SHA1, "SHA" },
+    { SERF_DIGEST_SHA256, "SHA-256" },
+};
+
+typedef struct digest_context_t {
+    serf_bucket_t *stream;
+
+    EVP_MD_CTX *md[DIGEST_COUNT];
+    unsigned char value[DIGEST_COUNT][EVP_MAX_MD_SIZE];
+    unsigned int value_len[DIGEST_COUNT];
+
+    /* Set once STREAM returned EOF and the digests are final */
+    bool done;
+    apr_status_t error;
+
+    serf_bucket_t *trailers;
+} digest_context_t;
+
+
+static const EVP_MD *digest_md(int i)
+{
+    switch (digest_info[i].algorithm) {
+        case SERF_DIGEST_MD5:
+            return EVP_md5();
+        case SERF_DIGEST_SHA1:
+            return EVP_sha1();
+        default:
+            return EVP_sha256();
+    }
+}
+
+serf_bucket_t *serf_bucket_digest_create(
+    serf_bucket_t *stream,
+    int algorithms,
+    serf_bucket_alloc_t *allocator)
+{
+    digest_context_t *ctx;
+    int i;
+
+    ctx = serf_bucket_mem_calloc(allocator, sizeof(*ctx));
+    ctx->stream = stream;
+
+    for (i = 0; i < DIGEST_COUNT; i++) {
+        if (!(algorithms & digest_info[i].algorithm))
+            continue;
+
+        ctx->md[i] = EVP_MD_CTX_new();
+        if (!ctx->md[i]
+            || !EVP_DigestInit_ex(ctx->md[i], digest_md(i), NULL)) {
+
+            ctx->error = APR_ENOTIMPL; /* E.g. MD5 in FIPS mode */
+        }
+    }
+
+    return serf_bucket_create(&serf_bucket_type_digest, allocator, ctx);
+}
+
+void serf_bucket_digest_set_trailers(
+    serf_bucket_t *bucket,
+    serf_bucket_t *trailers)
+{
+    digest_context_t *ctx = bucket->data;
+
+    ctx->trailers = trailers;
+}
+
+apr_status_t serf_bucket_digest_get(
+    serf_bucket_t *bucket,
+    int algorithm,
+    const unsigned char **digest,
+    apr_size_t *digest_len)
+{
+    digest_context_t *ctx = bucket->data;
+    int i;
+
+    for (i = 0; i < DIGEST_COUNT; i++) {
+        if (digest_info[i].algorithm == algorithm)
+            break;
+    }
+
+    if (i == DIGEST_COUNT || !ctx->md[i])
+        return APR_EINVAL;
+    else if (ctx->error)
+        return ctx->error;
+    else if (!ctx->done)
+        return APR_EINCOMPLETE;
+
+    *digest = ctx->value[i];
+    *digest_len = ctx->value_len[i];
+
+    return APR_SUCCESS;
+}
+
+/* Size of the base64 encoding of the largest digest, including the '\0' */
+#define DIGEST_B64_SIZE (((EVP_MAX_MD_SIZE + 2) / 3) * 4 + 1)
+
+/* Adds the final digests to the trailers, if any */
+static void digest_set_trailers(serf_bucket_t *bucket)
+{
+    digest_context_t *ctx = bucket->data;
+    /* Values are copied by the headers bucket, so no need to allocate */
+    char digest[DIGEST_COUNT * (sizeof("SHA-256=,") + DIGEST_B64_SIZE)];
+    apr_size_t len = 0;
+    int i;
+
+    for (i = 0; i < DIGEST_COUNT; i++) {
+        char b64[DIGEST_B64_SIZE];
+
+        if (!ctx->md[i])
+            continue;
+
+        apr_base64_encode(b64, (const char *)ctx->value[i],
+                          ctx->value_len[i]);
+
+        if (digest_info[i].algorithm == SERF_DIGEST_MD5)
+            serf_bucket_headers_setc(ctx->trailers, "Content-MD5", b64);
+
+        len += apr_snprintf(digest + len, sizeof(digest) - len, "%s%s=%s",
+                            len ? "," : "", digest_info[i].name, b64);
+    }
+
+    if (len)
+        serf_bucket_headers_setc(ctx->trailers, "Digest", digest);
+}
+
+/* Updates the digests with DATA, and finalizes them at EOF */
+static apr_status_t digest_update(serf_bucket_t *bucket,
+                                  const char *data,
+                                  apr_size_t len,
+                                  apr_status_t status)
+{
+    digest_context_t *ctx = bucket->data;
+    int i;
+
+    if (SERF_BUCKET_READ_ERROR(status) || ctx->done)
+        return status;
+
+    for (i = 0; i < DIGEST_COUNT; i++) {
+        if (ctx->md[i] && len
+            && !EVP_DigestUpdate(ctx->md[i], data, len)) {
+
+            ctx->error = APR_EGENERAL;
+            return ctx->error;
+        }
+    }
+
+    if (APR_STATUS_IS_EOF(status)) {
+        for (i = 0; i < DIGEST_COUNT; i++) {
+            if (ctx->md[i]
+                && !EVP_DigestFinal_ex(ctx->md[i], ctx->value[i],
+                                       &ctx->value_len[i])) {
+
+                ctx->error = APR_EGENERAL;
+                return ctx->error;
+            }
+        }
+        ctx->done = true;
+
+        if (ctx->trailers)
+            digest_set_trailers(bucket);
+    }
+
+    return status;
+}
+
+static apr_status_t serf_digest_read(serf_bucket_t *bucket,
+                                     apr_size_t requested,
+                                     const char **data, apr_size_t *len)
+{
+    digest_context_t *ctx = bucket->data;
+    apr_status_t status;
+
+    if (ctx->error)
+        return ctx->error;
+
+    status = serf_bucket_read(ctx->stream, requested, data, len);
+
+    return digest_update(bucket, *data, *len, status);
+}
+
+static apr_status_t serf_digest_readline(serf_bucket_t *bucket,
+                                         int acceptable, int *found,
+                                         const char **data, apr_size_t *len)
+{
+    digest_context_t *ctx = bucket->data;
+    apr_status_t status;
+
+    if (ctx->error)
+        return ctx->error;
+
+    status = serf_bucket_readline(ctx->stream, acceptable, found, data, len);
+
+    return digest_update(bucket, *data, *len, status);
+}
+
+static apr_status_t serf_digest_read_iovec(serf_bucket_t *bucket,
+                                           apr_size_t requested,
+                                           int vecs_size,
+                                           struct iovec *vecs,
+                                           int *vecs_used)
+{
+    digest_context_t *ctx = bucket->data;
+    apr_status_t status;
+    int i;
+
+    if (ctx->error)
+        return ctx->error;
+
+    status = serf_bucket_read_iovec(ctx->stream, requested, vecs_size, vecs,
+                                    vecs_used);
+
+    if (SERF_BUCKET_READ_ERROR(status))
+        return status;
+
+    for (i = 0; i < *vecs_used; i++) {
+        apr_status_t update_status;
+
+        /* Only pass the final status with the last vector */
+        update_status = digest_update(bucket, vecs[i].iov_base,
+                                      vecs[i].iov_len,
+                                      (i + 1 < *vecs_used) ? APR_SUCCESS
+                                                           : status);
+        if (SERF_BUCKET_READ_ERROR(update_status))
+            return update_status;
+    }
+
+    if (!*vecs_used)
+        return digest_update(bucket, NULL, 0, status);
+
+    return status;
+}
+
+static apr_status_t serf_digest_peek(serf_bucket_t *bucket,
+                                     const char **data,
+                                     apr_size_t *len)
+{
+    digest_context_t *ctx = bucket->data;
+
+    if (ctx->error)
+        return ctx->error;
+
+    return serf_bucket_peek(ctx->stream, data, len);
+}
+
+static apr_uint64_t serf_digest_get_remaining(serf_bucket_t *bucket)
+{
+    digest_context_t *ctx = bucket->data;
+
+    return serf_bucket_get_remaining(ctx->stream);
+}
+
+static void serf_digest_destroy(serf_bucket_t *bucket)
+{
+    digest_context_t *ctx = bucket->data;
+    int i;
+
+    for (i = 0; i < DIGEST_COUNT; i++) {
+        if (ctx->md[i])
+            EVP_MD_CTX_free(ctx->md[i]);
+    }
+
+    serf_bucket_destroy(ctx->stream);
+    serf_default_destroy_and_data(bucket);
+}
+
+static apr_status_t serf_digest_set_config(serf_bucket_t *bucket,
+                                           serf_config_t *config)
+{
+    digest_context_t *ctx = bucket->data;
+
+    return serf_bucket_set_config(ctx->stream, config);
+}
+
+const serf_bucket_type_t serf_bucket_type_digest = {
+    "DIGEST",
+    serf_digest_read,
+    serf_digest_readline,
+    serf_digest_read_iovec,
+    serf_default_read_for_sendfile,
+    serf_buckets_are_v2,
+    serf_digest_peek,
+    serf_digest_destroy,
+    serf_default_read_bucket,
+    serf_digest_get_remaining,
+    serf_digest_set_config,
+};
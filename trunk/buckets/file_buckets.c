@@ -23,11 +23,17 @@
 #include "serf.h"
 #include "serf_bucket_util.h"
 
+#include "serf_private.h"
+
 typedef struct file_context_t {
     apr_file_t *file;
 
     serf_databuf_t databuf;
     apr_uint64_t remaining;
+
+    /* Where we started reading, to allow rewinding. -1 when unknown */
+    apr_off_t start;
+    apr_uint64_t size;
 } file_context_t;
 
 
@@ -84,10 +90,38 @@ serf_bucket_t *serf_bucket_file_create(
     else {
         ctx->remaining = SERF_LENGTH_UNKNOWN;
     }
+    ctx->size = ctx->remaining;
+
+    ctx->start = 0;
+    if (apr_file_seek(file, APR_CUR, &ctx->start) != APR_SUCCESS)
+        ctx->start = -1;
 
     return serf_bucket_create(&serf_bucket_type_file, allocator, ctx);
 }
 
+apr_status_t serf__bucket_file_rewind(serf_bucket_t *bucket)
+{
+    file_context_t *ctx = bucket->data;
+    apr_off_t offset = ctx->start;
+    apr_status_t status;
+
+    if (ctx->start < 0)
+        return APR_ENOTIMPL;
+
+    status = apr_file_seek(ctx->file, APR_SET, &offset);
+    if (status)
+        return status;
+
+    /* Drop whatever we buffered */
+    serf_databuf_init(&ctx->databuf);
+    ctx->databuf.read = file_reader;
+    ctx->databuf.read_baton = ctx;
+
+    ctx->remaining = ctx->size;
+
+    return APR_SUCCESS;
+}
+
 static apr_status_t serf_file_read(serf_bucket_t *bucket,
                                    apr_size_t requested,
                                    const char **data, apr_size_t *len)
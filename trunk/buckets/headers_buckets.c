@@ -76,10 +76,13 @@ serf_bucket_t *serf_bucket_headers_create(
     return serf_bucket_create(&serf_bucket_type_headers, allocator, ctx);
 }
 
-void serf_bucket_headers_setx(
-    serf_bucket_t *bkt,
-    const char *header, apr_size_t header_size, int header_copy,
-    const char *value, apr_size_t value_size, int value_copy)
+void serf__bucket_headers_setm(serf_bucket_t *bkt,
+                               const char *header,
+                               apr_size_t header_size,
+                               int header_mode,
+                               const char *value,
+                               apr_size_t value_size,
+                               int value_mode)
 {
     headers_context_t *ctx = bkt->data;
     header_list_t *hdr;
@@ -98,20 +101,24 @@ void serf_bucket_headers_setx(
     hdr->alloc_flags = 0;
     hdr->next = NULL;
 
-    if (header_copy) {
+    if (header_mode == SERF__HEADER_COPY) {
         hdr->header = serf_bstrmemdup(bkt->allocator, header, header_size);
         hdr->alloc_flags |= ALLOC_HEADER;
     }
     else {
         hdr->header = header;
+        if (header_mode == SERF__HEADER_OWN)
+            hdr->alloc_flags |= ALLOC_HEADER;
     }
 
-    if (value_copy) {
+    if (value_mode == SERF__HEADER_COPY) {
         hdr->value = serf_bstrmemdup(bkt->allocator, value, value_size);
         hdr->alloc_flags |= ALLOC_VALUE;
     }
     else {
         hdr->value = value;
+        if (value_mode == SERF__HEADER_OWN)
+            hdr->alloc_flags |= ALLOC_VALUE;
     }
 
     /* Add the new header at the end of the list. */
@@ -123,6 +130,20 @@ void serf_bucket_headers_setx(
     ctx->last = hdr;
 }
 
+void serf_bucket_headers_setx(
+    serf_bucket_t *bkt,
+    const char *header, apr_size_t header_size, int header_copy,
+    const char *value, apr_size_t value_size, int value_copy)
+{
+    serf__bucket_headers_setm(bkt,
+                              header, header_size,
+                              header_copy ? SERF__HEADER_COPY
+                                          : SERF__HEADER_REF,
+                              value, value_size,
+                              value_copy ? SERF__HEADER_COPY
+                                         : SERF__HEADER_REF);
+}
+
 void serf_bucket_headers_set(
     serf_bucket_t *headers_bucket,
     const char *header,
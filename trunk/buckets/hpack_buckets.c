@@ -1161,15 +1161,25 @@ typedef struct serf_hpack_decode_ctx_t
     apr_size_t buffer_size;
     apr_size_t buffer_used;
 
-    const char *key; /* Allocated in tbl->alloc */
+    const char *key;
     apr_size_t key_size;
-    const char *val; /* Allocated in tbl->alloc */
+    const char *val;
     apr_size_t val_size;
     char index_item;
     char key_hm;
     char val_hm;
     apr_uint32_t reuse_item;
 
+    /* Where KEY and VAL live. Literals are decoded directly into the
+       allocator that ends up owning them: tbl->alloc when they are added
+       to the table, or the allocator of the headers bucket otherwise */
+    enum hpack_decode_src_t
+    {
+        HPACK_SRC_TABLE = 0, /* Dynamic table entry; must be copied */
+        HPACK_SRC_STATIC,    /* Static table entry; never freed */
+        HPACK_SRC_LITERAL    /* Decoded for this entry */
+    } key_src, val_src;
+
     enum
     {
         HPACK_DECODE_STATE_INITIAL = 0,
@@ -1389,16 +1399,61 @@ write_request_header(serf_hpack_decode_ctx_t *ctx)
     serf_bucket_aggregate_append(ctx->agg, ctx->headers);
 }
 
+/* Returns how the headers bucket can store a string from SRC */
+static int
+hpack_header_mode(const serf_hpack_decode_ctx_t *ctx,
+                  enum hpack_decode_src_t src)
+{
+    if (src == HPACK_SRC_STATIC)
+        return SERF__HEADER_REF;
+    else if (src == HPACK_SRC_LITERAL && !ctx->index_item)
+        return SERF__HEADER_OWN;
+    else
+        return SERF__HEADER_COPY;
+}
+
+/* Adds the current entry to the headers bucket, handing over the decoded
+   strings when possible */
+static void
+hpack_set_header(serf_hpack_decode_ctx_t *ctx)
+{
+    int key_mode = hpack_header_mode(ctx, ctx->key_src);
+    int val_mode = hpack_header_mode(ctx, ctx->val_src);
+
+    serf__bucket_headers_setm(ctx->headers,
+                              ctx->key, ctx->key_size, key_mode,
+                              ctx->val, ctx->val_size, val_mode);
+
+    /* Now owned by the headers bucket */
+    if (key_mode == SERF__HEADER_OWN)
+        ctx->key = NULL;
+    if (val_mode == SERF__HEADER_OWN)
+        ctx->val = NULL;
+}
+
+/* Returns the value as a string allocated in ALLOC, taking over the
+   decoded string when possible */
+static char *
+hpack_take_value(serf_hpack_decode_ctx_t *ctx,
+                 serf_bucket_alloc_t *alloc)
+{
+    char *val;
+
+    if (hpack_header_mode(ctx, ctx->val_src) != SERF__HEADER_OWN)
+        return serf_bstrmemdup(alloc, ctx->val, ctx->val_size);
+
+    val = (char *)ctx->val;
+    ctx->val = NULL;
+    return val;
+}
+
 static apr_status_t
 handle_read_entry_and_clear(serf_hpack_decode_ctx_t *ctx,
                             serf_bucket_alloc_t *alloc)
 {
     serf_hpack_table_t *tbl = ctx->tbl;
-    const char *keep_key = NULL;
-    const char *keep_val = NULL;
-    apr_status_t status;
-    char own_key;
-    char own_val;
+    bool own_key;
+    bool own_val;
 
     serf__log(LOGLVL_INFO, SERF_LOGCOMP_PROTOCOL, __FILE__, ctx->config,
               "Parsed from HPACK: %.*s: %.*s\n",
@@ -1413,7 +1468,12 @@ handle_read_entry_and_clear(serf_hpack_decode_ctx_t *ctx,
             b = SERF_BUCKET_SIMPLE_STRING("HTTP/2.0 ", alloc);
             serf_bucket_aggregate_append(ctx->agg, b);
 
-            b = serf_bucket_simple_copy_create(ctx->val, ctx->val_size, alloc);
+            if (ctx->val_src == HPACK_SRC_STATIC)
+                b = SERF_BUCKET_SIMPLE_STRING_LEN(ctx->val, ctx->val_size,
+                                                  alloc);
+            else
+                b = serf_bucket_simple_own_create(hpack_take_value(ctx, alloc),
+                                                  ctx->val_size, alloc);
             serf_bucket_aggregate_append(ctx->agg, b);
 
             b = SERF_BUCKET_SIMPLE_STRING(" <http2>\r\n", alloc);
@@ -1425,24 +1485,21 @@ handle_read_entry_and_clear(serf_hpack_decode_ctx_t *ctx,
         else if (ctx->key_size == 7 && !strcmp(ctx->key, ":method"))
         {
             ctx->is_request = true;
-            ctx->method = serf_bstrmemdup(ctx->agg->allocator,
-                                          ctx->val, ctx->val_size);
+            ctx->method = hpack_take_value(ctx, ctx->agg->allocator);
             if (ctx->authority && ctx->method && ctx->path)
                 write_request_header(ctx);
         }
         else if (ctx->key_size == 10 && !strcmp(ctx->key, ":authority"))
         {
             ctx->is_request = true;
-            ctx->authority = serf_bstrmemdup(ctx->agg->allocator,
-                                             ctx->val, ctx->val_size);
+            ctx->authority = hpack_take_value(ctx, ctx->agg->allocator);
             if (ctx->authority && ctx->method && ctx->path)
                 write_request_header(ctx);
         }
         else if (ctx->key_size == 5 && !strcmp(ctx->key, ":path"))
         {
             ctx->is_request = true;
-            ctx->path = serf_bstrmemdup(ctx->agg->allocator,
-                                        ctx->val, ctx->val_size);
+            ctx->path = hpack_take_value(ctx, ctx->agg->allocator);
             if (ctx->authority && ctx->method && ctx->path)
                 write_request_header(ctx);
         }
@@ -1466,23 +1523,17 @@ handle_read_entry_and_clear(serf_hpack_decode_ctx_t *ctx,
                 serf_bucket_aggregate_append(ctx->agg, ctx->headers);
             }
 
-            serf_bucket_headers_setc(ctx->headers, ctx->key, ctx->val);
+            hpack_set_header(ctx);
         }
     }
     else if (ctx->key_size && ctx->key[0] != ':')
     {
-        serf_bucket_headers_setc(ctx->headers, ctx->key, ctx->val);
-    }
-
-    if (ctx->reuse_item)
-    {
-        status = hpack_table_get(ctx->reuse_item, tbl,
-                                 &keep_key, NULL,
-                                 &keep_val, NULL);
+        hpack_set_header(ctx);
     }
 
-    own_key = (ctx->key && ctx->key != keep_key);
-    own_val = (ctx->val && ctx->val != keep_val);
+    /* Literals that weren't handed over are still ours */
+    own_key = (ctx->key && ctx->key_src == HPACK_SRC_LITERAL);
+    own_val = (ctx->val && ctx->val_src == HPACK_SRC_LITERAL);
 
     if (ctx->index_item)
     {
@@ -1508,10 +1559,49 @@ handle_read_entry_and_clear(serf_hpack_decode_ctx_t *ctx,
     else
     {
         if (own_key)
-            serf_bucket_mem_free(tbl->alloc, (void*)ctx->key);
+            serf_bucket_mem_free(alloc, (void*)ctx->key);
         if (own_val)
-            serf_bucket_mem_free(tbl->alloc, (void*)ctx->val);
+            serf_bucket_mem_free(alloc, (void*)ctx->val);
+    }
+
+    ctx->key = ctx->val = NULL;
+    return APR_SUCCESS;
+}
+
+/* Decodes the LEN byte literal at DATA, Huffman encoded when HM is set,
+   into a new string allocated in ALLOC. The Huffman output is written in
+   place into a buffer large enough for the longest possible result */
+static apr_status_t
+hpack_decode_literal(const char **result,
+                     apr_size_t *result_size,
+                     const void *data,
+                     apr_size_t len,
+                     char hm,
+                     serf_bucket_alloc_t *alloc)
+{
+    apr_size_t avail;
+    char *text;
+    apr_status_t status;
+
+    if (!hm)
+    {
+        *result = serf_bstrmemdup(alloc, data, len);
+        *result_size = len;
+        return APR_SUCCESS;
+    }
+
+    /* The shortest code is 5 bits, and we need room for a final '\0' */
+    avail = len * 8 / 5 + 1;
+    text = serf_bucket_mem_alloc(alloc, avail);
+
+    status = serf__hpack_huffman_decode(data, len, avail, text, result_size);
+    if (status)
+    {
+        serf_bucket_mem_free(alloc, text);
+        return status;
     }
+
+    *result = text;
     return APR_SUCCESS;
 }
 
@@ -1619,6 +1709,8 @@ hpack_process(serf_bucket_t *bucket)
 
                     ctx->key_hm = ctx->val_hm = FALSE;
                     ctx->reuse_item = 0;
+                    ctx->key = ctx->val = NULL;
+                    ctx->key_src = ctx->val_src = HPACK_SRC_TABLE;
 
                     uc = *data;
                     if (uc & 0x80)
@@ -1693,6 +1785,9 @@ hpack_process(serf_bucket_t *bucket)
                     if (status)
                         return status;
 
+                    if (v <= hpack_static_table_count)
+                        ctx->key_src = ctx->val_src = HPACK_SRC_STATIC;
+
                     if (ctx->header_allowed <= HPACK_KEY_SIZE(ctx->key_size)
                         + HPACK_KEY_SIZE(ctx->val_size))
                     {
@@ -1725,6 +1820,9 @@ hpack_process(serf_bucket_t *bucket)
                     if (status)
                         return status;
 
+                    if (v <= hpack_static_table_count)
+                        ctx->key_src = HPACK_SRC_STATIC;
+
                       /* Get key from table */
                     ctx->state = HPACK_DECODE_STATE_VALUE_LEN;
                     if (HPACK_KEY_SIZE(ctx->key_size) >= ctx->header_allowed)
@@ -1760,35 +1858,19 @@ hpack_process(serf_bucket_t *bucket)
                     if (status)
                         continue;
 
-                    if (ctx->key_hm)
-                    {
-                        apr_size_t ks;
-                        char *key;
-
-                        status = serf__hpack_huffman_decode(data,
-                                                            ctx->key_size,
-                                                            0, NULL, &ks);
-
-                        if (status)
-                            return status;
-
-                        if (HPACK_KEY_SIZE(ks) >= ctx->header_allowed)
-                            return SERF_ERROR_HTTP2_COMPRESSION_ERROR;
-
-                        key = serf_bucket_mem_alloc(ctx->tbl->alloc, ks + 1);
+                    status = hpack_decode_literal(&ctx->key, &ctx->key_size,
+                                                  data, ctx->key_size,
+                                                  ctx->key_hm,
+                                                  ctx->index_item
+                                                    ? ctx->tbl->alloc
+                                                    : bucket->allocator);
+                    if (status)
+                        return status;
 
-                        status = serf__hpack_huffman_decode(data,
-                                                            ctx->key_size,
-                                                            ks + 1, key,
-                                                            &ctx->key_size);
-                        if (status)
-                            return status;
+                    ctx->key_src = HPACK_SRC_LITERAL;
 
-                        ctx->key = key;
-                    }
-                    else
-                        ctx->key = serf_bstrmemdup(ctx->tbl->alloc, data,
-                                                   ctx->key_size);
+                    if (HPACK_KEY_SIZE(ctx->key_size) >= ctx->header_allowed)
+                        return SERF_ERROR_HTTP2_COMPRESSION_ERROR;
 
                     ctx->state = HPACK_DECODE_STATE_VALUE_LEN;
                     ctx->header_allowed -= HPACK_KEY_SIZE(ctx->key_size);
@@ -1821,34 +1903,19 @@ hpack_process(serf_bucket_t *bucket)
                     if (status)
                         continue;
 
-                    if (ctx->val_hm)
-                    {
-                        apr_size_t ks;
-                        char *val;
-
-                        status = serf__hpack_huffman_decode(data,
-                                                            ctx->val_size,
-                                                            0, NULL, &ks);
-                        if (status)
-                            return status;
-
-                        if (HPACK_KEY_SIZE(ks) >= ctx->header_allowed)
-                            return SERF_ERROR_HTTP2_COMPRESSION_ERROR;
-
-                        val = serf_bucket_mem_alloc(ctx->tbl->alloc, ks + 1);
+                    status = hpack_decode_literal(&ctx->val, &ctx->val_size,
+                                                  data, ctx->val_size,
+                                                  ctx->val_hm,
+                                                  ctx->index_item
+                                                    ? ctx->tbl->alloc
+                                                    : bucket->allocator);
+                    if (status)
+                        return status;
 
-                        status = serf__hpack_huffman_decode(data,
-                                                            ctx->val_size,
-                                                            ks + 1, val,
-                                                            &ctx->val_size);
-                        if (status)
-                            return status;
+                    ctx->val_src = HPACK_SRC_LITERAL;
 
-                        ctx->val = val;
-                    }
-                    else
-                        ctx->val = serf_bstrmemdup(ctx->tbl->alloc, data,
-                                                   ctx->val_size);
+                    if (HPACK_KEY_SIZE(ctx->val_size) >= ctx->header_allowed)
+                        return SERF_ERROR_HTTP2_COMPRESSION_ERROR;
 
                     ctx->header_allowed -= HPACK_KEY_SIZE(ctx->val_size);
 
@@ -1989,9 +2056,16 @@ serf_hpack_decode_destroy(serf_bucket_t *bucket)
 
     serf_bucket_mem_free(bucket->allocator, ctx->buffer);
 
-    /* Key and value are handled by table. If we fail reading
-       table can't be used anyway, so the allocator cleanup will
-       handle the leak */
+    /* Literals of an incomplete entry. If we fail reading the table
+       can't be used anyway, so for those decoded for the table the
+       allocator cleanup will handle the leak */
+    if (!ctx->index_item)
+    {
+        if (ctx->key && ctx->key_src == HPACK_SRC_LITERAL)
+            serf_bucket_mem_free(bucket->allocator, (void*)ctx->key);
+        if (ctx->val && ctx->val_src == HPACK_SRC_LITERAL)
+            serf_bucket_mem_free(bucket->allocator, (void*)ctx->val);
+    }
 
     serf_default_destroy_and_data(bucket);
 }
@@ -600,10 +600,14 @@ const serf_bucket_type_t serf_bucket_type__http2_unpad = {
 
 /* ==================================================================== */
 
+/* Payload bytes of small control frames that are stored in the frame
+   bucket itself. Large enough for PING, WINDOW_UPDATE, RST_STREAM,
+   PRIORITY and a few SETTINGS */
+#define FRAME_INLINE_SIZE 16
+
 typedef struct serf_http2_frame_context_t {
     serf_bucket_t *stream;
     serf_bucket_alloc_t *alloc;
-    serf_bucket_t *chunk;
     apr_size_t bytes_remaining;
     apr_size_t max_payload_size;
 
@@ -613,6 +617,13 @@ typedef struct serf_http2_frame_context_t {
     unsigned char flags;
     char created_frame;
 
+    /* The frame header, followed by INLINE_LEN bytes of payload that are
+       sent before STREAM. Written without allocating separate buckets */
+    unsigned char buffer[FRAME_PREFIX_SIZE + FRAME_INLINE_SIZE];
+    apr_size_t inline_len;
+    apr_size_t buffer_pos;
+    apr_size_t buffer_len;
+
     apr_int32_t *p_stream_id;
     void *stream_id_baton;
     void(*stream_id_alloc)(void *baton, apr_int32_t *stream_id);
@@ -621,6 +632,34 @@ typedef struct serf_http2_frame_context_t {
 
 } serf_http2_frame_context_t;
 
+static serf_http2_frame_context_t *
+http2_frame_ctx_create(serf_bucket_t *stream,
+                       unsigned char frame_type,
+                       unsigned char flags,
+                       apr_uint32_t max_payload_size,
+                       serf_bucket_alloc_t *alloc)
+{
+    serf_http2_frame_context_t *ctx = serf_bucket_mem_alloc(alloc,
+                                                            sizeof(*ctx));
+
+    if (max_payload_size > 0xFFFFFF)
+        max_payload_size = 0xFFFFFF;
+
+    ctx->alloc = alloc;
+    ctx->stream = stream;
+    ctx->max_payload_size = max_payload_size;
+    ctx->frametype = frame_type;
+    ctx->flags = flags;
+    ctx->inline_len = 0;
+    ctx->buffer_pos = 0;
+    ctx->buffer_len = 0;
+
+    ctx->config = NULL;
+    ctx->created_frame = FALSE;
+
+    return ctx;
+}
+
 serf_bucket_t *
 serf__bucket_http2_frame_create(serf_bucket_t *stream,
                                 unsigned char frame_type,
@@ -633,18 +672,10 @@ serf__bucket_http2_frame_create(serf_bucket_t *stream,
                                 apr_uint32_t max_payload_size,
                                 serf_bucket_alloc_t *alloc)
 {
-    serf_http2_frame_context_t *ctx = serf_bucket_mem_alloc(alloc,
-                                                            sizeof(*ctx));
+    serf_http2_frame_context_t *ctx;
 
-    ctx->alloc = alloc;
-    ctx->stream = stream;
-    ctx->chunk = serf_bucket_aggregate_create(alloc);
-    ctx->max_payload_size = max_payload_size;
-    ctx->frametype = frame_type;
-    ctx->flags = flags;
-
-    if (max_payload_size > 0xFFFFFF)
-        max_payload_size = 0xFFFFFF;
+    ctx = http2_frame_ctx_create(stream, frame_type, flags,
+                                 max_payload_size, alloc);
 
     if (!stream_id_alloc || (stream_id && *stream_id >= 0))
     {
@@ -667,8 +698,40 @@ serf__bucket_http2_frame_create(serf_bucket_t *stream,
         ctx->stream_id_baton = stream_id_baton;
     }
 
-    ctx->config = NULL;
-    ctx->created_frame = FALSE;
+    return serf_bucket_create(&serf_bucket_type__http2_frame, alloc, ctx);
+}
+
+serf_bucket_t *
+serf__bucket_http2_frame_create_inline(const void *payload,
+                                       apr_size_t payload_len,
+                                       unsigned char frame_type,
+                                       unsigned char flags,
+                                       apr_int32_t stream_id,
+                                       serf_bucket_alloc_t *alloc)
+{
+    serf_http2_frame_context_t *ctx;
+
+    if (payload_len > FRAME_INLINE_SIZE) {
+        serf_bucket_t *stream;
+
+        stream = serf_bucket_simple_copy_create(payload, payload_len, alloc);
+
+        return serf__bucket_http2_frame_create(stream, frame_type, flags,
+                                               &stream_id, NULL, NULL,
+                                               0xFFFFFF, alloc);
+    }
+
+    ctx = http2_frame_ctx_create(NULL, frame_type, flags, FRAME_INLINE_SIZE,
+                                 alloc);
+
+    if (payload_len)
+        memcpy(ctx->buffer + FRAME_PREFIX_SIZE, payload, payload_len);
+    ctx->inline_len = payload_len;
+
+    ctx->stream_id = stream_id;
+    ctx->p_stream_id = &ctx->stream_id;
+    ctx->stream_id_alloc = NULL;
+    ctx->stream_id_baton = NULL;
 
     return serf_bucket_create(&serf_bucket_type__http2_frame, alloc, ctx);
 }
@@ -694,13 +757,7 @@ http2_prepare_frame(serf_bucket_t *bucket)
     {
         return SERF_ERROR_HTTP2_FRAME_SIZE_ERROR;
     }
-    else if (payload_remaining != SERF_LENGTH_UNKNOWN) {
-        if (ctx->stream)
-            serf_bucket_aggregate_append(ctx->chunk, ctx->stream);
-
-        ctx->stream = NULL; /* Now managed by aggregate */
-    }
-    else {
+    else if (payload_remaining == SERF_LENGTH_UNKNOWN) {
       /* Our payload doesn't know how long it is. Our only option
          now is to create the actual data */
         struct iovec vecs[SERF__STD_IOV_COUNT];
@@ -713,18 +770,20 @@ http2_prepare_frame(serf_bucket_t *bucket)
             return status;
         else if (APR_STATUS_IS_EOF(status))
         {
-          /* OK, we got everything, let's put the data at the start of the
+            serf_bucket_t *chunk = serf_bucket_aggregate_create(ctx->alloc);
+
+          /* OK, we got everything, let's put the data at the start of an
              aggregate. */
-            serf_bucket_aggregate_append_iovec(ctx->chunk, vecs, vecs_used);
+            serf_bucket_aggregate_append_iovec(chunk, vecs, vecs_used);
 
             /* Obtain the size now , to avoid problems when the bucket
                doesn't know that it has nothing remaining*/
-            payload_remaining = serf_bucket_get_remaining(ctx->chunk);
+            payload_remaining = serf_bucket_get_remaining(chunk);
 
             /* Just add the stream behind the iovecs. This keeps the chunks
                 available exactly until they are no longer necessary */
-            serf_bucket_aggregate_append(ctx->chunk, ctx->stream);
-            ctx->stream = NULL; /* Managed by aggregate */
+            serf_bucket_aggregate_append(chunk, ctx->stream);
+            ctx->stream = chunk; /* Managed by aggregate */
 
             if (payload_remaining == SERF_LENGTH_UNKNOWN)
             {
@@ -784,24 +843,22 @@ http2_prepare_frame(serf_bucket_t *bucket)
                 return SERF_ERROR_HTTP2_FRAME_SIZE_ERROR;
             }
             else {
-              /* Ok, we have what we need in our buffer */
-                serf_bucket_aggregate_append(
-                    ctx->chunk,
-                    serf_bucket_simple_own_create(data, total,
-                                                  bucket->allocator));
-                payload_remaining = total;
-
-                /* And we no longer need stream */
+              /* Ok, we have what we need in our buffer. And we no longer
+                 need stream */
                 serf_bucket_destroy(ctx->stream);
-                ctx->stream = NULL;
+                ctx->stream = serf_bucket_simple_own_create(data, total,
+                                                            bucket->allocator);
+                payload_remaining = total;
             }
         }
     }
 
+    payload_remaining += ctx->inline_len;
+
   /* Ok, now we can construct the frame */
     ctx->created_frame = TRUE;
     {
-        unsigned char frame[FRAME_PREFIX_SIZE];
+        unsigned char *frame = ctx->buffer;
 
         /* Allocate the streamid if there isn't one.
            Once the streamid hits the wire it automatically closes all
@@ -823,11 +880,8 @@ http2_prepare_frame(serf_bucket_t *bucket)
         frame[7] = ((apr_uint32_t)ctx->stream_id >> 8) & 0xFF;
         frame[8] = ctx->stream_id & 0xFF;
 
-        /* Put the frame before the data */
-        serf_bucket_aggregate_prepend(ctx->chunk,
-                    serf_bucket_simple_copy_create((const char *)&frame,
-                                                    FRAME_PREFIX_SIZE,
-                                                    ctx->alloc));
+        /* The header (and inline payload) is read before the stream */
+        ctx->buffer_len = FRAME_PREFIX_SIZE + ctx->inline_len;
 
         /* And set the amount of data that we verify will be read */
         ctx->bytes_remaining = (apr_size_t)payload_remaining
@@ -836,28 +890,20 @@ http2_prepare_frame(serf_bucket_t *bucket)
     return APR_SUCCESS;
 }
 
+/* Accounts LEN bytes read from the frame, with STATUS the result of the
+   read operation */
 static apr_status_t
-serf_http2_frame_read(serf_bucket_t *bucket,
-                      apr_size_t requested,
-                      const char **data,
-                      apr_size_t *len)
+http2_frame_account(serf_http2_frame_context_t *ctx,
+                    apr_size_t len,
+                    apr_status_t status)
 {
-    serf_http2_frame_context_t *ctx = bucket->data;
-    apr_status_t status;
-
-    status = http2_prepare_frame(bucket);
-    if (status)
-        return status;
-
-    status = serf_bucket_read(ctx->chunk, requested, data, len);
-
     if (!SERF_BUCKET_READ_ERROR(status)) {
-        if (*len > ctx->bytes_remaining)
+        if (len > ctx->bytes_remaining)
         {
           /* Frame payload resized after the header was written */
             return SERF_ERROR_HTTP2_FRAME_SIZE_ERROR;
         }
-        ctx->bytes_remaining -= *len;
+        ctx->bytes_remaining -= len;
     }
 
     if (APR_STATUS_IS_EOF(status)) {
@@ -870,6 +916,37 @@ serf_http2_frame_read(serf_bucket_t *bucket,
     return status;
 }
 
+static apr_status_t
+serf_http2_frame_read(serf_bucket_t *bucket,
+                      apr_size_t requested,
+                      const char **data,
+                      apr_size_t *len)
+{
+    serf_http2_frame_context_t *ctx = bucket->data;
+    apr_status_t status;
+
+    status = http2_prepare_frame(bucket);
+    if (status)
+        return status;
+
+    if (ctx->buffer_pos < ctx->buffer_len) {
+        *data = (const char *)ctx->buffer + ctx->buffer_pos;
+        *len = MIN(requested, ctx->buffer_len - ctx->buffer_pos);
+        ctx->buffer_pos += *len;
+        ctx->bytes_remaining -= *len;
+
+        return ctx->bytes_remaining ? APR_SUCCESS : APR_EOF;
+    }
+    else if (!ctx->stream) {
+        *len = 0;
+        status = APR_EOF;
+    }
+    else
+        status = serf_bucket_read(ctx->stream, requested, data, len);
+
+    return http2_frame_account(ctx, *len, status);
+}
+
 static apr_status_t
 serf_http2_frame_read_iovec(serf_bucket_t *bucket,
                             apr_size_t requested,
@@ -878,38 +955,55 @@ serf_http2_frame_read_iovec(serf_bucket_t *bucket,
                             int *vecs_used)
 {
     serf_http2_frame_context_t *ctx = bucket->data;
+    apr_size_t len = 0;
     apr_status_t status;
+    int i;
 
     status = http2_prepare_frame(bucket);
     if (status)
         return status;
 
-    status = serf_bucket_read_iovec(ctx->chunk, requested, vecs_size, vecs,
-                                    vecs_used);
+    *vecs_used = 0;
 
-    if (!SERF_BUCKET_READ_ERROR(status)) {
-        apr_size_t len = 0;
-        int i;
+    if (ctx->buffer_pos < ctx->buffer_len && vecs_size > 0) {
+        len = MIN(requested, ctx->buffer_len - ctx->buffer_pos);
 
-        for (i = 0; i < *vecs_used; i++)
-            len += vecs[i].iov_len;
+        vecs[0].iov_base = ctx->buffer + ctx->buffer_pos;
+        vecs[0].iov_len = len;
+        ctx->buffer_pos += len;
+        ctx->bytes_remaining -= len;
+        *vecs_used = 1;
 
-        if (len > ctx->bytes_remaining)
+        if (requested != SERF_READ_ALL_AVAIL)
+            requested -= len;
+
+        if (!ctx->bytes_remaining)
+            return APR_EOF;
+        else if (!requested || ctx->buffer_pos < ctx->buffer_len
+                 || vecs_size == 1)
         {
-          /* Frame resized after the header was written */
-            return SERF_ERROR_HTTP2_FRAME_SIZE_ERROR;
+            return APR_SUCCESS;
         }
-        ctx->bytes_remaining -= len;
     }
 
-    if (APR_STATUS_IS_EOF(status)) {
-        if (ctx->bytes_remaining > 0) {
-          /* Frame payload resized after the header was written */
-            return SERF_ERROR_HTTP2_FRAME_SIZE_ERROR;
-        }
+    if (!ctx->stream)
+        return http2_frame_account(ctx, 0, APR_EOF);
+
+    status = serf_bucket_read_iovec(ctx->stream, requested,
+                                    vecs_size - *vecs_used,
+                                    vecs + *vecs_used, &i);
+
+    if (!SERF_BUCKET_READ_ERROR(status)) {
+        int j;
+
+        len = 0;
+        for (j = 0; j < i; j++)
+            len += vecs[*vecs_used + j].iov_len;
+
+        *vecs_used += i;
     }
 
-    return status;
+    return http2_frame_account(ctx, len, status);
 }
 
 static apr_status_t
@@ -926,7 +1020,18 @@ serf_http2_frame_peek(serf_bucket_t *bucket,
         return APR_SUCCESS;
     }
 
-    return serf_bucket_peek(ctx->chunk, data, len);
+    if (ctx->buffer_pos < ctx->buffer_len) {
+        *data = (const char *)ctx->buffer + ctx->buffer_pos;
+        *len = ctx->buffer_len - ctx->buffer_pos;
+
+        return (*len == ctx->bytes_remaining) ? APR_EOF : APR_SUCCESS;
+    }
+    else if (!ctx->stream) {
+        *len = 0;
+        return APR_EOF;
+    }
+
+    return serf_bucket_peek(ctx->stream, data, len);
 }
 
 static apr_uint64_t
@@ -961,8 +1066,6 @@ serf_http2_frame_destroy(serf_bucket_t *bucket)
     if (ctx->stream)
         serf_bucket_destroy(ctx->stream);
 
-    serf_bucket_destroy(ctx->chunk);
-
     serf_default_destroy_and_data(bucket);
 }
 
@@ -24,6 +24,8 @@
 #include "serf.h"
 #include "serf_bucket_util.h"
 
+#include "serf_private.h"
+
 #if APR_HAS_MMAP
 
 typedef struct mmap_context_t {
@@ -49,6 +51,16 @@ serf_bucket_t *serf_bucket_mmap_create(
     return serf_bucket_create(&serf_bucket_type_mmap, allocator, ctx);
 }
 
+apr_status_t serf__bucket_mmap_rewind(serf_bucket_t *bucket)
+{
+    mmap_context_t *ctx = bucket->data;
+
+    ctx->offset = 0;
+    ctx->remaining = ctx->mmap->size;
+
+    return APR_SUCCESS;
+}
+
 static apr_status_t serf_mmap_read(serf_bucket_t *bucket,
                                    apr_size_t requested,
                                    const char **data, apr_size_t *len)
@@ -158,6 +170,11 @@ serf_bucket_t *serf_bucket_mmap_create(apr_mmap_t *file_mmap,
     return NULL;
 }
 
+apr_status_t serf__bucket_mmap_rewind(serf_bucket_t *bucket)
+{
+    return APR_ENOTIMPL;
+}
+
 const serf_bucket_type_t serf_bucket_type_mmap = {
     "MMAP",
     NULL,
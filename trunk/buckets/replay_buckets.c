@@ -0,0 +1,472 @@
+/* ====================================================================
+ *    Licensed to the Apache Software Foundation (ASF) under one
+ *    or more contributor license agreements.  See the NOTICE file
+ *    distributed with this work for additional information
+ *    regarding copyright ownership.  The ASF licenses this file
+ *    to you under the Apache License, Version 2.0 (the
+ *    "License"); you may not use this file except in compliance
+ *    with the License.  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing,
+ *    software distributed under the License is distributed on an
+ *    "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ *    KIND, either express or implied.  See the License for the
+ *    specific language governing permissions and limitations
+ *    under the License.
+ * ====================================================================
+ */
+
+#include <apr_pools.h>
+#include <apr_file_io.h>
+#include <apr_strings.h>
+
+#include "serf.h"
+#include "serf_private.h"
+#include "serf_bucket_util.h"
+
+
+/* A piece of journaled data kept in memory. The data follows the header */
+typedef struct replay_chunk_t {
+    struct replay_chunk_t *next;
+    apr_size_t len;
+} replay_chunk_t;
+
+#define CHUNK_DATA(chunk) ((const char *)(chunk) + sizeof(replay_chunk_t))
+
+typedef struct replay_context_t {
+    serf_bucket_t *stream;
+
+    /* Stream that can rewind itself (file or mmap), so no journal needed */
+    bool stream_rewinds;
+
+    /* Set when the journal couldn't be written. Rewinding is then no longer
+       possible, but reading continues */
+    bool broken;
+
+    /* The journal. The first HELD_SIZE bytes are stored in memory, anything
+       after that in the journal file */
+    replay_chunk_t *first;
+    replay_chunk_t *last;
+    apr_size_t held_size;
+    apr_size_t memory_budget;
+
+    const char *temp_dir;
+    apr_pool_t *file_pool;
+    apr_file_t *file;
+    apr_off_t file_written;
+    apr_off_t file_read;
+    serf_databuf_t *databuf;
+
+    /* Total number of bytes in the journal, and our read position in it.
+       We are replaying while POSITION < JOURNAL_SIZE */
+    apr_uint64_t journal_size;
+    apr_uint64_t position;
+    replay_chunk_t *cur_chunk;
+    apr_size_t cur_offset;
+
+    /* EOF or error status from STREAM, to return after the journaled data */
+    apr_status_t stream_status;
+} replay_context_t;
+
+
+serf_bucket_t *serf_bucket_replay_create(
+    serf_bucket_t *stream,
+    apr_size_t memory_budget,
+    const char *temp_dir,
+    serf_bucket_alloc_t *allocator)
+{
+    replay_context_t *ctx;
+
+    ctx = serf_bucket_mem_calloc(allocator, sizeof(*ctx));
+    ctx->stream = stream;
+    ctx->memory_budget = memory_budget;
+    ctx->temp_dir = temp_dir;
+    ctx->stream_status = APR_SUCCESS;
+
+    if (SERF_BUCKET_IS_FILE(stream) || SERF_BUCKET_IS_MMAP(stream))
+        ctx->stream_rewinds = true;
+
+    return serf_bucket_create(&serf_bucket_type_replay, allocator, ctx);
+}
+
+/* Implements serf_databuf_reader_t, reading back from the journal file */
+static apr_status_t replay_file_reader(void *baton,
+                                       apr_size_t bufsize,
+                                       char *buf,
+                                       apr_size_t *len)
+{
+    replay_context_t *ctx = baton;
+    apr_off_t offset = ctx->file_read;
+    apr_status_t status;
+
+    if ((apr_uint64_t)(ctx->file_written - ctx->file_read) < bufsize)
+        bufsize = (apr_size_t)(ctx->file_written - ctx->file_read);
+
+    status = apr_file_seek(ctx->file, APR_SET, &offset);
+    if (status)
+        return status;
+
+    status = apr_file_read_full(ctx->file, buf, bufsize, len);
+    if (status)
+        return status;
+
+    ctx->file_read += *len;
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t replay_open_file(serf_bucket_t *bucket)
+{
+    replay_context_t *ctx = bucket->data;
+    const char *temp_dir = ctx->temp_dir;
+    char *path;
+    apr_status_t status;
+
+    status = apr_pool_create(&ctx->file_pool,
+                             serf_bucket_allocator_get_pool(bucket->allocator));
+    if (status)
+        return status;
+
+    if (!temp_dir) {
+        status = apr_temp_dir_get(&temp_dir, ctx->file_pool);
+        if (status)
+            return status;
+    }
+
+    path = apr_pstrcat(ctx->file_pool, temp_dir, "/serf-replayXXXXXX",
+                       NULL);
+
+    status = apr_file_mktemp(&ctx->file, path,
+                             APR_FOPEN_CREATE | APR_FOPEN_READ
+                             | APR_FOPEN_WRITE | APR_FOPEN_EXCL
+                             | APR_FOPEN_BINARY | APR_FOPEN_DELONCLOSE,
+                             ctx->file_pool);
+    if (status) {
+        ctx->file = NULL;
+        return status;
+    }
+
+    ctx->databuf = serf_bucket_mem_alloc(bucket->allocator,
+                                         sizeof(*ctx->databuf));
+    serf_databuf_init(ctx->databuf);
+    ctx->databuf->read = replay_file_reader;
+    ctx->databuf->read_baton = ctx;
+
+    return APR_SUCCESS;
+}
+
+/* Appends DATA to the journal */
+static apr_status_t replay_journal(serf_bucket_t *bucket,
+                                   const char *data,
+                                   apr_size_t len)
+{
+    replay_context_t *ctx = bucket->data;
+    apr_status_t status;
+    apr_off_t offset;
+    apr_size_t written;
+
+    if (!len)
+        return APR_SUCCESS;
+
+    if (ctx->file_written == 0
+        && ctx->held_size + len <= ctx->memory_budget) {
+
+        replay_chunk_t *chunk;
+
+        chunk = serf_bucket_mem_alloc(bucket->allocator,
+                                      sizeof(*chunk) + len);
+        chunk->next = NULL;
+        chunk->len = len;
+        memcpy((char *)CHUNK_DATA(chunk), data, len);
+
+        if (ctx->last)
+            ctx->last->next = chunk;
+        else
+            ctx->first = chunk;
+        ctx->last = chunk;
+
+        ctx->held_size += len;
+        return APR_SUCCESS;
+    }
+
+    if (!ctx->file) {
+        status = replay_open_file(bucket);
+        if (status)
+            return status;
+    }
+
+    offset = ctx->file_written;
+    status = apr_file_seek(ctx->file, APR_SET, &offset);
+    if (status)
+        return status;
+
+    status = apr_file_write_full(ctx->file, data, len, &written);
+    if (status)
+        return status;
+
+    ctx->file_written += written;
+
+    return APR_SUCCESS;
+}
+
+/* Journals DATA, just read from the stream */
+static void replay_record(serf_bucket_t *bucket,
+                          const char *data,
+                          apr_size_t len)
+{
+    replay_context_t *ctx = bucket->data;
+
+    if (ctx->broken)
+        return;
+
+    if (replay_journal(bucket, data, len))
+        ctx->broken = true;
+    else {
+        ctx->journal_size += len;
+        ctx->position = ctx->journal_size;
+    }
+}
+
+apr_status_t serf_bucket_replay_rewind(serf_bucket_t *bucket)
+{
+    replay_context_t *ctx = bucket->data;
+
+    if (ctx->stream_rewinds) {
+        if (SERF_BUCKET_IS_FILE(ctx->stream))
+            return serf__bucket_file_rewind(ctx->stream);
+        else
+            return serf__bucket_mmap_rewind(ctx->stream);
+    }
+
+    if (ctx->broken)
+        return APR_ENOTIMPL;
+
+    ctx->position = 0;
+    ctx->cur_chunk = ctx->first;
+    ctx->cur_offset = 0;
+
+    if (ctx->databuf) {
+        ctx->file_read = 0;
+        serf_databuf_init(ctx->databuf);
+        ctx->databuf->read = replay_file_reader;
+        ctx->databuf->read_baton = ctx;
+    }
+
+    return APR_SUCCESS;
+}
+
+/* Returns the status to report after returning data from the journal */
+static apr_status_t replay_status(replay_context_t *ctx)
+{
+    if (ctx->position == ctx->journal_size && ctx->stream_status)
+        return ctx->stream_status;
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t serf_replay_read(serf_bucket_t *bucket,
+                                     apr_size_t requested,
+                                     const char **data, apr_size_t *len)
+{
+    replay_context_t *ctx = bucket->data;
+    apr_status_t status;
+
+    if (ctx->stream_rewinds)
+        return serf_bucket_read(ctx->stream, requested, data, len);
+
+    if (ctx->position < ctx->journal_size) {
+        if (ctx->position < ctx->held_size) {
+            replay_chunk_t *chunk = ctx->cur_chunk;
+
+            *data = CHUNK_DATA(chunk) + ctx->cur_offset;
+            *len = chunk->len - ctx->cur_offset;
+
+            if (requested != SERF_READ_ALL_AVAIL && requested < *len)
+                *len = requested;
+
+            ctx->cur_offset += *len;
+            if (ctx->cur_offset == chunk->len) {
+                ctx->cur_chunk = chunk->next;
+                ctx->cur_offset = 0;
+            }
+        }
+        else {
+            status = serf_databuf_read(ctx->databuf, requested, data, len);
+            if (SERF_BUCKET_READ_ERROR(status))
+                return status;
+        }
+
+        ctx->position += *len;
+        return replay_status(ctx);
+    }
+
+    if (ctx->stream_status) {
+        *len = 0;
+        return ctx->stream_status;
+    }
+
+    status = serf_bucket_read(ctx->stream, requested, data, len);
+    if (SERF_BUCKET_READ_ERROR(status))
+        return status;
+
+    replay_record(bucket, *data, *len);
+
+    if (APR_STATUS_IS_EOF(status))
+        ctx->stream_status = status;
+
+    return status;
+}
+
+static apr_status_t serf_replay_read_iovec(serf_bucket_t *bucket,
+                                           apr_size_t requested,
+                                           int vecs_size,
+                                           struct iovec *vecs,
+                                           int *vecs_used)
+{
+    replay_context_t *ctx = bucket->data;
+    apr_status_t status;
+    int i;
+
+    if (ctx->stream_rewinds)
+        return serf_bucket_read_iovec(ctx->stream, requested,
+                                      vecs_size, vecs, vecs_used);
+
+    /* The journal is returned a chunk at a time */
+    if (ctx->position < ctx->journal_size || ctx->stream_status)
+        return serf_default_read_iovec(bucket, requested,
+                                       vecs_size, vecs, vecs_used);
+
+    status = serf_bucket_read_iovec(ctx->stream, requested,
+                                    vecs_size, vecs, vecs_used);
+    if (SERF_BUCKET_READ_ERROR(status))
+        return status;
+
+    for (i = 0; i < *vecs_used; i++)
+        replay_record(bucket, vecs[i].iov_base, vecs[i].iov_len);
+
+    if (APR_STATUS_IS_EOF(status))
+        ctx->stream_status = status;
+
+    return status;
+}
+
+static apr_status_t serf_replay_read_for_sendfile(serf_bucket_t *bucket,
+                                                  apr_size_t requested,
+                                                  apr_hdtr_t *hdtr,
+                                                  apr_file_t **file,
+                                                  apr_off_t *offset,
+                                                  apr_size_t *len)
+{
+    replay_context_t *ctx = bucket->data;
+
+    /* A file can be sent as is, as it rewinds itself. Anything else has to
+       pass through the journal */
+    if (ctx->stream_rewinds)
+        return serf_bucket_read_for_sendfile(ctx->stream, requested,
+                                             hdtr, file, offset, len);
+
+    return serf_default_read_for_sendfile(bucket, requested,
+                                          hdtr, file, offset, len);
+}
+
+static apr_status_t serf_replay_peek(serf_bucket_t *bucket,
+                                     const char **data,
+                                     apr_size_t *len)
+{
+    replay_context_t *ctx = bucket->data;
+    apr_status_t status;
+
+    if (ctx->stream_rewinds)
+        return serf_bucket_peek(ctx->stream, data, len);
+
+    if (ctx->position < ctx->journal_size) {
+        if (ctx->position < ctx->held_size) {
+            *data = CHUNK_DATA(ctx->cur_chunk) + ctx->cur_offset;
+            *len = ctx->cur_chunk->len - ctx->cur_offset;
+        }
+        else {
+            status = serf_databuf_peek(ctx->databuf, data, len);
+            if (SERF_BUCKET_READ_ERROR(status))
+                return status;
+        }
+
+        if (ctx->position + *len == ctx->journal_size)
+            return ctx->stream_status ? ctx->stream_status : APR_SUCCESS;
+
+        return APR_SUCCESS;
+    }
+
+    if (ctx->stream_status) {
+        *len = 0;
+        return ctx->stream_status;
+    }
+
+    return serf_bucket_peek(ctx->stream, data, len);
+}
+
+static apr_uint64_t serf_replay_get_remaining(serf_bucket_t *bucket)
+{
+    replay_context_t *ctx = bucket->data;
+    apr_uint64_t remaining;
+
+    if (ctx->stream_rewinds)
+        return serf_bucket_get_remaining(ctx->stream);
+
+    if (APR_STATUS_IS_EOF(ctx->stream_status))
+        remaining = 0;
+    else if (ctx->stream_status)
+        return SERF_LENGTH_UNKNOWN;
+    else {
+        remaining = serf_bucket_get_remaining(ctx->stream);
+
+        if (remaining == SERF_LENGTH_UNKNOWN)
+            return SERF_LENGTH_UNKNOWN;
+    }
+
+    return remaining + (ctx->journal_size - ctx->position);
+}
+
+static void serf_replay_destroy(serf_bucket_t *bucket)
+{
+    replay_context_t *ctx = bucket->data;
+
+    while (ctx->first) {
+        replay_chunk_t *next = ctx->first->next;
+
+        serf_bucket_mem_free(bucket->allocator, ctx->first);
+        ctx->first = next;
+    }
+
+    if (ctx->databuf)
+        serf_bucket_mem_free(bucket->allocator, ctx->databuf);
+
+    if (ctx->file_pool)
+        apr_pool_destroy(ctx->file_pool);
+
+    serf_bucket_destroy(ctx->stream);
+    serf_default_destroy_and_data(bucket);
+}
+
+static apr_status_t serf_replay_set_config(serf_bucket_t *bucket,
+                                           serf_config_t *config)
+{
+    replay_context_t *ctx = bucket->data;
+
+    return serf_bucket_set_config(ctx->stream, config);
+}
+
+const serf_bucket_type_t serf_bucket_type_replay = {
+    "REPLAY",
+    serf_replay_read,
+    serf_default_readline,
+    serf_replay_read_iovec,
+    serf_replay_read_for_sendfile,
+    serf_buckets_are_v2,
+    serf_replay_peek,
+    serf_replay_destroy,
+    serf_default_read_bucket,
+    serf_replay_get_remaining,
+    serf_replay_set_config,
+};
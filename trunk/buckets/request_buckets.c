@@ -32,6 +32,7 @@ typedef struct request_context_t {
     const char *uri;
     serf_bucket_t *headers;
     serf_bucket_t *body;
+    serf_bucket_t *trailers;
     apr_int64_t len;
     serf_config_t *config;
 } request_context_t;
@@ -52,6 +53,7 @@ serf_bucket_t *serf_bucket_request_create(
     ctx->uri = URI;
     ctx->headers = serf_bucket_headers_create(allocator);
     ctx->body = body;
+    ctx->trailers = NULL;
     ctx->len = LENGTH_UNKNOWN;
     ctx->config = NULL;
 
@@ -67,6 +69,18 @@ void serf_bucket_request_set_CL(
     ctx->len = len;
 }
 
+void serf_bucket_request_set_trailers(
+    serf_bucket_t *bucket,
+    serf_bucket_t *trailers)
+{
+    request_context_t *ctx = (request_context_t *)bucket->data;
+
+    if (ctx->trailers)
+        serf_bucket_destroy(ctx->trailers);
+
+    ctx->trailers = trailers;
+}
+
 serf_bucket_t *serf_bucket_request_get_headers(
     serf_bucket_t *bucket)
 {
@@ -88,6 +102,21 @@ void serf__bucket_request_read(serf_bucket_t *request_bucket,
         *method = ctx->method;
 }
 
+void serf__bucket_request_set_body(serf_bucket_t *request_bucket,
+                                   serf_bucket_t *body)
+{
+    request_context_t *ctx = request_bucket->data;
+
+    ctx->body = body;
+}
+
+apr_int64_t serf__bucket_request_get_CL(serf_bucket_t *request_bucket)
+{
+    request_context_t *ctx = request_bucket->data;
+
+    return ctx->len;
+}
+
 
 void serf_bucket_request_set_root(
     serf_bucket_t *bucket,
@@ -110,6 +139,17 @@ void serf_bucket_request_set_root(
                         NULL);
 }
 
+/* Implements serf_bucket_event_callback_t. Destroys the trailers that can't
+   be sent, once the body that may still add to them is gone */
+static apr_status_t destroy_trailers(void *baton,
+                                     apr_uint64_t bytes_read)
+{
+    serf_bucket_t *trailers = baton;
+
+    serf_bucket_destroy(trailers);
+    return APR_SUCCESS;
+}
+
 static void serialize_data(serf_bucket_t *bucket)
 {
     request_context_t *ctx = bucket->data;
@@ -146,6 +186,17 @@ static void serialize_data(serf_bucket_t *bucket)
         char buf[30];
         apr_snprintf(buf, 30, "%" APR_INT64_T_FMT, ctx->len);
         serf_bucket_headers_set(ctx->headers, "Content-Length", buf);
+
+        /* No way to send trailers without chunking. A digest bucket in the
+           body may still add to them, so keep them as long as the body */
+        if (ctx->body != NULL && ctx->trailers)
+            ctx->body = serf__bucket_event_create(ctx->body, ctx->trailers,
+                                                  NULL, NULL,
+                                                  destroy_trailers,
+                                                  bucket->allocator);
+        else if (ctx->trailers)
+            serf_bucket_destroy(ctx->trailers);
+
         if (ctx->body != NULL)
             serf_bucket_aggregate_append(bucket, ctx->body);
     }
@@ -153,8 +204,13 @@ static void serialize_data(serf_bucket_t *bucket)
         /* Morph the body bucket to a chunked encoding bucket for now. */
         serf_bucket_headers_setn(ctx->headers, "Transfer-Encoding", "chunked");
         ctx->body = serf_bucket_chunk_create(ctx->body, bucket->allocator);
+        if (ctx->trailers)
+            serf_bucket_chunk_set_trailers(ctx->body, ctx->trailers);
         serf_bucket_aggregate_append(bucket, ctx->body);
     }
+    else if (ctx->trailers) {
+        serf_bucket_destroy(ctx->trailers);
+    }
 
     /* Our private context is no longer needed, and is not referred to by
      * any existing bucket. Toss it.
@@ -229,6 +285,9 @@ static void serf_request_destroy(serf_bucket_t *bucket)
     if (ctx->body) {
         serf_bucket_destroy(ctx->body);
     }
+    if (ctx->trailers) {
+        serf_bucket_destroy(ctx->trailers);
+    }
 
     serf_default_destroy_and_data(bucket);
 }
@@ -246,6 +305,9 @@ void serf_bucket_request_become(
     ctx->uri = uri;
     ctx->headers = serf_bucket_headers_create(bucket->allocator);
     ctx->body = body;
+    ctx->trailers = NULL;
+    ctx->len = LENGTH_UNKNOWN;
+    ctx->config = NULL;
 
     bucket->type = &serf_bucket_type_request;
     bucket->data = ctx;
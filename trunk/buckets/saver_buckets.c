@@ -0,0 +1,403 @@
+/* ====================================================================
+ *    Licensed to the Apache Software Foundation (ASF) under one
+ *    or more contributor license agreements.  See the NOTICE file
+ *    distributed with this work for additional information
+ *    regarding copyright ownership.  The ASF licenses this file
+ *    to you under the Apache License, Version 2.0 (the
+ *    "License"); you may not use this file except in compliance
+ *    with the License.  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing,
+ *    software distributed under the License is distributed on an
+ *    "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ *    KIND, either express or implied.  See the License for the
+ *    specific language governing permissions and limitations
+ *    under the License.
+ * ====================================================================
+ */
+
+#include <apr_pools.h>
+#include <apr_file_io.h>
+#include <apr_strings.h>
+
+#include "serf.h"
+#include "serf_private.h"
+#include "serf_bucket_util.h"
+
+
+#define IOVEC_HOLD_COUNT 16
+
+typedef struct saver_context_t {
+    serf_bucket_t *stream;
+
+    /* Data saved in memory. An aggregate of simple buckets, which is always
+       read before anything stored in the spill file. */
+    serf_bucket_t *held;
+    apr_size_t held_size;
+    apr_size_t memory_budget;
+
+    /* Spill file, created on first use. FILE_READ and FILE_WRITTEN are the
+       offsets of the next read and write. When everything is read back both
+       are reset to 0, to reuse the file. */
+    const char *temp_dir;
+    apr_pool_t *file_pool;
+    apr_file_t *file;
+    apr_off_t file_read;
+    apr_off_t file_written;
+    serf_databuf_t *databuf;
+
+    /* EOF or error status from STREAM, to return after the saved data */
+    apr_status_t stream_status;
+} saver_context_t;
+
+
+serf_bucket_t *serf_bucket_saver_create(
+    serf_bucket_t *stream,
+    apr_size_t memory_budget,
+    const char *temp_dir,
+    serf_bucket_alloc_t *allocator)
+{
+    saver_context_t *ctx;
+
+    ctx = serf_bucket_mem_alloc(allocator, sizeof(*ctx));
+    ctx->stream = stream;
+    ctx->held = serf_bucket_aggregate_create(allocator);
+    ctx->held_size = 0;
+    ctx->memory_budget = memory_budget;
+    ctx->temp_dir = temp_dir;
+    ctx->file_pool = NULL;
+    ctx->file = NULL;
+    ctx->file_read = 0;
+    ctx->file_written = 0;
+    ctx->databuf = NULL;
+    ctx->stream_status = APR_SUCCESS;
+
+    return serf_bucket_create(&serf_bucket_type_saver, allocator, ctx);
+}
+
+/* Implements serf_databuf_reader_t, reading back from the spill file */
+static apr_status_t saver_file_reader(void *baton,
+                                      apr_size_t bufsize,
+                                      char *buf,
+                                      apr_size_t *len)
+{
+    saver_context_t *ctx = baton;
+    apr_off_t offset = ctx->file_read;
+    apr_status_t status;
+
+    if ((apr_uint64_t)(ctx->file_written - ctx->file_read) < bufsize)
+        bufsize = (apr_size_t)(ctx->file_written - ctx->file_read);
+
+    status = apr_file_seek(ctx->file, APR_SET, &offset);
+    if (status)
+        return status;
+
+    status = apr_file_read_full(ctx->file, buf, bufsize, len);
+    if (status)
+        return status;
+
+    ctx->file_read += *len;
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t saver_open_file(serf_bucket_t *bucket)
+{
+    saver_context_t *ctx = bucket->data;
+    const char *temp_dir = ctx->temp_dir;
+    char *path;
+    apr_status_t status;
+
+    status = apr_pool_create(&ctx->file_pool,
+                             serf_bucket_allocator_get_pool(bucket->allocator));
+    if (status)
+        return status;
+
+    if (!temp_dir) {
+        status = apr_temp_dir_get(&temp_dir, ctx->file_pool);
+        if (status)
+            return status;
+    }
+
+    path = apr_pstrcat(ctx->file_pool, temp_dir, "/serf-saverXXXXXX",
+                       NULL);
+
+    /* The file is removed as soon as it is closed, which happens when
+       FILE_POOL is destroyed */
+    status = apr_file_mktemp(&ctx->file, path,
+                             APR_FOPEN_CREATE | APR_FOPEN_READ
+                             | APR_FOPEN_WRITE | APR_FOPEN_EXCL
+                             | APR_FOPEN_BINARY | APR_FOPEN_DELONCLOSE,
+                             ctx->file_pool);
+    if (status) {
+        ctx->file = NULL;
+        return status;
+    }
+
+    ctx->databuf = serf_bucket_mem_alloc(bucket->allocator,
+                                         sizeof(*ctx->databuf));
+    serf_databuf_init(ctx->databuf);
+    ctx->databuf->read = saver_file_reader;
+    ctx->databuf->read_baton = ctx;
+
+    return APR_SUCCESS;
+}
+
+/* Stores the data in VECS at the end of the saved data */
+static apr_status_t saver_store(serf_bucket_t *bucket,
+                                struct iovec *vecs,
+                                int vecs_used,
+                                apr_size_t total)
+{
+    saver_context_t *ctx = bucket->data;
+    apr_status_t status;
+    apr_off_t offset;
+    apr_size_t written;
+    char *data;
+
+    if (!total)
+        return APR_SUCCESS;
+
+    /* Keep the data in memory when it fits in our budget, unless we already
+       started spilling. Otherwise we would reorder the data */
+    if (ctx->file_written == 0
+        && ctx->held_size + total <= ctx->memory_budget) {
+
+        data = serf_bucket_mem_alloc(bucket->allocator, total);
+        serf__copy_iovec(data, NULL, vecs, vecs_used);
+
+        serf_bucket_aggregate_append(
+                ctx->held,
+                serf_bucket_simple_own_create(data, total,
+                                              bucket->allocator));
+        ctx->held_size += total;
+        return APR_SUCCESS;
+    }
+
+    if (!ctx->file) {
+        status = saver_open_file(bucket);
+        if (status)
+            return status;
+    }
+
+    offset = ctx->file_written;
+    status = apr_file_seek(ctx->file, APR_SET, &offset);
+    if (status)
+        return status;
+
+    status = apr_file_writev_full(ctx->file, vecs, vecs_used, &written);
+    if (status)
+        return status;
+
+    ctx->file_written += written;
+
+    return APR_SUCCESS;
+}
+
+apr_status_t serf_bucket_saver_drain(serf_bucket_t *bucket)
+{
+    saver_context_t *ctx = bucket->data;
+    apr_status_t status;
+
+    if (ctx->stream_status)
+        return ctx->stream_status;
+
+    do {
+        struct iovec vecs[IOVEC_HOLD_COUNT];
+        int vecs_used;
+        apr_size_t total = 0;
+        apr_status_t store_status;
+        int i;
+
+        status = serf_bucket_read_iovec(ctx->stream, SERF_READ_ALL_AVAIL,
+                                        IOVEC_HOLD_COUNT, vecs, &vecs_used);
+
+        if (SERF_BUCKET_READ_ERROR(status)) {
+            ctx->stream_status = status;
+            return status;
+        }
+
+        for (i = 0; i < vecs_used; i++)
+            total += vecs[i].iov_len;
+
+        store_status = saver_store(bucket, vecs, vecs_used, total);
+        if (store_status)
+            return store_status;
+
+    } while (!status);
+
+    if (APR_STATUS_IS_EOF(status))
+        ctx->stream_status = status;
+
+    return status;
+}
+
+apr_uint64_t serf_bucket_saver_get_saved(serf_bucket_t *bucket)
+{
+    saver_context_t *ctx = bucket->data;
+    apr_uint64_t saved = ctx->held_size;
+
+    saved += (ctx->file_written - ctx->file_read);
+
+    if (ctx->databuf)
+        saved += ctx->databuf->remaining;
+
+    return saved;
+}
+
+/* Returns whether the spill file (or its read buffer) holds any data */
+static bool saver_file_pending(saver_context_t *ctx)
+{
+    return ctx->databuf
+           && (ctx->databuf->remaining || ctx->file_read < ctx->file_written);
+}
+
+static void saver_file_check_empty(saver_context_t *ctx)
+{
+    if (!saver_file_pending(ctx)) {
+        /* Everything was read back. Start writing at the start again */
+        ctx->file_read = ctx->file_written = 0;
+    }
+}
+
+static apr_status_t serf_saver_read(serf_bucket_t *bucket,
+                                    apr_size_t requested,
+                                    const char **data, apr_size_t *len)
+{
+    saver_context_t *ctx = bucket->data;
+    apr_status_t status;
+
+    if (ctx->held_size) {
+        status = serf_bucket_read(ctx->held, requested, data, len);
+        if (SERF_BUCKET_READ_ERROR(status))
+            return status;
+
+        ctx->held_size -= *len;
+
+        /* There may be more in the file or the stream */
+        return APR_SUCCESS;
+    }
+
+    if (saver_file_pending(ctx)) {
+        status = serf_databuf_read(ctx->databuf, requested, data, len);
+        if (SERF_BUCKET_READ_ERROR(status))
+            return status;
+
+        saver_file_check_empty(ctx);
+        return APR_SUCCESS;
+    }
+
+    if (ctx->stream_status) {
+        *len = 0;
+        return ctx->stream_status;
+    }
+
+    return serf_bucket_read(ctx->stream, requested, data, len);
+}
+
+static apr_status_t serf_saver_read_iovec(serf_bucket_t *bucket,
+                                          apr_size_t requested,
+                                          int vecs_size,
+                                          struct iovec *vecs,
+                                          int *vecs_used)
+{
+    saver_context_t *ctx = bucket->data;
+
+    /* Only pass through when we don't have anything saved */
+    if (ctx->held_size || saver_file_pending(ctx) || ctx->stream_status)
+        return serf_default_read_iovec(bucket, requested, vecs_size, vecs,
+                                       vecs_used);
+
+    return serf_bucket_read_iovec(ctx->stream, requested, vecs_size, vecs,
+                                  vecs_used);
+}
+
+static apr_status_t serf_saver_peek(serf_bucket_t *bucket,
+                                    const char **data,
+                                    apr_size_t *len)
+{
+    saver_context_t *ctx = bucket->data;
+    apr_status_t status;
+
+    if (ctx->held_size) {
+        status = serf_bucket_peek(ctx->held, data, len);
+        if (SERF_BUCKET_READ_ERROR(status))
+            return status;
+
+        return APR_SUCCESS;
+    }
+
+    if (saver_file_pending(ctx)) {
+        status = serf_databuf_peek(ctx->databuf, data, len);
+        if (SERF_BUCKET_READ_ERROR(status))
+            return status;
+
+        return APR_SUCCESS;
+    }
+
+    if (ctx->stream_status) {
+        *len = 0;
+        return ctx->stream_status;
+    }
+
+    return serf_bucket_peek(ctx->stream, data, len);
+}
+
+static apr_uint64_t serf_saver_get_remaining(serf_bucket_t *bucket)
+{
+    saver_context_t *ctx = bucket->data;
+    apr_uint64_t remaining;
+
+    if (APR_STATUS_IS_EOF(ctx->stream_status))
+        remaining = 0;
+    else if (ctx->stream_status)
+        return SERF_LENGTH_UNKNOWN;
+    else {
+        remaining = serf_bucket_get_remaining(ctx->stream);
+
+        if (remaining == SERF_LENGTH_UNKNOWN)
+            return SERF_LENGTH_UNKNOWN;
+    }
+
+    return remaining + serf_bucket_saver_get_saved(bucket);
+}
+
+static void serf_saver_destroy(serf_bucket_t *bucket)
+{
+    saver_context_t *ctx = bucket->data;
+
+    serf_bucket_destroy(ctx->held);
+
+    if (ctx->databuf)
+        serf_bucket_mem_free(bucket->allocator, ctx->databuf);
+
+    if (ctx->file_pool)
+        apr_pool_destroy(ctx->file_pool);
+
+    serf_bucket_destroy(ctx->stream);
+    serf_default_destroy_and_data(bucket);
+}
+
+static apr_status_t serf_saver_set_config(serf_bucket_t *bucket,
+                                          serf_config_t *config)
+{
+    saver_context_t *ctx = bucket->data;
+
+    return serf_bucket_set_config(ctx->stream, config);
+}
+
+const serf_bucket_type_t serf_bucket_type_saver = {
+    "SAVER",
+    serf_saver_read,
+    serf_default_readline,
+    serf_saver_read_iovec,
+    serf_default_read_for_sendfile,
+    serf_buckets_are_v2,
+    serf_saver_peek,
+    serf_saver_destroy,
+    serf_default_read_bucket,
+    serf_saver_get_remaining,
+    serf_saver_set_config,
+};
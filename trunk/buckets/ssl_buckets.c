@@ -31,11 +31,22 @@
 #include <apr_base64.h>
 #include <apr_version.h>
 #include <apr_atomic.h>
+#include <apr_hash.h>
+#include <apr_file_info.h>
+#if APR_HAS_THREADS
+#include <apr_thread_mutex.h>
+#endif
 
 #include "serf.h"
 #include "serf_private.h"
 #include "serf_bucket_util.h"
 
+#ifdef SERF_HAVE_WOLFSSL
+/* wolfSSL's OpenSSL compatibility layer depends on how wolfSSL was built */
+#include <wolfssl/options.h>
+#include <wolfssl/version.h>
+#endif
+
 #include <openssl/bio.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
@@ -51,6 +62,8 @@
 
 #ifdef SERF_NO_SSL_X509_STORE_WRAPPERS
 #define X509_STORE_get0_param(store) ((store)->param)
+#define X509_STORE_CTX_get0_cert(store_ctx) ((store_ctx)->cert)
+#define X509_STORE_CTX_get0_untrusted(store_ctx) ((store_ctx)->untrusted)
 #endif
 
 #ifdef SERF_NO_SSL_X509_GET0_NOTBEFORE
@@ -69,6 +82,21 @@
 #define ASN1_STRING_get0_data(asn1string) (ASN1_STRING_data(asn1string))
 #endif
 
+#ifdef SERF_NO_SSL_X509_UP_REF
+#define X509_up_ref(cert) \
+    (CRYPTO_add(&(cert)->references, 1, CRYPTO_LOCK_X509))
+#endif
+
+#ifdef SERF_NO_SSL_EVP_PKEY_UP_REF
+#define EVP_PKEY_up_ref(pkey) \
+    (CRYPTO_add(&(pkey)->references, 1, CRYPTO_LOCK_EVP_PKEY))
+#endif
+
+#ifdef SERF_NO_SSL_X509_CRL_UP_REF
+#define X509_CRL_up_ref(crl) \
+    (CRYPTO_add(&(crl)->references, 1, CRYPTO_LOCK_X509_CRL))
+#endif
+
 /*
  * Here's an overview of the SSL bucket's relationship to OpenSSL and serf.
  *
@@ -80,21 +108,22 @@
  * HTTP request read call path:
  *
  * write_to_connection
- *  |- serf_bucket_read on SSLENCRYPT
- *    |- serf_ssl_read
- *      |- serf_databuf_read
- *        |- common_databuf_prep
+ *  |- serf_bucket_read_iovec on SSLENCRYPT
+ *    |- serf_ssl_encrypt_read_iovec
  *          |- ssl_encrypt
- *            |- 1. Try to read pending encrypted data; If available, return.
+ *            |- 1. If encrypted data is pending, return it.
  *            |- 2. Try to read from ctx->stream [REQUEST bucket]
- *            |- 3. Call SSL_write with read data
+ *            |- 3. Call SSL_write with record sized slices of the read
+ *                  data, or with small pieces gathered in the stage buffer
  *              |- ...
  *                |- bio_bucket_read can be called
  *                  |- read data from ctx->decrypt.stream
  *                |- bio_bucket_write with encrypted data
- *                  |- store in sink
- *            |- 4. If successful, read pending encrypted data and return.
- *            |- 5. If fails, place read data back in ctx->stream
+ *                  |- store in a record buffer
+ *            |- 4. Move the record buffers to encrypt_pending, and
+ *                  return its iovecs without copying
+ *            |- 5. If SSL_write fails, keep the slice in the stage buffer
+ *                  and place the rest of the read data back in ctx->stream
  *
  * HTTP response read call path:
  *
@@ -117,13 +146,60 @@
  *
  */
 
+/* Largest plaintext in a TLS record */
+#define SSL_RECORD_PLAINTEXT 16384
+
+/* Size of the buffers collecting ciphertext: a complete record, with the
+   largest expansion the record layer allows, plus its header */
+#define SSL_RECORD_BUFSIZE (SSL_RECORD_PLAINTEXT + 2048 + 5)
+
+/* Plaintext of at least this size is encrypted straight from the memory
+   of the bucket that returned it. Smaller pieces are gathered in the stage
+   buffer first, to avoid sending many tiny records */
+#define SSL_DIRECT_MIN 4096
+
+/* Plaintext encrypted per call, when the caller asks for all */
+#define SSL_ENCRYPT_BATCH (4 * SSL_RECORD_PLAINTEXT)
+
+/* Plaintext in the records sent at the start of a connection and after
+   it was idle, so that each record fits in a single TCP segment and can
+   be decrypted as soon as that segment arrives */
+#define SSL_RECORD_SMALL 1400
+
+/* States of sending TLS 1.3 early data */
+#define SSL_EARLY_NONE   0  /* Not offered, or over */
+#define SSL_EARLY_GATHER 1  /* Collecting the data offered by the connection */
+#define SSL_EARLY_SENT   2  /* Sent, waiting for the server to accept it */
+
+/* Defaults for SERF_CONFIG_CTX_TLS_RECORD_RAMP and _IDLE. Dynamic record
+   sizing is off unless configured */
+#define SSL_RECORD_RAMP_DEFAULT 0
+#define SSL_RECORD_IDLE_DEFAULT apr_time_from_sec(1)
+
+/* Largest values accepted for SERF_CONFIG_CTX_TLS_RECORD_RAMP and _IDLE */
+#define SSL_RECORD_RAMP_MAX APR_INT32_MAX
+#define SSL_RECORD_IDLE_MAX APR_INT32_MAX
+
+/* How far the clock of an OCSP responder may be off from ours */
+#define SSL_OCSP_CLOCK_SKEW apr_time_from_sec(300)
+
+/* Crypto in async jobs, where the file descriptors the jobs signal can be
+   polled like sockets */
+#if defined(SSL_MODE_ASYNC) && !defined(WIN32)
+#define SSL_HAVE_ASYNC
+#endif
+
+/* How often the files of a CRL store are checked for changes, by default */
+#define SSL_CRL_CHECK_INTERVAL apr_time_from_sec(5)
+
 typedef struct bucket_list {
     serf_bucket_t *bucket;
     struct bucket_list *next;
 } bucket_list_t;
 
 typedef struct serf_ssl_stream_t {
-    /* Helper to read data. Wraps stream. */
+    /* Helper to read data. Wraps stream. Only used for decrypting, the
+       encrypted data is read from encrypt_pending directly. */
     serf_databuf_t databuf;
 
     /* Our source for more data. */
@@ -158,6 +234,25 @@ struct serf_ssl_context_t {
     /* Encrypted data waiting to be written. */
     serf_bucket_t *encrypt_pending;
 
+    /* Record buffer receiving ciphertext from the BIO, appended to
+       encrypt_pending as a whole */
+    char *rec_buf;
+    apr_size_t rec_size;
+    apr_size_t rec_used;
+
+    /* Plaintext gathered for, or kept to repeat, the next SSL_write() */
+    char *stage_buf;
+    apr_size_t stage_len;
+
+    /* Dynamic record sizing: small records are sent until RECORD_RAMP
+       bytes were written since the connection was last idle for longer
+       than RECORD_IDLE. A RECORD_RAMP of 0 always sends full records */
+    apr_size_t record_ramp;
+    apr_interval_time_t record_idle;
+    apr_size_t record_bytes;
+    apr_time_t record_last;
+    apr_size_t record_limit;  /* Plaintext per record in this ssl_encrypt */
+
     /* Should we read before we can write again? */
     int want_read;
     int handshake_done;
@@ -179,6 +274,9 @@ struct serf_ssl_context_t {
     serf_ssl_server_cert_chain_cb_t server_cert_chain_callback;
     void *server_cert_userdata;
 
+    /* Failures found in the server certificate chain so far */
+    int verify_failures;
+
     const char *cert_path;
 
     X509 *cached_cert;
@@ -200,6 +298,31 @@ struct serf_ssl_context_t {
     serf_ssl_protocol_result_cb_t protocol_callback;
     void *protocol_userdata;
 
+    /* Set once a cached session was looked up for the handshake */
+    int session_checked;
+
+    /* TLS 1.3 early data, see serf__ssl_early_data_offer() */
+    int early_allowed;
+    int early_state;
+    serf__ssl_early_data_cb_t early_callback;
+    void *early_baton;
+
+    /* Online check of the server certificate, see
+       serf__ssl_ocsp_fetch_enable(). Application data is held back while
+       OCSP_WAITER is set */
+    serf__ocsp_fetcher_t *ocsp_fetcher;
+    serf__ssl_wakeup_t ocsp_wakeup;
+    void *ocsp_wakeup_baton;
+    serf__ocsp_waiter_t *ocsp_waiter;
+    apr_pool_t *ocsp_pool;
+    serf_ssl_ocsp_request_t *ocsp_request;
+    unsigned char ocsp_key[SERF__SSL_VERIFY_KEY_SIZE];
+
+    /* Crypto in async jobs, see serf_ssl_allow_async_crypto() */
+    int async_allowed;
+    serf__ssl_async_wait_t async_wait;
+    void *async_baton;
+
     serf_config_t *config;
 };
 
@@ -224,6 +347,7 @@ static char *
     pstrdup_escape_nul_bytes(const char *buf, int len, apr_pool_t *pool);
 
 static const char *ssl_get_selected_protocol(serf_ssl_context_t *context);
+static const char *ssl_session_host(serf_ssl_context_t *ctx);
 
 #ifdef SERF_LOGGING_ENABLED
 /* Log all ssl alerts that we receive from the server. */
@@ -398,11 +522,28 @@ static int bio_bucket_read(BIO *bio, char *in, int inlen)
     return len;
 }
 
+/* Appends the ciphertext collected in the record buffer of CTX to the
+   encrypted data waiting to be written */
+static void encrypt_flush_records(serf_ssl_context_t *ctx)
+{
+    serf_bucket_t *tmp;
+
+    if (!ctx->rec_used || !ctx->encrypt_pending)
+        return;
+
+    tmp = serf_bucket_simple_own_create(ctx->rec_buf, ctx->rec_used,
+                                        ctx->allocator);
+    serf_bucket_aggregate_append(ctx->encrypt_pending, tmp);
+
+    ctx->rec_buf = NULL;
+    ctx->rec_size = 0;
+    ctx->rec_used = 0;
+}
+
 /* Returns the amount written. */
 static int bio_bucket_write(BIO *bio, const char *in, int inl)
 {
     serf_ssl_context_t *ctx = bio_get_data(bio);
-    serf_bucket_t *tmp;
 
     serf__log(LOGLVL_DEBUG, LOGCOMP_SSL, __FILE__, ctx->config,
               "bio_bucket_write called for %d bytes\n", inl);
@@ -418,10 +559,26 @@ static int bio_bucket_write(BIO *bio, const char *in, int inl)
 
     ctx->crypt_status = APR_SUCCESS;
 
-    tmp = serf_bucket_simple_copy_create(in, inl,
-                                         ctx->encrypt_pending->allocator);
+    if (ctx->rec_size - ctx->rec_used < (apr_size_t)inl) {
+        apr_size_t size = MAX(SSL_RECORD_BUFSIZE, (apr_size_t)inl);
+        char *buf;
 
-    serf_bucket_aggregate_append(ctx->encrypt_pending, tmp);
+        encrypt_flush_records(ctx);
+
+        /* Without a pending bucket to move it to, grow the buffer */
+        size += ctx->rec_used;
+        buf = serf_bucket_mem_alloc(ctx->allocator, size);
+        if (ctx->rec_buf) {
+            memcpy(buf, ctx->rec_buf, ctx->rec_used);
+            serf_bucket_mem_free(ctx->allocator, ctx->rec_buf);
+        }
+
+        ctx->rec_buf = buf;
+        ctx->rec_size = size;
+    }
+
+    memcpy(ctx->rec_buf + ctx->rec_used, in, inl);
+    ctx->rec_used += inl;
 
     return inl;
 }
@@ -604,6 +761,27 @@ static void bio_meth_free(BIO_METHOD *biom)
 #endif
 }
 
+/* Sets KEY to the SHA-256 fingerprint of CERT, followed by the SHA-256
+   digest of the LEN bytes at DATA. Returns whether that succeeded */
+static int verify_cache_key(unsigned char *key,
+                            X509 *cert,
+                            const void *data,
+                            apr_size_t len)
+{
+    unsigned int digest_len;
+
+    if (!X509_digest(cert, EVP_sha256(), key, &digest_len)
+        || digest_len != SERF__SSL_VERIFY_KEY_SIZE / 2)
+        return FALSE;
+
+    if (!EVP_Digest(data, len, key + digest_len, &digest_len, EVP_sha256(),
+                    NULL)
+        || digest_len != SERF__SSL_VERIFY_KEY_SIZE / 2)
+        return FALSE;
+
+    return TRUE;
+}
+
 #ifndef OPENSSL_NO_OCSP
 static int ocsp_response_status(int failures, OCSP_RESPONSE *response)
 {
@@ -627,7 +805,129 @@ static int ocsp_response_status(int failures, OCSP_RESPONSE *response)
     return failures;
 }
 
+/* Returns the certificate in CERTS that issued CERT, or NULL */
+static X509 *ocsp_find_issuer(STACK_OF(X509) *certs, X509 *cert)
+{
+    int i;
+
+    for (i = 0; certs && i < sk_X509_num(certs); i++) {
+        X509 *issuer = sk_X509_value(certs, i);
+
+        if (issuer != cert && X509_check_issued(issuer, cert) == X509_V_OK)
+            return issuer;
+    }
+
+    return NULL;
+}
+
+/* Checks the OCSP response of LEN bytes at DER, adding the failures found
+   to *FAILURES. When REQUEST is not NULL and the status of the certificate
+   it asks for could be verified, sets *NEXT_UPDATE to the time the
+   responder promised an update, if any. Returns an error when the response
+   can't be parsed */
+static apr_status_t ocsp_verify_response(int *failures,
+                                         apr_time_t *next_update,
+                                         serf_ssl_context_t *ctx,
+                                         serf_ssl_ocsp_request_t *request,
+                                         const unsigned char *der,
+                                         int len,
+                                         apr_pool_t *scratch_pool)
+{
+    serf_ssl_ocsp_response_t *response;
+
+    *next_update = 0;
+
+    /* Did the responder send a valid response */
+    response = serf_ssl_ocsp_response_parse(der, len, failures,
+                                            scratch_pool, scratch_pool);
+    if (!response)
+        return *failures ? APR_SUCCESS : SERF_ERROR_SSL_OCSP_RESPONSE_INVALID;
+
+    /* Without the request the response can't be matched to the server
+       certificate. */
+    if (!request)
+        return APR_SUCCESS;
+
+    /* Responses are cached by servers and responders, so any age is fine
+       as long as the responder didn't promise an update by now. */
+    switch (serf_ssl_ocsp_response_verify(ctx, response, request,
+                                          SSL_OCSP_CLOCK_SKEW,
+                                          apr_time_from_sec(-1),
+                                          NULL, next_update, scratch_pool))
+    {
+        case SERF_ERROR_SSL_OCSP_RESPONSE_CERT_REVOKED:
+            *failures |= SERF_SSL_CERT_REVOKED;
+            break;
+        case SERF_ERROR_SSL_OCSP_RESPONSE_CERT_UNKNOWN:
+        case APR_SUCCESS:
+            break;
+        default:
+            /* The answer can't be trusted, e.g. it isn't signed by the
+               issuer or a responder it delegated to. The application
+               decides whether that stops the connection */
+            *failures |= SERF_SSL_OCSP_RESPONDER_UNKNOWN_FAILURE;
+            *next_update = 0;
+            break;
+    }
+
+    return APR_SUCCESS;
+}
+
 #  ifndef OPENSSL_NO_TLSEXT
+/* Checks the stapled OCSP response of LEN bytes at DER against the
+   certificates the server of SSL presented, like ocsp_verify_response() */
+static apr_status_t ocsp_check_response(int *failures,
+                                        apr_time_t *next_update,
+                                        serf_ssl_context_t *ctx,
+                                        SSL *ssl,
+                                        const unsigned char *der,
+                                        int len)
+{
+    STACK_OF(X509) *chain = SSL_get_peer_cert_chain(ssl);
+    serf_ssl_certificate_t server_cert, issuer_cert;
+    serf_ssl_ocsp_request_t *request = NULL;
+    apr_pool_t *subpool;
+    apr_status_t status;
+
+    apr_pool_create(&subpool, ctx->pool);
+
+    server_cert.ssl_cert = NULL;
+    server_cert.depth = 0;
+    issuer_cert.ssl_cert = NULL;
+    issuer_cert.depth = 1;
+
+    if (chain && sk_X509_num(chain) > 0) {
+        server_cert.ssl_cert = sk_X509_value(chain, 0);
+        issuer_cert.ssl_cert = ocsp_find_issuer(chain, server_cert.ssl_cert);
+    }
+
+    if (issuer_cert.ssl_cert)
+        request = serf_ssl_ocsp_request_create(&server_cert, &issuer_cert,
+                                               FALSE, subpool, subpool);
+
+    status = ocsp_verify_response(failures, next_update, ctx, request,
+                                  der, len, subpool);
+
+    apr_pool_destroy(subpool);
+    return status;
+}
+
+/* Sets KEY to the key of the stapled OCSP response of LEN bytes at DER in
+   the verification cache. Returns whether there is a server certificate
+   to compute it for */
+static int ocsp_cache_key(unsigned char *key,
+                          SSL *ssl,
+                          const unsigned char *der,
+                          int len)
+{
+    STACK_OF(X509) *chain = SSL_get_peer_cert_chain(ssl);
+
+    if (!chain || sk_X509_num(chain) < 1)
+        return FALSE;
+
+    return verify_cache_key(key, sk_X509_value(chain, 0), der, len);
+}
+
 /* Callback called when the server response has some OCSP info.
    Returns 1 if the application accepts the OCSP response as successful,
            0 in case of error.
@@ -635,7 +935,8 @@ static int ocsp_response_status(int failures, OCSP_RESPONSE *response)
 static int ocsp_callback(SSL *ssl, void *baton)
 {
     serf_ssl_context_t *ctx = (serf_ssl_context_t*)baton;
-    OCSP_RESPONSE *response;
+    serf_ssl_verify_cache_t *cache = NULL;
+    unsigned char key[SERF__SSL_VERIFY_KEY_SIZE];
     const unsigned char *resp_der;
     int len;
     int failures = 0;
@@ -650,18 +951,32 @@ static int ocsp_callback(SSL *ssl, void *baton)
         /* No response sent */
         return SSL_TLSEXT_ERR_ALERT_FATAL;
     }
-    response = d2i_OCSP_RESPONSE(NULL, &resp_der, len);
-    if (!response) {
-        /* Error parsing OCSP response - tell the app? */
-        return SSL_TLSEXT_ERR_ALERT_FATAL;
-    }
 
-    /* Did the server get a valid response from the OCSP responder */
-    failures = ocsp_response_status(failures, response);
+    if (ctx->config)
+        cache = serf__ssl_verify_cache_from_config(ctx->config);
+    if (cache && !ocsp_cache_key(key, ssl, resp_der, len))
+        cache = NULL;
+
+    if (cache && serf__ssl_verify_cache_lookup(&failures, cache,
+                                               SERF__SSL_VERIFY_OCSP, key))
+    {
+        serf__log(LOGLVL_DEBUG, LOGCOMP_SSL, __FILE__, ctx->config,
+                  "Using the cached check of the OCSP response.\n");
+    }
+    else {
+        apr_time_t next_update;
 
-    /* TODO: check certificate status */
+        if (ocsp_check_response(&failures, &next_update, ctx, ssl,
+                                resp_der, len)) {
+            /* Error parsing OCSP response - tell the app? */
+            return SSL_TLSEXT_ERR_ALERT_FATAL;
+        }
 
-    OCSP_RESPONSE_free(response);
+        /* Responses without a promised update may change at any time */
+        if (cache && next_update)
+            serf__ssl_verify_cache_store(cache, SERF__SSL_VERIFY_OCSP, key,
+                                         failures, next_update);
+    }
 
     if (ctx->server_cert_callback && failures) {
         apr_status_t status;
@@ -817,6 +1132,36 @@ static apr_status_t validate_cert_hostname(X509 *server_cert, apr_pool_t *pool)
     return APR_SUCCESS;
 }
 
+/* Stores the host names SERVER_CERT is valid for in the connection config,
+   allowing requests for those hosts to share the connection */
+static void store_peer_names(serf_ssl_context_t *ctx, X509 *server_cert)
+{
+    apr_array_header_t *names;
+    apr_pool_t *subpool;
+
+    apr_pool_create(&subpool, ctx->pool);
+
+    if (get_subject_alt_names(&names, server_cert, EscapeNulAndCopy, subpool)
+        || !names || !names->nelts)
+    {
+        /* Only without DNS names the common name identifies the server */
+        X509_NAME *subject = X509_get_subject_name(server_cert);
+        char buf[1024];
+
+        names = apr_array_make(subpool, 1, sizeof(const char *));
+        if (subject
+            && X509_NAME_get_text_by_NID(subject, NID_commonName,
+                                         buf, sizeof(buf)) > 0)
+        {
+            APR_ARRAY_PUSH(names, const char *) = apr_pstrdup(subpool, buf);
+        }
+    }
+
+    (void)serf__config_store_set_peer_names(ctx->config, names);
+
+    apr_pool_destroy(subpool);
+}
+
 static int
 validate_server_certificate(int cert_valid, X509_STORE_CTX *store_ctx)
 {
@@ -974,6 +1319,13 @@ validate_server_certificate(int cert_valid, X509_STORE_CTX *store_ctx)
         apr_pool_destroy(subpool);
     }
 
+    /* OpenSSL verifies the chain from the root down to the server
+       certificate, so at depth 0 we know whether the whole chain passed
+       all checks, without any exceptions made by the application */
+    ctx->verify_failures |= failures;
+    if (depth == 0 && cert_valid && !ctx->verify_failures && ctx->config)
+        store_peer_names(ctx, server_cert);
+
     /* Return a specific error if the server certificate is not accepted by
        OpenSSL and the application has not set callbacks to override this. */
     if (!cert_valid &&
@@ -986,148 +1338,866 @@ validate_server_certificate(int cert_valid, X509_STORE_CTX *store_ctx)
     return cert_valid;
 }
 
-/* Helper function to convert the ssl error code contained in ret_code + the
-   ssl context to a proper serf status code.
-
-   If DO_WANT_READ is true, handle the SSL_ERROR_WANT_* as SERF_ERROR_WAIT_CONN
-   and set ctx->want_read.
- */
-static apr_status_t status_from_ssl_error(serf_ssl_context_t *ctx,
-                                          int ret_code,
-                                          int do_want_read)
-{
-    int ssl_err = SSL_get_error(ctx->ssl, ret_code);
-    apr_status_t status;
-
-    switch (ssl_err) {
-        case SSL_ERROR_SYSCALL:
-            /* One of the bio functions returned a failure by returning -1.
-               Return the underlying status that caused OpenSSL to fail.
+/* A PEM file of a CRL store, with the CRLs parsed from it when it had
+   MTIME and SIZE */
+typedef struct crl_file_t {
+    struct crl_file_t *next;
+    const char *path;
+    apr_time_t mtime;
+    apr_off_t size;
+    STACK_OF(X509_CRL) *crls;
+} crl_file_t;
+
+struct serf_ssl_crl_store_t {
+    apr_pool_t *pool;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *lock;
+#endif
 
-               There is no ssl status to log here, as the only reason
-               the call failed is that our data delivery function didn't
-               deliver data. And even that is already logged by the info
-               callback if you turn up the logging level high enough. */
-            status = ctx->crypt_status;
-            break;
+    /* Files are only added. The CRLs of a file are replaced when it is
+       reloaded, while verifications keep references to the old ones */
+    crl_file_t *files;
+    apr_uint32_t generation;  /* Changes with the CRLs */
 
-        case SSL_ERROR_WANT_READ:
-            if (do_want_read)
-                ctx->want_read = TRUE;
-            /* Fall through */
+    apr_time_t checked;  /* When the files were last checked for changes */
+    apr_interval_time_t check_interval;
+    int reloading;
+};
 
-        case SSL_ERROR_WANT_WRITE:
-            status = do_want_read ? SERF_ERROR_WAIT_CONN : APR_EAGAIN;
-            break;
+#define SERF_CONFIG__SSL_CRL_STORE  (SERF_CONFIG_PER_CONTEXT | 0xF00004)
 
-        case SSL_ERROR_SSL:
-            if (ctx->pending_err) {
-                status = ctx->pending_err;
-                ctx->pending_err = APR_SUCCESS;
-            } else {
-                /*unsigned long l = ERR_peek_error();
-                int lib = ERR_GET_LIB(l);
-                int func = ERR_GET_FUNC(l);
-                int reason = ERR_GET_REASON(l);*/
+static void crl_store_lock(serf_ssl_crl_store_t *store)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(store->lock);
+#endif
+}
 
-                /* ### Detect more specific errors?
-                  When lib is ERR_LIB_SSL, then reason is one of the
-                  many SSL_R_XXXX reasons in ssl.h
-                */
+static void crl_store_unlock(serf_ssl_crl_store_t *store)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(store->lock);
+#endif
+}
 
-                if (SSL_in_init(ctx->ssl))
-                    ctx->fatal_err = SERF_ERROR_SSL_SETUP_FAILED;
-                else
-                    ctx->fatal_err = SERF_ERROR_SSL_COMM_FAILED;
+static apr_status_t cleanup_crl_store(void *data)
+{
+    serf_ssl_crl_store_t *store = data;
+    crl_file_t *file;
 
-                status = ctx->fatal_err;
-                log_ssl_error(ctx);
-            }
-            break;
-        default:
-            status = ctx->fatal_err = SERF_ERROR_SSL_COMM_FAILED;
-            log_ssl_error(ctx);
-            break;
+    for (file = store->files; file; file = file->next) {
+        if (file->crls)
+            sk_X509_CRL_pop_free(file->crls, X509_CRL_free);
+        file->crls = NULL;
     }
 
-    return status;
+    return APR_SUCCESS;
 }
 
-/* Explicitly perform the SSL handshake without waiting for the first
-   write */
-static apr_status_t ssl_handshake(serf_ssl_context_t *ctx,
-                                  int do_want_read)
+/* Parses the CRLs in the PEM file at PATH into *CRLS, and sets FINFO to
+   what the file was before it was read */
+static apr_status_t crl_read_file(STACK_OF(X509_CRL) **crls,
+                                  apr_finfo_t *finfo,
+                                  const char *path,
+                                  apr_pool_t *pool)
 {
-    int ssl_result;
-    const unsigned char *data;
-    apr_size_t len;
+    apr_file_t *crl_file;
+    BIO_METHOD *biom;
+    BIO *bio;
+    X509_CRL *crl;
+    apr_status_t status;
 
-    /* If we have a cached session, use it to allow speeding up the handshake */
-    if (ctx->config
-        && !serf__config_store_get_ssl_session(ctx->config, &data, &len)) {
+    status = apr_stat(finfo, path, APR_FINFO_MTIME | APR_FINFO_SIZE, pool);
+    if (status)
+        return status;
 
-        SSL_SESSION *sess;
+    status = apr_file_open(&crl_file, path, APR_READ, APR_OS_DEFAULT, pool);
+    if (status)
+        return status;
 
-        sess = d2i_SSL_SESSION(NULL, &data, (long)len);
+    biom = bio_meth_file_new();
+    bio = BIO_new(biom);
+    bio_set_data(bio, crl_file);
 
-        SSL_set_session(ctx->ssl, sess);
+    *crls = sk_X509_CRL_new_null();
+    while ((crl = PEM_read_bio_X509_CRL(bio, NULL, NULL, NULL)) != NULL) {
+        if (!sk_X509_CRL_push(*crls, crl)) {
+            X509_CRL_free(crl);
+            break;
+        }
     }
 
-    ctx->crypt_status = APR_SUCCESS; /* Clear before calling SSL */
-    ssl_result = SSL_do_handshake(ctx->ssl);
-    if (ssl_result <= 0) {
-        apr_status_t status = status_from_ssl_error(ctx, ssl_result,
-                                                    do_want_read);
+    /* Reading stops at the end of the file, or at something else */
+    ERR_clear_error();
 
-        if (SERF_BUCKET_READ_ERROR(status)) {
-            return status;
-        }
+    BIO_free(bio);
+    bio_meth_free(biom);
+    apr_file_close(crl_file);
+
+    if (!sk_X509_CRL_num(*crls)) {
+        sk_X509_CRL_free(*crls);
+        *crls = NULL;
+        return SERF_ERROR_SSL_CERT_FAILED;
     }
 
     return APR_SUCCESS;
 }
 
-/* This function reads an encrypted stream and returns the decrypted stream.
-   Implements serf_databuf_reader_t */
-static apr_status_t ssl_decrypt(void *baton, apr_size_t bufsize,
-                                char *buf, apr_size_t *len)
+/* Reloads the files of STORE that changed since they were read, at most
+   once per check interval of STORE. Verifications in other threads keep
+   using the CRLs that were loaded before, while a file is parsed */
+static void crl_store_refresh(serf_ssl_crl_store_t *store,
+                              serf_config_t *config,
+                              apr_pool_t *scratch_pool)
 {
-    serf_ssl_context_t *ctx = baton;
-    apr_status_t status;
-    int ssl_len;
+    apr_time_t now = apr_time_now();
+    apr_pool_t *iterpool;
+    crl_file_t *file;
 
-    if (ctx->fatal_err)
-        return ctx->fatal_err;
+    crl_store_lock(store);
+    if (store->reloading || now - store->checked < store->check_interval) {
+        crl_store_unlock(store);
+        return;
+    }
+    store->reloading = TRUE;
+    store->checked = now;
+    file = store->files;
+    crl_store_unlock(store);
 
-    if (!ctx->handshake_done) {
+    /* SCRATCH_POOL may live as long as the connection, which can check
+       the files many times */
+    apr_pool_create(&iterpool, scratch_pool);
 
-        ctx->handshake_done = TRUE;
+    for (; file; file = file->next) {
+        STACK_OF(X509_CRL) *crls;
+        apr_finfo_t finfo;
+        int changed;
 
-        status = ssl_handshake(ctx, FALSE);
+        apr_pool_clear(iterpool);
 
-        if (SERF_BUCKET_READ_ERROR(status)) {
-            *len = 0;
-            return status;
+        if (apr_stat(&finfo, file->path, APR_FINFO_MTIME | APR_FINFO_SIZE,
+                     iterpool))
+            continue;
+
+        crl_store_lock(store);
+        changed = (finfo.mtime != file->mtime || finfo.size != file->size);
+        crl_store_unlock(store);
+
+        if (!changed)
+            continue;
+
+        if (crl_read_file(&crls, &finfo, file->path, iterpool)) {
+            /* Maybe it is still being written; try again later */
+            serf__log(LOGLVL_WARNING, LOGCOMP_SSL, __FILE__, config,
+                      "Can't reload CRL file %s, keeping its old CRLs\n",
+                      file->path);
+            continue;
         }
+
+        serf__log(LOGLVL_INFO, LOGCOMP_SSL, __FILE__, config,
+                  "Reloaded %d CRLs from changed file %s\n",
+                  sk_X509_CRL_num(crls), file->path);
+
+        crl_store_lock(store);
+        sk_X509_CRL_pop_free(file->crls, X509_CRL_free);
+        file->crls = crls;
+        file->mtime = finfo.mtime;
+        file->size = finfo.size;
+        store->generation++;
+        crl_store_unlock(store);
     }
 
-    serf__log(LOGLVL_DEBUG, LOGCOMP_SSL, __FILE__, ctx->config,
-              "ssl_decrypt: begin %" APR_SIZE_T_FMT "\n", bufsize);
+    apr_pool_destroy(iterpool);
 
-    ctx->want_read = FALSE; /* Reading now */
-    ctx->crypt_status = APR_SUCCESS; /* Clear before calling SSL */
+    crl_store_lock(store);
+    store->reloading = FALSE;
+    crl_store_unlock(store);
+}
 
-    /* When an SSL_read() operation has to be repeated because of
-       SSL_ERROR_WANT_READ or SSL_ERROR_WANT_WRITE, it must be repeated
-       with the same arguments.
+/* Returns new references to all CRLs in STORE, after reloading the files
+   that changed, and sets *GENERATION to the generation of these CRLs */
+static STACK_OF(X509_CRL) *crl_store_get(apr_uint32_t *generation,
+                                         serf_ssl_crl_store_t *store,
+                                         serf_config_t *config,
+                                         apr_pool_t *scratch_pool)
+{
+    STACK_OF(X509_CRL) *crls = sk_X509_CRL_new_null();
+    crl_file_t *file;
 
-       Luckily we can assume that we are called from the databuffer
-       implementation */
-    /* Is there some data waiting to be read? */
-    ssl_len = SSL_read(ctx->ssl, buf, bufsize);
-    if (ssl_len < 0) {
+    crl_store_refresh(store, config, scratch_pool);
 
-        *len = 0;
+    crl_store_lock(store);
+    for (file = store->files; crls && file; file = file->next) {
+        int i;
+
+        for (i = 0; i < sk_X509_CRL_num(file->crls); i++) {
+            X509_CRL *crl = sk_X509_CRL_value(file->crls, i);
+
+            if (sk_X509_CRL_push(crls, crl))
+                X509_CRL_up_ref(crl);
+        }
+    }
+    *generation = store->generation;
+    crl_store_unlock(store);
+
+    return crls;
+}
+
+/* Returns the CRL store of the context of CONFIG, or NULL */
+static serf_ssl_crl_store_t *crl_store_from_config(serf_config_t *config)
+{
+    void *store;
+
+    if (!config
+        || serf_config_get_object(config, SERF_CONFIG__SSL_CRL_STORE, &store))
+        return NULL;
+
+    return store;
+}
+
+/* Sets DIGEST to the SHA-256 digest of the trusted certificates and CRLs
+   in the store of STORE_CTX, and of its verification parameters. Returns
+   whether that succeeded */
+static int store_digest(unsigned char *digest,
+                        X509_STORE_CTX *store_ctx)
+{
+    X509_STORE *store = X509_STORE_CTX_get0_store(store_ctx);
+    X509_VERIFY_PARAM *param = X509_STORE_CTX_get0_param(store_ctx);
+    STACK_OF(X509_OBJECT) *objects;
+    EVP_MD_CTX *md_ctx;
+    unsigned long flags = X509_VERIFY_PARAM_get_flags(param);
+    int depth = X509_VERIFY_PARAM_get_depth(param);
+    int result;
+    int i;
+
+    md_ctx = EVP_MD_CTX_new();
+    if (!md_ctx)
+        return FALSE;
+
+    result = EVP_DigestInit_ex(md_ctx, EVP_sha256(), NULL)
+             && EVP_DigestUpdate(md_ctx, &flags, sizeof(flags))
+             && EVP_DigestUpdate(md_ctx, &depth, sizeof(depth));
+
+    X509_STORE_lock(store);
+    objects = X509_STORE_get0_objects(store);
+    for (i = 0; result && objects && i < sk_X509_OBJECT_num(objects); i++) {
+        X509_OBJECT *object = sk_X509_OBJECT_value(objects, i);
+        unsigned char md[EVP_MAX_MD_SIZE];
+        unsigned int md_len;
+
+        /* SHA-1 fingerprints are cached by OpenSSL */
+        switch (X509_OBJECT_get_type(object)) {
+            case X509_LU_X509:
+                result = X509_digest(X509_OBJECT_get0_X509(object),
+                                     EVP_sha1(), md, &md_len);
+                break;
+            case X509_LU_CRL:
+                result = X509_CRL_digest(X509_OBJECT_get0_X509_CRL(object),
+                                         EVP_sha1(), md, &md_len);
+                break;
+            default:
+                continue;
+        }
+
+        result = result && EVP_DigestUpdate(md_ctx, md, md_len);
+    }
+    X509_STORE_unlock(store);
+
+    result = result && EVP_DigestFinal_ex(md_ctx, digest, NULL);
+
+    EVP_MD_CTX_free(md_ctx);
+
+    return result;
+}
+
+/* Sets KEY to the key of the certificate chain in STORE_CTX in the
+   verification cache. Besides the certificates, the outcome depends on the
+   host they are presented for, the certificates the store trusts and its
+   parameters, the callbacks that may accept failures and their baton, and
+   the CRLs of CRL_STORE, which have CRL_GENERATION.
+   Returns whether the key could be computed */
+static int chain_cache_key(unsigned char *key,
+                           serf_ssl_context_t *ctx,
+                           X509_STORE_CTX *store_ctx,
+                           serf_ssl_crl_store_t *crl_store,
+                           apr_uint32_t crl_generation)
+{
+    STACK_OF(X509) *untrusted = X509_STORE_CTX_get0_untrusted(store_ctx);
+    X509 *server_cert = X509_STORE_CTX_get0_cert(store_ctx);
+    const char *host = ssl_session_host(ctx);
+    unsigned char *data, *p;
+    apr_size_t host_len;
+    int count, i;
+    int result;
+
+    if (!server_cert || !host)
+        return FALSE;
+
+    host_len = strlen(host) + 1;
+    count = untrusted ? sk_X509_num(untrusted) : 0;
+
+    data = serf_bucket_mem_alloc(ctx->allocator,
+                                 host_len
+                                 + sizeof(ctx->server_cert_callback)
+                                 + sizeof(ctx->server_cert_chain_callback)
+                                 + sizeof(ctx->server_cert_userdata)
+                                 + sizeof(crl_store) + sizeof(crl_generation)
+                                 + (count + 1) * EVP_MAX_MD_SIZE);
+    p = data;
+
+    memcpy(p, host, host_len);
+    p += host_len;
+    memcpy(p, &ctx->server_cert_callback, sizeof(ctx->server_cert_callback));
+    p += sizeof(ctx->server_cert_callback);
+    memcpy(p, &ctx->server_cert_chain_callback,
+           sizeof(ctx->server_cert_chain_callback));
+    p += sizeof(ctx->server_cert_chain_callback);
+    memcpy(p, &ctx->server_cert_userdata, sizeof(ctx->server_cert_userdata));
+    p += sizeof(ctx->server_cert_userdata);
+    memcpy(p, &crl_store, sizeof(crl_store));
+    p += sizeof(crl_store);
+    memcpy(p, &crl_generation, sizeof(crl_generation));
+    p += sizeof(crl_generation);
+
+    if (!store_digest(p, store_ctx)) {
+        serf_bucket_mem_free(ctx->allocator, data);
+        return FALSE;
+    }
+    p += SHA256_DIGEST_LENGTH;
+
+    for (i = 0; i < count; i++) {
+        unsigned int digest_len;
+
+        if (!X509_digest(sk_X509_value(untrusted, i), EVP_sha256(), p,
+                         &digest_len))
+            break;
+        p += digest_len;
+    }
+
+    result = (i == count)
+             && verify_cache_key(key, server_cert, data, p - data);
+
+    serf_bucket_mem_free(ctx->allocator, data);
+
+    return result;
+}
+
+/* Returns when the first certificate of the verified chain in STORE_CTX
+   expires, or 0 when that isn't known */
+static apr_time_t chain_expires(X509_STORE_CTX *store_ctx)
+{
+    STACK_OF(X509) *chain = X509_STORE_CTX_get0_chain(store_ctx);
+    apr_time_t now = apr_time_now();
+    apr_time_t expires = 0;
+    int i;
+
+    for (i = 0; chain && i < sk_X509_num(chain); i++) {
+        X509 *cert = sk_X509_value(chain, i);
+        apr_time_t when;
+        int days, secs;
+
+        if (!ASN1_TIME_diff(&days, &secs, NULL, X509_get0_notAfter(cert)))
+            return 0;
+
+        when = now + apr_time_from_sec((apr_time_t)days * 86400 + secs);
+        if (!expires || when < expires)
+            expires = when;
+    }
+
+    return expires;
+}
+
+#ifndef OPENSSL_NO_OCSP
+/* Passes the FAILURES found in the status of the server certificate to
+   the application. Returns the error to fail the connection with */
+static apr_status_t ocsp_report_failures(serf_ssl_context_t *ctx,
+                                         int failures)
+{
+    if (!failures)
+        return APR_SUCCESS;
+
+    if (!ctx->server_cert_callback)
+        return SERF_ERROR_SSL_CERT_FAILED;
+
+    return ctx->server_cert_callback(ctx->server_cert_userdata, failures,
+                                     NULL);
+}
+
+static void ocsp_fetch_done(serf_ssl_context_t *ctx)
+{
+    ctx->ocsp_waiter = NULL;
+    ctx->ocsp_request = NULL;
+
+    if (ctx->ocsp_pool) {
+        apr_pool_destroy(ctx->ocsp_pool);
+        ctx->ocsp_pool = NULL;
+    }
+}
+
+/* Implements serf__ocsp_fetched_t */
+static void ocsp_fetched(void *baton,
+                         apr_status_t status,
+                         const void *response,
+                         apr_size_t len)
+{
+    serf_ssl_context_t *ctx = baton;
+    int failures = 0;
+
+    if (!status) {
+        apr_time_t next_update;
+
+        status = ocsp_verify_response(&failures, &next_update, ctx,
+                                      ctx->ocsp_request, response, (int)len,
+                                      ctx->ocsp_pool);
+
+        if (!status && next_update)
+            serf__ssl_verify_cache_store(
+                serf__ocsp_fetch_results(ctx->ocsp_fetcher),
+                SERF__SSL_VERIFY_OCSP_FETCH, ctx->ocsp_key, failures,
+                next_update);
+    }
+
+    /* Like browsers do, a responder that can't be asked doesn't stop the
+       connection */
+    if (status) {
+        serf__log(LOGLVL_WARNING, LOGCOMP_SSL, __FILE__, ctx->config,
+                  "No usable answer about the status of the server "
+                  "certificate: %d\n", status);
+    }
+
+    ocsp_fetch_done(ctx);
+
+    status = ocsp_report_failures(ctx, failures);
+    if (status)
+        ctx->fatal_err = status;
+
+    ctx->ocsp_wakeup(ctx->ocsp_wakeup_baton);
+}
+
+/* Asks the responder of the server certificate in the verified chain in
+   STORE_CTX for its status, unless the answer is known already. Returns
+   the error to fail the handshake with */
+static apr_status_t ocsp_fetch_start(serf_ssl_context_t *ctx,
+                                     X509_STORE_CTX *store_ctx)
+{
+    STACK_OF(X509) *chain = X509_STORE_CTX_get0_chain(store_ctx);
+    serf_ssl_certificate_t server_cert, issuer_cert;
+    apr_array_header_t *responders;
+    const void *der;
+    apr_size_t der_len;
+    int failures;
+    int i;
+
+    if (!ctx->ocsp_fetcher || ctx->ocsp_pool)
+        return APR_SUCCESS;
+
+    server_cert.ssl_cert = X509_STORE_CTX_get0_cert(store_ctx);
+    server_cert.depth = 0;
+    issuer_cert.depth = 1;
+
+    /* A chain accepted from the verification cache wasn't built */
+    if (chain && sk_X509_num(chain) > 1)
+        issuer_cert.ssl_cert = sk_X509_value(chain, 1);
+    else
+        issuer_cert.ssl_cert = ocsp_find_issuer(
+                                   X509_STORE_CTX_get0_untrusted(store_ctx),
+                                   server_cert.ssl_cert);
+
+    if (!server_cert.ssl_cert || !issuer_cert.ssl_cert)
+        return APR_SUCCESS;
+
+    apr_pool_create(&ctx->ocsp_pool, ctx->pool);
+
+    get_ocsp_responders(&responders, server_cert.ssl_cert, ctx->ocsp_pool);
+    if (!responders || !responders->nelts)
+        goto cleanup;
+
+    ctx->ocsp_request = serf_ssl_ocsp_request_create(&server_cert,
+                                                     &issuer_cert, FALSE,
+                                                     ctx->ocsp_pool,
+                                                     ctx->ocsp_pool);
+    if (!ctx->ocsp_request)
+        goto cleanup;
+
+    der = serf_ssl_ocsp_request_body(ctx->ocsp_request);
+    der_len = serf_ssl_ocsp_request_body_size(ctx->ocsp_request);
+
+    if (!verify_cache_key(ctx->ocsp_key, server_cert.ssl_cert, der,
+                          der_len))
+        goto cleanup;
+
+    if (serf__ssl_verify_cache_lookup(
+            &failures, serf__ocsp_fetch_results(ctx->ocsp_fetcher),
+            SERF__SSL_VERIFY_OCSP_FETCH, ctx->ocsp_key))
+    {
+        serf__log(LOGLVL_DEBUG, LOGCOMP_SSL, __FILE__, ctx->config,
+                  "Using the known status of the server certificate.\n");
+
+        ocsp_fetch_done(ctx);
+        return ocsp_report_failures(ctx, failures);
+    }
+
+    for (i = 0; i < responders->nelts; i++) {
+        const char *url = APR_ARRAY_IDX(responders, i, const char *);
+
+        if (!serf__ocsp_fetch(&ctx->ocsp_waiter, ctx->ocsp_fetcher, url,
+                              der, der_len, ocsp_fetched, ctx))
+            return APR_SUCCESS;
+    }
+
+  cleanup:
+    ocsp_fetch_done(ctx);
+    return APR_SUCCESS;
+}
+#endif  /* OPENSSL_NO_OCSP */
+
+/* Verifies the certificate chain in STORE_CTX, calling
+   validate_server_certificate() for each certificate. With a verification
+   cache, a chain that was accepted before is accepted again right away */
+static int ssl_verify_chain(X509_STORE_CTX *store_ctx, void *baton)
+{
+    serf_ssl_context_t *ctx = baton;
+    serf_ssl_verify_cache_t *cache = NULL;
+    serf_ssl_crl_store_t *crl_store;
+    STACK_OF(X509_CRL) *crls = NULL;
+    apr_uint32_t crl_generation = 0;
+    unsigned char key[SERF__SSL_VERIFY_KEY_SIZE];
+    int failures;
+    int cert_valid;
+
+    /* Check the chain against the CRLs shared by the context, besides
+       those of this SSL context */
+    crl_store = crl_store_from_config(ctx->config);
+    if (crl_store)
+        crls = crl_store_get(&crl_generation, crl_store, ctx->config,
+                             ctx->pool);
+    if (crls) {
+        X509_STORE_CTX_set0_crls(store_ctx, crls);
+        X509_STORE_CTX_set_flags(store_ctx, X509_V_FLAG_CRL_CHECK |
+                                            X509_V_FLAG_CRL_CHECK_ALL);
+    }
+
+    if (ctx->config)
+        cache = serf__ssl_verify_cache_from_config(ctx->config);
+    if (cache && !chain_cache_key(key, ctx, store_ctx, crl_store,
+                                  crl_generation))
+        cache = NULL;
+
+    if (cache && serf__ssl_verify_cache_lookup(&failures, cache,
+                                               SERF__SSL_VERIFY_CHAIN, key))
+    {
+        serf__log(LOGLVL_DEBUG, LOGCOMP_SSL, __FILE__, ctx->config,
+                  "Accepting a certificate chain that was verified "
+                  "before.\n");
+
+        ctx->verify_failures |= failures;
+        if (!ctx->verify_failures)
+            store_peer_names(ctx, X509_STORE_CTX_get0_cert(store_ctx));
+
+        cert_valid = 1;
+    }
+    else {
+        cert_valid = X509_verify_cert(store_ctx);
+
+        if (cache && cert_valid > 0 && ctx->pending_err == APR_SUCCESS)
+            serf__ssl_verify_cache_store(cache, SERF__SSL_VERIFY_CHAIN, key,
+                                         ctx->verify_failures,
+                                         chain_expires(store_ctx));
+    }
+
+    if (crls) {
+        X509_STORE_CTX_set0_crls(store_ctx, NULL);
+        sk_X509_CRL_pop_free(crls, X509_CRL_free);
+    }
+
+#ifndef OPENSSL_NO_OCSP
+    if (cert_valid > 0 && ctx->pending_err == APR_SUCCESS) {
+        apr_status_t status = ocsp_fetch_start(ctx, store_ctx);
+
+        if (status) {
+            ctx->pending_err = status;
+            cert_valid = 0;
+        }
+    }
+#endif
+
+    return cert_valid;
+}
+
+#ifdef SSL_HAVE_ASYNC
+/* Makes the connection of CTX wait for the async job of the last SSL call.
+   With HAVE_JOB unset there was no job to run the call in, and it can just
+   be repeated */
+static void ssl_async_wait(serf_ssl_context_t *ctx, int have_job)
+{
+    int fds[SERF__SSL_ASYNC_MAX_FDS];
+    OSSL_ASYNC_FD *ssl_fds = NULL;
+    size_t num_fds = 0;
+    size_t i;
+
+    if (have_job && SSL_get_all_async_fds(ctx->ssl, NULL, &num_fds)
+        && num_fds)
+    {
+        ssl_fds = serf_bucket_mem_alloc(ctx->allocator,
+                                        num_fds * sizeof(*ssl_fds));
+        if (!SSL_get_all_async_fds(ctx->ssl, ssl_fds, &num_fds))
+            num_fds = 0;
+    }
+
+    serf__log(LOGLVL_DEBUG, LOGCOMP_SSL, __FILE__, ctx->config,
+              "Waiting for async crypto, %d fds\n", (int)num_fds);
+
+    /* Without file descriptors the call is retried right away */
+    if (num_fds > SERF__SSL_ASYNC_MAX_FDS)
+        num_fds = 0;
+
+    for (i = 0; i < num_fds; i++)
+        fds[i] = ssl_fds[i];
+
+    if (ssl_fds)
+        serf_bucket_mem_free(ctx->allocator, ssl_fds);
+
+    ctx->async_wait(ctx->async_baton, fds, (int)num_fds);
+}
+
+/* Runs the crypto of CTX in async jobs when it is allowed and the
+   connection can wait for them */
+static void ssl_async_update_mode(serf_ssl_context_t *ctx)
+{
+    if (ctx->async_allowed && ctx->async_wait)
+        SSL_set_mode(ctx->ssl, SSL_MODE_ASYNC);
+    else
+        SSL_clear_mode(ctx->ssl, SSL_MODE_ASYNC);
+}
+#endif  /* SSL_HAVE_ASYNC */
+
+/* Helper function to convert the ssl error code contained in ret_code + the
+   ssl context to a proper serf status code.
+
+   If DO_WANT_READ is true, handle the SSL_ERROR_WANT_* as SERF_ERROR_WAIT_CONN
+   and set ctx->want_read.
+ */
+static apr_status_t status_from_ssl_error(serf_ssl_context_t *ctx,
+                                          int ret_code,
+                                          int do_want_read)
+{
+    int ssl_err = SSL_get_error(ctx->ssl, ret_code);
+    apr_status_t status;
+
+    switch (ssl_err) {
+        case SSL_ERROR_SYSCALL:
+            /* One of the bio functions returned a failure by returning -1.
+               Return the underlying status that caused OpenSSL to fail.
+
+               There is no ssl status to log here, as the only reason
+               the call failed is that our data delivery function didn't
+               deliver data. And even that is already logged by the info
+               callback if you turn up the logging level high enough. */
+            status = ctx->crypt_status;
+            break;
+
+        case SSL_ERROR_WANT_READ:
+            if (do_want_read)
+                ctx->want_read = TRUE;
+            /* Fall through */
+
+        case SSL_ERROR_WANT_WRITE:
+            status = do_want_read ? SERF_ERROR_WAIT_CONN : APR_EAGAIN;
+            break;
+
+#ifdef SSL_HAVE_ASYNC
+        case SSL_ERROR_WANT_ASYNC:
+        case SSL_ERROR_WANT_ASYNC_JOB:
+            /* The crypto runs elsewhere; the call is repeated once the
+               connection is woken up */
+            ssl_async_wait(ctx, ssl_err == SSL_ERROR_WANT_ASYNC);
+            status = do_want_read ? SERF_ERROR_WAIT_CONN : APR_EAGAIN;
+            break;
+#endif
+
+        case SSL_ERROR_SSL:
+            if (ctx->pending_err) {
+                status = ctx->pending_err;
+                ctx->pending_err = APR_SUCCESS;
+            } else {
+                /*unsigned long l = ERR_peek_error();
+                int lib = ERR_GET_LIB(l);
+                int func = ERR_GET_FUNC(l);
+                int reason = ERR_GET_REASON(l);*/
+
+                /* ### Detect more specific errors?
+                  When lib is ERR_LIB_SSL, then reason is one of the
+                  many SSL_R_XXXX reasons in ssl.h
+                */
+
+                if (SSL_in_init(ctx->ssl))
+                    ctx->fatal_err = SERF_ERROR_SSL_SETUP_FAILED;
+                else
+                    ctx->fatal_err = SERF_ERROR_SSL_COMM_FAILED;
+
+                status = ctx->fatal_err;
+                log_ssl_error(ctx);
+            }
+            break;
+        default:
+            status = ctx->fatal_err = SERF_ERROR_SSL_COMM_FAILED;
+            log_ssl_error(ctx);
+            break;
+    }
+
+    return status;
+}
+
+/* Returns the key of the host of CTX in the shared session cache, or NULL
+   when it isn't known */
+static const char *ssl_session_host(serf_ssl_context_t *ctx)
+{
+    const char *name, *port;
+
+    if (serf_config_get_string(ctx->config, SERF_CONFIG_HOST_NAME, &name)
+        || !name)
+        return NULL;
+
+    if (serf_config_get_string(ctx->config, SERF_CONFIG_HOST_PORT, &port)
+        || !port)
+        return NULL;
+
+    return apr_pstrcat(ctx->pool, name, ":", port, NULL);
+}
+
+/* Sets the cached session for the host of CTX on the connection, if there
+   is one, to allow speeding up the handshake. Only looks once */
+static void ssl_use_cached_session(serf_ssl_context_t *ctx)
+{
+    serf_ssl_session_cache_t *cache = NULL;
+    const char *host = NULL;
+    unsigned char *copy = NULL;
+    const unsigned char *data;
+    apr_size_t len;
+    apr_status_t status = APR_ENOENT;
+
+    if (ctx->session_checked)
+        return;
+    ctx->session_checked = TRUE;
+
+    if (ctx->config) {
+        cache = serf__ssl_session_cache_from_config(ctx->config);
+        if (cache)
+            host = ssl_session_host(ctx);
+    }
+
+    /* If we have a cached session, use it to allow speeding up the handshake */
+    if (cache && host) {
+        status = serf__ssl_session_cache_lookup(&copy, &len, cache, host,
+                                                ctx->allocator);
+        data = copy;
+    }
+    else if (ctx->config) {
+        status = serf__config_store_get_ssl_session(ctx->config, &data, &len);
+    }
+
+    if (!status) {
+        SSL_SESSION *sess;
+
+        sess = d2i_SSL_SESSION(NULL, &data, (long)len);
+        if (sess) {
+            SSL_set_session(ctx->ssl, sess);
+            SSL_SESSION_free(sess);
+
+            serf__log(LOGLVL_DEBUG, LOGCOMP_SSL, __FILE__, ctx->config,
+                      "Trying to resume a cached session\n");
+        }
+    }
+
+    if (copy)
+        serf_bucket_mem_free(ctx->allocator, copy);
+}
+
+/* Explicitly perform the SSL handshake without waiting for the first
+   write */
+static apr_status_t ssl_handshake(serf_ssl_context_t *ctx,
+                                  int do_want_read)
+{
+    int ssl_result;
+
+    ssl_use_cached_session(ctx);
+
+    /* The ClientHello goes out along with the early data */
+    if (ctx->early_state == SSL_EARLY_GATHER)
+        return APR_SUCCESS;
+
+    ctx->crypt_status = APR_SUCCESS; /* Clear before calling SSL */
+    ssl_result = SSL_do_handshake(ctx->ssl);
+    if (ssl_result <= 0) {
+        apr_status_t status = status_from_ssl_error(ctx, ssl_result,
+                                                    do_want_read);
+
+        if (SERF_BUCKET_READ_ERROR(status)) {
+            return status;
+        }
+    }
+
+    return APR_SUCCESS;
+}
+
+/* Tells the connection whether the server took the early data of CTX, now
+   that the handshake is through */
+static void ssl_early_data_done(serf_ssl_context_t *ctx)
+{
+    int resend = TRUE;
+
+#ifdef SSL_EARLY_DATA_ACCEPTED
+    resend = (SSL_get_early_data_status(ctx->ssl) != SSL_EARLY_DATA_ACCEPTED);
+#endif
+
+    serf__log(LOGLVL_DEBUG, LOGCOMP_SSL, __FILE__, ctx->config,
+              "Early data %s\n", resend ? "rejected" : "accepted");
+
+    ctx->early_state = SSL_EARLY_NONE;
+    ctx->early_callback(ctx->early_baton, resend != FALSE);
+}
+
+/* This function reads an encrypted stream and returns the decrypted stream.
+   Implements serf_databuf_reader_t */
+static apr_status_t ssl_decrypt(void *baton, apr_size_t bufsize,
+                                char *buf, apr_size_t *len)
+{
+    serf_ssl_context_t *ctx = baton;
+    apr_status_t status;
+    int ssl_len;
+
+    if (ctx->fatal_err)
+        return ctx->fatal_err;
+
+    if (!ctx->handshake_done) {
+
+        ctx->handshake_done = TRUE;
+
+        status = ssl_handshake(ctx, FALSE);
+
+        if (SERF_BUCKET_READ_ERROR(status)) {
+            *len = 0;
+            return status;
+        }
+    }
+
+    serf__log(LOGLVL_DEBUG, LOGCOMP_SSL, __FILE__, ctx->config,
+              "ssl_decrypt: begin %" APR_SIZE_T_FMT "\n", bufsize);
+
+    ctx->want_read = FALSE; /* Reading now */
+    ctx->crypt_status = APR_SUCCESS; /* Clear before calling SSL */
+
+    /* When an SSL_read() operation has to be repeated because of
+       SSL_ERROR_WANT_READ or SSL_ERROR_WANT_WRITE, it must be repeated
+       with the same arguments.
+
+       Luckily we can assume that we are called from the databuffer
+       implementation */
+    /* Is there some data waiting to be read? */
+    ssl_len = SSL_read(ctx->ssl, buf, bufsize);
+    if (ssl_len < 0) {
+
+        *len = 0;
         status = status_from_ssl_error(ctx, ssl_len, FALSE);
     } else if (ssl_len == 0) {
         /* The server shut down the connection. */
@@ -1162,58 +2232,284 @@ static apr_status_t ssl_decrypt(void *baton, apr_size_t bufsize,
     }
 
 
-    if (!ctx->handshake_finished
-        && !SERF_BUCKET_READ_ERROR(status)) {
+    if (!ctx->handshake_finished
+        && !SERF_BUCKET_READ_ERROR(status)) {
+
+        apr_status_t s = APR_SUCCESS;
+
+        /* Once we got through the initial handshake, we should have received
+           the ALPN information if there is such information. */
+        ctx->handshake_finished = SSL_is_init_finished(ctx->ssl)
+#ifdef SERF_HAVE_OSSL_HANDSHAKE_STATE
+                                  || (SSL_get_state(ctx->ssl) == TLS_ST_OK);
+#elif defined(SSL_CB_HANDSHAKE_DONE)
+                                  || (SSL_state(ctx->ssl)
+                                      & SSL_CB_HANDSHAKE_DONE);
+#else
+#error "neither TLS_ST_OK nor SSL_CB_HANDSHAKE_DONE is available"
+#endif
+
+        if (ctx->handshake_finished && ctx->early_state == SSL_EARLY_SENT)
+            ssl_early_data_done(ctx);
+
+        /* Call the protocol callback as soon as possible as this triggers
+           pipelining data for the selected protocol. */
+        if (ctx->protocol_callback) {
+            const char *protocol = ssl_get_selected_protocol(ctx);
+
+            /* When ctx->init_finished is TRUE protocol will never be NULL,
+               reporting the final result if not already handled */
+            if (protocol) {
+                s = ctx->protocol_callback(ctx->protocol_userdata, protocol);
+                ctx->protocol_callback = NULL;
+            }
+        }
+
+        if (SERF_BUCKET_READ_ERROR(s)) {
+            serf__log(LOGLVL_ERROR, LOGCOMP_SSL, __FILE__, ctx->config,
+                      "ssl_decrypt: negotiation reported: %d\n", status);
+            status = s;
+        }
+    }
+
+    serf__log(LOGLVL_DEBUG, LOGCOMP_SSL, __FILE__, ctx->config,
+              "ssl_decrypt: %d %"APR_SIZE_T_FMT"\n", status, *len);
+
+    return status;
+}
+
+/* Passes LEN bytes of plaintext at DATA to SSL_write(), as one record */
+static apr_status_t ssl_write_record(serf_ssl_context_t *ctx,
+                                     const char *data,
+                                     apr_size_t len)
+{
+    int ssl_len;
+    apr_status_t status;
+
+    /* When an SSL_write() operation has to be repeated because of
+       SSL_ERROR_WANT_READ or SSL_ERROR_WANT_WRITE, it MUST be
+       repeated with the same arguments.
+
+       Unless SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER is set...
+       ... which we do. The data must still be the same, which is why
+       the caller keeps it in the stage buffer until it is taken.
+    */
+    ctx->crypt_status = APR_SUCCESS; /* Clear before calling SSL */
+    ssl_len = SSL_write(ctx->ssl, data, (int)len);
+
+    serf__log(LOGLVL_DEBUG, LOGCOMP_SSL, __FILE__, ctx->config,
+              "ssl_encrypt: SSL write: %d\n", ssl_len);
+
+    if (ssl_len > 0) {
+        serf__log(LOGLVL_DEBUG, LOGCOMP_SSL, __FILE__, ctx->config,
+                  "---\n%.*s\n-(%"APR_SIZE_T_FMT")-\n",
+                  (int)len, data, len);
+
+        ctx->record_bytes += len;
+        ctx->record_last = apr_time_now();
+        return APR_SUCCESS;
+    }
+
+    status = status_from_ssl_error(ctx, ssl_len, TRUE);
+
+    /* Whatever the reason, the data wasn't taken */
+    return status ? status : APR_EAGAIN;
+}
+
+/* Writes the plaintext in the stage buffer of CTX */
+static apr_status_t ssl_write_stage(serf_ssl_context_t *ctx)
+{
+    apr_status_t status;
+
+    status = ssl_write_record(ctx, ctx->stage_buf, ctx->stage_len);
+    if (!status)
+        ctx->stage_len = 0;
+
+    return status;
+}
+
+/* Places the data of VECS that SSL_write() didn't take, starting SKIP
+   bytes into the first iovec, back in front of the stream. We don't own
+   the memory of the iovecs, so it is copied */
+static void ssl_encrypt_unread(serf_ssl_context_t *ctx,
+                               const struct iovec *vecs,
+                               int vecs_used,
+                               apr_size_t skip)
+{
+    apr_size_t len = 0;
+    char *data;
+    int i;
+
+    for (i = 0; i < vecs_used; i++)
+        len += vecs[i].iov_len;
+
+    len -= skip;
+    if (!len)
+        return;
+
+    data = serf_bucket_mem_alloc(ctx->allocator, len);
+
+    len = vecs[0].iov_len - skip;
+    memcpy(data, (const char *)vecs[0].iov_base + skip, len);
+    for (i = 1; i < vecs_used; i++) {
+        memcpy(data + len, vecs[i].iov_base, vecs[i].iov_len);
+        len += vecs[i].iov_len;
+    }
+
+    serf_bucket_aggregate_prepend(ctx->encrypt.stream,
+                                  serf_bucket_simple_own_create(
+                                                    data, len,
+                                                    ctx->allocator));
+}
+
+/* Returns the plaintext size of the records CTX should send now */
+static apr_size_t ssl_record_limit(serf_ssl_context_t *ctx)
+{
+    if (!ctx->record_ramp)
+        return SSL_RECORD_PLAINTEXT;
+
+    /* The congestion window may have shrunk while idle, start over */
+    if (ctx->record_bytes && ctx->record_idle
+        && apr_time_now() - ctx->record_last > ctx->record_idle)
+    {
+        serf__log(LOGLVL_DEBUG, LOGCOMP_SSL, __FILE__, ctx->config,
+                  "ssl_encrypt: idle, back to small records\n");
+        ctx->record_bytes = 0;
+    }
+
+    if (ctx->record_bytes < ctx->record_ramp)
+        return SSL_RECORD_SMALL;
+
+    return SSL_RECORD_PLAINTEXT;
+}
+
+/* Encrypts the plaintext in VECS. Pieces of at least SSL_DIRECT_MIN bytes
+   are passed to SSL_write() as they are, in slices of at most a record;
+   smaller pieces are gathered in the stage buffer up to a record. What
+   remains in the stage buffer is left for the caller. Records hold at
+   most ctx->record_limit bytes of plaintext */
+static apr_status_t ssl_encrypt_vecs(serf_ssl_context_t *ctx,
+                                     const struct iovec *vecs,
+                                     int vecs_used)
+{
+    int i;
+
+    for (i = 0; i < vecs_used; i++) {
+        const char *data = vecs[i].iov_base;
+        apr_size_t left = vecs[i].iov_len;
+
+        while (left) {
+            apr_status_t status = APR_SUCCESS;
+            apr_size_t chunk;
+
+            if (!ctx->stage_len && left >= SSL_DIRECT_MIN) {
+                chunk = MIN(left, ctx->record_limit);
+                status = ssl_write_record(ctx, data, chunk);
+
+                /* Keep it to repeat the write */
+                if (status) {
+                    memcpy(ctx->stage_buf, data, chunk);
+                    ctx->stage_len = chunk;
+                }
+            }
+            else {
+                chunk = MIN(left, ctx->record_limit - ctx->stage_len);
+                memcpy(ctx->stage_buf + ctx->stage_len, data, chunk);
+                ctx->stage_len += chunk;
+
+                if (ctx->stage_len == ctx->record_limit)
+                    status = ssl_write_stage(ctx);
+            }
+
+            data += chunk;
+            left -= chunk;
+
+            if (status) {
+                ssl_encrypt_unread(ctx, vecs + i, vecs_used - i,
+                                   vecs[i].iov_len - left);
+                return status;
+            }
+        }
+    }
 
-        apr_status_t s = APR_SUCCESS;
+    return APR_SUCCESS;
+}
 
-        /* Once we got through the initial handshake, we should have received
-           the ALPN information if there is such information. */
-        ctx->handshake_finished = SSL_is_init_finished(ctx->ssl)
-#ifdef SERF_HAVE_OSSL_HANDSHAKE_STATE
-                                  || (SSL_get_state(ctx->ssl) == TLS_ST_OK);
-#elif defined(SSL_CB_HANDSHAKE_DONE)
-                                  || (SSL_state(ctx->ssl)
-                                      & SSL_CB_HANDSHAKE_DONE);
-#else
-#error "neither TLS_ST_OK nor SSL_CB_HANDSHAKE_DONE is available"
+/* Gathers the data the connection offered as early data in the stage
+   buffer, and sends it along with the ClientHello once the stream has
+   nothing more. Returns APR_EAGAIN while gathering. When the data doesn't
+   fit in the early data the server allows, it is sent after the handshake
+   instead */
+static apr_status_t ssl_encrypt_early(serf_ssl_context_t *ctx)
+{
+    apr_size_t max_early = SSL_RECORD_PLAINTEXT;
+    apr_status_t status;
+
+#ifdef SSL_EARLY_DATA_ACCEPTED
+    max_early = MIN(max_early,
+                    SSL_SESSION_get_max_early_data(SSL_get_session(ctx->ssl)));
 #endif
 
-        /* Call the protocol callback as soon as possible as this triggers
-           pipelining data for the selected protocol. */
-        if (ctx->protocol_callback) {
-            const char *protocol = ssl_get_selected_protocol(ctx);
+    do {
+        struct iovec vecs[SERF__STD_IOV_COUNT];
+        int vecs_read, i;
 
-            /* When ctx->init_finished is TRUE protocol will never be NULL,
-               reporting the final result if not already handled */
-            if (protocol) {
-                s = ctx->protocol_callback(ctx->protocol_userdata, protocol);
-                ctx->protocol_callback = NULL;
-            }
+        status = serf_bucket_read_iovec(ctx->encrypt.stream,
+                                        max_early - ctx->stage_len,
+                                        COUNT_OF(vecs), vecs, &vecs_read);
+        if (SERF_BUCKET_READ_ERROR(status))
+            return status;
+
+        for (i = 0; i < vecs_read; i++) {
+            memcpy(ctx->stage_buf + ctx->stage_len, vecs[i].iov_base,
+                   vecs[i].iov_len);
+            ctx->stage_len += vecs[i].iov_len;
         }
+    } while (!status && ctx->stage_len < max_early);
 
-        if (SERF_BUCKET_READ_ERROR(s)) {
-            serf__log(LOGLVL_ERROR, LOGCOMP_SSL, __FILE__, ctx->config,
-                      "ssl_decrypt: negotiation reported: %d\n", status);
-            status = s;
+    if (APR_STATUS_IS_EAGAIN(status) && !ctx->stage_len)
+        return status;
+
+#ifdef SSL_EARLY_DATA_ACCEPTED
+    /* The stream ran dry, so the stage holds all the offered data */
+    if (status) {
+        size_t written;
+
+        ctx->crypt_status = APR_SUCCESS; /* Clear before calling SSL */
+        if (SSL_write_early_data(ctx->ssl, ctx->stage_buf, ctx->stage_len,
+                                 &written) > 0) {
+            serf__log(LOGLVL_DEBUG, LOGCOMP_SSL, __FILE__, ctx->config,
+                      "ssl_encrypt: sent %"APR_SIZE_T_FMT" bytes of early "
+                      "data\n", (apr_size_t)written);
+
+            ctx->stage_len = 0;
+            ctx->early_state = SSL_EARLY_SENT;
+            return APR_SUCCESS;
         }
+
+        log_ssl_error(ctx);
     }
+#endif
 
+    /* Send it the usual way, which needs no resend */
     serf__log(LOGLVL_DEBUG, LOGCOMP_SSL, __FILE__, ctx->config,
-              "ssl_decrypt: %d %"APR_SIZE_T_FMT"\n", status, *len);
+              "ssl_encrypt: not sending early data\n");
 
-    return status;
+    ctx->early_state = SSL_EARLY_NONE;
+    ctx->early_callback(ctx->early_baton, false);
+
+    return APR_SUCCESS;
 }
 
-/* This function reads a decrypted stream and returns an encrypted stream.
-   Implements serf_databuf_reader_t */
-static apr_status_t ssl_encrypt(void *baton, apr_size_t bufsize,
-                                char *buf, apr_size_t *len)
+/* Encrypts up to BUFSIZE bytes of the stream into encrypt_pending, unless
+   encrypted data is already waiting there. Returns the status of reading
+   the stream, or the error that stopped encryption. */
+static apr_status_t ssl_encrypt(serf_ssl_context_t *ctx, apr_size_t bufsize)
 {
     const char *data;
-    apr_size_t interim_bufsize;
-    serf_ssl_context_t *ctx = baton;
+    apr_size_t len;
     apr_status_t status;
+    int write_failed = FALSE;
 
     if (ctx->fatal_err)
         return ctx->fatal_err;
@@ -1232,144 +2528,104 @@ static apr_status_t ssl_encrypt(void *baton, apr_size_t bufsize,
         }
     }
 
-    /* Try to read already encrypted but unread data first. */
-    status = serf_bucket_read(ctx->encrypt_pending, bufsize, &data, len);
+    /* Data written by OpenSSL on its own, e.g. while decrypting */
+    encrypt_flush_records(ctx);
+
+    /* Already encrypted but unread data goes first. */
+    status = serf_bucket_peek(ctx->encrypt_pending, &data, &len);
     if (SERF_BUCKET_READ_ERROR(status)) {
         return status;
     }
-
-    /* Aha, we read something.  Return that now. */
-    if (*len) {
-        memcpy(buf, data, *len);
-        if (APR_STATUS_IS_EOF(status)) {
-            status = APR_SUCCESS;
-        }
-
-        serf__log(LOGLVL_DEBUG, LOGCOMP_SSL, __FILE__, ctx->config,
-                  "ssl_encrypt: %d %"APR_SIZE_T_FMT" (quick read)\n",
-                  status, *len);
-
-        return status;
+    else if (len) {
+        return APR_SUCCESS;
     }
 
-    /* Oh well, read from our stream now. */
-    interim_bufsize = bufsize;
-    do {
-        apr_size_t interim_len;
-
-        if (!ctx->want_read) {
-            struct iovec vecs[SERF__STD_IOV_COUNT];
-            int vecs_read;
-
-            status = serf_bucket_read_iovec(ctx->encrypt.stream,
-                                            interim_bufsize,
-                                            COUNT_OF(vecs), vecs,
-                                            &vecs_read);
-
-            if (!SERF_BUCKET_READ_ERROR(status) && vecs_read) {
-                char *vecs_data;
-                int i, cur, vecs_data_len;
-                int ssl_len;
-
-                /* Combine the buffers of the iovec into one buffer, as
-                   that is with SSL_write requires. */
-                vecs_data_len = 0;
-                for (i = 0; i < vecs_read; i++) {
-                    vecs_data_len += vecs[i].iov_len;
-                }
+    if (!ctx->stage_buf)
+        ctx->stage_buf = serf_bucket_mem_alloc(ctx->allocator,
+                                               SSL_RECORD_PLAINTEXT);
 
-                vecs_data = serf_bucket_mem_alloc(ctx->allocator,
-                                                  vecs_data_len);
+    bufsize = MIN(bufsize, SSL_ENCRYPT_BATCH);
 
-                cur = 0;
-                for (i = 0; i < vecs_read; i++) {
-                    memcpy(vecs_data + cur, vecs[i].iov_base, vecs[i].iov_len);
-                    cur += vecs[i].iov_len;
-                }
+    if (ctx->early_state == SSL_EARLY_GATHER) {
+        status = ssl_encrypt_early(ctx);
+        if (status)
+            return status;
 
-                interim_bufsize -= vecs_data_len;
-                interim_len = vecs_data_len;
+        encrypt_flush_records(ctx);
+    }
 
-                serf__log(LOGLVL_DEBUG, LOGCOMP_SSL, __FILE__, ctx->config,
-                          "ssl_encrypt: bucket read %"APR_SIZE_T_FMT" bytes; "\
-                          "status %d\n", interim_len, status);
+    /* No application data until the responder told the status of the
+       server certificate */
+    if (ctx->ocsp_waiter) {
+        serf__log(LOGLVL_DEBUG, LOGCOMP_SSL, __FILE__, ctx->config,
+                  "ssl_encrypt: waiting for the OCSP responder\n");
+        return SERF_ERROR_WAIT_CONN;
+    }
 
-                /* When an SSL_write() operation has to be repeated because of
-                   SSL_ERROR_WANT_READ or SSL_ERROR_WANT_WRITE, it MUST be
-                   repeated with the same arguments.
+    /* A write that has to be repeated goes first */
+    status = APR_SUCCESS;
+    if (ctx->stage_len && !ctx->want_read) {
+        status = ssl_write_stage(ctx);
+        write_failed = (status != APR_SUCCESS);
+    }
 
-                   Unless SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER is set...
-                   ... which we now do.
-                */
-                ctx->crypt_status = APR_SUCCESS; /* Clear before calling SSL */
-                ssl_len = SSL_write(ctx->ssl, vecs_data, interim_len);
-
-                serf__log(LOGLVL_DEBUG, LOGCOMP_SSL, __FILE__, ctx->config,
-                          "ssl_encrypt: SSL write: %d\n", ssl_len);
-
-                /* If we failed to write... */
-                if (ssl_len <= 0) {
-
-                    /* Ah, bugger. We need to put that data back.
-                       Note: use the copy here, we do not own the original iovec
-                       data buffer so it will be freed on next read. */
-                    serf_bucket_t *vecs_copy =
-                        serf_bucket_simple_own_create(vecs_data,
-                                                      vecs_data_len,
-                                                      ctx->allocator);
-                    serf_bucket_aggregate_prepend(ctx->encrypt.stream,
-                                                  vecs_copy);
-
-                    status = status_from_ssl_error(ctx, ssl_len, TRUE);
-                } else {
-                    /* We're done with this data. */
-                    serf_bucket_mem_free(ctx->allocator, vecs_data);
-
-                    serf__log(LOGLVL_DEBUG, LOGCOMP_SSL, __FILE__, ctx->config,
-                              "---\n%.*s\n-(%"APR_SIZE_T_FMT")-\n",
-                              (int)interim_len, vecs_data, interim_len);
+    /* The stage is empty here unless its write failed, so it never holds
+       more than the limit while gathering */
+    if (!status)
+        ctx->record_limit = ssl_record_limit(ctx);
 
-                }
-            }
-        }
-        else {
-            interim_len = 0;
-            *len = 0;
+    /* Oh well, read from our stream now. */
+    while (!status && bufsize) {
+        struct iovec vecs[SERF__STD_IOV_COUNT];
+        int vecs_read, i;
+
+        if (ctx->want_read) {
             status = ctx->crypt_status;
 
             if (!status) {
                 status = APR_EAGAIN; /* Exit loop */
             }
+            break;
         }
 
-    } while (!status && interim_bufsize);
-
-    /* Okay, we exhausted our underlying stream. */
-    if (!SERF_BUCKET_READ_ERROR(status)) {
-        apr_status_t agg_status;
-        struct iovec vecs[SERF__STD_IOV_COUNT];
-        int vecs_read, i;
+        status = serf_bucket_read_iovec(ctx->encrypt.stream, bufsize,
+                                        COUNT_OF(vecs), vecs, &vecs_read);
+        if (SERF_BUCKET_READ_ERROR(status))
+            break;
 
-        /* We read something! */
-        agg_status = serf_bucket_read_iovec(ctx->encrypt_pending, bufsize,
-                                            COUNT_OF(vecs), vecs, &vecs_read);
-        *len = 0;
         for (i = 0; i < vecs_read; i++) {
-            memcpy(buf + *len, vecs[i].iov_base, vecs[i].iov_len);
-            *len += vecs[i].iov_len;
+            bufsize -= vecs[i].iov_len;
         }
 
         serf__log(LOGLVL_DEBUG, LOGCOMP_SSL, __FILE__, ctx->config,
-                  "ssl_encrypt read agg: %d %d %d %"APR_SIZE_T_FMT"\n", status, agg_status,
-                  ctx->crypt_status, *len);
+                  "ssl_encrypt: bucket read %d iovecs; status %d\n",
+                  vecs_read, status);
 
-        if (!agg_status) {
-            status = APR_SUCCESS;
+        if (vecs_read) {
+            apr_status_t write_status;
+
+            write_status = ssl_encrypt_vecs(ctx, vecs, vecs_read);
+            if (write_status) {
+                status = write_status;
+                write_failed = TRUE;
+            }
         }
     }
 
+    /* Don't hold back what was gathered so far */
+    if (ctx->stage_len && !write_failed
+        && !SERF_BUCKET_READ_ERROR(status) && !ctx->want_read)
+    {
+        apr_status_t write_status = ssl_write_stage(ctx);
+
+        if (write_status)
+            status = write_status;
+    }
+
+    encrypt_flush_records(ctx);
+
     serf__log(LOGLVL_DEBUG, LOGCOMP_SSL, __FILE__, ctx->config,
-              "ssl_encrypt finished: %d %"APR_SIZE_T_FMT"\n", status, *len);
+              "ssl_encrypt finished: %d\n", status);
 
     return status;
 }
@@ -1456,80 +2712,327 @@ static volatile apr_uint32_t have_init_ssl = INIT_UNINITIALIZED;
 
 static void init_ssl_libraries(void)
 {
-    apr_uint32_t val;
+    apr_uint32_t val;
+
+    val = apr_atomic_cas32(&have_init_ssl, INIT_BUSY, INIT_UNINITIALIZED);
+
+    if (!val) {
+#if APR_HAS_THREADS && defined(SERF_HAVE_SSL_LOCKING_CALLBACKS)
+        int i, numlocks;
+#endif
+
+#ifdef SERF_LOGGING_ENABLED
+        /* Warn when compile-time and run-time version of OpenSSL differ in
+           major/minor version number. */
+#ifdef SERF_HAVE_OPENSSL_VERSION_NUM
+        unsigned long libver = OpenSSL_version_num();
+#else
+        long libver = SSLeay();
+#endif
+
+        if ((libver ^ OPENSSL_VERSION_NUMBER) & 0xFFF00000) {
+            serf__log(LOGLVL_WARNING, LOGCOMP_SSL, __FILE__, NULL,
+                      "Warning: OpenSSL library version mismatch, compile-"
+                      "time was %lx, runtime is %lx.\n",
+                      OPENSSL_VERSION_NUMBER, libver);
+        }
+#endif
+
+#ifdef SERF_HAVE_OPENSSL_SSL_LIBRARY_INIT
+        ERR_load_crypto_strings();
+        SSL_load_error_strings();
+        SSL_library_init();
+        OpenSSL_add_all_algorithms();
+#endif
+
+#if APR_HAS_THREADS && defined(SERF_HAVE_SSL_LOCKING_CALLBACKS)
+        numlocks = CRYPTO_num_locks();
+        apr_pool_create(&ssl_pool, NULL);
+        ssl_locks = apr_palloc(ssl_pool, sizeof(apr_thread_mutex_t*)*numlocks);
+        for (i = 0; i < numlocks; i++) {
+            apr_status_t rv;
+
+            /* Intraprocess locks don't /need/ a filename... */
+            rv = apr_thread_mutex_create(&ssl_locks[i],
+                                         APR_THREAD_MUTEX_DEFAULT, ssl_pool);
+            if (rv != APR_SUCCESS) {
+                /* FIXME: error out here */
+            }
+        }
+        CRYPTO_set_locking_callback(ssl_lock);
+        CRYPTO_set_id_callback(ssl_id);
+        CRYPTO_set_dynlock_create_callback(ssl_dyn_create);
+        CRYPTO_set_dynlock_lock_callback(ssl_dyn_lock);
+        CRYPTO_set_dynlock_destroy_callback(ssl_dyn_destroy);
+
+        apr_pool_cleanup_register(ssl_pool, NULL, cleanup_ssl, cleanup_ssl);
+#endif
+        apr_atomic_cas32(&have_init_ssl, INIT_DONE, INIT_BUSY);
+    }
+  else
+    {
+        /* Make sure we don't continue before the initialization in another
+           thread has completed */
+        while (val != INIT_DONE) {
+            apr_sleep(APR_USEC_PER_SEC / 1000);
+
+            val = apr_atomic_cas32(&have_init_ssl,
+                                   INIT_UNINITIALIZED,
+                                   INIT_UNINITIALIZED);
+        }
+    }
+}
+
+/* A client certificate and its private key, parsed from the PKCS#12 file
+   at PATH when the file had MTIME and SIZE */
+typedef struct client_cert_entry_t {
+    const char *path;
+    apr_time_t mtime;
+    apr_off_t size;
+    X509 *cert;
+    EVP_PKEY *pkey;
+} client_cert_entry_t;
+
+struct serf_ssl_client_cert_cache_t {
+    apr_pool_t *pool;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *lock;
+#endif
+
+    apr_hash_t *entries;  /* path -> client_cert_entry_t */
+};
+
+#define SERF_CONFIG__SSL_CLIENT_CERT_CACHE \
+    (SERF_CONFIG_PER_CONTEXT | 0xF00003)
+
+static void client_cert_cache_lock(serf_ssl_client_cert_cache_t *cache)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(cache->lock);
+#endif
+}
+
+static void client_cert_cache_unlock(serf_ssl_client_cert_cache_t *cache)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(cache->lock);
+#endif
+}
+
+static void client_cert_entry_clear(client_cert_entry_t *entry)
+{
+    if (entry->cert)
+        X509_free(entry->cert);
+    if (entry->pkey)
+        EVP_PKEY_free(entry->pkey);
+
+    entry->cert = NULL;
+    entry->pkey = NULL;
+}
+
+static apr_status_t cleanup_client_cert_cache(void *data)
+{
+    serf_ssl_client_cert_cache_t *cache = data;
+    apr_hash_index_t *hi;
+
+    for (hi = apr_hash_first(NULL, cache->entries); hi;
+         hi = apr_hash_next(hi))
+    {
+        client_cert_entry_clear(apr_hash_this_val(hi));
+    }
+
+    return APR_SUCCESS;
+}
+
+/* Sets *CERT and *PKEY to new references to the certificate and key
+   loaded from the file at PATH, if CACHE has them and the file still has
+   the times and size in FINFO. Returns whether it did */
+static int client_cert_cache_get(X509 **cert,
+                                 EVP_PKEY **pkey,
+                                 serf_ssl_client_cert_cache_t *cache,
+                                 const char *path,
+                                 const apr_finfo_t *finfo)
+{
+    client_cert_entry_t *entry;
+    int found = FALSE;
+
+    client_cert_cache_lock(cache);
+
+    entry = apr_hash_get(cache->entries, path, APR_HASH_KEY_STRING);
+    if (entry && entry->cert
+        && entry->mtime == finfo->mtime && entry->size == finfo->size)
+    {
+        X509_up_ref(entry->cert);
+        EVP_PKEY_up_ref(entry->pkey);
+        *cert = entry->cert;
+        *pkey = entry->pkey;
+        found = TRUE;
+    }
+
+    client_cert_cache_unlock(cache);
+
+    return found;
+}
+
+/* Keeps references to CERT and PKEY in CACHE, as loaded from the file at
+   PATH when it had the times and size in FINFO */
+static void client_cert_cache_store(serf_ssl_client_cert_cache_t *cache,
+                                    const char *path,
+                                    const apr_finfo_t *finfo,
+                                    X509 *cert,
+                                    EVP_PKEY *pkey)
+{
+    client_cert_entry_t *entry;
+
+    if (!cert || !pkey)
+        return;
+
+    client_cert_cache_lock(cache);
+
+    entry = apr_hash_get(cache->entries, path, APR_HASH_KEY_STRING);
+    if (entry) {
+        client_cert_entry_clear(entry);
+    }
+    else {
+        entry = apr_pcalloc(cache->pool, sizeof(*entry));
+        entry->path = apr_pstrdup(cache->pool, path);
+        apr_hash_set(cache->entries, entry->path, APR_HASH_KEY_STRING,
+                     entry);
+    }
+
+    X509_up_ref(cert);
+    EVP_PKEY_up_ref(pkey);
+    entry->cert = cert;
+    entry->pkey = pkey;
+    entry->mtime = finfo->mtime;
+    entry->size = finfo->size;
+
+    client_cert_cache_unlock(cache);
+}
+
+/* Reads the PKCS#12 structure from the file at PATH into *P12, which is
+   NULL when the file doesn't hold one */
+static apr_status_t client_cert_read_p12(PKCS12 **p12,
+                                         const char *path,
+                                         apr_pool_t *pool)
+{
+    apr_file_t *cert_file;
+    BIO_METHOD *biom;
+    BIO *bio;
+    apr_status_t status;
+
+    status = apr_file_open(&cert_file, path, APR_READ, APR_OS_DEFAULT, pool);
+    if (status)
+        return status;
+
+    biom = bio_meth_file_new();
+    bio = BIO_new(biom);
+    bio_set_data(bio, cert_file);
+
+    *p12 = d2i_PKCS12_bio(bio, NULL);
+    BIO_free(bio);
+    bio_meth_free(biom);
+    apr_file_close(cert_file);
+
+    return APR_SUCCESS;
+}
+
+apr_status_t
+serf_ssl_client_cert_cache_create(serf_ssl_client_cert_cache_t **cache,
+                                  apr_pool_t *pool)
+{
+    serf_ssl_client_cert_cache_t *c = apr_pcalloc(pool, sizeof(*c));
+
+    c->pool = pool;
+    c->entries = apr_hash_make(pool);
+
+#if APR_HAS_THREADS
+    {
+        apr_status_t status;
+
+        status = apr_thread_mutex_create(&c->lock, APR_THREAD_MUTEX_DEFAULT,
+                                         pool);
+        if (status)
+            return status;
+    }
+#endif
+
+    apr_pool_cleanup_register(pool, c, cleanup_client_cert_cache,
+                              apr_pool_cleanup_null);
+
+    *cache = c;
+    return APR_SUCCESS;
+}
+
+apr_status_t
+serf_ssl_client_cert_cache_load(serf_ssl_client_cert_cache_t *cache,
+                                const char *path,
+                                const char *password,
+                                apr_pool_t *scratch_pool)
+{
+    apr_finfo_t finfo;
+    PKCS12 *p12;
+    X509 *cert = NULL;
+    EVP_PKEY *pkey = NULL;
+    apr_status_t status;
 
-    val = apr_atomic_cas32(&have_init_ssl, INIT_BUSY, INIT_UNINITIALIZED);
+    init_ssl_libraries();
 
-    if (!val) {
-#if APR_HAS_THREADS && defined(SERF_HAVE_SSL_LOCKING_CALLBACKS)
-        int i, numlocks;
-#endif
+    status = apr_stat(&finfo, path, APR_FINFO_MTIME | APR_FINFO_SIZE,
+                      scratch_pool);
+    if (status)
+        return status;
 
-#ifdef SERF_LOGGING_ENABLED
-        /* Warn when compile-time and run-time version of OpenSSL differ in
-           major/minor version number. */
-#ifdef SERF_HAVE_OPENSSL_VERSION_NUM
-        unsigned long libver = OpenSSL_version_num();
-#else
-        long libver = SSLeay();
-#endif
+    status = client_cert_read_p12(&p12, path, scratch_pool);
+    if (status)
+        return status;
 
-        if ((libver ^ OPENSSL_VERSION_NUMBER) & 0xFFF00000) {
-            serf__log(LOGLVL_WARNING, LOGCOMP_SSL, __FILE__, NULL,
-                      "Warning: OpenSSL library version mismatch, compile-"
-                      "time was %lx, runtime is %lx.\n",
-                      OPENSSL_VERSION_NUMBER, libver);
-        }
-#endif
+    if (!p12 || PKCS12_parse(p12, password, &pkey, &cert, NULL) != 1
+        || !cert || !pkey)
+    {
+        ERR_clear_error();
+        status = SERF_ERROR_SSL_CERT_FAILED;
+    }
+    else {
+        client_cert_cache_store(cache, path, &finfo, cert, pkey);
+    }
 
-#ifdef SERF_HAVE_OPENSSL_SSL_LIBRARY_INIT
-        ERR_load_crypto_strings();
-        SSL_load_error_strings();
-        SSL_library_init();
-        OpenSSL_add_all_algorithms();
-#endif
+    if (cert)
+        X509_free(cert);
+    if (pkey)
+        EVP_PKEY_free(pkey);
+    if (p12)
+        PKCS12_free(p12);
 
-#if APR_HAS_THREADS && defined(SERF_HAVE_SSL_LOCKING_CALLBACKS)
-        numlocks = CRYPTO_num_locks();
-        apr_pool_create(&ssl_pool, NULL);
-        ssl_locks = apr_palloc(ssl_pool, sizeof(apr_thread_mutex_t*)*numlocks);
-        for (i = 0; i < numlocks; i++) {
-            apr_status_t rv;
+    return status;
+}
 
-            /* Intraprocess locks don't /need/ a filename... */
-            rv = apr_thread_mutex_create(&ssl_locks[i],
-                                         APR_THREAD_MUTEX_DEFAULT, ssl_pool);
-            if (rv != APR_SUCCESS) {
-                /* FIXME: error out here */
-            }
-        }
-        CRYPTO_set_locking_callback(ssl_lock);
-        CRYPTO_set_id_callback(ssl_id);
-        CRYPTO_set_dynlock_create_callback(ssl_dyn_create);
-        CRYPTO_set_dynlock_lock_callback(ssl_dyn_lock);
-        CRYPTO_set_dynlock_destroy_callback(ssl_dyn_destroy);
+void serf_context_set_ssl_client_cert_cache(
+    serf_context_t *ctx,
+    serf_ssl_client_cert_cache_t *cache)
+{
+    serf_config_set_object(ctx->config, SERF_CONFIG__SSL_CLIENT_CERT_CACHE,
+                           cache);
+}
 
-        apr_pool_cleanup_register(ssl_pool, NULL, cleanup_ssl, cleanup_ssl);
-#endif
-        apr_atomic_cas32(&have_init_ssl, INIT_DONE, INIT_BUSY);
-    }
-  else
-    {
-        /* Make sure we don't continue before the initialization in another
-           thread has completed */
-        while (val != INIT_DONE) {
-            apr_sleep(APR_USEC_PER_SEC / 1000);
+/* Returns the client certificate cache of the context of CONFIG, or NULL */
+static serf_ssl_client_cert_cache_t *
+client_cert_cache_from_config(serf_config_t *config)
+{
+    void *cache;
 
-            val = apr_atomic_cas32(&have_init_ssl,
-                                   INIT_UNINITIALIZED,
-                                   INIT_UNINITIALIZED);
-        }
-    }
+    if (!config
+        || serf_config_get_object(config, SERF_CONFIG__SSL_CLIENT_CERT_CACHE,
+                                  &cache))
+        return NULL;
+
+    return cache;
 }
 
 static int ssl_need_client_cert(SSL *ssl, X509 **cert, EVP_PKEY **pkey)
 {
     serf_ssl_context_t *ctx = SSL_get_app_data(ssl);
+    serf_ssl_client_cert_cache_t *cache;
     apr_status_t status;
 
     serf__log(LOGLVL_DEBUG, LOGCOMP_SSL, __FILE__, ctx->config,
@@ -1541,11 +3044,11 @@ static int ssl_need_client_cert(SSL *ssl, X509 **cert, EVP_PKEY **pkey)
         return 1;
     }
 
+    cache = client_cert_cache_from_config(ctx->config);
+
     while (ctx->cert_callback) {
         const char *cert_path;
-        apr_file_t *cert_file;
-        BIO *bio;
-        BIO_METHOD *biom;
+        apr_finfo_t finfo;
         PKCS12 *p12;
         int i;
         int retrying_success = 0;
@@ -1563,29 +3066,48 @@ static int ssl_need_client_cert(SSL *ssl, X509 **cert, EVP_PKEY **pkey)
             break;
         }
 
+        /* The file is checked before it is read, so a change while
+           reading is noticed by the next lookup in the cache */
+        if (cache) {
+            apr_pool_t *scratch_pool;
+
+            apr_pool_create(&scratch_pool, ctx->pool);
+            status = apr_stat(&finfo, cert_path,
+                              APR_FINFO_MTIME | APR_FINFO_SIZE, scratch_pool);
+            apr_pool_destroy(scratch_pool);
+
+            if (status)
+                cache = NULL;
+        }
+
+        /* Another connection may have loaded and decrypted it already */
+        if (cache && client_cert_cache_get(cert, pkey, cache, cert_path,
+                                           &finfo)) {
+            serf__log(LOGLVL_DEBUG, LOGCOMP_SSL, __FILE__, ctx->config,
+                      "Using cached client certificate %s\n", cert_path);
+            ctx->cert_path = cert_path;
+            ctx->cached_cert = *cert;
+            ctx->cached_cert_pw = *pkey;
+            return 1;
+        }
+
         /* Load the x.509 cert file stored in PKCS12 */
-        status = apr_file_open(&cert_file, cert_path, APR_READ, APR_OS_DEFAULT,
-                               ctx->pool);
+        status = client_cert_read_p12(&p12, cert_path, ctx->pool);
 
         /* TODO: this will hang indefintely when the file can't be found. */
         if (status) {
             continue;
         }
 
-        biom = bio_meth_file_new();
-        bio = BIO_new(biom);
-        bio_set_data(bio, cert_file);
-
         ctx->cert_path = cert_path;
-        p12 = d2i_PKCS12_bio(bio, NULL);
-        BIO_free(bio);
-        apr_file_close(cert_file);
 
         i = PKCS12_parse(p12, NULL, pkey, cert, NULL);
 
         if (i == 1) {
             PKCS12_free(p12);
-            bio_meth_free(biom);
+            if (cache)
+                client_cert_cache_store(cache, cert_path, &finfo,
+                                        *cert, *pkey);
             ctx->cached_cert = *cert;
             ctx->cached_cert_pw = *pkey;
             if (!retrying_success && ctx->cert_cache_pool) {
@@ -1621,7 +3143,9 @@ static int ssl_need_client_cert(SSL *ssl, X509 **cert, EVP_PKEY **pkey)
                         i = PKCS12_parse(p12, password, pkey, cert, NULL);
                         if (i == 1) {
                             PKCS12_free(p12);
-                            bio_meth_free(biom);
+                            if (cache)
+                                client_cert_cache_store(cache, cert_path,
+                                                        &finfo, *cert, *pkey);
                             ctx->cached_cert = *cert;
                             ctx->cached_cert_pw = *pkey;
                             if (!retrying_success && ctx->cert_cache_pool) {
@@ -1649,7 +3173,6 @@ static int ssl_need_client_cert(SSL *ssl, X509 **cert, EVP_PKEY **pkey)
                     }
                 }
                 PKCS12_free(p12);
-                bio_meth_free(biom);
                 return 0;
             }
             else {
@@ -1658,7 +3181,6 @@ static int ssl_need_client_cert(SSL *ssl, X509 **cert, EVP_PKEY **pkey)
                           ERR_GET_FUNC(err),
                           ERR_GET_REASON(err));
                 PKCS12_free(p12);
-                bio_meth_free(biom);
             }
         }
     }
@@ -1722,6 +3244,8 @@ void serf_ssl_server_cert_chain_callback_set(
 static int ssl_new_session(SSL *ssl, SSL_SESSION *session)
 {
     serf_ssl_context_t *ctx = SSL_get_app_data(ssl);
+    serf_ssl_session_cache_t *cache;
+    const char *host = NULL;
     void *mem;
     unsigned char *der_data;
     apr_size_t der_len;
@@ -1729,11 +3253,48 @@ static int ssl_new_session(SSL *ssl, SSL_SESSION *session)
     if (!ctx->config)
         return 0;
 
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+    if (!SSL_SESSION_is_resumable(session))
+        return 0;
+#endif
+
+    cache = serf__ssl_session_cache_from_config(ctx->config);
+
+    /* Contexts that share the cache may trust other certificates, so only
+       sessions with a chain that passed all checks are shared. A resumed
+       session was such a session already */
+    if (cache && (ctx->verify_failures || ctx->pending_err)) {
+        serf__log(LOGLVL_DEBUG, LOGCOMP_SSL, __FILE__, ctx->config,
+                  "Not sharing a session with certificate failures\n");
+        return 0;
+    }
+
+    if (cache)
+        host = ssl_session_host(ctx);
+
     der_len = i2d_SSL_SESSION(session, NULL);
 
     mem = serf_bucket_mem_alloc(ctx->allocator, der_len);
     der_data = mem;
-    if (der_len == i2d_SSL_SESSION(session, &der_data)) {
+    if (der_len != i2d_SSL_SESSION(session, &der_data)) {
+        /* Not stored */
+    }
+    else if (cache && host) {
+        apr_time_t expires;
+        bool single_use = false;
+
+        expires = apr_time_from_sec((apr_time_t)SSL_SESSION_get_time(session)
+                                    + SSL_SESSION_get_timeout(session));
+#ifdef TLS1_3_VERSION
+        /* TLS 1.3 tickets shouldn't be reused, servers send several */
+        single_use = (SSL_SESSION_get_protocol_version(session)
+                      >= TLS1_3_VERSION);
+#endif
+
+        serf__ssl_session_cache_store(cache, host, mem, der_len, expires,
+                                      single_use);
+    }
+    else {
         /* der_data was modified by i2d_SSL_SESSION(), so
            we store the original pointer */
         (void)serf__config_store_set_ssl_session(ctx->config,
@@ -1776,14 +3337,33 @@ static serf_ssl_context_t *ssl_init_context(serf_bucket_alloc_t *allocator)
     ssl_ctx->cert_pw_callback = NULL;
     ssl_ctx->server_cert_callback = NULL;
     ssl_ctx->server_cert_chain_callback = NULL;
+    ssl_ctx->verify_failures = 0;
 
     ssl_ctx->selected_protocol = "";
     ssl_ctx->handshake_finished = FALSE;
     ssl_ctx->protocol_callback = NULL;
     ssl_ctx->protocol_userdata = NULL;
 
+    ssl_ctx->session_checked = FALSE;
+    ssl_ctx->early_allowed = FALSE;
+    ssl_ctx->early_state = SSL_EARLY_NONE;
+    ssl_ctx->early_callback = NULL;
+    ssl_ctx->early_baton = NULL;
+
+    ssl_ctx->ocsp_fetcher = NULL;
+    ssl_ctx->ocsp_wakeup = NULL;
+    ssl_ctx->ocsp_wakeup_baton = NULL;
+    ssl_ctx->ocsp_waiter = NULL;
+    ssl_ctx->ocsp_pool = NULL;
+    ssl_ctx->ocsp_request = NULL;
+
+    ssl_ctx->async_allowed = FALSE;
+    ssl_ctx->async_wait = NULL;
+    ssl_ctx->async_baton = NULL;
+
     SSL_CTX_set_verify(ssl_ctx->ctx, SSL_VERIFY_PEER,
                        validate_server_certificate);
+    SSL_CTX_set_cert_verify_callback(ssl_ctx->ctx, ssl_verify_chain, ssl_ctx);
     SSL_CTX_set_options(ssl_ctx->ctx, SSL_OP_ALL);
     /* Disable SSL compression by default. */
     disable_compression(ssl_ctx);
@@ -1797,6 +3377,9 @@ static serf_ssl_context_t *ssl_init_context(serf_bucket_alloc_t *allocator)
 
     /* Enable SSL callback to store the SSL session state to allow
        optimized resumption later. */
+    SSL_CTX_set_session_cache_mode(ssl_ctx->ctx,
+                                   SSL_SESS_CACHE_CLIENT
+                                   | SSL_SESS_CACHE_NO_INTERNAL_STORE);
     SSL_CTX_sess_set_new_cb(ssl_ctx->ctx, ssl_new_session);
 
     SSL_set_connect_state(ssl_ctx->ssl);
@@ -1810,9 +3393,16 @@ static serf_ssl_context_t *ssl_init_context(serf_bucket_alloc_t *allocator)
     ssl_ctx->encrypt.stream = NULL;
     ssl_ctx->encrypt.stream_next = NULL;
     ssl_ctx->encrypt_pending = serf_bucket_aggregate_create(allocator);
-    serf_databuf_init(&ssl_ctx->encrypt.databuf);
-    ssl_ctx->encrypt.databuf.read = ssl_encrypt;
-    ssl_ctx->encrypt.databuf.read_baton = ssl_ctx;
+    ssl_ctx->rec_buf = NULL;
+    ssl_ctx->rec_size = 0;
+    ssl_ctx->rec_used = 0;
+    ssl_ctx->stage_buf = NULL;
+    ssl_ctx->stage_len = 0;
+    ssl_ctx->record_ramp = SSL_RECORD_RAMP_DEFAULT;
+    ssl_ctx->record_idle = SSL_RECORD_IDLE_DEFAULT;
+    ssl_ctx->record_bytes = 0;
+    ssl_ctx->record_last = 0;
+    ssl_ctx->record_limit = SSL_RECORD_PLAINTEXT;
 
     ssl_ctx->decrypt.stream = NULL;
     serf_databuf_init(&ssl_ctx->decrypt.databuf);
@@ -1833,6 +3423,15 @@ static apr_status_t ssl_free_context(
     if (ssl_ctx->encrypt_pending != NULL) {
         serf_bucket_destroy(ssl_ctx->encrypt_pending);
     }
+    if (ssl_ctx->rec_buf)
+        serf_bucket_mem_free(ssl_ctx->allocator, ssl_ctx->rec_buf);
+    if (ssl_ctx->stage_buf)
+        serf_bucket_mem_free(ssl_ctx->allocator, ssl_ctx->stage_buf);
+
+    if (ssl_ctx->ocsp_waiter)
+        serf__ocsp_fetch_cancel(ssl_ctx->ocsp_fetcher, ssl_ctx->ocsp_waiter);
+    if (ssl_ctx->ocsp_pool)
+        apr_pool_destroy(ssl_ctx->ocsp_pool);
 
     /* SSL_free implicitly frees the underlying BIO. */
     SSL_free(ssl_ctx->ssl);
@@ -1972,6 +3571,17 @@ static apr_status_t free_ssl_cert(void *data)
     return APR_SUCCESS;
 }
 
+const char *serf_ssl_backend_version(void)
+{
+#if defined(SERF_HAVE_WOLFSSL)
+    return "wolfSSL " LIBWOLFSSL_VERSION_STRING;
+#elif defined(SERF_HAVE_OPENSSL_VERSION_NUM)
+    return OpenSSL_version(OPENSSL_VERSION);
+#else
+    return SSLeay_version(SSLEAY_VERSION);
+#endif
+}
+
 apr_status_t serf_ssl_use_default_certificates(serf_ssl_context_t *ssl_ctx)
 {
     X509_STORE *store = SSL_CTX_get_cert_store(ssl_ctx->ctx);
@@ -2098,6 +3708,89 @@ apr_status_t serf_ssl_add_crl_from_file(serf_ssl_context_t *ssl_ctx,
     return serf_ssl_check_crl(ssl_ctx, 1);
 }
 
+apr_status_t serf_ssl_crl_store_create(serf_ssl_crl_store_t **store,
+                                       apr_pool_t *pool)
+{
+    serf_ssl_crl_store_t *s = apr_pcalloc(pool, sizeof(*s));
+
+    s->pool = pool;
+    s->checked = apr_time_now();
+    s->check_interval = SSL_CRL_CHECK_INTERVAL;
+
+#if APR_HAS_THREADS
+    {
+        apr_status_t status;
+
+        status = apr_thread_mutex_create(&s->lock, APR_THREAD_MUTEX_DEFAULT,
+                                         pool);
+        if (status)
+            return status;
+    }
+#endif
+
+    apr_pool_cleanup_register(pool, s, cleanup_crl_store,
+                              apr_pool_cleanup_null);
+
+    *store = s;
+    return APR_SUCCESS;
+}
+
+apr_status_t serf_ssl_crl_store_add_file(serf_ssl_crl_store_t *store,
+                                         const char *file_path,
+                                         apr_pool_t *scratch_pool)
+{
+    STACK_OF(X509_CRL) *crls;
+    apr_finfo_t finfo;
+    crl_file_t *file;
+    apr_status_t status;
+
+    init_ssl_libraries();
+
+    status = crl_read_file(&crls, &finfo, file_path, scratch_pool);
+    if (status)
+        return status;
+
+    crl_store_lock(store);
+
+    for (file = store->files; file; file = file->next) {
+        if (strcmp(file->path, file_path) == 0)
+            break;
+    }
+
+    if (file) {
+        sk_X509_CRL_pop_free(file->crls, X509_CRL_free);
+    }
+    else {
+        file = apr_pcalloc(store->pool, sizeof(*file));
+        file->path = apr_pstrdup(store->pool, file_path);
+        file->next = store->files;
+        store->files = file;
+    }
+
+    file->crls = crls;
+    file->mtime = finfo.mtime;
+    file->size = finfo.size;
+    store->generation++;
+
+    crl_store_unlock(store);
+
+    return APR_SUCCESS;
+}
+
+void serf_ssl_crl_store_set_check_interval(serf_ssl_crl_store_t *store,
+                                           apr_interval_time_t interval)
+{
+    crl_store_lock(store);
+    store->check_interval = interval;
+    crl_store_unlock(store);
+}
+
+void serf_context_set_ssl_crl_store(serf_context_t *ctx,
+                                    serf_ssl_crl_store_t *store)
+{
+    serf_config_set_object(ctx->config, SERF_CONFIG__SSL_CRL_STORE, store);
+}
+
 apr_status_t
 serf_ssl_check_cert_status_request(serf_ssl_context_t *ssl_ctx, int enabled)
 {
@@ -2156,7 +3849,7 @@ serf_bucket_t *serf_bucket_ssl_encrypt_create(
 
     ctx = bkt->data;
 
-    ctx->databuf = &ctx->ssl_ctx->encrypt.databuf;
+    ctx->databuf = NULL; /* Read from encrypt_pending instead */
     ctx->our_stream = &ctx->ssl_ctx->encrypt.stream;
     if (ctx->ssl_ctx->encrypt.stream == NULL) {
         serf_bucket_t *tmp = serf_bucket_aggregate_create(stream->allocator);
@@ -2488,6 +4181,89 @@ apr_status_t serf_ssl_use_compression(serf_ssl_context_t *ssl_ctx, int enabled)
     return APR_EGENERAL;
 }
 
+apr_status_t serf_ssl_allow_early_data(serf_ssl_context_t *ssl_ctx,
+                                       int enabled)
+{
+#ifdef SSL_EARLY_DATA_ACCEPTED
+    ssl_ctx->early_allowed = (enabled != 0);
+    return APR_SUCCESS;
+#else
+    return enabled ? APR_ENOTIMPL : APR_SUCCESS;
+#endif
+}
+
+apr_status_t serf_ssl_allow_async_crypto(serf_ssl_context_t *ssl_ctx,
+                                         int enabled)
+{
+#ifdef SSL_HAVE_ASYNC
+    ssl_ctx->async_allowed = (enabled != 0);
+    ssl_async_update_mode(ssl_ctx);
+    return APR_SUCCESS;
+#else
+    return enabled ? APR_ENOTIMPL : APR_SUCCESS;
+#endif
+}
+
+void serf__ssl_async_setup(serf_ssl_context_t *ssl_ctx,
+                           serf__ssl_async_wait_t wait,
+                           void *baton)
+{
+#ifdef SSL_HAVE_ASYNC
+    ssl_ctx->async_wait = wait;
+    ssl_ctx->async_baton = baton;
+    ssl_async_update_mode(ssl_ctx);
+#endif
+}
+
+bool serf__ssl_early_data_offer(serf_ssl_context_t *ssl_ctx,
+                                serf__ssl_early_data_cb_t callback,
+                                void *baton)
+{
+#ifdef SSL_EARLY_DATA_ACCEPTED
+    SSL_SESSION *sess;
+    const unsigned char *alpn;
+    size_t alpn_len;
+
+    if (!ssl_ctx->early_allowed || ssl_ctx->handshake_done
+        || ssl_ctx->early_state != SSL_EARLY_NONE)
+    {
+        return false;
+    }
+
+    ssl_use_cached_session(ssl_ctx);
+
+    sess = SSL_get_session(ssl_ctx->ssl);
+    if (!sess || !SSL_SESSION_get_max_early_data(sess))
+        return false;
+
+    /* The early data is HTTP/1.1, so the session must not have
+       negotiated another protocol */
+    SSL_SESSION_get0_alpn_selected(sess, &alpn, &alpn_len);
+    if (alpn_len && (alpn_len != 8 || memcmp(alpn, "http/1.1", 8) != 0))
+        return false;
+
+    ssl_ctx->early_state = SSL_EARLY_GATHER;
+    ssl_ctx->early_callback = callback;
+    ssl_ctx->early_baton = baton;
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+void serf__ssl_ocsp_fetch_enable(serf_ssl_context_t *ssl_ctx,
+                                 serf__ocsp_fetcher_t *fetcher,
+                                 serf__ssl_wakeup_t wakeup,
+                                 void *baton)
+{
+#ifndef OPENSSL_NO_OCSP
+    ssl_ctx->ocsp_fetcher = fetcher;
+    ssl_ctx->ocsp_wakeup = wakeup;
+    ssl_ctx->ocsp_wakeup_baton = baton;
+#endif
+}
+
 static void serf_ssl_destroy_and_data(serf_bucket_t *bucket)
 {
     ssl_context_t *ctx = bucket->data;
@@ -2517,9 +4293,8 @@ static void serf_ssl_encrypt_destroy_and_data(serf_bucket_t *bucket)
         serf_bucket_destroy(*ctx->our_stream);
         serf_bucket_destroy(ssl_ctx->encrypt_pending);
 
-        /* Reset our status and databuf. */
+        /* Reset our status. */
         ssl_ctx->crypt_status = APR_SUCCESS;
-        ssl_ctx->encrypt.databuf.status = APR_SUCCESS;
 
         /* Advance to the next stream - if we have one. */
         if (ssl_ctx->encrypt.stream_next == NULL) {
@@ -2572,6 +4347,105 @@ static apr_status_t serf_ssl_peek(serf_bucket_t *bucket,
     return serf_databuf_peek(ctx->databuf, data, len);
 }
 
+/* Combines the status of reading PENDING_STATUS from encrypt_pending
+   with the status of the stream */
+static apr_status_t encrypt_read_status(apr_status_t pending_status,
+                                        apr_status_t status)
+{
+    if (SERF_BUCKET_READ_ERROR(pending_status))
+        return pending_status;
+
+    /* More encrypted data waits */
+    if (!pending_status)
+        return APR_SUCCESS;
+
+    return status;
+}
+
+static apr_status_t serf_ssl_encrypt_read(serf_bucket_t *bucket,
+                                          apr_size_t requested,
+                                          const char **data,
+                                          apr_size_t *len)
+{
+    ssl_context_t *ctx = bucket->data;
+    serf_ssl_context_t *ssl_ctx = ctx->ssl_ctx;
+    apr_status_t status;
+
+    status = ssl_encrypt(ssl_ctx, requested);
+    if (SERF_BUCKET_READ_ERROR(status)) {
+        *len = 0;
+        return status;
+    }
+
+    return encrypt_read_status(serf_bucket_read(ssl_ctx->encrypt_pending,
+                                                requested, data, len),
+                               status);
+}
+
+/* Returns the encrypted records as they are, to avoid copying them */
+static apr_status_t serf_ssl_encrypt_read_iovec(serf_bucket_t *bucket,
+                                                apr_size_t requested,
+                                                int vecs_size,
+                                                struct iovec *vecs,
+                                                int *vecs_used)
+{
+    ssl_context_t *ctx = bucket->data;
+    serf_ssl_context_t *ssl_ctx = ctx->ssl_ctx;
+    apr_status_t status;
+
+    status = ssl_encrypt(ssl_ctx, requested);
+    if (SERF_BUCKET_READ_ERROR(status)) {
+        *vecs_used = 0;
+        return status;
+    }
+
+    return encrypt_read_status(
+                serf_bucket_read_iovec(ssl_ctx->encrypt_pending, requested,
+                                       vecs_size, vecs, vecs_used),
+                status);
+}
+
+static apr_status_t serf_ssl_encrypt_peek(serf_bucket_t *bucket,
+                                          const char **data,
+                                          apr_size_t *len)
+{
+    ssl_context_t *ctx = bucket->data;
+    serf_ssl_context_t *ssl_ctx = ctx->ssl_ctx;
+    apr_status_t status;
+
+    status = ssl_encrypt(ssl_ctx, SERF_READ_ALL_AVAIL);
+    if (SERF_BUCKET_READ_ERROR(status)) {
+        *len = 0;
+        return status;
+    }
+
+    return encrypt_read_status(serf_bucket_peek(ssl_ctx->encrypt_pending,
+                                                data, len),
+                               status);
+}
+
+/* Parses the decimal configuration VALUE into *NUMBER. Values that aren't
+   a number from 0 to MAX are rejected, and leave *NUMBER alone */
+static apr_status_t ssl_config_number(serf_ssl_context_t *ssl_ctx,
+                                      const char *value,
+                                      apr_int64_t max,
+                                      apr_int64_t *number)
+{
+    char *end;
+    apr_int64_t result = apr_strtoi64(value, &end, 10);
+
+    if (errno == ERANGE || end == value || *end || result < 0
+        || result > max)
+    {
+        serf__log(LOGLVL_ERROR, LOGCOMP_SSL, __FILE__, ssl_ctx->config,
+                  "ssl config: invalid number \"%s\", ignored\n", value);
+        return APR_EINVAL;
+    }
+
+    *number = result;
+    return APR_SUCCESS;
+}
+
 static apr_status_t serf_ssl_set_config(serf_bucket_t *bucket,
                                         serf_config_t *config)
 {
@@ -2579,6 +4453,7 @@ static apr_status_t serf_ssl_set_config(serf_bucket_t *bucket,
     serf_ssl_context_t *ssl_ctx = ctx->ssl_ctx;
     apr_status_t err_status = APR_SUCCESS;
     const char *pipelining;
+    const char *value;
     apr_status_t status;
 
     if (ssl_ctx->config == config)
@@ -2609,6 +4484,30 @@ static apr_status_t serf_ssl_set_config(serf_bucket_t *bucket,
         if (strcmp(pipelining, "Y") == 0) {
             SSL_CTX_set_info_callback(ssl_ctx->ctx, detect_renegotiate);
         }
+
+        if (serf_config_get_string(config, SERF_CONFIG_CTX_TLS_RECORD_RAMP,
+                                   &value) == APR_SUCCESS && value) {
+            apr_int64_t ramp;
+
+            status = ssl_config_number(ssl_ctx, value, SSL_RECORD_RAMP_MAX,
+                                       &ramp);
+            if (status)
+                err_status = status;
+            else
+                ssl_ctx->record_ramp = (apr_size_t)ramp;
+        }
+
+        if (serf_config_get_string(config, SERF_CONFIG_CTX_TLS_RECORD_IDLE,
+                                   &value) == APR_SUCCESS && value) {
+            apr_int64_t idle;
+
+            status = ssl_config_number(ssl_ctx, value, SSL_RECORD_IDLE_MAX,
+                                       &idle);
+            if (status)
+                err_status = status;
+            else
+                ssl_ctx->record_idle = apr_time_from_msec(idle);
+        }
     }
 
     return err_status;
@@ -2616,12 +4515,12 @@ static apr_status_t serf_ssl_set_config(serf_bucket_t *bucket,
 
 const serf_bucket_type_t serf_bucket_type_ssl_encrypt = {
     "SSLENCRYPT",
-    serf_ssl_read,
-    serf_ssl_readline,
-    serf_default_read_iovec,
+    serf_ssl_encrypt_read,
+    serf_default_readline,
+    serf_ssl_encrypt_read_iovec,
     serf_default_read_for_sendfile,
     serf_buckets_are_v2,
-    serf_ssl_peek,
+    serf_ssl_encrypt_peek,
     serf_ssl_encrypt_destroy_and_data,
     serf_default_read_bucket,
     serf_default_get_remaining,
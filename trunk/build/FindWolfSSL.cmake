@@ -0,0 +1,90 @@
+# ===================================================================
+#   Licensed to the Apache Software Foundation (ASF) under one
+#   or more contributor license agreements.  See the NOTICE file
+#   distributed with this work for additional information
+#   regarding copyright ownership.  The ASF licenses this file
+#   to you under the Apache License, Version 2.0 (the
+#   "License"); you may not use this file except in compliance
+#   with the License.  You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+#   Unless required by applicable law or agreed to in writing,
+#   software distributed under the License is distributed on an
+#   "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+#   KIND, either express or implied.  See the License for the
+#   specific language governing permissions and limitations
+#   under the License.
+# ===================================================================
+
+cmake_minimum_required(VERSION 3.0)
+
+#.rst:
+# FindWolfSSL
+# --------
+#
+# Find the wolfSSL includes and library, for use through wolfSSL's
+# OpenSSL compatibility layer.
+#
+# IMPORTED Targets
+# ^^^^^^^^^^^^^^^^
+#
+# This module defines :prop_tgt:`IMPORTED` target ``WolfSSL::WolfSSL``, if
+# wolfSSL has been found.
+#
+# Result Variables
+# ^^^^^^^^^^^^^^^^
+#
+# This module defines the following variables:
+#
+# ::
+#
+#   WOLFSSL_FOUND          - True if wolfSSL was found
+#   WOLFSSL_VERSION        - The version of wolfSSL found (x.y.z)
+#   WOLFSSL_INCLUDE_DIRS   - Where to find wolfssl/ssl.h and the
+#                            compatible openssl/ssl.h
+#   WOLFSSL_LIBRARIES      - Linker switches to use with ld to link
+#                            against wolfSSL
+#
+# Hints
+# ^^^^^
+#
+# A user may set ``WolfSSL_ROOT`` to a wolfSSL installation root to tell
+# this module where to look. wolfSSL must be configured with
+# --enable-opensslall for the compatibility layer serf needs.
+
+find_path(WOLFSSL_INCLUDE_DIR
+          NAMES "wolfssl/ssl.h"
+          PATH_SUFFIXES "include")
+find_library(WOLFSSL_LIBRARY
+             NAMES "wolfssl"
+             PATH_SUFFIXES "lib")
+mark_as_advanced(WOLFSSL_INCLUDE_DIR WOLFSSL_LIBRARY)
+
+if(WOLFSSL_INCLUDE_DIR AND EXISTS "${WOLFSSL_INCLUDE_DIR}/wolfssl/version.h")
+  file(STRINGS "${WOLFSSL_INCLUDE_DIR}/wolfssl/version.h" _wolfssl_version
+       REGEX "^#define LIBWOLFSSL_VERSION_STRING")
+  string(REGEX REPLACE "^.*\"([0-9.]+)\".*$" "\\1"
+         WOLFSSL_VERSION "${_wolfssl_version}")
+  unset(_wolfssl_version)
+endif()
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(WolfSSL
+                                  REQUIRED_VARS WOLFSSL_LIBRARY
+                                                WOLFSSL_INCLUDE_DIR
+                                  VERSION_VAR WOLFSSL_VERSION)
+
+if(WOLFSSL_FOUND)
+  # The OpenSSL compatible headers are in include/wolfssl/openssl
+  set(WOLFSSL_INCLUDE_DIRS "${WOLFSSL_INCLUDE_DIR}"
+                           "${WOLFSSL_INCLUDE_DIR}/wolfssl")
+  set(WOLFSSL_LIBRARIES ${WOLFSSL_LIBRARY})
+
+  if(NOT TARGET WolfSSL::WolfSSL)
+    add_library(WolfSSL::WolfSSL UNKNOWN IMPORTED)
+    set_target_properties(WolfSSL::WolfSSL PROPERTIES
+      INTERFACE_INCLUDE_DIRECTORIES "${WOLFSSL_INCLUDE_DIRS}"
+      IMPORTED_LOCATION "${WOLFSSL_LIBRARY}")
+  endif()
+endif()
@@ -0,0 +1,132 @@
+#!/usr/bin/env python
+#
+# tls_bench.py :  Compare serf builds with different TLS libraries.
+#
+# ===================================================================
+#   Licensed to the Apache Software Foundation (ASF) under one
+#   or more contributor license agreements.  See the NOTICE file
+#   distributed with this work for additional information
+#   regarding copyright ownership.  The ASF licenses this file
+#   to you under the Apache License, Version 2.0 (the
+#   "License"); you may not use this file except in compliance
+#   with the License.  You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+#   Unless required by applicable law or agreed to in writing,
+#   software distributed under the License is distributed on an
+#   "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+#   KIND, either express or implied.  See the License for the
+#   specific language governing permissions and limitations
+#   under the License.
+# ===================================================================
+#
+# Runs the serf_tls_bench program of each serf build, one per TLS
+# library, against the same https server, and prints their results side
+# by side. Each program runs ROUNDS times, alternating between the builds
+# so that changes in the load of the host affect all of them alike; the
+# best round of each counts.
+#
+#   tls_bench.py [-n HANDSHAKES] [-b FETCHES] [-u KBYTES] [-r ROUNDS]
+#                URL BENCH...
+#
+# With -u, FETCHES uploads of KBYTES each are timed as well.
+#
+
+import sys
+import re
+import getopt
+import subprocess
+
+
+LIBRARY_RE = re.compile(r'^TLS library: (.*)$', re.M)
+FULL_RE = re.compile(r'^Handshakes: \d+ in .* \(([0-9.]+) per second', re.M)
+RESUMED_RE = re.compile(r'^Handshakes: \d+ resumed in .* \(([0-9.]+) per second',
+                        re.M)
+BULK_RE = re.compile(r'^Bulk: .* \(([0-9.]+) MB/s', re.M)
+UPLOAD_RE = re.compile(r'^Upload: .* \(([0-9.]+) MB/s', re.M)
+
+
+def run(bench, args):
+  output = subprocess.check_output([bench] + args)
+  if not isinstance(output, str):
+    output = output.decode('utf-8', 'replace')
+  return output
+
+
+def value(regex, output):
+  match = regex.search(output)
+  if not match:
+    return 0.0
+  return float(match.group(1))
+
+
+def usage():
+  print('usage: tls_bench.py [-n HANDSHAKES] [-b FETCHES] [-u KBYTES] '
+        '[-r ROUNDS] URL BENCH...')
+  sys.exit(1)
+
+
+if __name__ == '__main__':
+  try:
+    opts, args = getopt.getopt(sys.argv[1:], 'n:b:u:r:')
+  except getopt.GetoptError:
+    usage()
+
+  handshakes = '100'
+  fetches = '10'
+  upload = None
+  rounds = 3
+  for opt, val in opts:
+    if opt == '-n':
+      handshakes = val
+    elif opt == '-b':
+      fetches = val
+    elif opt == '-u':
+      upload = val
+    elif opt == '-r':
+      rounds = int(val)
+
+  if len(args) < 2:
+    usage()
+
+  url = args[0]
+  benches = args[1:]
+  results = {}
+
+  for bench in benches:
+    results[bench] = { 'library': bench, 'full': 0.0, 'resumed': 0.0,
+                       'bulk': 0.0, 'upload': 0.0 }
+
+  for i in range(rounds):
+    for bench in benches:
+      result = results[bench]
+      try:
+        full = run(bench, ['-n', handshakes, '-b', fetches, url])
+        resumed = run(bench, ['-r', '-n', handshakes, '-b', '0', url])
+        if upload:
+          uploaded = run(bench, ['-n', '0', '-b', fetches, '-u', upload, url])
+        else:
+          uploaded = ''
+      except (OSError, subprocess.CalledProcessError) as x:
+        print("ERROR: running '%s' failed: %s" % (bench, x))
+        sys.exit(1)
+
+      match = LIBRARY_RE.search(full)
+      if match:
+        result['library'] = match.group(1)
+      result['full'] = max(result['full'], value(FULL_RE, full))
+      result['resumed'] = max(result['resumed'], value(RESUMED_RE, resumed))
+      result['bulk'] = max(result['bulk'], value(BULK_RE, full))
+      result['upload'] = max(result['upload'], value(UPLOAD_RE, uploaded))
+
+  print('%-40s %12s %12s %10s %11s' % ('TLS library', 'full hs/s',
+                                       'resumed hs/s', 'bulk MB/s',
+                                       'upload MB/s'))
+  for bench in benches:
+    result = results[bench]
+    print('%-40s %12.1f %12.1f %10.1f %11.1f' % (result['library'][:40],
+                                                 result['full'],
+                                                 result['resumed'],
+                                                 result['bulk'],
+                                                 result['upload']))
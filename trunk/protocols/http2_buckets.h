@@ -205,6 +205,17 @@ serf__bucket_http2_frame_create(serf_bucket_t *stream,
                                 apr_uint32_t max_payload_size,
                                 serf_bucket_alloc_t *alloc);
 
+/* Creates a frame for a small control payload (PING, WINDOW_UPDATE, etc.)
+   on STREAM_ID. The PAYLOAD_LEN bytes at PAYLOAD are copied into the frame
+   bucket, next to the frame header, so no other buckets are allocated. */
+serf_bucket_t *
+serf__bucket_http2_frame_create_inline(const void *payload,
+                                       apr_size_t payload_len,
+                                       unsigned char frame_type,
+                                       unsigned char flags,
+                                       apr_int32_t stream_id,
+                                       serf_bucket_alloc_t *alloc);
+
 /* ==================================================================== */
 
 #ifdef __cplusplus
@@ -0,0 +1,302 @@
+/* ====================================================================
+ *    Licensed to the Apache Software Foundation (ASF) under one
+ *    or more contributor license agreements.  See the NOTICE file
+ *    distributed with this work for additional information
+ *    regarding copyright ownership.  The ASF licenses this file
+ *    to you under the Apache License, Version 2.0 (the
+ *    "License"); you may not use this file except in compliance
+ *    with the License.  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing,
+ *    software distributed under the License is distributed on an
+ *    "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ *    KIND, either express or implied.  See the License for the
+ *    specific language governing permissions and limitations
+ *    under the License.
+ * ====================================================================
+ */
+
+#include <apr_pools.h>
+
+#include "serf.h"
+#include "serf_private.h"
+
+#include "protocols/http2_protocol.h"
+
+/* The stream dependency tree of RFC 7540, section 5.3, used to schedule
+   outgoing DATA frames.
+
+   Siblings share the bandwidth of their parent by weight, using stride
+   scheduling: every sibling has a virtual time that is advanced by the
+   amount of data sent through it, divided by its weight. The sibling with
+   the lowest virtual time that has something to send goes next. A stream
+   only gets to send when its ancestors can't. */
+
+/* Returns the list of children STREAM is in */
+static serf_http2_stream_t **
+sibling_list(serf_http2_priority_tree_t *tree,
+             serf_http2_stream_t *stream)
+{
+    return stream->dep_parent ? &stream->dep_parent->dep_first_child
+                              : &tree->first_child;
+}
+
+/* Returns the virtual clock of the level STREAM is on */
+static apr_uint64_t *
+level_vclock(serf_http2_priority_tree_t *tree,
+             serf_http2_stream_t *stream)
+{
+    return stream->dep_parent ? &stream->dep_parent->child_vclock
+                              : &tree->vclock;
+}
+
+static void priority_unlink(serf_http2_priority_tree_t *tree,
+                            serf_http2_stream_t *stream)
+{
+    serf_http2_stream_t **ps;
+
+    for (ps = sibling_list(tree, stream); *ps; ps = &(*ps)->dep_next_sibling)
+    {
+        if (*ps == stream) {
+            *ps = stream->dep_next_sibling;
+            break;
+        }
+    }
+
+    stream->dep_next_sibling = NULL;
+}
+
+static void priority_move(serf_http2_priority_tree_t *tree,
+                          serf_http2_stream_t *stream,
+                          serf_http2_stream_t *parent,
+                          apr_uint16_t weight,
+                          bool exclusive)
+{
+    serf_http2_stream_t **ps;
+
+    priority_unlink(tree, stream);
+
+    stream->dep_parent = parent;
+    stream->weight = weight;
+
+    ps = sibling_list(tree, stream);
+
+    if (exclusive) {
+        serf_http2_stream_t **pc = &stream->dep_first_child;
+
+        /* Adopt all other children of PARENT */
+        while (*pc)
+            pc = &(*pc)->dep_next_sibling;
+
+        *pc = *ps;
+        for (; *pc; pc = &(*pc)->dep_next_sibling) {
+            (*pc)->dep_parent = stream;
+            (*pc)->vtime = stream->child_vclock;
+        }
+
+        *ps = NULL;
+    }
+
+    stream->dep_next_sibling = *ps;
+    *ps = stream;
+
+    /* Start at the current time of the new level, to avoid taking or
+       losing bandwidth because of history on another level */
+    stream->vtime = *level_vclock(tree, stream);
+}
+
+/* Removes the closed STREAM from the tree. Its dependencies take its place,
+   sharing its weight in proportion to their own (RFC 7540, section 5.3.4) */
+static void priority_remove(serf_http2_priority_tree_t *tree,
+                            serf_http2_stream_t *stream)
+{
+    serf_http2_stream_t **ps;
+    serf_http2_stream_t *c, *last = NULL;
+    apr_uint32_t total = 0;
+
+    for (ps = sibling_list(tree, stream); *ps && *ps != stream;
+         ps = &(*ps)->dep_next_sibling)
+        ;
+
+    if (!*ps)
+        return;
+
+    for (c = stream->dep_first_child; c; c = c->dep_next_sibling)
+        total += c->weight;
+
+    for (c = stream->dep_first_child; c; c = c->dep_next_sibling) {
+        apr_uint32_t weight = (apr_uint32_t)stream->weight * c->weight
+                              / total;
+
+        c->weight = weight ? (apr_uint16_t)weight : 1;
+        c->dep_parent = stream->dep_parent;
+        c->vtime = *level_vclock(tree, stream);
+        last = c;
+    }
+
+    if (last) {
+        last->dep_next_sibling = stream->dep_next_sibling;
+        *ps = stream->dep_first_child;
+    }
+    else
+        *ps = stream->dep_next_sibling;
+
+    stream->dep_parent = stream->dep_first_child = NULL;
+    stream->dep_next_sibling = NULL;
+    stream->writable = false;
+}
+
+/* Removes the closed streams from the tree starting at LIST */
+static void priority_prune(serf_http2_priority_tree_t *tree,
+                           serf_http2_stream_t **list)
+{
+    while (*list) {
+        serf_http2_stream_t *s = *list;
+
+        if (s->status == H2S_CLOSED) {
+            /* Replaced by its dependencies or its next sibling */
+            priority_remove(tree, s);
+            continue;
+        }
+
+        priority_prune(tree, &s->dep_first_child);
+        list = &s->dep_next_sibling;
+    }
+}
+
+apr_uint16_t serf_http2__priority_weight(apr_uint16_t priority)
+{
+    /* Ignore the lowest 8 bits, as documented for
+       serf_connection_request_prioritize() */
+    apr_uint16_t weight = priority >> 8;
+
+    return weight ? weight : 1;
+}
+
+void serf_http2__priority_set(serf_http2_priority_tree_t *tree,
+                              serf_http2_stream_t *stream,
+                              serf_http2_stream_t *parent,
+                              apr_uint16_t weight,
+                              bool exclusive)
+{
+    serf_http2_stream_t *s;
+
+    if (parent == stream)
+        parent = NULL;
+
+    /* A dependency on a stream that is no longer in the tree gets the
+       default priority (RFC 7540, section 5.3.1) */
+    if (parent && parent->status == H2S_CLOSED) {
+        parent = NULL;
+        weight = HTTP2_PRIORITY_WEIGHT_DEFAULT;
+        exclusive = false;
+    }
+
+    if (weight < 1)
+        weight = 1;
+    else if (weight > HTTP2_PRIORITY_WEIGHT_MAX)
+        weight = HTTP2_PRIORITY_WEIGHT_MAX;
+
+    /* If a stream is made dependent on one of its own dependencies, the
+       formerly dependent stream is first moved to be dependent on the
+       reprioritized stream's previous parent (RFC 7540, section 5.3.3) */
+    for (s = parent; s; s = s->dep_parent) {
+        if (s == stream) {
+            priority_move(tree, parent, stream->dep_parent, parent->weight,
+                          false);
+            break;
+        }
+    }
+
+    priority_move(tree, stream, parent, weight, exclusive);
+}
+
+void serf_http2__priority_activate(serf_http2_priority_tree_t *tree,
+                                   serf_http2_stream_t *stream)
+{
+    serf_http2_stream_t *s;
+
+    stream->writable = true;
+
+    /* Don't let streams that were idle for a while catch up by sending
+       more than their share */
+    for (s = stream; s; s = s->dep_parent) {
+        apr_uint64_t vclock = *level_vclock(tree, s);
+
+        if (s->vtime < vclock)
+            s->vtime = vclock;
+    }
+}
+
+static bool stream_can_write(serf_http2_stream_t *stream)
+{
+    if (!stream->writable)
+        return false;
+
+    if (stream->status != H2S_OPEN
+        && stream->status != H2S_HALFCLOSED_REMOTE)
+    {
+        /* Nothing will ever be written on this stream */
+        stream->writable = false;
+        return false;
+    }
+
+    return stream->lr_window > 0;
+}
+
+/* Returns the stream that should send next in the subtrees starting at
+   FIRST and its siblings, or NULL if none of them can send */
+static serf_http2_stream_t *
+priority_pick(serf_http2_stream_t *first)
+{
+    serf_http2_stream_t *s;
+    serf_http2_stream_t *best = NULL;
+    serf_http2_stream_t *best_pick = NULL;
+
+    for (s = first; s; s = s->dep_next_sibling) {
+        serf_http2_stream_t *pick;
+
+        if (best && s->vtime >= best->vtime)
+            continue;
+
+        if (stream_can_write(s))
+            pick = s;
+        else
+            pick = priority_pick(s->dep_first_child);
+
+        if (pick) {
+            best = s;
+            best_pick = pick;
+        }
+    }
+
+    return best_pick;
+}
+
+serf_http2_stream_t *
+serf_http2__priority_next(serf_http2_priority_tree_t *tree)
+{
+    priority_prune(tree, &tree->first_child);
+
+    return priority_pick(tree->first_child);
+}
+
+void serf_http2__priority_charge(serf_http2_priority_tree_t *tree,
+                                 serf_http2_stream_t *stream,
+                                 apr_size_t len)
+{
+    serf_http2_stream_t *s;
+    apr_uint64_t cost = (apr_uint64_t)len + HTTP2_FRAME_HEADER_SIZE;
+
+    /* Every stream on the path to the root used its share for this */
+    for (s = stream; s; s = s->dep_parent) {
+        apr_uint64_t *vclock = level_vclock(tree, s);
+
+        if (s->vtime > *vclock)
+            *vclock = s->vtime;
+
+        s->vtime += cost * HTTP2_PRIORITY_WEIGHT_MAX / s->weight;
+    }
+}
@@ -70,33 +70,40 @@ http2_cancel_request(serf_request_t *rq, apr_status_t reason);
 static void
 http2_prioritize_request(serf_request_t *rq, bool exclusive);
 
+static void
+http2_throttle(serf_connection_t *conn, bool throttled);
+
 static apr_status_t http2_write_data(serf_http2_protocol_t *h2);
 
+/* Creates a control frame of FRAME_TYPE with a payload of big endian
+   numbers, of the byte sizes ('1'-'4') in FORMAT. The payload is stored
+   in the frame bucket itself */
 static serf_bucket_t *
-serf_bucket_create_numberv(serf_bucket_alloc_t *allocator, const char *format,
+http2_frame_create_numberv(serf_bucket_alloc_t *allocator,
+                           unsigned char frame_type,
+                           apr_int32_t stream_id,
+                           const char *format,
                            ...)
 {
     va_list argp;
     const char *c;
-    char *buffer;
-    apr_size_t sz = 0;
+    unsigned char buffer[16];
     unsigned char *r;
 
     va_start(argp, format);
 
+    r = buffer;
     for (c = format; *c; c++)
     {
-        SERF_H2_assert(*c >= '1' && *c <= '4');
+        apr_uint32_t tmp;
 
-        if (*c >= '1' && *c <= '4')
-            sz += (*c - '0');
-    }
+        SERF_H2_assert(*c >= '1' && *c <= '4');
 
-    buffer = serf_bucket_mem_alloc(allocator, sz);
-    r = (void*)buffer;
-    for (c = format; *c; c++)
-    {
-        apr_uint32_t tmp;
+        /* Never write past the buffer, even when asserts are disabled */
+        if (r + (*c - '0') > buffer + sizeof(buffer)) {
+            SERF_H2_assert(FALSE);
+            break;
+        }
 
         switch (*c)
         {
@@ -126,7 +133,9 @@ serf_bucket_create_numberv(serf_bucket_alloc_t *allocator, const char *format,
 
     va_end(argp);
 
-    return serf_bucket_simple_own_create(buffer, sz, allocator);
+    return serf__bucket_http2_frame_create_inline(buffer, r - buffer,
+                                                  frame_type, 0, stream_id,
+                                                  allocator);
 }
 
 struct serf_http2_protocol_t
@@ -176,12 +185,45 @@ struct serf_http2_protocol_t
     serf_http2_stream_t *last;
 
     int setting_acks;
+    int settings_sent;           /* SETTINGS frames sent, excluding acks */
+    bool settings_received;      /* Peer sent its first SETTINGS */
     bool enforce_flow_control;
 
+    /* Throttled by the memory budget: don't open our receive windows */
+    bool throttled;
+
     serf_bucket_t *continuation_bucket;
     apr_int32_t continuation_streamid;
 
-    serf_http2_stream_t *first_writable, *last_writable, *cur_writable;
+    /* Stream dependencies, used for scheduling outgoing DATA frames */
+    serf_http2_priority_tree_t priority;
+
+    /* When set, frames are queued without flushing, to be written
+       together by a single http2_flush() */
+    bool batching;
+
+    /* Receive window auto-tuning, based on bandwidth-delay product (BDP)
+       estimates. Disabled when bdp_window_max is 0 */
+    apr_uint32_t bdp_window_max;
+    apr_uint32_t bdp_window;     /* Current connection and stream windows */
+    apr_uint32_t bdp_pending_window; /* Initial stream window to apply... */
+    int bdp_pending_ack;             /* ...when this many SETTINGS are acked */
+    apr_time_t bdp_ping_time;    /* When the BDP ping was sent, or 0 */
+    apr_uint64_t bdp_bytes;      /* DATA received since sending the ping */
+    apr_uint64_t bdp_estimate;   /* Last measured BDP, or 0 */
+    apr_interval_time_t rtt;     /* Last measured round trip, or -1 */
+
+    /* Round trip times measured with PINGs, following RFC 6298 */
+    apr_interval_time_t srtt;    /* Smoothed round trip, or -1 */
+    apr_interval_time_t rttvar;  /* Round trip variation */
+
+    /* Keepalive, see serf__http2_protocol_keepalive() */
+    bool frames_received;        /* Since the last keepalive check */
+    apr_time_t last_received;    /* Time of that check */
+    apr_time_t ping_sent;        /* Time in the unanswered PING, or 0 */
+
+    /* Accepted server pushes */
+    serf_http2_push_cache_t push_cache;
 };
 
 /* Forward definition */
@@ -207,6 +249,9 @@ http2_protocol_cleanup(void *state)
     }
 
     h2->first = h2->last = NULL;
+    h2->priority.first_child = NULL;
+
+    serf_http2__push_cache_cleanup(&h2->push_cache);
 
     if (h2->processor != NULL)
     {
@@ -248,13 +293,12 @@ static void http2_send_window_update(serf_http2_protocol_t *h2,
 {
     apr_uint32_t increase;
     apr_uint32_t *window;
-    apr_int32_t *stream_id;
+    apr_int32_t stream_id;
     serf_bucket_t *bkt;
     apr_status_t status;
-    struct window_update_t
-    {
-        unsigned char v3, v2, v1, v0;
-    } window_update;
+
+    if (h2->throttled)
+        return; /* Let the windows run dry. See http2_throttle() */
 
     if (!stream) {
         if (h2->rl_window >= h2->rl_window_upd_to)
@@ -262,7 +306,7 @@ static void http2_send_window_update(serf_http2_protocol_t *h2,
 
         increase = h2->rl_window_upd_to - h2->rl_window;
         window = &h2->rl_window;
-        stream_id = NULL;
+        stream_id = 0;
     }
     else {
         if (stream->rl_window >= stream->rl_window_upd_to)
@@ -270,22 +314,12 @@ static void http2_send_window_update(serf_http2_protocol_t *h2,
 
         increase = stream->rl_window_upd_to - stream->rl_window;
         window = &stream->rl_window;
-        stream_id = &stream->streamid;
+        stream_id = stream->streamid;
     }
 
-    window_update.v3 = (increase >> 24) & 0xFF;
-    window_update.v2 = (increase >> 16) & 0xFF;
-    window_update.v1 = (increase >> 8) & 0xFF;
-    window_update.v0 = increase & 0xFF;
-
-    bkt = serf_bucket_simple_copy_create((void *)&window_update,
-                                         sizeof(window_update),
-                                         h2->allocator);
-
-    bkt = serf__bucket_http2_frame_create(bkt, HTTP2_FRAME_TYPE_WINDOW_UPDATE,
-                                          0, stream_id, NULL, NULL/* stream */,
-                                          h2->lr_max_framesize,
-                                          h2->allocator);
+    bkt = http2_frame_create_numberv(h2->allocator,
+                                     HTTP2_FRAME_TYPE_WINDOW_UPDATE,
+                                     stream_id, "4", increase);
     status = serf_http2__enqueue_frame(h2, bkt, FALSE);
 
     if (!status) {
@@ -296,6 +330,159 @@ static void http2_send_window_update(serf_http2_protocol_t *h2,
     /* Ignore connection broken statee. Move along */
 }
 
+/* Sets up the receive window of a new STREAM */
+static void http2_stream_window_setup(serf_http2_protocol_t *h2,
+                                      serf_http2_stream_t *stream)
+{
+    if (!h2->bdp_window_max)
+        return; /* Keep the static defaults */
+
+    stream->rl_window_upd_to = h2->bdp_window;
+    stream->rl_window_upd_below = h2->bdp_window / 2;
+}
+
+/* Returns the largest window that auto-tuning may grant */
+static apr_uint32_t http2_bdp_limit(serf_http2_protocol_t *h2)
+{
+    apr_size_t limit = h2->bdp_window_max;
+
+    /* There is no use in allowing more data in flight than the memory
+       budget lets us hold */
+    if (h2->conn) {
+        if (h2->conn->mem_high_watermark)
+            limit = MIN(limit, h2->conn->mem_high_watermark);
+        if (h2->conn->ctx->mem_high_watermark)
+            limit = MIN(limit, h2->conn->ctx->mem_high_watermark);
+    }
+
+    return (apr_uint32_t)MAX(limit, h2->bdp_window);
+}
+
+/* Applies the initial stream window announced by http2_grow_windows(),
+   now that the peer acknowledged the SETTINGS frame */
+static void http2_apply_stream_windows(serf_http2_protocol_t *h2)
+{
+    serf_http2_stream_t *stream;
+    apr_uint32_t delta = h2->bdp_pending_window - h2->rl_default_window;
+
+    h2->bdp_pending_ack = 0;
+
+    /* The peer applied the difference to the windows of all existing
+       streams (RFC 7540, section 6.9.2) */
+    h2->rl_default_window = h2->bdp_pending_window;
+    for (stream = h2->first; stream; stream = stream->next) {
+        stream->rl_window = (apr_uint32_t)MIN((apr_uint64_t)stream->rl_window
+                                              + delta,
+                                              HTTP2_WINDOW_MAX_ALLOWED);
+        http2_stream_window_setup(h2, stream);
+
+        if ((stream->status == H2S_OPEN
+             || stream->status == H2S_HALFCLOSED_LOCAL)
+            && stream->rl_window < stream->rl_window_upd_below) {
+
+            http2_send_window_update(h2, stream);
+        }
+    }
+}
+
+/* Grows the receive window of the connection to WINDOW, and announces it
+   as initial window for the streams. The stream windows change when the
+   peer acknowledges that */
+static void http2_grow_windows(serf_http2_protocol_t *h2,
+                               apr_uint32_t window)
+{
+    serf_bucket_t *bkt;
+
+    serf__log(LOGLVL_DEBUG, SERF_LOGHTTP2, h2->config,
+              "Growing receive windows from %u to %u bytes (rtt %"
+              APR_TIME_T_FMT " usec)\n", h2->bdp_window, window, h2->rtt);
+
+    h2->bdp_window = window;
+
+    bkt = http2_frame_create_numberv(h2->allocator, HTTP2_FRAME_TYPE_SETTINGS,
+                                     0, "24",
+                                     HTTP2_SETTING_INITIAL_WINDOW_SIZE,
+                                     window);
+    serf_http2__enqueue_frame(h2, bkt, FALSE);
+    h2->settings_sent++;
+
+    h2->bdp_pending_window = window;
+    h2->bdp_pending_ack = h2->settings_sent;
+
+    /* The connection window is not affected by SETTINGS */
+    h2->rl_window_upd_to = window;
+    h2->rl_window_upd_below = window / 2;
+    http2_send_window_update(h2, NULL);
+}
+
+/* Updates the smoothed round trip time with the measured round trip RTT,
+   as TCP does (RFC 6298, section 2) */
+static void http2_rtt_sample(serf_http2_protocol_t *h2,
+                             apr_interval_time_t rtt)
+{
+    if (h2->srtt < 0) {
+        h2->srtt = rtt;
+        h2->rttvar = rtt / 2;
+    }
+    else {
+        apr_interval_time_t delta = h2->srtt - rtt;
+
+        if (delta < 0)
+            delta = -delta;
+
+        h2->rttvar = (3 * h2->rttvar + delta) / 4;
+        h2->srtt = (7 * h2->srtt + rtt) / 8;
+    }
+
+    if (h2->conn)
+        h2->conn->latency = h2->srtt;
+}
+
+/* Accounts LEN bytes of received DATA for the BDP estimate, starting a
+   measurement with a PING when none is running */
+static void http2_bdp_received(serf_http2_protocol_t *h2,
+                               apr_size_t len)
+{
+    if (!h2->bdp_ping_time) {
+        if (h2->throttled || h2->bdp_window >= http2_bdp_limit(h2))
+            return; /* No reason to grow */
+
+        serf_http2__enqueue_frame(
+            h2,
+            serf__bucket_http2_frame_create_inline(HTTP2_BDP_PING_DATA,
+                                                   HTTP2_PING_DATA_SIZE,
+                                                   HTTP2_FRAME_TYPE_PING, 0,
+                                                   0, h2->allocator),
+            FALSE);
+
+        h2->bdp_ping_time = apr_time_now();
+        h2->bdp_bytes = 0;
+    }
+
+    h2->bdp_bytes += len;
+}
+
+/* Completes a BDP measurement. When the peer managed to send close to
+   a full window in one round trip, the window is probably what limits
+   the transfer, so it is grown to twice the measured BDP */
+static void http2_bdp_ping_ack(serf_http2_protocol_t *h2)
+{
+    apr_uint64_t window;
+
+    h2->rtt = apr_time_now() - h2->bdp_ping_time;
+    h2->bdp_ping_time = 0;
+    h2->bdp_estimate = h2->bdp_bytes;
+    http2_rtt_sample(h2, h2->rtt);
+
+    if (h2->throttled || h2->bdp_bytes < (apr_uint64_t)h2->bdp_window * 2 / 3)
+        return;
+
+    window = MIN(h2->bdp_bytes * 2, http2_bdp_limit(h2));
+
+    if (window > h2->bdp_window)
+        http2_grow_windows(h2, (apr_uint32_t)window);
+}
+
 void serf__http2_protocol_init(serf_connection_t *conn)
 {
     serf_http2_protocol_t *h2;
@@ -337,10 +524,30 @@ void serf__http2_protocol_init(serf_connection_t *conn)
 
     h2->setting_acks = 0;
     h2->enforce_flow_control = TRUE;
+    h2->throttled = conn->mem_throttled;
+    h2->rtt = -1;
+    h2->srtt = -1;
+    h2->last_received = apr_time_now();
+
+    if (conn->http2_window_max) {
+        /* Start at the protocol default, and let http2_bdp_ping_ack()
+           grow the windows from there */
+        h2->bdp_window_max = MIN(MAX(conn->http2_window_max,
+                                     HTTP2_DEFAULT_WINDOW_SIZE),
+                                 HTTP2_WINDOW_MAX_ALLOWED);
+        h2->bdp_window = HTTP2_DEFAULT_WINDOW_SIZE;
+        h2->rl_window_upd_to = h2->bdp_window;
+        h2->rl_window_upd_below = h2->bdp_window / 2;
+    }
+
     h2->continuation_bucket = NULL;
     h2->continuation_streamid = 0;
 
     h2->first = h2->last = NULL;
+    h2->priority.first_child = NULL;
+    h2->priority.vclock = 0;
+
+    serf_http2__push_cache_init(&h2->push_cache, conn, h2->allocator);
 
     h2->hpack_tbl = serf__hpack_table_create(TRUE,
                                              HTTP2_DEFAULT_HPACK_TABLE_SIZE,
@@ -356,6 +563,7 @@ void serf__http2_protocol_init(serf_connection_t *conn)
     conn->perform_pre_teardown = http2_outgoing_pre_teardown;
     conn->perform_cancel_request = http2_cancel_request;
     conn->perform_prioritize_request = http2_prioritize_request;
+    conn->perform_throttle = http2_throttle;
     conn->protocol_baton = h2;
 
     /* Disable HTTP/1.1 guessing that affects writability */
@@ -367,12 +575,12 @@ void serf__http2_protocol_init(serf_connection_t *conn)
     serf_pump__add_output(h2->pump, tmp, false);
 
     /* And now a settings frame */
-    tmp = serf__bucket_http2_frame_create(NULL, HTTP2_FRAME_TYPE_SETTINGS,
-                                              0,
-                                              NULL, NULL, NULL, /* stream: 0 */
-                                              h2->lr_max_framesize,
-                                              h2->allocator);
+    tmp = serf__bucket_http2_frame_create_inline(NULL, 0,
+                                                 HTTP2_FRAME_TYPE_SETTINGS, 0,
+                                                 0 /* stream: 0 */,
+                                                 h2->allocator);
     serf_http2__enqueue_frame(h2, tmp, FALSE);
+    h2->settings_sent++;
 
     /* And an initial window update */
     http2_send_window_update(h2, NULL);
@@ -421,10 +629,17 @@ void serf__http2_protocol_init_server(serf_incoming_t *client)
 
     h2->setting_acks = 0;
     h2->enforce_flow_control = TRUE;
+    h2->rtt = -1;
+    h2->srtt = -1;
     h2->continuation_bucket = NULL;
     h2->continuation_streamid = 0;
 
     h2->first = h2->last = NULL;
+    h2->priority.first_child = NULL;
+    h2->priority.vclock = 0;
+
+    /* Clients don't push */
+    serf_http2__push_cache_init(&h2->push_cache, NULL, h2->allocator);
 
     h2->hpack_tbl = serf__hpack_table_create(TRUE,
                                              HTTP2_DEFAULT_HPACK_TABLE_SIZE,
@@ -441,13 +656,24 @@ void serf__http2_protocol_init_server(serf_incoming_t *client)
     client->protocol_baton = h2;
 
     /* Send a settings frame */
-    tmp = serf__bucket_http2_frame_create(NULL, HTTP2_FRAME_TYPE_SETTINGS,
-                                          0,
-                                          NULL, NULL, NULL, /* stream: 0 */
-                                          h2->lr_max_framesize,
-                                          h2->allocator);
+    tmp = serf__bucket_http2_frame_create_inline(NULL, 0,
+                                                 HTTP2_FRAME_TYPE_SETTINGS, 0,
+                                                 0 /* stream: 0 */,
+                                                 h2->allocator);
 
     serf_http2__enqueue_frame(h2, tmp, FALSE);
+    h2->settings_sent++;
+
+    if (client->http2_max_streams) {
+        h2->rl_max_concurrent = client->http2_max_streams;
+
+        tmp = http2_frame_create_numberv(h2->allocator,
+                                         HTTP2_FRAME_TYPE_SETTINGS, 0, "24",
+                                         HTTP2_SETTING_MAX_CONCURRENT_STREAMS,
+                                         h2->rl_max_concurrent);
+        serf_http2__enqueue_frame(h2, tmp, FALSE);
+        h2->settings_sent++;
+    }
 
     /* And an initial window update*/
     http2_send_window_update(h2, NULL);
@@ -458,6 +684,13 @@ static apr_status_t
 enqueue_http2_request(serf_http2_protocol_t *h2)
 {
     serf_http2_stream_t *stream;
+    bool served;
+    apr_status_t status;
+
+    /* No need to ask what the server already pushed */
+    status = serf_http2__push_serve(&served, &h2->push_cache);
+    if (status || served)
+        return status;
 
     stream = serf_http2__stream_create(h2, -1,
                                        h2->lr_default_window,
@@ -473,6 +706,10 @@ enqueue_http2_request(serf_http2_protocol_t *h2)
     else
         h2->last = h2->first = stream;
 
+    serf_http2__priority_set(&h2->priority, stream, NULL,
+                             HTTP2_PRIORITY_WEIGHT_DEFAULT, false);
+    http2_stream_window_setup(h2, stream);
+
     return serf_http2__stream_setup_next_request(stream, h2->conn,
                                                  h2->lr_max_framesize,
                                                  h2->hpack_tbl);
@@ -483,9 +720,45 @@ serf_http2__enqueue_frame(serf_http2_protocol_t *h2,
                           serf_bucket_t *frame,
                           bool flush)
 {
+    if (h2->batching)
+        flush = false; /* Written by the end of the batch */
+
     return serf_pump__add_output(h2->pump, frame, flush);
 }
 
+/* Writes all queued frames to the socket */
+static apr_status_t
+http2_flush(serf_http2_protocol_t *h2)
+{
+    apr_status_t status = serf_pump__write(h2->pump, true);
+
+    if (SERF_BUCKET_READ_ERROR(status))
+        return status;
+
+    return APR_SUCCESS;
+}
+
+/* Processes the incoming frames, while batching the frames that are
+   written in reply, such as SETTINGS and PING acks and WINDOW_UPDATEs */
+static apr_status_t
+http2_process_batched(serf_http2_protocol_t *h2)
+{
+    apr_status_t status;
+    apr_status_t flush_status;
+    bool was_batching = h2->batching;
+
+    h2->batching = true;
+    status = http2_process(h2);
+    h2->batching = was_batching;
+
+    if (was_batching || SERF_BUCKET_READ_ERROR(status))
+        return status;
+
+    flush_status = http2_flush(h2);
+
+    return flush_status ? flush_status : status;
+}
+
 /* Implements serf_bucket_prefix_handler_t.
    Handles PRIORITY frames and the priority prefix of HEADERS frames */
 static apr_status_t
@@ -495,6 +768,16 @@ http2_handle_priority(void *baton,
                       apr_size_t len)
 {
     serf_http2_stream_t *stream = baton;
+    serf_http2_protocol_t *h2;
+    serf_http2_stream_t *parent;
+    apr_int32_t depends_on;
+    apr_uint16_t weight;
+    bool exclusive;
+    const struct priority_t
+    {
+        unsigned char s3, s2, s1, s0;
+        unsigned char weight;
+    } *prio;
 
     if (len != HTTP2_PRIORITY_DATA_SIZE)
         return SERF_ERROR_HTTP2_FRAME_SIZE_ERROR;
@@ -502,8 +785,38 @@ http2_handle_priority(void *baton,
     if (stream == NULL)
         return APR_SUCCESS; /* Nothing to record this on */
 
-    /* ### TODO: Store priority information on stream */
-    SERF_H2_assert(stream->h2 != NULL);
+    h2 = stream->h2;
+    SERF_H2_assert(h2 != NULL);
+
+    prio = (const void *)data;
+
+    exclusive = (prio->s3 & 0x80) != 0;
+    depends_on = ((prio->s3 & 0x7F) << 24) | (prio->s2 << 16)
+                 | (prio->s1 << 8) | prio->s0;
+    weight = prio->weight + 1;
+
+    /* A stream cannot depend on itself. An endpoint MUST treat this as a
+       stream error (Section 5.4.2) of type PROTOCOL_ERROR. */
+    if (depends_on == stream->streamid)
+        return SERF_ERROR_HTTP2_PROTOCOL_ERROR;
+
+    if (depends_on == 0)
+        parent = NULL;
+    else
+    {
+        parent = serf_http2__stream_get(h2, depends_on, FALSE, FALSE);
+
+        if (!parent)
+        {
+            /* If a stream identifier is given that is not in the tree, the
+               stream is given a default priority (Section 5.3.1) */
+            weight = HTTP2_PRIORITY_WEIGHT_DEFAULT;
+            exclusive = false;
+        }
+    }
+
+    serf_http2__priority_set(&h2->priority, stream, parent, weight,
+                             exclusive);
 
     return APR_SUCCESS;
 }
@@ -724,7 +1037,6 @@ http2_handle_ping(void *baton,
                   apr_size_t len)
 {
     serf_http2_protocol_t *h2 = baton;
-    serf_bucket_t *body;
     apr_status_t status;
 
     if (len != HTTP2_PING_DATA_SIZE)
@@ -734,17 +1046,12 @@ http2_handle_ping(void *baton,
 
     /* Reply with a PONG (=PING + ACK) with the same data*/
 
-    body = serf_bucket_simple_copy_create(data, len,
-                                          h2->allocator);
-
     status = serf_http2__enqueue_frame(
         h2,
-        serf__bucket_http2_frame_create(body,
-                                        HTTP2_FRAME_TYPE_PING,
-                                        HTTP2_FLAG_ACK,
-                                        NULL, NULL, NULL,
-                                        h2->lr_max_framesize,
-                                        h2->allocator),
+        serf__bucket_http2_frame_create_inline(data, len,
+                                               HTTP2_FRAME_TYPE_PING,
+                                               HTTP2_FLAG_ACK, 0,
+                                               h2->allocator),
         TRUE /* pump */);
 
     if (SERF_BUCKET_READ_ERROR(status))
@@ -768,6 +1075,26 @@ http2_handle_ping_ack(void *baton,
     SERF_H2_assert(h2 != NULL);
 
     /* Did we send a ping? */
+    if (h2->bdp_ping_time
+        && !memcmp(data, HTTP2_BDP_PING_DATA, HTTP2_PING_DATA_SIZE))
+    {
+        http2_bdp_ping_ack(h2);
+    }
+    else if (h2->ping_sent) {
+        /* Our other pings carry the time they were sent */
+        const unsigned char *d = (const unsigned char *)data;
+        apr_time_t now = apr_time_now();
+        apr_time_t sent = 0;
+        int i;
+
+        for (i = 0; i < HTTP2_PING_DATA_SIZE; i++)
+            sent = (sent << 8) | d[i];
+
+        if (sent == h2->ping_sent && sent <= now) {
+            h2->ping_sent = 0;
+            http2_rtt_sample(h2, now - sent);
+        }
+    }
 
     return APR_SUCCESS;
 }
@@ -854,16 +1181,27 @@ http2_handle_settings(void *baton,
         }
     }
 
+    /* The peer evidently speaks HTTP/2 */
+    if (!h2->settings_received) {
+        h2->settings_received = true;
+
+        if (h2->conn) {
+            const char *scheme = h2->conn->host_info.scheme;
+
+            if (scheme && strcmp(scheme, "https") == 0)
+                serf__h2c_record_protocol(h2->conn, "h2");
+            else
+                serf__h2c_record_protocol(h2->conn, "h2c");
+        }
+    }
+
   /* Always ack settings */
     serf_http2__enqueue_frame(
         h2,
-        serf__bucket_http2_frame_create(
-            NULL,
-            HTTP2_FRAME_TYPE_SETTINGS,
-            HTTP2_FLAG_ACK,
-            NULL, NULL, NULL,
-            h2->lr_max_framesize,
-            h2->allocator),
+        serf__bucket_http2_frame_create_inline(NULL, 0,
+                                               HTTP2_FRAME_TYPE_SETTINGS,
+                                               HTTP2_FLAG_ACK, 0,
+                                               h2->allocator),
         TRUE);
 
     return APR_SUCCESS;
@@ -1136,6 +1474,8 @@ http2_process(serf_http2_protocol_t *h2)
                 SERF_H2_assert(h2->read_frame != NULL);
             }
 
+            h2->frames_received = true;
+
             serf__log(LOGLVL_INFO, SERF_LOGHTTP2, h2->config,
                       "Reading 0x%x frame, stream=0x%x, flags=0x%x\n",
                       frametype, sid, frameflags);
@@ -1187,6 +1527,9 @@ http2_process(serf_http2_protocol_t *h2)
                         else
                             h2->rl_window -= remaining;
 
+                        if (h2->bdp_window_max && remaining)
+                            http2_bdp_received(h2, remaining);
+
                         if (h2->rl_window < h2->rl_window_upd_below)
                             http2_send_window_update(h2, NULL);
 
@@ -1452,6 +1795,12 @@ http2_process(serf_http2_protocol_t *h2)
                             return SERF_ERROR_HTTP2_FRAME_SIZE_ERROR;
                         }
                         h2->setting_acks++;
+
+                        if (h2->bdp_pending_ack
+                            && h2->setting_acks >= h2->bdp_pending_ack) {
+
+                            http2_apply_stream_windows(h2);
+                        }
                     }
                     else if ((remaining % HTTP2_SETTING_SIZE) != 0)
                     {
@@ -1497,8 +1846,8 @@ http2_process(serf_http2_protocol_t *h2)
                                             body,
                                             HTTP2_PING_DATA_SIZE,
                                             (frameflags & HTTP2_FLAG_ACK)
-                                                    ? http2_handle_ping
-                                                    : http2_handle_ping_ack,
+                                                    ? http2_handle_ping_ack
+                                                    : http2_handle_ping,
                                             h2, h2->allocator);
 
                     /* Just reading will do the right thing now */
@@ -1624,44 +1973,65 @@ http2_process(serf_http2_protocol_t *h2)
     } /* while(TRUE) */
 }
 
+/* Writes DATA frames in the order chosen by the scheduler, until the
+   socket, the flow control windows or the streams stop us.
+
+   Frames are queued in batches of up to HTTP2_WRITE_BATCH_FRAMES frames
+   or HTTP2_WRITE_BATCH_SIZE bytes, which are then written together with
+   any pending control frames using as few writev() calls as possible. */
 static apr_status_t http2_write_data(serf_http2_protocol_t *h2)
 {
-    serf_http2_stream_t *stream = h2->cur_writable;
+    bool was_batching = h2->batching;
+    apr_status_t status = APR_SUCCESS;
 
     while (h2->lr_window > 0)
     {
-        apr_status_t status;
+        apr_size_t batch_size = 0;
+        int batch_frames = 0;
 
-        if (!stream)
-            stream = h2->first_writable;
-
-        if (!stream)
-            return APR_SUCCESS;
+        h2->batching = true;
 
-        if (stream->status != H2S_OPEN
-            && stream->status != H2S_HALFCLOSED_REMOTE)
+        while (h2->lr_window > 0
+               && batch_frames < HTTP2_WRITE_BATCH_FRAMES
+               && batch_size < HTTP2_WRITE_BATCH_SIZE)
         {
-            /* This stream is NOT writable. Remove it */
-            if (stream->prev_writable)
-                stream->prev_writable->next_writable = stream->next_writable;
-            else
-                h2->first_writable = stream->next_writable;
+            serf_http2_stream_t *stream;
+            apr_uint32_t lr_window;
+            apr_size_t written;
 
-            if (stream->next_writable)
-                stream->next_writable->prev_writable = stream->prev_writable;
-            else
-                h2->last_writable = stream->prev_writable;
+            stream = serf_http2__priority_next(&h2->priority);
+            if (!stream)
+                break;
 
-            stream->prev_writable = stream->next_writable = NULL;
-            stream = NULL;
-            continue;
+            /* Writing marks the stream writable again if there is more */
+            stream->writable = false;
+            lr_window = stream->lr_window;
+
+            status = serf_http2__stream_write_data(stream);
+
+            written = lr_window - stream->lr_window;
+            serf_http2__priority_charge(&h2->priority, stream, written);
+
+            batch_size += written + HTTP2_FRAME_HEADER_SIZE;
+            batch_frames++;
+
+            if (status)
+                break;
         }
 
-        status = serf_http2__stream_write_data(stream);
-        if (status || stream->lr_window == 0)
-            h2->cur_writable = stream->next_writable;
+        h2->batching = was_batching;
+
+        if (status || !batch_frames)
+            return status;
+
+        status = http2_flush(h2);
+        if (status)
+            return status;
 
-        return status ? status : APR_EAGAIN;
+        /* Stop when the socket doesn't take more right now. The pump
+           asks for a write event to continue */
+        if (serf_pump__data_pending(h2->pump))
+            return APR_SUCCESS;
     }
 
     return APR_SUCCESS; /* Done for now */
@@ -1673,10 +2043,18 @@ http2_outgoing_read(serf_connection_t *conn)
     serf_http2_protocol_t *h2 = conn->protocol_baton;
     apr_status_t status;
 
-    status = http2_process(h2);
+    status = http2_process_batched(h2);
 
     if (!status)
         return APR_SUCCESS;
+
+    /* A server we expected to speak HTTP/2 failed before it did */
+    if (!h2->settings_received
+        && !APR_STATUS_IS_EAGAIN(status) && status != SERF_ERROR_WAIT_CONN)
+    {
+        serf__h2c_forget_protocol(conn);
+        return status;
+    }
     else if (APR_STATUS_IS_EOF(status))
     {
       /* TODO: Teardown connection, reset if necessary, etc. */
@@ -1696,15 +2074,24 @@ static apr_status_t
 http2_outgoing_write(serf_connection_t *conn)
 {
     serf_http2_protocol_t *h2 = conn->protocol_baton;
-    apr_status_t status;
-
-    if (conn->unwritten_reqs
-        && conn->nr_of_written_reqs < h2->lr_max_concurrent)
+    apr_status_t status = APR_SUCCESS;
+    bool was_batching = h2->batching;
+    int batch_frames = 0;
+
+    /* Send the headers of as many new requests as we can at once */
+    h2->batching = true;
+    while (conn->unwritten_reqs
+           && conn->nr_of_written_reqs < h2->lr_max_concurrent
+           && batch_frames++ < HTTP2_WRITE_BATCH_FRAMES)
     {
         status = enqueue_http2_request(h2);
         if (status)
-            return status;
+            break;
     }
+    h2->batching = was_batching;
+
+    if (status)
+        return status;
 
     status = serf_pump__write(h2->pump, true);
 
@@ -1773,6 +2160,38 @@ static void http2_prioritize_request(serf_request_t *rq, bool exclusive)
                                           rq, exclusive);
 }
 
+/* Implements perform_throttle. Instead of not reading from the socket,
+   which would also block control frames, we push back on the server by
+   not sending WINDOW_UPDATE frames while throttled. */
+static void http2_throttle(serf_connection_t *conn, bool throttled)
+{
+    serf_http2_protocol_t *h2 = conn->protocol_baton;
+    serf_http2_stream_t *stream;
+
+    if (!h2 || h2->throttled == throttled)
+        return;
+
+    h2->throttled = throttled;
+
+    if (throttled)
+        return;
+
+    /* Send the updates that we withheld */
+    if (h2->rl_window < h2->rl_window_upd_below)
+        http2_send_window_update(h2, NULL);
+
+    for (stream = h2->first; stream; stream = stream->next) {
+        if ((stream->status == H2S_OPEN
+             || stream->status == H2S_HALFCLOSED_LOCAL)
+            && stream->rl_window < stream->rl_window_upd_below) {
+
+            http2_send_window_update(h2, stream);
+        }
+    }
+
+    serf_io__set_pollset_dirty(&conn->io);
+}
+
 static apr_status_t
 http2_incoming_read(serf_incoming_t *client)
 {
@@ -1821,7 +2240,7 @@ http2_incoming_read(serf_incoming_t *client)
         }
     }
 
-    status = http2_process(h2);
+    status = http2_process_batched(h2);
 
     if (!status)
         return APR_SUCCESS;
@@ -1962,6 +2381,10 @@ serf_http2__stream_get(serf_http2_protocol_t *h2,
         else
             h2->last = h2->first = stream;
 
+        serf_http2__priority_set(&h2->priority, stream, NULL,
+                                 HTTP2_PRIORITY_WEIGHT_DEFAULT, false);
+        http2_stream_window_setup(h2, stream);
+
         if (streamid < h2->rl_next_streamid)
         {
           /* https://tools.ietf.org/html/rfc7540#section-5.1.1
@@ -1995,16 +2418,156 @@ serf_http2__enqueue_stream_reset(serf_http2_protocol_t *h2,
     else
         http_reason = SERF_ERROR_HTTP2_INTERNAL_ERROR;
 
-    bkt = serf_bucket_create_numberv(h2->allocator, "4", http_reason);
+    bkt = http2_frame_create_numberv(h2->allocator,
+                                     HTTP2_FRAME_TYPE_RST_STREAM,
+                                     streamid, "4", http_reason);
+
+    return serf_http2__enqueue_frame(h2, bkt, TRUE);
+}
+
+void
+serf_http2__stream_set_priority(serf_http2_stream_t *stream,
+                                serf_http2_stream_t *parent,
+                                apr_uint16_t weight,
+                                bool exclusive)
+{
+    serf_http2_protocol_t *h2 = stream->h2;
+    serf_bucket_t *bkt;
+    apr_uint32_t depends_on;
+
+    serf_http2__priority_set(&h2->priority, stream, parent, weight,
+                             exclusive);
+
+    if (stream->streamid < 0)
+        return; /* Not on the wire yet */
+
+    if (parent && parent->streamid >= 0)
+        depends_on = parent->streamid;
+    else
+        depends_on = 0;
+
+    bkt = http2_frame_create_numberv(h2->allocator,
+                                     HTTP2_FRAME_TYPE_PRIORITY,
+                                     stream->streamid, "41",
+                                     depends_on
+                                     | (exclusive ? 0x80000000 : 0),
+                                     stream->weight - 1);
+
+    serf_http2__enqueue_frame(h2, bkt, TRUE);
+}
+
+void serf__http2_protocol_adopt_request(void *protocol_baton,
+                                        serf_request_t *request)
+{
+    serf_http2_protocol_t *h2 = protocol_baton;
+    serf_http2_stream_t *stream;
+
+    /* The request sent with the upgrade offer is stream 1, which is
+       half-closed for us (RFC 7540, section 3.2) */
+    SERF_H2_assert(h2->lr_next_streamid == 1);
+
+    stream = serf_http2__stream_create(h2, h2->lr_next_streamid,
+                                       h2->lr_default_window,
+                                       h2->rl_default_window,
+                                       h2->allocator);
+    h2->lr_next_streamid += 2;
+
+    if (h2->first)
+    {
+        stream->next = h2->first;
+        h2->first->prev = stream;
+        h2->first = stream;
+    }
+    else
+        h2->last = h2->first = stream;
+
+    serf_http2__priority_set(&h2->priority, stream, NULL,
+                             HTTP2_PRIORITY_WEIGHT_DEFAULT, false);
+    http2_stream_window_setup(h2, stream);
+
+    serf_http2__stream_adopt_request(stream, request);
+}
+
+void serf__http2_protocol_get_stats(void *protocol_baton,
+                                    apr_uint32_t *recv_window,
+                                    apr_uint32_t *send_window,
+                                    apr_uint64_t *bdp_estimate,
+                                    apr_interval_time_t *rtt)
+{
+    serf_http2_protocol_t *h2 = protocol_baton;
+
+    if (recv_window)
+        *recv_window = h2->rl_window_upd_to;
+    if (send_window)
+        *send_window = h2->lr_window;
+    if (bdp_estimate)
+        *bdp_estimate = h2->bdp_estimate;
+    if (rtt)
+        *rtt = h2->rtt;
+}
+
+apr_uint32_t serf__http2_protocol_max_streams(void *protocol_baton)
+{
+    serf_http2_protocol_t *h2 = protocol_baton;
+
+    return h2->lr_max_concurrent;
+}
+
+void serf__http2_protocol_get_rtt(void *protocol_baton,
+                                  apr_interval_time_t *srtt,
+                                  apr_interval_time_t *rttvar)
+{
+    serf_http2_protocol_t *h2 = protocol_baton;
+
+    *srtt = h2->srtt;
+    *rttvar = (h2->srtt < 0) ? -1 : h2->rttvar;
+}
+
+apr_status_t serf__http2_protocol_keepalive(void *protocol_baton,
+                                            apr_time_t now)
+{
+    serf_http2_protocol_t *h2 = protocol_baton;
+    serf_connection_t *conn = h2->conn;
+    apr_interval_time_t timeout;
+    unsigned char data[HTTP2_PING_DATA_SIZE];
+    int i;
+
+    if (h2->frames_received) {
+        /* The peer is alive */
+        h2->frames_received = false;
+        h2->last_received = now;
+    }
+
+    if (h2->ping_sent) {
+        timeout = conn->keepalive_timeout ? conn->keepalive_timeout
+                                          : conn->keepalive_interval;
+
+        if (now - h2->ping_sent <= timeout)
+            return APR_SUCCESS;
+
+        /* Nothing at all received since we sent the PING */
+        if (h2->last_received <= h2->ping_sent)
+            return APR_TIMEUP;
+
+        h2->ping_sent = 0; /* Never answered, but the peer is alive */
+    }
+
+    if (now - h2->last_received < conn->keepalive_interval)
+        return APR_SUCCESS;
+
+    /* Send the time in the opaque data, to measure the round trip */
+    for (i = HTTP2_PING_DATA_SIZE; i--; )
+        data[i] = (unsigned char)(now >> ((HTTP2_PING_DATA_SIZE - 1 - i) * 8));
+
+    h2->ping_sent = now;
 
     return serf_http2__enqueue_frame(
-        h2,
-        serf__bucket_http2_frame_create(bkt,
-                                        HTTP2_FRAME_TYPE_RST_STREAM,
-                                        0, &streamid, NULL, NULL,
-                                        h2->lr_max_framesize,
-                                        h2->allocator),
-        TRUE);
+                h2,
+                serf__bucket_http2_frame_create_inline(data,
+                                                       HTTP2_PING_DATA_SIZE,
+                                                       HTTP2_FRAME_TYPE_PING,
+                                                       0, 0, h2->allocator),
+                TRUE);
 }
 
 apr_status_t
@@ -2029,6 +2592,12 @@ serf_http2__max_payload_size(serf_http2_protocol_t *h2)
     return h2->lr_max_framesize;
 }
 
+serf_http2_push_cache_t *
+serf_http2__get_push_cache(serf_http2_protocol_t *h2)
+{
+    return &h2->push_cache;
+}
+
 apr_size_t serf_http2__alloc_window(serf_http2_protocol_t *h2,
                                     serf_http2_stream_t *stream,
                                     apr_size_t requested)
@@ -2060,17 +2629,11 @@ void serf_http2__return_window(serf_http2_protocol_t *h2,
 
 void serf_http2__ensure_writable(serf_http2_stream_t *stream)
 {
-    serf_http2_protocol_t *h2 = stream->h2;
     SERF_H2_assert(stream->status == H2S_OPEN
                    || stream->status == H2S_HALFCLOSED_REMOTE);
 
-    if (stream->next_writable || stream->prev_writable)
+    if (stream->writable)
         return;
 
-    stream->prev_writable = h2->last_writable;
-    h2->last_writable = stream;
-    if (stream->prev_writable)
-        stream->prev_writable->next_writable = stream;
-    else
-        h2->first_writable = stream;
+    serf_http2__priority_activate(&stream->h2->priority, stream);
 }
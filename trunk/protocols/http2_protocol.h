@@ -56,6 +56,21 @@ extern "C" {
 
 #define HTTP2_SETTING_SIZE              6
 
+#define HTTP2_FRAME_HEADER_SIZE         9
+
+/* Payload of the PINGs used to measure the bandwidth-delay product */
+#define HTTP2_BDP_PING_DATA             "serf-bdp"
+
+/* Limits on the frames queued before they are written to the socket at
+   once. A DATA frame typically takes two iovecs, so a full batch fills
+   a writev() of 64 iovecs */
+#define HTTP2_WRITE_BATCH_FRAMES        32
+#define HTTP2_WRITE_BATCH_SIZE          (256 * 1024)
+
+/* Stream weights are 1-256, with 16 used when nothing is specified */
+#define HTTP2_PRIORITY_WEIGHT_DEFAULT   16
+#define HTTP2_PRIORITY_WEIGHT_MAX       256
+
 #define HTTP2_WINDOW_MAX_ALLOWED        0x7FFFFFFF
 
 /* Frame type is an 8 bit unsigned integer */
@@ -111,6 +126,29 @@ extern "C" {
 /* ------------------------------------- */
 typedef struct serf_http2_protocol_t serf_http2_protocol_t;
 typedef struct serf_http2_stream_data_t serf_http2_stream_data_t;
+typedef struct serf_http2_push_t serf_http2_push_t;
+
+/* Root of the stream dependency tree of a connection */
+typedef struct serf_http2_priority_tree_t
+{
+  struct serf_http2_stream_t *first_child;
+  /* Virtual time of the streams directly below the root */
+  apr_uint64_t vclock;
+} serf_http2_priority_tree_t;
+
+/* Pushed responses kept for later requests, see http2_push.c */
+typedef struct serf_http2_push_cache_t
+{
+  serf_connection_t *conn;
+  serf_bucket_alloc_t *allocator;
+
+  /* Oldest first */
+  serf_http2_push_t *first;
+  serf_http2_push_t *last;
+
+  /* Bytes buffered by pushes that don't serve a request yet */
+  apr_size_t size;
+} serf_http2_push_cache_t;
 
 typedef struct serf_http2_stream_t
 {
@@ -148,8 +186,19 @@ typedef struct serf_http2_stream_t
   /* Used while receiving a promise stream */
   struct serf_http2_stream_t *new_reserved_stream;
 
-  /* TODO: Priority, etc. */
-  struct serf_http2_stream_t *next_writable, *prev_writable;
+  /* Set when the stream receives an accepted push */
+  serf_http2_push_t *push;
+
+  /* Position in the dependency tree. NULL parent is the root */
+  struct serf_http2_stream_t *dep_parent;
+  struct serf_http2_stream_t *dep_first_child;
+  struct serf_http2_stream_t *dep_next_sibling;
+  apr_uint16_t weight; /* 1-256 */
+
+  /* Scheduling state, see http2_priority.c */
+  apr_uint64_t vtime;
+  apr_uint64_t child_vclock;
+  bool writable; /* Stream has (or might have) data to send */
 } serf_http2_stream_t;
 
 typedef apr_status_t (* serf_http2_processor_t)(void *baton,
@@ -206,6 +255,12 @@ serf_http2__stream_setup_next_request(serf_http2_stream_t *stream,
                                       apr_size_t max_payload_size,
                                       serf_hpack_table_t *hpack_tbl);
 
+/* Makes STREAM handle REQUEST, which was already sent as HTTP/1.1 with an
+   accepted upgrade offer */
+void
+serf_http2__stream_adopt_request(serf_http2_stream_t *stream,
+                                 serf_request_t *request);
+
 apr_status_t
 serf_http2__setup_incoming_request(serf_incoming_request_t **in_request,
                                    serf_incoming_request_setup_t *req_setup,
@@ -226,6 +281,13 @@ void serf_http2__return_window(serf_http2_protocol_t *h2,
 
 void serf_http2__ensure_writable(serf_http2_stream_t *stream);
 
+/* Updates the dependency of STREAM in the connection's dependency tree and
+   informs the peer via a PRIORITY frame if the stream is already open */
+void serf_http2__stream_set_priority(serf_http2_stream_t *stream,
+                                     serf_http2_stream_t *parent,
+                                     apr_uint16_t weight,
+                                     bool exclusive);
+
 apr_status_t
 serf_http2__stream_reset(serf_http2_stream_t *stream,
                          apr_status_t reason,
@@ -264,6 +326,85 @@ serf_http2__stream_processor(void *baton,
 apr_status_t
 serf_http2__stream_write_data(serf_http2_stream_t *stream);
 
+/* Makes STREAM depend on PARENT (or on the root when NULL) with WEIGHT,
+   following the reprioritization rules of RFC 7540, section 5.3.3. When
+   EXCLUSIVE is true STREAM becomes the only dependency of PARENT, taking
+   over all its former dependencies */
+void
+serf_http2__priority_set(serf_http2_priority_tree_t *tree,
+                         serf_http2_stream_t *stream,
+                         serf_http2_stream_t *parent,
+                         apr_uint16_t weight,
+                         bool exclusive);
+
+/* Marks STREAM as having data to send */
+void
+serf_http2__priority_activate(serf_http2_priority_tree_t *tree,
+                              serf_http2_stream_t *stream);
+
+/* Returns the HTTP/2 weight for the serf request PRIORITY */
+apr_uint16_t
+serf_http2__priority_weight(apr_uint16_t priority);
+
+/* Returns the stream that should send the next DATA frame, or NULL if no
+   stream is able to send. Closed streams are removed from the tree first */
+serf_http2_stream_t *
+serf_http2__priority_next(serf_http2_priority_tree_t *tree);
+
+/* Accounts LEN bytes of payload written by STREAM against its share, and
+   the shares of its ancestors */
+void
+serf_http2__priority_charge(serf_http2_priority_tree_t *tree,
+                            serf_http2_stream_t *stream,
+                            apr_size_t len);
+
+/* Returns the push cache of H2 */
+serf_http2_push_cache_t *
+serf_http2__get_push_cache(serf_http2_protocol_t *h2);
+
+void
+serf_http2__push_cache_init(serf_http2_push_cache_t *cache,
+                            serf_connection_t *conn,
+                            serf_bucket_alloc_t *allocator);
+
+void
+serf_http2__push_cache_cleanup(serf_http2_push_cache_t *cache);
+
+/* Decides whether the response promised on STREAM for METHOD, AUTHORITY
+   and PATH should be received. Returns the push that buffers it, or NULL
+   when the stream should be refused */
+serf_http2_push_t *
+serf_http2__push_accept(serf_http2_push_cache_t *cache,
+                        serf_http2_stream_t *stream,
+                        const char *method,
+                        const char *authority,
+                        const char *path);
+
+/* Adds VECS_USED vecs of response data to PUSH, passing it on to the
+   request served by PUSH, if any. May destroy PUSH */
+apr_status_t
+serf_http2__push_append(serf_http2_push_t *push,
+                        const struct iovec *vecs,
+                        int vecs_used);
+
+/* Marks the response of PUSH as complete (APR_EOF) or failed. May destroy
+   PUSH */
+apr_status_t
+serf_http2__push_done(serf_http2_push_t *push,
+                      apr_status_t status);
+
+/* Serves the first unwritten request of the connection of CACHE from a
+   matching push. Sets *SERVED to true when it did */
+apr_status_t
+serf_http2__push_serve(bool *served,
+                       serf_http2_push_cache_t *cache);
+
+/* Handles cancelling REQUEST, which is served by PUSH or replaces the
+   request served by PUSH */
+void
+serf_http2__push_cancel(serf_http2_push_t *push,
+                        serf_request_t *request);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,416 @@
+/* ====================================================================
+ *    Licensed to the Apache Software Foundation (ASF) under one
+ *    or more contributor license agreements.  See the NOTICE file
+ *    distributed with this work for additional information
+ *    regarding copyright ownership.  The ASF licenses this file
+ *    to you under the Apache License, Version 2.0 (the
+ *    "License"); you may not use this file except in compliance
+ *    with the License.  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing,
+ *    software distributed under the License is distributed on an
+ *    "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ *    KIND, either express or implied.  See the License for the
+ *    specific language governing permissions and limitations
+ *    under the License.
+ * ====================================================================
+ */
+
+#include <apr_pools.h>
+#include <apr_general.h>  /* for strcasecmp() */
+#include <apr_strings.h>
+
+#include "serf.h"
+#include "serf_bucket_util.h"
+#include "serf_private.h"
+
+#include "protocols/http2_protocol.h"
+
+/* Server push (RFC 7540, section 8.2) for client connections.
+
+   Accepted pushes copy the response received on their promised stream,
+   as read from the HPACK decoder and DATA frames, into a bucket of their
+   own. The first request for the same method, authority and path that
+   is about to be written gets that bucket as its response stream instead
+   of being sent; data that arrives later is passed on to it directly. */
+
+struct serf_http2_push_t
+{
+    serf_http2_push_cache_t *cache;
+    serf_http2_push_t *next;
+    serf_http2_push_t *prev;
+
+    serf_http2_stream_t *stream;  /* Stream receiving the response */
+    serf_request_t *request;      /* Request served from this push */
+
+    char *method;
+    char *authority;
+    char *path;
+
+    serf_bucket_t *response;      /* Data received, not yet read */
+    apr_size_t size;              /* Bytes accounted in the cache */
+
+    /* APR_EAGAIN while receiving, APR_EOF when complete, or the reason
+       the response is incomplete */
+    apr_status_t status;
+};
+
+void serf_http2__push_cache_init(serf_http2_push_cache_t *cache,
+                                 serf_connection_t *conn,
+                                 serf_bucket_alloc_t *allocator)
+{
+    cache->conn = conn;
+    cache->allocator = allocator;
+    cache->first = cache->last = NULL;
+    cache->size = 0;
+}
+
+static apr_status_t push_response_eof(void *baton,
+                                      serf_bucket_t *aggregate_bucket)
+{
+    serf_http2_push_t *push = baton;
+
+    return push->status;
+}
+
+static void push_destroy(serf_http2_push_t *push)
+{
+    serf_http2_push_cache_t *cache = push->cache;
+    serf_bucket_alloc_t *alloc = cache->allocator;
+
+    if (push->prev)
+        push->prev->next = push->next;
+    else
+        cache->first = push->next;
+
+    if (push->next)
+        push->next->prev = push->prev;
+    else
+        cache->last = push->prev;
+
+    cache->size -= push->size;
+
+    if (push->stream) {
+        serf_http2_stream_t *stream = push->stream;
+
+        stream->push = NULL;
+
+        /* Not interested in the rest of the response */
+        if (stream->status != H2S_CLOSED)
+            serf_http2__stream_reset(stream, SERF_ERROR_HTTP2_CANCEL, true);
+    }
+
+    serf_bucket_destroy(push->response);
+    serf_bucket_mem_free(alloc, push->method);
+    serf_bucket_mem_free(alloc, push->authority);
+    serf_bucket_mem_free(alloc, push->path);
+    serf_bucket_mem_free(alloc, push);
+}
+
+void serf_http2__push_cache_cleanup(serf_http2_push_cache_t *cache)
+{
+    while (cache->first) {
+        serf_http2_push_t *push = cache->first;
+
+        /* The streams are already gone */
+        push->stream = NULL;
+        if (push->request)
+            push->request->protocol_baton = NULL;
+
+        push_destroy(push);
+    }
+}
+
+/* Drops the oldest pushes that don't serve a request, except KEEP, until
+   NEEDED more bytes fit in CACHE. Returns whether they fit */
+static bool make_room(serf_http2_push_cache_t *cache,
+                      serf_http2_push_t *keep,
+                      apr_size_t needed)
+{
+    apr_size_t max_size = cache->conn->push_max_size;
+    serf_http2_push_t *push = cache->first;
+
+    while (push && cache->size + needed > max_size) {
+        serf_http2_push_t *next = push->next;
+
+        if (push != keep && !push->request)
+            push_destroy(push);
+
+        push = next;
+    }
+
+    return cache->size + needed <= max_size;
+}
+
+serf_http2_push_t *
+serf_http2__push_accept(serf_http2_push_cache_t *cache,
+                        serf_http2_stream_t *stream,
+                        const char *method,
+                        const char *authority,
+                        const char *path)
+{
+    serf_connection_t *conn = cache->conn;
+    serf_bucket_alloc_t *alloc = cache->allocator;
+    serf_http2_push_t *push;
+
+    if (!conn || !conn->push_max_size || !method || !authority || !path)
+        return NULL;
+
+    /* Only safe and cacheable requests can be pushed, and we can only
+       match requests without a body */
+    if (strcmp(method, "GET") != 0)
+        return NULL;
+
+    if (conn->push_accept
+        && !conn->push_accept(conn->push_accept_baton, method, authority,
+                              path))
+    {
+        return NULL;
+    }
+
+    /* A newer push replaces one for the same resource */
+    for (push = cache->first; push; push = push->next) {
+        if (!push->request
+            && strcmp(push->path, path) == 0
+            && strcmp(push->authority, authority) == 0)
+        {
+            push_destroy(push);
+            break;
+        }
+    }
+
+    if (!make_room(cache, NULL, 1))
+        return NULL;
+
+    push = serf_bucket_mem_calloc(alloc, sizeof(*push));
+    push->cache = cache;
+    push->stream = stream;
+    push->method = serf_bstrdup(alloc, method);
+    push->authority = serf_bstrdup(alloc, authority);
+    push->path = serf_bstrdup(alloc, path);
+    push->status = APR_EAGAIN;
+
+    push->response = serf_bucket_aggregate_create(alloc);
+    serf_bucket_aggregate_hold_open(push->response, push_response_eof, push);
+
+    push->prev = cache->last;
+    if (cache->last)
+        cache->last->next = push;
+    else
+        cache->first = push;
+    cache->last = push;
+
+    stream->push = push;
+
+    serf__log(LOGLVL_DEBUG, SERF_LOGCOMP_PROTOCOL, __FILE__, conn->config,
+              "Accepted push of %s %s%s on stream %d\n",
+              method, authority, path, stream->streamid);
+
+    return push;
+}
+
+/* Passes the response of PUSH on to the request it serves, and finishes
+   the request when the response is done */
+static apr_status_t push_deliver(serf_http2_push_t *push)
+{
+    serf_request_t *request;
+    serf_connection_t *conn;
+    serf_request_t **rq;
+    serf_request_t *last = NULL;
+    apr_status_t status;
+
+    /* The request may be replaced by one that discards the response */
+    do {
+        request = push->request;
+        status = serf__handle_response(request, request->respool);
+    } while (status == APR_SUCCESS);
+
+    if (!APR_STATUS_IS_EOF(status) && !SERF_BUCKET_READ_ERROR(status))
+        return APR_SUCCESS;
+
+    request = push->request;
+    conn = request->conn;
+
+    for (rq = &conn->written_reqs; *rq && (*rq != request); rq = &last->next)
+        last = *rq;
+
+    if (*rq) {
+        (*rq) = request->next;
+
+        if (conn->written_reqs_tail == request)
+            conn->written_reqs_tail = last;
+
+        conn->nr_of_written_reqs--;
+    }
+
+    push->request = NULL;
+    request->protocol_baton = NULL;
+    serf__destroy_request(request);
+
+    push_destroy(push);
+
+    return SERF_BUCKET_READ_ERROR(status) ? status : APR_SUCCESS;
+}
+
+apr_status_t serf_http2__push_append(serf_http2_push_t *push,
+                                     const struct iovec *vecs,
+                                     int vecs_used)
+{
+    serf_http2_push_cache_t *cache = push->cache;
+    apr_size_t len = 0;
+    int i;
+
+    for (i = 0; i < vecs_used; i++)
+        len += vecs[i].iov_len;
+
+    /* Once a request reads the response, it is no longer kept */
+    if (!push->request) {
+        if (!make_room(cache, push, len)) {
+            serf__log(LOGLVL_DEBUG, SERF_LOGCOMP_PROTOCOL, __FILE__,
+                      cache->conn->config,
+                      "Dropping push of %s%s: cache full\n",
+                      push->authority, push->path);
+
+            push_destroy(push);
+            return APR_SUCCESS;
+        }
+
+        push->size += len;
+        cache->size += len;
+    }
+
+    for (i = 0; i < vecs_used; i++) {
+        if (!vecs[i].iov_len)
+            continue;
+
+        serf_bucket_aggregate_append(
+            push->response,
+            serf_bucket_simple_copy_create(vecs[i].iov_base,
+                                           vecs[i].iov_len,
+                                           cache->allocator));
+    }
+
+    if (push->request)
+        return push_deliver(push);
+
+    return APR_SUCCESS;
+}
+
+apr_status_t serf_http2__push_done(serf_http2_push_t *push,
+                                   apr_status_t status)
+{
+    if (push->status != APR_EAGAIN)
+        return APR_SUCCESS;
+
+    push->status = status;
+
+    if (push->request)
+        return push_deliver(push);
+
+    if (!APR_STATUS_IS_EOF(status))
+        push_destroy(push);
+
+    return APR_SUCCESS;
+}
+
+apr_status_t serf_http2__push_serve(bool *served,
+                                    serf_http2_push_cache_t *cache)
+{
+    serf_connection_t *conn = cache->conn;
+    serf_request_t *request = conn->unwritten_reqs;
+    serf_http2_push_t *push;
+    serf_bucket_t *body;
+    const char *uri, *method, *host;
+    apr_status_t status;
+
+    *served = false;
+
+    if (!cache->first || !request || request->ssltunnel)
+        return APR_SUCCESS;
+
+    if (!request->req_bkt) {
+        status = serf__setup_request(request);
+        if (status)
+            return status;
+    }
+
+    serf__bucket_request_read(request->req_bkt, &body, &uri, &method);
+    host = serf_bucket_headers_get(
+                        serf_bucket_request_get_headers(request->req_bkt),
+                        "Host");
+
+    if (body || !uri || !method || !host)
+        return APR_SUCCESS;
+
+    for (push = cache->first; push; push = push->next) {
+        if (!push->request
+            && (push->status == APR_EAGAIN || APR_STATUS_IS_EOF(push->status))
+            && strcmp(push->path, uri) == 0
+            && strcmp(push->method, method) == 0
+            && strcasecmp(push->authority, host) == 0)
+        {
+            break;
+        }
+    }
+
+    if (!push)
+        return APR_SUCCESS;
+
+    serf__log(LOGLVL_DEBUG, SERF_LOGCOMP_PROTOCOL, __FILE__, conn->config,
+              "Serving %s %s%s from push\n", method, host, uri);
+
+    /* The request is handled as if it was written */
+    conn->unwritten_reqs = request->next;
+    if (conn->unwritten_reqs_tail == request)
+        conn->unwritten_reqs_tail = NULL;
+
+    request->next = NULL;
+
+    serf__link_requests(&conn->written_reqs, &conn->written_reqs_tail,
+                        request);
+    conn->nr_of_written_reqs++;
+    conn->nr_of_unwritten_reqs--;
+
+    serf_bucket_destroy(request->req_bkt);
+    request->req_bkt = NULL;
+    request->writing = SERF_WRITING_FINISHED;
+
+    /* Allows cancelling the request via the stream */
+    request->protocol_baton = push->stream;
+    push->request = request;
+
+    cache->size -= push->size;
+    push->size = 0;
+
+    request->resp_bkt = request->acceptor(request, push->response,
+                                          request->acceptor_baton,
+                                          request->respool);
+
+    *served = true;
+    return push_deliver(push);
+}
+
+void serf_http2__push_cancel(serf_http2_push_t *push,
+                             serf_request_t *request)
+{
+    if (push->request && push->request != request) {
+        /* A request that discards the response took over */
+        push->request = request;
+        return;
+    }
+
+    push->request = NULL;
+    push_destroy(push);
+}
+
+void serf_connection_set_push_cache(serf_connection_t *conn,
+                                    apr_size_t max_size,
+                                    serf_push_accept_t accept,
+                                    void *accept_baton)
+{
+    conn->push_max_size = max_size;
+    conn->push_accept = accept;
+    conn->push_accept_baton = accept_baton;
+}
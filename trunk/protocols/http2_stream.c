@@ -37,6 +37,7 @@ struct serf_http2_stream_data_t
     serf_bucket_t *response_agg;
     serf_hpack_table_t *tbl;
     serf_bucket_t *data_tail;
+    serf_bucket_t *promise_req; /* PUSH_PROMISE being read */
     bool resetted;
 };
 
@@ -62,6 +63,7 @@ serf_http2__stream_create(serf_http2_protocol_t *h2,
     stream->data->response_agg = NULL;
     stream->data->tbl = NULL;
     stream->data->data_tail = NULL;
+    stream->data->promise_req = NULL;
     stream->data->resetted = false;
 
     stream->lr_window = lr_window;
@@ -77,12 +79,32 @@ serf_http2__stream_create(serf_http2_protocol_t *h2,
 
     stream->status = (streamid >= 0) ? H2S_IDLE : H2S_INIT;
     stream->new_reserved_stream = NULL;
+    stream->push = NULL;
 
-    stream->prev_writable = stream->next_writable = NULL;
+    stream->dep_parent = stream->dep_first_child = NULL;
+    stream->dep_next_sibling = NULL;
+    stream->weight = HTTP2_PRIORITY_WEIGHT_DEFAULT;
+    stream->vtime = stream->child_vclock = 0;
+    stream->writable = false;
 
     return stream;
 }
 
+/* Maps the 16 bit serf request priority on a HTTP/2 weight */
+static apr_uint16_t request_weight(serf_request_t *request)
+{
+    return serf_http2__priority_weight(request->dep_priority);
+}
+
+/* Returns the stream of the request REQUEST depends on, if any */
+static serf_http2_stream_t *request_parent(serf_request_t *request)
+{
+    if (request->depends_on)
+        return request->depends_on->protocol_baton;
+
+    return NULL;
+}
+
 void
 serf_http2__stream_pre_cleanup(serf_http2_stream_t *stream)
 {
@@ -100,6 +122,8 @@ serf_http2__stream_cleanup(serf_http2_stream_t *stream)
     if (stream->data) {
         if (stream->data->response_agg)
             serf_bucket_destroy(stream->data->response_agg);
+        if (stream->data->promise_req)
+            serf_bucket_destroy(stream->data->promise_req);
 
         serf_bucket_mem_free(stream->alloc, stream->data);
         stream->data = NULL;
@@ -343,6 +367,7 @@ serf_http2__stream_setup_next_request(serf_http2_stream_t *stream,
     apr_status_t status;
     serf_bucket_t *hpack;
     serf_bucket_t *body;
+    serf_http2_stream_t *ds;
     bool end_stream;
     bool priority = false;
 
@@ -379,33 +404,39 @@ serf_http2__stream_setup_next_request(serf_http2_stream_t *stream,
     if (status)
         return status;
 
-    if (request->depends_on && request->depends_on->protocol_baton)
-    {
-        serf_http2_stream_t *ds = request->depends_on->protocol_baton;
+    ds = request_parent(request);
+    if (ds && ds->streamid < 0)
+        ds = NULL; /* Can't refer to it on the wire */
 
-        if (ds->streamid >= 0) {
-            serf_bucket_t *agg;
-            unsigned char priority_data[5];
+    /* Not sent yet, so this just updates our own dependency tree */
+    serf_http2__stream_set_priority(stream, ds, request_weight(request),
+                                    false);
 
-            agg = serf_bucket_aggregate_create(request->allocator);
+    if (ds || stream->weight != HTTP2_PRIORITY_WEIGHT_DEFAULT)
+    {
+        apr_int32_t ds_id = ds ? ds->streamid : 0;
+        serf_bucket_t *agg;
+        unsigned char priority_data[HTTP2_PRIORITY_DATA_SIZE];
 
-            priority_data[0] = (ds->streamid >> 24) & 0x7F;
-            /* bit 7 of [0] is the exclusive flag */
-            priority_data[1] = (ds->streamid >> 16) & 0xFF;
-            priority_data[2] = (ds->streamid >> 8) & 0xFF;
-            priority_data[3] = ds->streamid & 0xFF;
-            priority_data[4] = request->dep_priority >> 8;
+        agg = serf_bucket_aggregate_create(request->allocator);
 
-            serf_bucket_aggregate_append(
-                agg,
-                serf_bucket_simple_copy_create((void *)priority_data,
-                                               5, request->allocator));
+        priority_data[0] = (ds_id >> 24) & 0x7F;
+        /* bit 7 of [0] is the exclusive flag */
+        priority_data[1] = (ds_id >> 16) & 0xFF;
+        priority_data[2] = (ds_id >> 8) & 0xFF;
+        priority_data[3] = ds_id & 0xFF;
+        priority_data[4] = (unsigned char)(stream->weight - 1);
 
-            serf_bucket_aggregate_append(agg, hpack);
-            hpack = agg;
+        serf_bucket_aggregate_append(
+            agg,
+            serf_bucket_simple_copy_create((void *)priority_data,
+                                           HTTP2_PRIORITY_DATA_SIZE,
+                                           request->allocator));
 
-            priority = true;
-        }
+        serf_bucket_aggregate_append(agg, hpack);
+        hpack = agg;
+
+        priority = true;
     }
 
     if (!body) {
@@ -440,6 +471,17 @@ serf_http2__stream_setup_next_request(serf_http2_stream_t *stream,
     return stream_send_data(stream, body);
 }
 
+void
+serf_http2__stream_adopt_request(serf_http2_stream_t *stream,
+                                 serf_request_t *request)
+{
+    stream->data->request = request;
+    request->protocol_baton = stream;
+
+    /* The request was sent completely; only the response is left */
+    stream->status = H2S_HALFCLOSED_LOCAL;
+}
+
 apr_status_t
 serf_http2__stream_reset(serf_http2_stream_t *stream,
                          apr_status_t reason,
@@ -447,6 +489,9 @@ serf_http2__stream_reset(serf_http2_stream_t *stream,
 {
     stream->status = H2S_CLOSED;
 
+    if (stream->push)
+        serf_http2__push_done(stream->push, reason);
+
     if (stream->streamid < 0 || stream->data->resetted)
         return APR_SUCCESS;
 
@@ -464,6 +509,12 @@ void serf_http2__stream_cancel_request(serf_http2_stream_t *stream,
                                        serf_request_t *rq,
                                        apr_status_t reason)
 {
+    if (stream->push) {
+        /* The request is served from a push */
+        serf_http2__push_cancel(stream->push, rq);
+        return;
+    }
+
     if (stream->streamid < 0)
         return; /* Never hit the wire */
     else if (stream->status == H2S_CLOSED)
@@ -486,12 +537,12 @@ void serf_http2__stream_prioritize_request(serf_http2_stream_t *stream,
                                            serf_request_t *rq,
                                            bool exclusive)
 {
-    if (stream->streamid < 0)
-        return; /* Never hit the wire */
-    else if (stream->status == H2S_CLOSED)
+    if (stream->status == H2S_CLOSED)
         return; /* We are already detached */
 
-    /* Ignore for now. We start by handling this at setup */
+    /* Until the stream has an id this only updates our own tree */
+    serf_http2__stream_set_priority(stream, request_parent(rq),
+                                    request_weight(rq), exclusive);
 }
 
 
@@ -603,7 +654,7 @@ stream_setup_response(serf_http2_stream_t *stream,
                                                   scratch_pool);
         }
     }
-    else {
+    else if (!stream->push) {
         serf_incoming_request_t *in_request = stream->data->in_request;
 
         if (!in_request) {
@@ -646,29 +697,39 @@ stream_promise_done(void *baton,
 {
     serf_http2_stream_t *parent_stream = baton;
     serf_http2_stream_t *stream = parent_stream->new_reserved_stream;
+    serf_bucket_t *promise_req = parent_stream->data->promise_req;
+    serf_bucket_t *headers;
+    const char *method, *path;
+    apr_status_t status;
 
     SERF_H2_assert(stream != NULL);
     SERF_H2_assert(stream->status == H2S_RESERVED_REMOTE);
     parent_stream->new_reserved_stream = NULL; /* End of PUSH_PROMISE */
+    parent_stream->data->promise_req = NULL;
 
-    /* Anything else? */
-
-
-    /* ### Absolute minimal implementation.
-           Just sending that we are not interested in the initial SETTINGS
-           would be the easier approach. */
-    serf_http2__stream_reset(stream, SERF_ERROR_HTTP2_REFUSED_STREAM, TRUE);
-
+    /* The promised request is complete, as the decoder reached EOF */
+    status = serf_bucket_incoming_request_read(&headers, &method, &path,
+                                               NULL, promise_req);
 
+    if (status
+        || !serf_http2__push_accept(serf_http2__get_push_cache(stream->h2),
+                                    stream, method,
+                                    serf_bucket_headers_get(headers, "Host"),
+                                    path))
+    {
+        serf_http2__stream_reset(stream, SERF_ERROR_HTTP2_REFUSED_STREAM,
+                                 TRUE);
+    }
 
+    serf_bucket_destroy(promise_req);
 
     /* Exit condition:
-       * Either we should accept the stream and are ready to receive
+       * Either we accepted the stream and are ready to receive
          HEADERS and DATA on it.
-       * Or we aren't and reject the stream
+       * Or we didn't and rejected the stream
      */
     SERF_H2_assert(stream->status == H2S_CLOSED
-                   || stream->data->request != NULL);
+                   || stream->push != NULL);
 
     /* We must return a proper error or EOF here! */
     return APR_EOF;
@@ -686,6 +747,9 @@ serf_http2__stream_handle_hpack(serf_http2_stream_t *stream,
 {
     if (frametype == HTTP2_FRAME_TYPE_HEADERS) {
 
+        if (stream->status == H2S_RESERVED_REMOTE)
+            stream->status = H2S_HALFCLOSED_LOCAL; /* Receiving the push */
+
         if (!stream->data->response_agg)
             stream_setup_response(stream, config);
 
@@ -710,24 +774,19 @@ serf_http2__stream_handle_hpack(serf_http2_stream_t *stream,
         serf_bucket_t *agg;
         SERF_H2_assert(frametype == HTTP2_FRAME_TYPE_PUSH_PROMISE);
 
-        /* First create the HPACK decoder as requested */
-
-     /* TODO: Store key+value somewhere to allow asking the application
-             if it is interested in the promised stream.
-
-             Most likely it is not interested *yet* as the HTTP/2 spec
-             recommends pushing promised items *before* the stream that
-             references them.
-
-             So we probably want to store the request anyway, to allow
-             matching this against a later added outgoing request.
-     */
+        /* First create the HPACK decoder as requested, and parse its
+           output as the promised request */
         bucket = serf__bucket_hpack_decode_create(bucket, max_entry_size,
                                                   hpack_tbl, allocator);
+        bucket = serf_bucket_incoming_request_create(bucket, allocator);
+        stream->data->promise_req = bucket;
 
-        /* And now wrap around it the easiest way to get an EOF callback */
+        /* And now wrap around it the easiest way to get an EOF callback,
+           without destroying the request before we looked at it */
         agg = serf_bucket_aggregate_create(allocator);
-        serf_bucket_aggregate_append(agg, bucket);
+        serf_bucket_aggregate_append(agg,
+                                     serf_bucket_barrier_create(bucket,
+                                                                allocator));
 
         serf_bucket_aggregate_hold_open(agg, stream_promise_done, stream);
 
@@ -892,11 +951,28 @@ serf_http2__stream_processor(void *baton,
                                         SERF_READ_ALL_AVAIL, COUNT_OF(vecs),
                                         vecs, &vecs_used);
 
-        if (vecs_used) {
-          /* We have data... What should we do with it? */
+        if (vecs_used && stream->push) {
+            /* Keep the pushed response for a later request */
+            apr_status_t push_status;
+
+            push_status = serf_http2__push_append(stream->push, vecs,
+                                                  vecs_used);
+            if (push_status)
+                return push_status;
         }
     }
 
+    if (APR_STATUS_IS_EOF(status) && stream->push
+        && (stream->status == H2S_CLOSED
+            || stream->status == H2S_HALFCLOSED_REMOTE))
+    {
+        apr_status_t push_status;
+
+        push_status = serf_http2__push_done(stream->push, APR_EOF);
+        if (push_status)
+            return push_status;
+    }
+
     if ((APR_STATUS_IS_EOF(status) || sd->resetted)
         && (stream->status == H2S_CLOSED
             || stream->status == H2S_HALFCLOSED_REMOTE))
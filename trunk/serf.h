@@ -301,6 +301,50 @@ void serf_context_set_progress_cb(
     const serf_progress_t progress_func,
     void *progress_baton);
 
+/**
+ * Configure a memory budget for the buckets of all connections in @a ctx.
+ *
+ * Serf keeps track of the memory held by the bucket allocators of the
+ * connections and their requests. When this total exceeds @a high_watermark
+ * bytes, serf stops reading from the connection that holds the most memory.
+ * If that doesn't help, the next heaviest connection is throttled, etc.
+ * Once the total drops below @a low_watermark all throttled connections
+ * are read again.
+ *
+ * Throttled HTTP/1 connections are not polled for input, which lets TCP
+ * flow control push back on the server. On HTTP/2 connections serf keeps
+ * reading, but stops sending WINDOW_UPDATE frames.
+ *
+ * Memory is only released when the application consumes the responses, so
+ * the budget should be well above the amount of data the application holds
+ * on to. Pass 0 as @a high_watermark to disable the budget (the default).
+ *
+ * @since New in 1.4.
+ */
+void serf_context_set_memory_budget(
+    serf_context_t *ctx,
+    apr_size_t high_watermark,
+    apr_size_t low_watermark);
+
+/**
+ * Retrieve memory budget statistics for @a ctx. Output arguments that are
+ * not of interest may be NULL.
+ *
+ * @a *used is set to the number of bytes that are currently held in bucket
+ * allocators of the connections, and @a *peak to the highest value seen
+ * while a memory budget is configured. @a *throttled is set to the number
+ * of connections that are currently throttled, and @a *throttle_events to
+ * the number of times a connection was throttled.
+ *
+ * @since New in 1.4.
+ */
+void serf_context_get_memory_stats(
+    serf_context_t *ctx,
+    apr_size_t *used,
+    apr_size_t *peak,
+    unsigned int *throttled,
+    apr_uint64_t *throttle_events);
+
 /** @} */
 
 /**
@@ -667,6 +711,231 @@ void serf_connection_set_max_outstanding_requests(
     serf_connection_t *conn,
     unsigned int max_requests);
 
+/**
+ * Configure a memory budget for @a conn only. This works like the context
+ * wide budget (@see serf_context_set_memory_budget), but throttles @a conn
+ * when the memory held by its own bucket allocators exceeds
+ * @a high_watermark, until it drops below @a low_watermark.
+ *
+ * @since New in 1.4.
+ */
+void serf_connection_set_memory_budget(
+    serf_connection_t *conn,
+    apr_size_t high_watermark,
+    apr_size_t low_watermark);
+
+/**
+ * Returns the number of bytes currently held in the bucket allocators of
+ * @a conn and its requests.
+ *
+ * @since New in 1.4.
+ */
+apr_size_t serf_connection_get_memory_used(
+    serf_connection_t *conn);
+
+/**
+ * Retrieve write statistics for @a conn. Output arguments that are not of
+ * interest may be NULL.
+ *
+ * @a *write_calls is set to the number of socket write calls made on the
+ * current socket of the connection, and @a *bytes_written to the number of
+ * bytes they wrote. Both are reset when the connection is reopened.
+ *
+ * @since New in 1.4.
+ */
+void serf_connection_get_write_stats(
+    serf_connection_t *conn,
+    apr_uint64_t *write_calls,
+    apr_uint64_t *bytes_written);
+
+/**
+ * Enable auto-tuning of the HTTP/2 receive windows of @a conn, allowing
+ * them to grow up to @a max_window bytes. Pass 0 to use static windows
+ * (the default).
+ *
+ * With auto-tuning the windows start at the protocol default of 64 KB.
+ * While data is received, serf measures the bandwidth-delay product by
+ * counting the bytes that arrive during a PING round trip. When that
+ * comes close to the current window, the connection and stream windows,
+ * and the initial window announced for new streams, are grown to twice
+ * the measured product. The windows never grow beyond the memory budget
+ * of the connection or the context.
+ *
+ * The setting is applied when the HTTP/2 session is set up, so it should
+ * be called before the framing type is set to HTTP/2.
+ *
+ * @since New in 1.4.
+ */
+void serf_connection_set_http2_window_tuning(
+    serf_connection_t *conn,
+    apr_uint32_t max_window);
+
+/**
+ * Retrieve HTTP/2 flow control statistics for @a conn. Output arguments
+ * that are not of interest may be NULL.
+ *
+ * @a *recv_window is set to the receive window that is granted to the
+ * server, and @a *send_window to the connection window that is currently
+ * available for sending. @a *bdp_estimate is set to the last measured
+ * bandwidth-delay product in bytes, or 0 when unknown, and @a *rtt to the
+ * round trip time measured with it, or -1 when unknown.
+ *
+ * Returns APR_ENOTIMPL when @a conn is not using HTTP/2.
+ *
+ * @since New in 1.4.
+ */
+apr_status_t serf_connection_get_http2_stats(
+    serf_connection_t *conn,
+    apr_uint32_t *recv_window,
+    apr_uint32_t *send_window,
+    apr_uint64_t *bdp_estimate,
+    apr_interval_time_t *rtt);
+
+/**
+ * Callback creating an additional connection to the same server as
+ * @a conn, allocated in @a pool. The new connection should be set up like
+ * @a conn, including its framing type, and returned in @a *new_conn.
+ *
+ * Serf owns the new connection: it is closed by destroying @a pool.
+ *
+ * @since New in 1.4.
+ */
+typedef apr_status_t (*serf_connection_spawn_t)(
+    serf_connection_t **new_conn,
+    serf_connection_t *conn,
+    void *spawn_baton,
+    apr_pool_t *pool);
+
+/**
+ * Allow serf to spread the requests of the HTTP/2 connection @a conn over
+ * additional connections to the same server. Pass NULL for @a spawn to
+ * disable this (the default).
+ *
+ * When requests are queued on @a conn while it can't start new streams,
+ * because all streams the server allows are in use or because its send
+ * window is exhausted, the requests that don't fit are moved to the
+ * least loaded connection of the group that has room for them. When no
+ * such connection exists, @a spawn is called with @a spawn_baton to open
+ * one. Additional connections that stay idle while @a conn has room again
+ * are closed after a few seconds.
+ *
+ * Only requests that are not started yet and that have no priority
+ * relations with other requests are moved.
+ *
+ * The maximum number of connections to the server, including @a conn, is
+ * read from the per host configuration value SERF_CONFIG_HOST_MAX_CONNS
+ * and defaults to 4.
+ *
+ * @since New in 1.4.
+ */
+void serf_connection_set_spillover(
+    serf_connection_t *conn,
+    serf_connection_spawn_t spawn,
+    void *spawn_baton);
+
+/**
+ * Returns the number of additional connections that are currently open
+ * for the requests of @a conn.
+ *
+ * @since New in 1.4.
+ */
+unsigned int serf_connection_get_spillover_count(
+    serf_connection_t *conn);
+
+/**
+ * Allow the requests of @a conn to be sent over another HTTP/2 connection
+ * in the same context, instead of opening a connection of its own, when
+ * @a enabled is non-zero (RFC 7540, section 9.1.1).
+ *
+ * A connection is only reused when it connects to the same address and
+ * port with the same scheme, and the server certificate it received is
+ * valid for the host of @a conn. The certificate must have been verified
+ * without failures; certificates accepted by the application despite
+ * failures are never shared.
+ *
+ * When the server answers a request with 421 Misdirected Request, the
+ * request is sent again over a connection of its own, and the host of
+ * @a conn is not sent over that connection again. Requests are also
+ * handed back when the connection serving them is closed.
+ *
+ * @since New in 1.4.
+ */
+void serf_connection_set_coalescing(
+    serf_connection_t *conn,
+    int enabled);
+
+/**
+ * Allow @a conn to speak HTTP/2 over a plain TCP connection ("h2c", RFC 7540,
+ * section 3.2) when @a enabled is non-zero. The default is disabled.
+ *
+ * The first request on a new connection offers the server an upgrade to
+ * HTTP/2 via the Upgrade header, when it has no body. Other requests are
+ * held back until the server answers it. When the server accepts, its
+ * response and all following requests use HTTP/2.
+ *
+ * The protocol the server spoke is remembered in the per host
+ * configuration value SERF_CONFIG_HOST_PROTOCOL. Connections to a server
+ * known to speak HTTP/2 start with it immediately, without an upgrade;
+ * servers known to decline the upgrade aren't asked again. When a server
+ * that was remembered to speak HTTP/2 fails to do so, the value is
+ * forgotten.
+ *
+ * Connections that use TLS or a proxy are not affected.
+ *
+ * @since New in 1.4.
+ */
+void serf_connection_set_h2c_upgrade(
+    serf_connection_t *conn,
+    int enabled);
+
+/**
+ * Decides whether a response the server offers to push is wanted.
+ *
+ * The promised request is described by @a method, @a authority (the host
+ * and optional port) and @a path. Return non-zero to accept the push.
+ *
+ * @since New in 1.4.
+ */
+typedef int (*serf_push_accept_t)(
+    void *accept_baton,
+    const char *method,
+    const char *authority,
+    const char *path);
+
+/**
+ * Accept HTTP/2 server pushes on @a conn, keeping up to @a max_size bytes
+ * of pushed responses in memory.
+ *
+ * Responses the server pushes for GET requests are buffered, and handed to
+ * a later request created with serf_connection_request_create() for the
+ * same method, authority and path, without sending that request to the
+ * server. A pushed response is used for at most one request.
+ *
+ * When @a accept is not NULL it is called with @a accept_baton for every
+ * promised request, to decide whether the push is wanted. Pushes that
+ * are not wanted, or that don't fit in @a max_size, are refused with a
+ * RST_STREAM frame; the oldest unused pushes are dropped to make room for
+ * new ones.
+ *
+ * Passing 0 for @a max_size, which is the default, refuses all pushes.
+ *
+ * @since New in 1.4.
+ */
+void serf_connection_set_push_cache(
+    serf_connection_t *conn,
+    apr_size_t max_size,
+    serf_push_accept_t accept,
+    void *accept_baton);
+
+/**
+ * Returns the configuration store of @a conn, which can be used to set
+ * per host and per connection configuration values.
+ *
+ * @since New in 1.4.
+ */
+serf_config_t *serf_connection_get_config(
+    serf_connection_t *conn);
+
 void serf_connection_set_async_responses(
     serf_connection_t *conn,
     serf_response_acceptor_t acceptor,
@@ -700,6 +969,19 @@ void serf_incoming_set_framing_type(
     serf_incoming_t *client,
     serf_connection_framing_type_t framing_type);
 
+/**
+ * Limit the number of concurrent streams that the peer of the HTTP/2
+ * session on @a client may open to @a max_streams. The limit is announced
+ * with SETTINGS_MAX_CONCURRENT_STREAMS when the session is set up, so this
+ * should be called before the framing type is determined. 0 (the default)
+ * announces no limit.
+ *
+ * @since New in 1.4.
+ */
+void serf_incoming_set_http2_max_streams(
+    serf_incoming_t *client,
+    apr_uint32_t max_streams);
+
 /**
  * Setup the @a request for delivery on its connection.
  *
@@ -805,9 +1087,50 @@ void serf_connection_request_prioritize(serf_request_t *request,
 /**
  * Returns detected network latency for the @a conn connection. Negative
  * value means that latency is unknwon.
+ *
+ * For HTTP/2 connections this is the smoothed round trip time measured
+ * with PING frames, once available. Before that, and for other
+ * connections, it is the time it took to connect.
  */
 apr_interval_time_t serf_connection_get_latency(serf_connection_t *conn);
 
+/**
+ * Retrieve the round trip time of @a conn as measured with HTTP/2 PING
+ * frames, smoothed as TCP does (RFC 6298). @a *srtt is set to the smoothed
+ * round trip time and @a *rttvar to its variation, or both to -1 when no
+ * round trip was measured yet.
+ *
+ * Round trips are measured by the PINGs used for receive window tuning
+ * (see serf_connection_set_http2_window_tuning()) and for keepalive (see
+ * serf_connection_set_keepalive()).
+ *
+ * Returns APR_ENOTIMPL when @a conn is not using HTTP/2.
+ *
+ * @since New in 1.4.
+ */
+apr_status_t serf_connection_get_rtt(
+    serf_connection_t *conn,
+    apr_interval_time_t *srtt,
+    apr_interval_time_t *rttvar);
+
+/**
+ * Send a PING frame when nothing was received over the HTTP/2 connection
+ * @a conn for @a interval, to keep NAT mappings alive and to notice peers
+ * that went away. When the peer doesn't answer within @a timeout (or
+ * @a interval when @a timeout is 0), the connection is closed and its
+ * requests are sent again over a new connection.
+ *
+ * The check happens when serf_context_run() is called, so a run duration
+ * shorter than @a interval is needed for timely PINGs. An @a interval of 0,
+ * the default, disables keepalive.
+ *
+ * @since New in 1.4.
+ */
+void serf_connection_set_keepalive(
+    serf_connection_t *conn,
+    apr_interval_time_t interval,
+    apr_interval_time_t timeout);
+
 /**
  * Returns the number of requests waiting to be sent over connection CONN.
  *
@@ -881,6 +1204,78 @@ void serf_request_set_handler(
     const serf_response_handler_t handler,
     const void **handler_baton);
 
+/**
+ * Apply application pushback on the response of @a request.
+ *
+ * Call this from the response handler when the application can't process
+ * more of the response right now, instead of reading the response until
+ * APR_EAGAIN. The handler should return APR_EAGAIN after this call.
+ *
+ * @a saver must be a saver bucket (@see serf_bucket_saver_create) that is
+ * part of the response bucket chain, typically wrapped around the stream
+ * passed to the response acceptor. The response handler isn't called again
+ * until serf_request_resume() is called.
+ *
+ * While the response is paused, serf stops reading from the connection, to
+ * let the TCP window fill up and the server pause sending. To avoid that the
+ * server times out the connection, serf drains whatever is available from
+ * the network into @a saver every @a drain_interval. A @a drain_interval of
+ * 0 or less disables these drains. Note that this relies on
+ * serf_context_run() being called with a duration that is shorter than
+ * @a drain_interval.
+ *
+ * No other request is written on the connection while the response is
+ * paused, as anything that arrives is saved for this response.
+ *
+ * Returns APR_ENOTIMPL when the connection of @a request doesn't support
+ * pushback, which is currently the case for everything except plain HTTP/1
+ * connections. Returns APR_EBUSY when other requests were written on the
+ * connection, whose responses would follow this one.
+ *
+ * @since New in 1.4.
+ */
+apr_status_t serf_request_pushback(
+    serf_request_t *request,
+    serf_bucket_t *saver,
+    apr_interval_time_t drain_interval);
+
+/**
+ * Stop applying pushback on the response of @a request, to resume
+ * delivery of the response (starting with what is saved in the saver
+ * bucket) to the response handler.
+ *
+ * @since New in 1.4.
+ */
+void serf_request_resume(
+    serf_request_t *request);
+
+/**
+ * Allow serf to send @a request again without calling its setup callback
+ * again, e.g. when authentication is requested or when the connection is
+ * lost while the request is being written, or before a response arrived.
+ *
+ * Call this before the request is set up, or from its setup callback.
+ * After setup serf captures the request line, the headers and the body of
+ * the request bucket, which must be created with
+ * serf_request_bucket_request_create(). Bodies in file and mmap buckets
+ * are rewound by offset. Other bodies are journaled while they are
+ * written: up to @a memory_budget bytes in memory, the rest in a temporary
+ * file in @a temp_dir (or the default temporary directory when @a temp_dir
+ * is NULL). @a temp_dir must remain valid for the lifetime of the request.
+ *
+ * When the request can't be replayed, serf falls back to cancelling the
+ * request or calling its setup callback again, as it would without this
+ * call. Note that the acceptor and handler from the first setup call are
+ * used for all attempts, and that a replayed request might have been
+ * processed by the server already.
+ *
+ * @since New in 1.4.
+ */
+void serf_request_set_replayable(
+    serf_request_t *request,
+    apr_size_t memory_budget,
+    const char *temp_dir);
+
 /**
  * Configure proxy server settings, to be used by all connections associated
  * with the @a ctx serf context.
@@ -946,6 +1341,132 @@ serf_bucket_t *serf_request_bucket_request_create(
     serf_bucket_t *body,
     serf_bucket_alloc_t *allocator);
 
+/**
+ * Segmented download of a single resource, fetching parts of it in
+ * parallel over several connections using Range requests.
+ *
+ * @since New in 1.4.
+ */
+typedef struct serf_download_t serf_download_t;
+
+/**
+ * Callback receiving the data of a download in order. @a offset is the
+ * offset of @a data in the resource.
+ *
+ * Returning an error fails the download with that error.
+ *
+ * All temporary allocations should be made in @a pool.
+ *
+ * @since New in 1.4.
+ */
+typedef apr_status_t (*serf_download_data_t)(
+    serf_download_t *download,
+    void *baton,
+    apr_uint64_t offset,
+    const char *data,
+    apr_size_t len,
+    apr_pool_t *pool);
+
+/**
+ * Callback notifying the application that @a download completed with
+ * @a status. This is called exactly once for a started download, unless
+ * the pool of the download is destroyed before it completes.
+ *
+ * The pool of the download must not be destroyed from this callback.
+ *
+ * All temporary allocations should be made in @a pool.
+ *
+ * @since New in 1.4.
+ */
+typedef void (*serf_download_done_t)(
+    serf_download_t *download,
+    void *baton,
+    apr_status_t status,
+    apr_pool_t *pool);
+
+/**
+ * Create a download of @a url in the @a ctx serf context. The connections
+ * of the download are created with @a setup and @a setup_baton, as passed
+ * to serf_connection_create2().
+ *
+ * The download and its connections are allocated in @a pool. Destroying
+ * @a pool closes the connections and cancels the download.
+ *
+ * @since New in 1.4.
+ */
+apr_status_t serf_download_create(
+    serf_download_t **download,
+    serf_context_t *ctx,
+    const char *url,
+    serf_connection_setup_t setup,
+    void *setup_baton,
+    apr_pool_t *pool);
+
+/**
+ * Split @a download in at most @a max_segments segments of at least
+ * @a segment_size bytes, each fetched over its own connection. The first
+ * segment is requested before the size of the resource is known, with a
+ * Range of @a segment_size bytes. The defaults are 4 segments of 1 MB.
+ *
+ * @since New in 1.4.
+ */
+void serf_download_set_segments(
+    serf_download_t *download,
+    unsigned int max_segments,
+    apr_uint64_t segment_size);
+
+/**
+ * Write the data of @a download directly at its offset in @a file, as
+ * soon as it arrives for any segment. @a file must be opened for writing
+ * and must live at least as long as @a download.
+ *
+ * @since New in 1.4.
+ */
+void serf_download_set_file(
+    serf_download_t *download,
+    apr_file_t *file);
+
+/**
+ * Deliver the data of @a download in order to @a data_cb. Data of later
+ * segments that arrives early is saved until it can be delivered: up to
+ * @a memory_budget bytes per segment in memory, and the rest in a
+ * temporary file in @a temp_dir (or the default temporary directory when
+ * @a temp_dir is NULL).
+ *
+ * @since New in 1.4.
+ */
+void serf_download_set_ordered(
+    serf_download_t *download,
+    serf_download_data_t data_cb,
+    void *data_baton,
+    apr_size_t memory_budget,
+    const char *temp_dir);
+
+/**
+ * Start @a download. When it completes, @a done is called with
+ * @a done_baton.
+ *
+ * Servers that answer with 206 Partial Content, with a single range or as
+ * multipart/byteranges, are fetched in segments. When the server ignores
+ * the Range header and sends the complete resource, it is fetched over a
+ * single connection.
+ *
+ * @since New in 1.4.
+ */
+apr_status_t serf_download_start(
+    serf_download_t *download,
+    serf_download_done_t done,
+    void *done_baton);
+
+/**
+ * Returns the size of the resource fetched by @a download, or
+ * SERF_LENGTH_UNKNOWN when it is not known yet.
+ *
+ * @since New in 1.4.
+ */
+apr_uint64_t serf_download_get_size(
+    serf_download_t *download);
+
 /** @} */
 
 
@@ -1367,10 +1888,14 @@ typedef enum serf_config_categories_t {
 
 #define SERF_CONFIG_HOST_NAME       (SERF_CONFIG_PER_HOST | 0x000001)
 #define SERF_CONFIG_HOST_PORT       (SERF_CONFIG_PER_HOST | 0x000002)
+#define SERF_CONFIG_HOST_MAX_CONNS  (SERF_CONFIG_PER_HOST | 0x000003)
+#define SERF_CONFIG_HOST_PROTOCOL   (SERF_CONFIG_PER_HOST | 0x000004)
 #define SERF_CONFIG_CONN_LOCALIP    (SERF_CONFIG_PER_CONNECTION | 0x000001)
 #define SERF_CONFIG_CONN_REMOTEIP   (SERF_CONFIG_PER_CONNECTION | 0x000002)
 #define SERF_CONFIG_CONN_PIPELINING (SERF_CONFIG_PER_CONNECTION | 0x000003)
 #define SERF_CONFIG_CTX_LOGBATON    (SERF_CONFIG_PER_CONTEXT | 0x000001)
+#define SERF_CONFIG_CTX_TLS_RECORD_RAMP (SERF_CONFIG_PER_CONTEXT | 0x000002)
+#define SERF_CONFIG_CTX_TLS_RECORD_IDLE (SERF_CONFIG_PER_CONTEXT | 0x000003)
 
 /* Configuration values stored in the configuration store:
 
@@ -1378,11 +1903,24 @@ typedef enum serf_config_categories_t {
    --------     ---          ----------
    Context      logbaton     log_baton_t *
    Context      proxyauthn   apr_hash_t * (not implemented)
+   Context      tlsrecramp   const char * (decimal number of bytes)
+   Context      tlsrecidle   const char * (decimal number of milliseconds)
    Connection   localip      const char *
    Connection   remoteip     const char *
    Host         hostname     const char *
    Host         hostport     const char *
+   Host         maxconns     const char * (decimal number)
+   Host         protocol     const char * ("h2", "h2c" or "http/1.1")
    Host         authn        apr_hash_t * (not implemented)
+
+   TLS connections send small records, that each fit in a TCP segment, for
+   the first tlsrecramp bytes and again after being idle for tlsrecidle
+   milliseconds; full 16 KB records after that. The defaults are 0 bytes,
+   which always sends full records, and 1000 milliseconds; e.g. a tlsrecramp
+   of 1048576 enables small records. A tlsrecidle of 0 never goes back to
+   small records. Values that aren't a decimal number up to 2^31-1 are
+   ignored.
+   @since New in 1.4.
 */
 
 /**
@@ -1758,6 +2296,8 @@ void serf_debug__entered_loop(
     serf_bucket_alloc_t *allocator);
 void serf_debug__closed_conn(
     serf_bucket_alloc_t *allocator);
+void serf_debug__pushback(
+    serf_bucket_alloc_t *allocator);
 void serf_debug__bucket_destroy(
     const serf_bucket_t *bucket);
 void serf_debug__bucket_alloc_check(
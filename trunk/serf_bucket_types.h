@@ -83,6 +83,22 @@ void serf_bucket_request_set_root(
     serf_bucket_t *bucket,
     const char *root_url);
 
+/**
+ * Sends the headers in the headers bucket @a trailers as trailers after
+ * the body of request @a bucket. The request bucket takes ownership of
+ * @a trailers. Headers may be added to @a trailers until the body reached
+ * EOF, e.g. by a digest bucket (@see serf_bucket_digest_set_trailers).
+ *
+ * Trailers can only be sent when the body is sent with chunked encoding,
+ * so they are dropped when a Content-Length is set. The caller should
+ * announce the trailers in a Trailer header.
+ *
+ * @since New in 1.4.
+ */
+void serf_bucket_request_set_trailers(
+    serf_bucket_t *bucket,
+    serf_bucket_t *trailers);
+
 
 /* ==================================================================== */
 
@@ -524,6 +540,17 @@ serf_bucket_t *serf_bucket_chunk_create(
     serf_bucket_t *stream,
     serf_bucket_alloc_t *allocator);
 
+/**
+ * Sends the headers in the headers bucket @a trailers after the last chunk
+ * of chunk @a bucket, which takes ownership of @a trailers. Headers may be
+ * added to @a trailers until the wrapped stream reached EOF.
+ *
+ * @since New in 1.4.
+ */
+void serf_bucket_chunk_set_trailers(
+    serf_bucket_t *bucket,
+    serf_bucket_t *trailers);
+
 
 /* ==================================================================== */
 
@@ -645,6 +672,16 @@ void serf_ssl_server_cert_chain_callback_set(
     serf_ssl_server_cert_chain_cb_t cert_chain_callback,
     void *data);
 
+/**
+ * Return the name and version of the TLS library serf was built with,
+ * e.g. "OpenSSL 3.0.13 30 Jan 2024". The library is chosen when serf is
+ * built; besides OpenSSL, that can be one that provides its API:
+ * LibreSSL, BoringSSL or, less well tested, wolfSSL's compatibility layer.
+ *
+ * @since New in 1.4.
+ */
+const char *serf_ssl_backend_version(void);
+
 /**
  * Use the default root CA certificates as included with the OpenSSL library.
  */
@@ -785,6 +822,68 @@ apr_status_t serf_ssl_add_crl_from_file(serf_ssl_context_t *ssl_ctx,
 apr_status_t serf_ssl_check_crl(serf_ssl_context_t *ssl_ctx,
                                 int enabled);
 
+/**
+ * A store of certificate revocation lists, that are parsed once and then
+ * used to check the server certificates of the connections of any number
+ * of serf contexts, also in different threads. Each connection takes its
+ * own references to the CRLs, so a store can be kept for the life of the
+ * process while the lists in it are replaced.
+ *
+ * @since New in 1.4.
+ */
+typedef struct serf_ssl_crl_store_t serf_ssl_crl_store_t;
+
+/**
+ * Create a CRL store in @a pool. The CRLs are freed when @a pool is
+ * cleared, which must not happen while contexts still use the store.
+ *
+ * @since New in 1.4.
+ */
+apr_status_t serf_ssl_crl_store_create(
+    serf_ssl_crl_store_t **store,
+    apr_pool_t *pool);
+
+/**
+ * Load the CRLs in the .pem file at @a file_path into @a store. When the
+ * modification time or size of the file changes later, its CRLs are
+ * reloaded before a following certificate check, see
+ * serf_ssl_crl_store_set_check_interval(); the old ones stay in use if
+ * the file can't be parsed. Loading the same file again replaces its
+ * CRLs right away.
+ *
+ * Returns SERF_ERROR_SSL_CERT_FAILED when the file holds no CRL.
+ *
+ * Use @a scratch_pool for temporary allocations.
+ *
+ * @since New in 1.4.
+ */
+apr_status_t serf_ssl_crl_store_add_file(
+    serf_ssl_crl_store_t *store,
+    const char *file_path,
+    apr_pool_t *scratch_pool);
+
+/**
+ * Look for changes to the files of @a store at most once per @a interval,
+ * before a certificate check. The default is five seconds; with 0 the
+ * files are looked at before every check.
+ *
+ * @since New in 1.4.
+ */
+void serf_ssl_crl_store_set_check_interval(
+    serf_ssl_crl_store_t *store,
+    apr_interval_time_t interval);
+
+/**
+ * Check the server certificates of the connections of @a ctx against the
+ * CRLs in @a store, as with serf_ssl_check_crl(), in addition to the CRLs
+ * added to their SSL contexts.
+ *
+ * @since New in 1.4.
+ */
+void serf_context_set_ssl_crl_store(
+    serf_context_t *ctx,
+    serf_ssl_crl_store_t *store);
+
 /**
  * Enable or disable certificate status request (OCSP stapling) checking of all
  * server certificates.
@@ -805,6 +904,219 @@ apr_status_t serf_ssl_use_compression(
     serf_ssl_context_t *ssl_ctx,
     int enabled);
 
+/**
+ * Allow sending the first request on the connection of @a ssl_ctx as
+ * TLS 1.3 early data (0-RTT), when a session with the server is resumed
+ * that allows it. This saves a round trip on reconnects. Only a GET or
+ * HEAD request without a body is sent this way, as early data can be
+ * replayed by an attacker. When the server rejects the early data, the
+ * request is sent again after the handshake.
+ * @a enabled = 1 to allow early data, 0 to disallow it.
+ * Default = disallowed.
+ *
+ * Returns APR_ENOTIMPL when the TLS library doesn't support early data.
+ *
+ * @since New in 1.4.
+ */
+apr_status_t serf_ssl_allow_early_data(
+    serf_ssl_context_t *ssl_ctx,
+    int enabled);
+
+/**
+ * Allow the TLS library to run the handshake and record crypto of
+ * @a ssl_ctx as async jobs. With an async capable crypto engine or
+ * provider configured, the connection then waits for the crypto in the
+ * event loop of its context instead of blocking it, so other connections
+ * keep being served during expensive handshakes.
+ * @a enabled = 1 to allow async crypto, 0 to disallow it.
+ * Default = disallowed.
+ *
+ * Returns APR_ENOTIMPL when the TLS library doesn't support async jobs.
+ *
+ * @since New in 1.4.
+ */
+apr_status_t serf_ssl_allow_async_crypto(
+    serf_ssl_context_t *ssl_ctx,
+    int enabled);
+
+/**
+ * A cache of TLS sessions, that lets connections resume an earlier
+ * session with a server instead of doing a full handshake. A cache can
+ * be shared by any number of serf contexts, also in different threads.
+ *
+ * @since New in 1.4.
+ */
+typedef struct serf_ssl_session_cache_t serf_ssl_session_cache_t;
+
+/**
+ * Create a session cache in @a pool, that holds at most @a max_sessions
+ * sessions. The least recently used sessions are dropped first.
+ *
+ * @since New in 1.4.
+ */
+apr_status_t serf_ssl_session_cache_create(
+    serf_ssl_session_cache_t **cache,
+    apr_size_t max_sessions,
+    apr_pool_t *pool);
+
+/**
+ * Keep the sessions in @a cache in the file at @a path as well, so other
+ * processes can resume them. The sessions that are in the file and not
+ * expired are loaded right away. The file is locked while it is accessed.
+ * When the file holds twice as many sessions as the cache, it is rewritten
+ * with the sessions in @a cache.
+ *
+ * The file holds secrets that allow resuming sessions; it should only be
+ * readable by the user.
+ *
+ * Use @a scratch_pool for temporary allocations.
+ *
+ * @since New in 1.4.
+ */
+apr_status_t serf_ssl_session_cache_set_file(
+    serf_ssl_session_cache_t *cache,
+    const char *path,
+    apr_pool_t *scratch_pool);
+
+/**
+ * Use @a cache to store and resume the TLS sessions of all connections
+ * of @a ctx. Without a cache, sessions are only kept per context, one per
+ * host.
+ *
+ * Only sessions with a server certificate chain that passed all checks
+ * are stored in @a cache, as a resumed session isn't checked again.
+ * Sessions accepted by the application despite certificate failures are
+ * not shared.
+ *
+ * @since New in 1.4.
+ */
+void serf_context_set_ssl_session_cache(
+    serf_context_t *ctx,
+    serf_ssl_session_cache_t *cache);
+
+/**
+ * A cache of the outcome of server certificate checks, that lets
+ * connections skip verifying a certificate chain, and a stapled OCSP
+ * response, that were checked before. A cache can be shared by any number
+ * of serf contexts, also in different threads. Certificate chains checked
+ * by a context are only accepted from the cache by contexts that trust the
+ * same certificates.
+ *
+ * @since New in 1.4.
+ */
+typedef struct serf_ssl_verify_cache_t serf_ssl_verify_cache_t;
+
+/**
+ * Create a verification cache in @a pool, that holds at most
+ * @a max_entries outcomes. The least recently used outcomes are dropped
+ * first.
+ *
+ * A verified certificate chain is kept until its first certificate
+ * expires, and at most @a max_age, or one hour when @a max_age is 0. A
+ * stapled OCSP response is kept until the time its responder promised an
+ * update.
+ *
+ * Outcomes are only reused by connections that trust the same
+ * certificates, with the same verification parameters, callbacks and
+ * callback baton.
+ *
+ * @since New in 1.4.
+ */
+apr_status_t serf_ssl_verify_cache_create(
+    serf_ssl_verify_cache_t **cache,
+    apr_size_t max_entries,
+    apr_interval_time_t max_age,
+    apr_pool_t *pool);
+
+/**
+ * Use @a cache for the connections of @a ctx.
+ *
+ * A certificate chain is only cached once it was accepted, together with
+ * the failures found in it and the host it was presented for. When the
+ * same server presents it again to a context with the same certificate
+ * callbacks, the connection is accepted without calling those callbacks.
+ *
+ * @since New in 1.4.
+ */
+void serf_context_set_ssl_verify_cache(
+    serf_context_t *ctx,
+    serf_ssl_verify_cache_t *cache);
+
+/**
+ * When @a enabled is non-zero, ask the OCSP responder named in the server
+ * certificate of each TLS connection of @a ctx whether the certificate was
+ * revoked, once the handshake verified it. Requests are only written to
+ * the connection after the answer arrived.
+ *
+ * The responders are queried over HTTP connections of @a ctx, while the
+ * context runs. Connections that need the status of the same certificate
+ * share a single query, and the answers are kept until the responder
+ * promised an update.
+ *
+ * Failures found in the answer, like @c SERF_SSL_CERT_REVOKED or
+ * @c SERF_SSL_OCSP_RESPONDER_TRYLATER, are passed to the server
+ * certificate callback without a certificate, like those of stapled
+ * responses. Certificates that name no HTTP responder, and responders
+ * that can't be reached, are not reported.
+ *
+ * @since New in 1.4.
+ */
+apr_status_t serf_context_check_cert_status_online(
+    serf_context_t *ctx,
+    int enabled);
+
+/**
+ * A cache of client certificates and their private keys, as loaded from
+ * the PKCS#12 files the client certificate provider names. Connections
+ * that use a cached file skip reading and decrypting it, and don't ask
+ * for its password. A file is loaded again once its modification time or
+ * size changed. A cache can be shared by any number of serf contexts,
+ * also in different threads.
+ *
+ * The cache holds the decrypted private keys, so it should only be shared
+ * by contexts that may all use them.
+ *
+ * @since New in 1.4.
+ */
+typedef struct serf_ssl_client_cert_cache_t serf_ssl_client_cert_cache_t;
+
+/**
+ * Create a client certificate cache in @a pool. The certificates and keys
+ * are freed when @a pool is cleared.
+ *
+ * @since New in 1.4.
+ */
+apr_status_t serf_ssl_client_cert_cache_create(
+    serf_ssl_client_cert_cache_t **cache,
+    apr_pool_t *pool);
+
+/**
+ * Load the PKCS#12 file at @a path into @a cache, decrypting it with
+ * @a password, which can be NULL. Connections that are asked for a client
+ * certificate and whose provider names @a path then use it right away.
+ *
+ * Returns SERF_ERROR_SSL_CERT_FAILED when the file doesn't hold a
+ * certificate and key, or @a password doesn't decrypt it.
+ *
+ * Use @a scratch_pool for temporary allocations.
+ *
+ * @since New in 1.4.
+ */
+apr_status_t serf_ssl_client_cert_cache_load(
+    serf_ssl_client_cert_cache_t *cache,
+    const char *path,
+    const char *password,
+    apr_pool_t *scratch_pool);
+
+/**
+ * Use @a cache for the client certificates of the connections of @a ctx.
+ *
+ * @since New in 1.4.
+ */
+void serf_context_set_ssl_client_cert_cache(
+    serf_context_t *ctx,
+    serf_ssl_client_cert_cache_t *cache);
+
 serf_bucket_t *serf_bucket_ssl_encrypt_create(
     serf_bucket_t *stream,
     serf_ssl_context_t *ssl_context,
@@ -1063,6 +1375,185 @@ void serf_bucket_split_create(serf_bucket_t **head,
                               apr_size_t min_chunk_size,
                               apr_size_t max_chunk_size);
 
+/* ==================================================================== */
+
+/**
+ * Content saver bucket, allowing an application to apply pushback on
+ * a response (@see serf_request_pushback).
+ *
+ * Reading from the saver bucket first returns all data that was saved by
+ * serf_bucket_saver_drain() and then continues reading from @a stream.
+ *
+ * Up to @a memory_budget bytes of saved data are kept in memory. Anything
+ * beyond that is stored in a temporary file in @a temp_dir, or in the
+ * default temporary directory when @a temp_dir is NULL. @a temp_dir must
+ * remain valid for the lifetime of the bucket.
+ *
+ * Destroying the saver bucket destroys @a stream.
+ *
+ * @since New in 1.4.
+ */
+extern const serf_bucket_type_t serf_bucket_type_saver;
+#define SERF_BUCKET_IS_SAVER(b) SERF_BUCKET_CHECK((b), saver)
+
+serf_bucket_t *serf_bucket_saver_create(
+    serf_bucket_t *stream,
+    apr_size_t memory_budget,
+    const char *temp_dir,
+    serf_bucket_alloc_t *allocator);
+
+/**
+ * Reads everything that is currently available from the stream wrapped by
+ * the saver @a bucket and saves it, to be returned by later reads.
+ *
+ * Returns APR_EAGAIN when no more data is available at this time, APR_EOF
+ * when the wrapped stream was read completely, or an error.
+ *
+ * @since New in 1.4.
+ */
+apr_status_t serf_bucket_saver_drain(
+    serf_bucket_t *bucket);
+
+/**
+ * Returns the number of bytes that are currently saved by the saver
+ * @a bucket, both in memory and on disk.
+ *
+ * @since New in 1.4.
+ */
+apr_uint64_t serf_bucket_saver_get_saved(
+    serf_bucket_t *bucket);
+
+/* ==================================================================== */
+
+/**
+ * Replay bucket, making the data of @a stream available more than once
+ * (@see serf_request_set_replayable).
+ *
+ * Reads pass through to @a stream, while serf_bucket_replay_rewind() can
+ * be used to return to the start of the data. When @a stream is a file or
+ * mmap bucket it is rewound by offset. Any other stream is journaled while
+ * it is read: up to @a memory_budget bytes in memory and the rest in a
+ * temporary file in @a temp_dir, or in the default temporary directory
+ * when @a temp_dir is NULL. @a temp_dir must remain valid for the lifetime
+ * of the bucket.
+ *
+ * Destroying the replay bucket destroys @a stream.
+ *
+ * @since New in 1.4.
+ */
+extern const serf_bucket_type_t serf_bucket_type_replay;
+#define SERF_BUCKET_IS_REPLAY(b) SERF_BUCKET_CHECK((b), replay)
+
+serf_bucket_t *serf_bucket_replay_create(
+    serf_bucket_t *stream,
+    apr_size_t memory_budget,
+    const char *temp_dir,
+    serf_bucket_alloc_t *allocator);
+
+/**
+ * Makes the next read from the replay @a bucket start again at the start
+ * of its data.
+ *
+ * Returns APR_ENOTIMPL when the data can't be replayed, e.g. because the
+ * journal couldn't be written.
+ *
+ * @since New in 1.4.
+ */
+apr_status_t serf_bucket_replay_rewind(
+    serf_bucket_t *bucket);
+
+/* ==================================================================== */
+
+/**
+ * Digest bucket, calculating one or more digests of the data of @a stream
+ * while it is read.
+ *
+ * @a algorithms is a combination of SERF_DIGEST_* flags. The digests are
+ * available via serf_bucket_digest_get() once the bucket returned EOF.
+ *
+ * Destroying the digest bucket destroys @a stream.
+ *
+ * @since New in 1.4.
+ */
+#define SERF_DIGEST_MD5     0x01
+#define SERF_DIGEST_SHA1    0x02
+#define SERF_DIGEST_SHA256  0x04
+
+extern const serf_bucket_type_t serf_bucket_type_digest;
+#define SERF_BUCKET_IS_DIGEST(b) SERF_BUCKET_CHECK((b), digest)
+
+serf_bucket_t *serf_bucket_digest_create(
+    serf_bucket_t *stream,
+    int algorithms,
+    serf_bucket_alloc_t *allocator);
+
+/**
+ * Returns in @a digest and @a digest_len the binary digest calculated by
+ * the digest @a bucket for @a algorithm, a single SERF_DIGEST_* value.
+ *
+ * Returns APR_EINCOMPLETE when the bucket didn't return EOF yet, and
+ * APR_EINVAL when @a algorithm wasn't requested when creating the bucket.
+ *
+ * @since New in 1.4.
+ */
+apr_status_t serf_bucket_digest_get(
+    serf_bucket_t *bucket,
+    int algorithm,
+    const unsigned char **digest,
+    apr_size_t *digest_len);
+
+/**
+ * When the digest @a bucket reaches EOF, add the digests as a Digest
+ * header (RFC 3230) to the headers bucket @a trailers, and also as a
+ * Content-MD5 header when MD5 is calculated. @a trailers is not owned by
+ * the digest bucket.
+ *
+ * @see serf_bucket_request_set_trailers
+ * @since New in 1.4.
+ */
+void serf_bucket_digest_set_trailers(
+    serf_bucket_t *bucket,
+    serf_bucket_t *trailers);
+
+/* ==================================================================== */
+
+/**
+ * Byteranges bucket, returning the data of the parts of a
+ * multipart/byteranges body (RFC 7233, Appendix A) read from @a stream,
+ * using @a boundary as found in the Content-Type of the response.
+ *
+ * The data of all parts is returned back to back, without the boundaries
+ * and part headers. Use serf_bucket_byteranges_get_range() to find where
+ * the data that is currently returned belongs.
+ *
+ * Destroying the byteranges bucket destroys @a stream.
+ *
+ * @since New in 1.4.
+ */
+extern const serf_bucket_type_t serf_bucket_type_byteranges;
+#define SERF_BUCKET_IS_BYTERANGES(b) SERF_BUCKET_CHECK((b), byteranges)
+
+serf_bucket_t *serf_bucket_byteranges_create(
+    serf_bucket_t *stream,
+    const char *boundary,
+    serf_bucket_alloc_t *allocator);
+
+/**
+ * Returns the range of the part that the byteranges @a bucket is reading,
+ * as found in its Content-Range header. @a start and @a end are both
+ * inclusive. @a total is SERF_LENGTH_UNKNOWN when the server didn't
+ * report the complete length.
+ *
+ * Returns APR_EAGAIN when the headers of the first part were not read yet.
+ *
+ * @since New in 1.4.
+ */
+apr_status_t serf_bucket_byteranges_get_range(
+    serf_bucket_t *bucket,
+    apr_uint64_t *start,
+    apr_uint64_t *end,
+    apr_uint64_t *total);
+
 
 /**
  * Check if Serf bucket functions support Brotli (RFC 7932) format.
@@ -88,6 +88,7 @@ typedef int serf__bool_t; /* Not _Bool */
 #define SERF_IO_CLIENT (1)
 #define SERF_IO_CONN (2)
 #define SERF_IO_LISTENER (3)
+#define SERF_IO_ASYNC (4)
 
 /*** Logging facilities ***/
 
@@ -133,6 +134,7 @@ typedef int serf__bool_t; /* Not _Bool */
 #endif
 
 typedef struct serf__authn_scheme_t serf__authn_scheme_t;
+typedef struct serf__ocsp_fetcher_t serf__ocsp_fetcher_t;
 
 typedef struct serf_io_baton_t {
     int type;
@@ -181,6 +183,10 @@ typedef struct serf_pump_t
     /* Set to true when ostream_tail was read to EOF */
     bool hit_eof;
 
+    /* Statistics: number of writev() calls and bytes written */
+    apr_uint64_t write_calls;
+    apr_uint64_t bytes_written;
+
     apr_pool_t *pool;
 } serf_pump_t;
 
@@ -204,6 +210,10 @@ typedef enum serf_request_writing_t {
 struct serf_request_t {
     serf_connection_t *conn;
 
+    /* The connection the request was created for. Differs from CONN while
+       the request is served by another connection to the same server */
+    serf_connection_t *origin;
+
     apr_pool_t *respool;
     serf_bucket_alloc_t *allocator;
 
@@ -234,6 +244,32 @@ struct serf_request_t {
     serf_request_t *depends_first;   /* First dependency on us */
     apr_uint16_t dep_priority;
 
+    /* Application pushback. Set while the response is paused by the
+       application. See serf_request_pushback() */
+    serf_bucket_t *pushback_bkt;
+    apr_interval_time_t pushback_interval;
+    apr_time_t pushback_drain_at;  /* Next keepalive drain */
+    bool pushback_resumed;         /* Deliver saved data to the handler */
+
+    /* Replay support. When enabled the request line, headers and body are
+       captured after setup, so the request can be sent again without
+       calling setup again. See serf_request_set_replayable() */
+    bool replay_enabled;
+    apr_size_t replay_budget;
+    const char *replay_temp_dir;
+    const char *replay_method;
+    const char *replay_uri;
+    apr_int64_t replay_len;          /* Content-Length, or -1 */
+    serf_bucket_t *replay_headers;   /* Copy of the headers. NULL if not
+                                        captured */
+    serf_bucket_t *replay_body;      /* REPLAY bucket, or NULL */
+
+    /* The discard request still reading the response of an earlier attempt,
+       which borrows our RESPOOL and ALLOCATOR. And for that discard request
+       the request that owns them. */
+    struct serf_request_t *replay_discard;
+    struct serf_request_t *replay_owner;
+
     /* This baton is currently only used for digest authentication, which
        needs access to the uri of the request in the response handler.
        If serf_request_t is replaced by a serf_http_request_t in the future,
@@ -362,6 +398,111 @@ apr_status_t serf__config_store_get_ssl_session(serf_config_t *config,
                                                 const unsigned char **session,
                                                 apr_size_t *session_len);
 
+/* From ssl_buckets.c */
+
+/* Called when the server answered the early data, with RESEND set when
+   the data was rejected and must be sent again */
+typedef void (*serf__ssl_early_data_cb_t)(void *baton, bool resend);
+
+/* Asks SSL_CTX to send the data that is written next, up to the first
+   time the stream has nothing more, as TLS 1.3 early data. Returns whether
+   it will, after which CALLBACK is called with BATON once */
+bool serf__ssl_early_data_offer(serf_ssl_context_t *ssl_ctx,
+                                serf__ssl_early_data_cb_t callback,
+                                void *baton);
+
+/* Called when a connection that was held back can write again */
+typedef void (*serf__ssl_wakeup_t)(void *baton);
+
+/* Makes SSL_CTX ask FETCHER for the status of the server certificate once
+   it is verified, holding back application data until the answer arrives.
+   WAKEUP is then called with BATON */
+void serf__ssl_ocsp_fetch_enable(serf_ssl_context_t *ssl_ctx,
+                                 serf__ocsp_fetcher_t *fetcher,
+                                 serf__ssl_wakeup_t wakeup,
+                                 void *baton);
+
+/* Most file descriptors an async crypto job signals */
+#define SERF__SSL_ASYNC_MAX_FDS 4
+
+/* Called when the crypto of a TLS connection runs as an async job, which
+   signals one of the NUM_FDS file descriptors in FDS when it can continue.
+   Without file descriptors the crypto can be retried right away. Async
+   crypto is not available on Windows, so these are always POSIX fds */
+typedef void (*serf__ssl_async_wait_t)(void *baton,
+                                       const int *fds,
+                                       int num_fds);
+
+/* Makes SSL_CTX call WAIT with BATON when its crypto has to wait, if
+   async crypto is allowed on it */
+void serf__ssl_async_setup(serf_ssl_context_t *ssl_ctx,
+                           serf__ssl_async_wait_t wait,
+                           void *baton);
+
+/* From ssl_session_cache.c */
+
+/* Returns the session cache configured for the context of CONFIG, or NULL */
+serf_ssl_session_cache_t *
+serf__ssl_session_cache_from_config(serf_config_t *config);
+
+/* Stores SESSION of HOST in CACHE until EXPIRES. A SINGLE_USE session is
+   removed from the cache when it is looked up */
+void serf__ssl_session_cache_store(serf_ssl_session_cache_t *cache,
+                                   const char *host,
+                                   const unsigned char *session,
+                                   apr_size_t session_len,
+                                   apr_time_t expires,
+                                   bool single_use);
+
+/* Copies the most recent session of HOST in CACHE to *SESSION, allocated
+   in ALLOCATOR. Returns APR_ENOENT when there is none */
+apr_status_t serf__ssl_session_cache_lookup(unsigned char **session,
+                                            apr_size_t *session_len,
+                                            serf_ssl_session_cache_t *cache,
+                                            const char *host,
+                                            serf_bucket_alloc_t *allocator);
+
+/* From ssl_verify_cache.c */
+
+/* Size of the keys of the verification cache: two SHA-256 digests */
+#define SERF__SSL_VERIFY_KEY_SIZE 64
+
+typedef enum serf__ssl_verify_kind_t {
+    SERF__SSL_VERIFY_CHAIN,  /* Verification of a certificate chain */
+    SERF__SSL_VERIFY_OCSP,   /* Check of a stapled OCSP response */
+    SERF__SSL_VERIFY_OCSP_FETCH  /* Check with the OCSP responder */
+} serf__ssl_verify_kind_t;
+
+/* Returns the verification cache configured for the context of CONFIG,
+   or NULL */
+serf_ssl_verify_cache_t *
+serf__ssl_verify_cache_from_config(serf_config_t *config);
+
+/* Stores the FAILURES found by the check of KIND with KEY in CACHE until
+   EXPIRES, or the maximum age of the cache for certificate chains */
+void serf__ssl_verify_cache_store(serf_ssl_verify_cache_t *cache,
+                                  serf__ssl_verify_kind_t kind,
+                                  const unsigned char *key,
+                                  int failures,
+                                  apr_time_t expires);
+
+/* Sets *FAILURES to the outcome of the check of KIND with KEY in CACHE.
+   Returns false when it isn't cached, or expired */
+bool serf__ssl_verify_cache_lookup(int *failures,
+                                   serf_ssl_verify_cache_t *cache,
+                                   serf__ssl_verify_kind_t kind,
+                                   const unsigned char *key);
+
+/* Stores the host names the verified server certificate of a connection is
+   valid for */
+apr_status_t serf__config_store_set_peer_names(serf_config_t *config,
+                                               const apr_array_header_t *names);
+
+/* Gets the names stored by serf__config_store_set_peer_names() as a list of
+   '\0' terminated strings, ending with an empty string. Returns NULL when
+   no verified certificate is known */
+const char *serf__config_store_get_peer_names(serf_config_t *config);
+
 
 /* Cleans up all connection specific configuration values */
 apr_status_t
@@ -423,6 +564,18 @@ struct serf_context_t {
     serf_credentials_callback_t cred_cb;
 
     serf_config_t *config;
+
+    /* Memory budget over all connections. See serf_context_set_memory_budget()
+       and check_memory_budget() in context.c */
+    bool mem_budget_enabled; /* Set while any budget is configured */
+    apr_size_t mem_high_watermark;
+    apr_size_t mem_low_watermark;
+    apr_size_t mem_used;
+    apr_size_t mem_peak;
+    apr_uint64_t mem_throttle_events;
+
+    /* Set by serf_context_check_cert_status_online() */
+    serf__ocsp_fetcher_t *ocsp_fetcher;
 };
 
 struct serf_listener_t {
@@ -458,6 +611,7 @@ struct serf_incoming_t {
     void *closed_baton;
 
     serf_connection_framing_type_t framing_type;
+    apr_uint32_t http2_max_streams; /* 0 for no limit */
 
     bool wait_for_connect;
 
@@ -596,6 +750,74 @@ struct serf_connection_t {
     void (*perform_prioritize_request)(serf_request_t *request,
                                        bool exclusive);
 
+    /* Called when the memory budget starts or stops throttling the
+       connection. When NULL the connection is just not polled for reading
+       while throttled. */
+    void (*perform_throttle)(serf_connection_t *conn,
+                             bool throttled);
+
+    /* Memory budget. MEM_USED is updated by the context before every run */
+    apr_size_t mem_high_watermark;
+    apr_size_t mem_low_watermark;
+    apr_size_t mem_used;
+    bool mem_over_budget;    /* Above own budget */
+    bool mem_ctx_throttled;  /* Selected by the context budget */
+    bool mem_throttled;      /* Either of the above */
+
+    /* Maximum HTTP/2 receive window for auto-tuning, 0 when disabled */
+    apr_uint32_t http2_window_max;
+
+    /* Spillover of requests to additional connections. SPILL_PRIMARY is
+       set on the additional connections, which are linked via SPILL_NEXT
+       from the connection they were spawned for */
+    serf_connection_spawn_t spill_spawn;
+    void *spill_spawn_baton;
+    serf_connection_t *spill_primary;
+    serf_connection_t *spill_next;
+    apr_time_t spill_idle_since;  /* 0 while the connection has requests */
+
+    /* Whether requests may be sent over another HTTP/2 connection whose
+       certificate covers this host (RFC 7540, section 9.1.1) */
+    bool coalesce;
+
+    /* Host names that answered 421 Misdirected Request over this
+       connection, which must not be coalesced onto it again */
+    apr_hash_t *misdirected;
+
+    /* HTTP/2 keepalive PINGs, disabled when KEEPALIVE_INTERVAL is 0 */
+    apr_interval_time_t keepalive_interval;
+    apr_interval_time_t keepalive_timeout;
+
+    /* Acceptance of HTTP/2 server pushes. Pushes are refused when
+       PUSH_MAX_SIZE is 0 */
+    apr_size_t push_max_size;
+    serf_push_accept_t push_accept;
+    void *push_accept_baton;
+
+    /* HTTP/2 over plain TCP (h2c.c). H2C_TRIED is set once the first
+       request on the socket was considered for an upgrade offer, and
+       H2C_REQUEST is that request until the server answered it */
+    bool h2c_upgrade;
+    bool h2c_tried;
+    bool h2c_from_cache;          /* HTTP/2 started by prior knowledge */
+    serf_request_t *h2c_request;
+    serf_linebuf_t *h2c_linebuf;  /* Reading the headers of a 101 */
+
+    /* TLS 1.3 early data (early_data.c). EARLY_REQUEST is the request
+       sent as early data until the server accepted or rejected it */
+    serf_ssl_context_t *early_ssl;
+    bool early_tried;
+    bool early_rejected;
+    serf_request_t *early_request;
+
+    /* Async TLS crypto (async_crypto.c): the file descriptors of the job
+       the connection waits for, polled with ASYNC_IO. Their files live in
+       ASYNC_POOL, which is cleared for each wait. */
+    serf_io_baton_t async_io;
+    apr_pollfd_t async_pfds[SERF__SSL_ASYNC_MAX_FDS];
+    int async_nfds;
+    apr_pool_t *async_pool;
+
     /* Configuration shared with buckets and authn plugins */
     serf_config_t *config;
 };
@@ -606,6 +828,16 @@ void serf__connection_pre_cleanup(serf_connection_t *);
 
 /*** Internal bucket functions ***/
 
+/* Returns the number of bytes currently allocated from ALLOCATOR via
+   serf_bucket_mem_alloc(), including the allocator's own overhead */
+apr_size_t serf__bucket_allocator_get_used(
+    const serf_bucket_alloc_t *allocator);
+
+/* Returns the number of blocks currently allocated from ALLOCATOR via
+   serf_bucket_mem_alloc() */
+apr_uint32_t serf__bucket_allocator_get_count(
+    const serf_bucket_alloc_t *allocator);
+
 /* Copies all data contained in vecs to *data, optionally telling how much was
    copied */
 void serf__copy_iovec(char *data,
@@ -639,6 +871,24 @@ void serf__bucket_response_set_error_on_eof(serf_bucket_t *bucket,
 void serf__bucket_headers_remove(serf_bucket_t *headers_bucket,
                                  const char *header);
 
+/* How serf__bucket_headers_setm() stores a header name or value */
+#define SERF__HEADER_REF   0 /* Referenced; must outlive the bucket */
+#define SERF__HEADER_COPY  1 /* Copied into the bucket's allocator */
+#define SERF__HEADER_OWN   2 /* Allocated in the bucket's allocator and freed
+                                with the bucket */
+
+/**
+ * Like serf_bucket_headers_setx(), but the header and value can also be
+ * handed over to the bucket, as specified by HEADER_MODE and VALUE_MODE.
+ */
+void serf__bucket_headers_setm(serf_bucket_t *headers_bucket,
+                               const char *header,
+                               apr_size_t header_size,
+                               int header_mode,
+                               const char *value,
+                               apr_size_t value_size,
+                               int value_mode);
+
 /**
  * Read raw information stored in request REQUEST_BUCKET. All output values
  * are directly copied from the internal state.
@@ -653,6 +903,35 @@ void serf__bucket_request_read(serf_bucket_t *request_bucket,
 serf_bucket_t *serf_bucket_request_get_body(
   serf_bucket_t *bucket);
 
+/**
+ * Replace the body of request REQUEST_BUCKET by BODY, without destroying
+ * the old body. Only valid before the request bucket is read.
+ */
+void serf__bucket_request_set_body(serf_bucket_t *request_bucket,
+                                   serf_bucket_t *body);
+
+/**
+ * Return the Content-Length set on request REQUEST_BUCKET with
+ * serf_bucket_request_set_CL(), or -1 if none was set.
+ */
+apr_int64_t serf__bucket_request_get_CL(serf_bucket_t *request_bucket);
+
+/* Rewind file bucket BUCKET to the file offset at which it was created.
+   Returns APR_ENOTIMPL if the file can't seek */
+apr_status_t serf__bucket_file_rewind(serf_bucket_t *bucket);
+
+/* Rewind mmap bucket BUCKET to the start of the mapping */
+apr_status_t serf__bucket_mmap_rewind(serf_bucket_t *bucket);
+
+/* Parse the Content-Range header VALUE ("bytes START-END/TOTAL"). For an
+   unsatisfied range ("bytes * /TOTAL") START and END are set to
+   SERF_LENGTH_UNKNOWN, as is TOTAL when it is "*". Returns
+   SERF_ERROR_BAD_HTTP_RESPONSE when VALUE can't be parsed. */
+apr_status_t serf__parse_content_range(const char *value,
+                                       apr_uint64_t *start,
+                                       apr_uint64_t *end,
+                                       apr_uint64_t *total);
+
 
 /*** Authentication handler declarations ***/
 
@@ -700,6 +979,79 @@ void serf__incoming_request_destroy(serf_incoming_request_t *request);
 
 /* from outgoing.c */
 apr_status_t serf__open_connections(serf_context_t *ctx);
+apr_status_t serf__process_pushback(serf_context_t *ctx);
+apr_status_t serf__process_keepalive(serf_context_t *ctx);
+
+/* from spillover.c */
+apr_status_t serf__process_spillover(serf_context_t *ctx);
+void serf__spillover_close(serf_connection_t *conn);
+
+/* from coalesce.c */
+apr_status_t serf__process_coalescing(serf_context_t *ctx);
+void serf__coalesce_close(serf_connection_t *conn);
+apr_status_t serf__coalesce_handle_response(bool *consumed_response,
+                                            serf_request_t *request);
+bool serf__coalesce_name_matches(const char *pattern, const char *hostname);
+
+/* from h2c.c */
+void serf__h2c_connected(serf_connection_t *conn);
+void serf__h2c_offer(serf_connection_t *conn, serf_request_t *request);
+apr_status_t serf__h2c_handle_response(bool *upgraded,
+                                       serf_request_t *request);
+void serf__h2c_reset(serf_connection_t *conn);
+void serf__h2c_record_protocol(serf_connection_t *conn,
+                               const char *protocol);
+void serf__h2c_forget_protocol(serf_connection_t *conn);
+
+/* from async_crypto.c */
+void serf__async_crypto_setup(serf_connection_t *conn,
+                              serf_bucket_t *ostream);
+apr_status_t serf__async_crypto_ready(serf_connection_t *conn);
+void serf__async_crypto_reset(serf_connection_t *conn);
+
+/* from early_data.c */
+void serf__early_data_setup(serf_connection_t *conn, serf_bucket_t *ostream);
+void serf__early_data_offer(serf_connection_t *conn,
+                            serf_request_t *request);
+apr_status_t serf__early_data_handle_response(bool *resent,
+                                              serf_request_t *request);
+void serf__early_data_reset(serf_connection_t *conn);
+
+/* from ocsp_fetch.c */
+typedef struct serf__ocsp_waiter_t serf__ocsp_waiter_t;
+
+/* Called with the DER encoded RESPONSE of LEN bytes, or with the STATUS
+   why there is none */
+typedef void (*serf__ocsp_fetched_t)(void *baton,
+                                     apr_status_t status,
+                                     const void *response,
+                                     apr_size_t len);
+
+void serf__ocsp_fetch_setup(serf_connection_t *conn, serf_bucket_t *ostream);
+
+/* Sends the DER encoded REQUEST of REQUEST_LEN bytes to the OCSP responder
+   at the URL RESPONDER, unless the same request is already on its way.
+   CALLBACK is called with BATON once the answer arrives, unless *WAITER is
+   passed to serf__ocsp_fetch_cancel() before */
+apr_status_t serf__ocsp_fetch(serf__ocsp_waiter_t **waiter,
+                              serf__ocsp_fetcher_t *fetcher,
+                              const char *responder,
+                              const void *request,
+                              apr_size_t request_len,
+                              serf__ocsp_fetched_t callback,
+                              void *baton);
+void serf__ocsp_fetch_cancel(serf__ocsp_fetcher_t *fetcher,
+                             serf__ocsp_waiter_t *waiter);
+
+/* Fails the queries waiting for CONN when it is a connection to an OCSP
+   responder that failed with STATUS, and closes it. Returns STATUS for
+   other connections */
+apr_status_t serf__ocsp_fetch_conn_failed(serf_connection_t *conn,
+                                          apr_status_t status);
+
+/* Returns the cache of the outcomes of the checks of FETCHER */
+serf_ssl_verify_cache_t *
+serf__ocsp_fetch_results(serf__ocsp_fetcher_t *fetcher);
 apr_status_t serf__process_connection(serf_connection_t *conn,
                                        apr_int16_t events);
 apr_status_t serf__conn_update_pollset(serf_connection_t *conn);
@@ -739,6 +1091,32 @@ serf_bucket_t *serf__bucket_log_wrapper_create(serf_bucket_t *wrapped,
 void serf__http2_protocol_init(serf_connection_t *conn);
 void serf__http2_protocol_init_server(serf_incoming_t *client);
 
+/* From http2_protocol.c: Implements serf_connection_get_http2_stats() */
+void serf__http2_protocol_get_stats(void *protocol_baton,
+                                    apr_uint32_t *recv_window,
+                                    apr_uint32_t *send_window,
+                                    apr_uint64_t *bdp_estimate,
+                                    apr_interval_time_t *rtt);
+
+/* From http2_protocol.c: Continues REQUEST, which was sent as HTTP/1.1
+   with an accepted upgrade offer, as stream 1 of the new HTTP/2 session */
+void serf__http2_protocol_adopt_request(void *protocol_baton,
+                                        serf_request_t *request);
+
+/* From http2_protocol.c: Returns the number of concurrent streams the
+   server allows on the HTTP/2 session */
+apr_uint32_t serf__http2_protocol_max_streams(void *protocol_baton);
+
+/* From http2_protocol.c: Implements serf_connection_get_rtt() */
+void serf__http2_protocol_get_rtt(void *protocol_baton,
+                                  apr_interval_time_t *srtt,
+                                  apr_interval_time_t *rttvar);
+
+/* From http2_protocol.c: Sends a PING when nothing was received for the
+   keepalive interval. Returns APR_TIMEUP when the peer didn't answer */
+apr_status_t serf__http2_protocol_keepalive(void *protocol_baton,
+                                            apr_time_t now);
+
 /* From fcgi_protocol.c: Initializes http2 state on connection */
 void serf__fcgi_protocol_init(serf_connection_t *conn);
 void serf__fcgi_protocol_init_server(serf_incoming_t *client);
@@ -774,6 +1152,10 @@ apr_status_t serf__cancel_request(serf_request_t *request,
                                   int notify_request);
 unsigned int serf__req_list_length(serf_request_t *req);
 apr_status_t serf__setup_request(serf_request_t *request);
+/* Prepare a request that was (partially) written for sending again, by
+   rebuilding it from the data captured at setup. Returns APR_ENOTIMPL when
+   the request isn't replayable, in which case nothing is changed. */
+apr_status_t serf__request_replay(serf_request_t *request);
 void serf__link_requests(serf_request_t **list, serf_request_t **tail,
                          serf_request_t *request);
 
@@ -0,0 +1,143 @@
+/* ====================================================================
+ *    Licensed to the Apache Software Foundation (ASF) under one
+ *    or more contributor license agreements.  See the NOTICE file
+ *    distributed with this work for additional information
+ *    regarding copyright ownership.  The ASF licenses this file
+ *    to you under the Apache License, Version 2.0 (the
+ *    "License"); you may not use this file except in compliance
+ *    with the License.  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing,
+ *    software distributed under the License is distributed on an
+ *    "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ *    KIND, either express or implied.  See the License for the
+ *    specific language governing permissions and limitations
+ *    under the License.
+ * ====================================================================
+ */
+
+#include <apr_pools.h>
+#include <apr_poll.h>
+#include <apr_portable.h>
+
+#include "serf.h"
+#include "serf_bucket_util.h"
+
+#include "serf_private.h"
+
+/* Async TLS crypto for outgoing connections.
+
+   When the application allows it on the TLS context, OpenSSL runs the
+   handshake and record crypto as async jobs, which an async capable
+   engine or provider completes on its own hardware or threads. The SSL
+   call returns early, and the job signals a file descriptor once it can
+   be continued. The connection polls these descriptors along with the
+   sockets of the context, so the event loop keeps serving the other
+   connections while the crypto runs. */
+
+/* Removes the job descriptors of CONN from the pollset */
+static void unwatch_fds(serf_connection_t *conn)
+{
+    serf_context_t *ctx = conn->ctx;
+    int i;
+
+    for (i = 0; i < conn->async_nfds; i++)
+        ctx->pollset_rm(ctx->pollset_baton, &conn->async_pfds[i],
+                        &conn->async_io);
+
+    conn->async_nfds = 0;
+}
+
+/* Implements serf__ssl_async_wait_t */
+static void async_wait(void *baton, const int *fds, int num_fds)
+{
+    serf_connection_t *conn = baton;
+    serf_context_t *ctx = conn->ctx;
+    int i;
+
+    unwatch_fds(conn);
+
+#ifndef WIN32
+    /* Async jobs aren't supported on Windows, where a descriptor isn't
+       an apr_os_file_t */
+
+    /* The files of the previous wait are no longer polled */
+    if (conn->async_pool)
+        apr_pool_clear(conn->async_pool);
+    else if (num_fds)
+        apr_pool_create(&conn->async_pool, conn->pool);
+
+    for (i = 0; i < num_fds; i++) {
+        apr_pollfd_t *pfd = &conn->async_pfds[conn->async_nfds];
+        apr_os_file_t osfd = fds[i];
+        apr_file_t *file;
+
+        /* Unlike a socket, the file doesn't close the descriptor when the
+           pool is cleared. It belongs to OpenSSL. */
+        if (apr_os_file_put(&file, &osfd, APR_FOPEN_READ, conn->async_pool))
+            continue;
+
+        memset(pfd, 0, sizeof(*pfd));
+        pfd->desc_type = APR_POLL_FILE;
+        pfd->desc.f = file;
+        pfd->reqevents = APR_POLLIN;
+        pfd->p = conn->async_pool;
+
+        if (ctx->pollset_add(ctx->pollset_baton, pfd, &conn->async_io))
+            continue;
+
+        conn->async_nfds++;
+    }
+#endif
+
+    serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, conn->config,
+              "Polling %d async crypto descriptors of %s\n",
+              conn->async_nfds, conn->host_url);
+
+    /* Without a descriptor to wait for, retry on the next write */
+    if (!conn->async_nfds) {
+        conn->pump.stop_writing = false;
+        serf_io__set_pollset_dirty(&conn->io);
+    }
+}
+
+void serf__async_crypto_setup(serf_connection_t *conn,
+                              serf_bucket_t *ostream)
+{
+    serf__async_crypto_reset(conn);
+
+    conn->async_io.type = SERF_IO_ASYNC;
+    conn->async_io.u.conn = conn;
+    conn->async_io.ctx = conn->ctx;
+
+    if (ostream && SERF_BUCKET_IS_SSL_ENCRYPT(ostream))
+        serf__ssl_async_setup(serf_bucket_ssl_encrypt_context_get(ostream),
+                              async_wait, conn);
+}
+
+apr_status_t serf__async_crypto_ready(serf_connection_t *conn)
+{
+    /* The socket was already processed in this run, maybe before the job
+       could continue. The descriptors stay readable until the job ran, so
+       leave them polled and continue on the next run. */
+    if (conn->seen_in_pollset & (APR_POLLIN | APR_POLLOUT | APR_POLLHUP))
+        return APR_SUCCESS;
+
+    unwatch_fds(conn);
+
+    serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, conn->config,
+              "Async crypto of %s can continue\n", conn->host_url);
+
+    /* Repeat the SSL calls that waited, in either direction */
+    conn->pump.stop_writing = false;
+    serf_io__set_pollset_dirty(&conn->io);
+
+    return serf__process_connection(conn, APR_POLLIN | APR_POLLOUT);
+}
+
+void serf__async_crypto_reset(serf_connection_t *conn)
+{
+    unwatch_fds(conn);
+}
@@ -0,0 +1,377 @@
+/* ====================================================================
+ *    Licensed to the Apache Software Foundation (ASF) under one
+ *    or more contributor license agreements.  See the NOTICE file
+ *    distributed with this work for additional information
+ *    regarding copyright ownership.  The ASF licenses this file
+ *    to you under the Apache License, Version 2.0 (the
+ *    "License"); you may not use this file except in compliance
+ *    with the License.  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing,
+ *    software distributed under the License is distributed on an
+ *    "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ *    KIND, either express or implied.  See the License for the
+ *    specific language governing permissions and limitations
+ *    under the License.
+ * ====================================================================
+ */
+
+#include <apr_pools.h>
+#include <apr_hash.h>
+#include <apr_general.h>  /* for strcasecmp() */
+#include <apr_strings.h>
+
+#include "serf.h"
+#include "serf_bucket_util.h"
+
+#include "serf_private.h"
+
+/* Connection reuse of RFC 7540, section 9.1.1.
+
+   A connection that allows coalescing doesn't open a socket when its
+   requests can be sent over an established HTTP/2 connection to the same
+   address and port, whose verified certificate is valid for its host.
+   The requests are moved to that connection, but keep the connection they
+   were created for as their origin. When the server answers 421
+   Misdirected Request, or when the serving connection is closed, they are
+   handed back to their origin. */
+
+/* Matches HOSTNAME against certificate name PATTERN, which may contain a
+   wildcard as the complete left-most label (RFC 6125, section 6.4.3) */
+bool serf__coalesce_name_matches(const char *pattern, const char *hostname)
+{
+    if (pattern[0] == '*' && pattern[1] == '.') {
+        const char *dot = strchr(hostname, '.');
+
+        /* The wildcard matches exactly one non-empty label */
+        if (!dot || dot == hostname)
+            return false;
+
+        return strcasecmp(pattern + 1, dot) == 0;
+    }
+
+    return strcasecmp(pattern, hostname) == 0;
+}
+
+/* Returns whether the verified certificate of CONN is valid for HOSTNAME */
+static bool cert_covers(serf_connection_t *conn, const char *hostname)
+{
+    const char *names = serf__config_store_get_peer_names(conn->config);
+
+    if (!names)
+        return false;
+
+    for (; *names; names += strlen(names) + 1) {
+        if (serf__coalesce_name_matches(names, hostname))
+            return true;
+    }
+
+    return false;
+}
+
+/* Returns whether requests of CONN may be sent over CANDIDATE */
+static bool can_coalesce(serf_connection_t *conn,
+                         serf_connection_t *candidate)
+{
+    const char *hostname = conn->host_info.hostname;
+
+    if (candidate == conn
+        || !candidate->skt
+        || candidate->state != SERF_CONN_CONNECTED
+        || candidate->framing_type != SERF_CONNECTION_FRAMING_TYPE_HTTP2
+        || !candidate->protocol_baton)
+    {
+        return false;
+    }
+
+    if (candidate->host_info.port != conn->host_info.port
+        || strcmp(candidate->host_info.scheme, conn->host_info.scheme) != 0
+        || !apr_sockaddr_equal(candidate->address, conn->address))
+    {
+        return false;
+    }
+
+    if (candidate->misdirected
+        && apr_hash_get(candidate->misdirected, hostname, APR_HASH_KEY_STRING))
+    {
+        return false;
+    }
+
+    return cert_covers(candidate, hostname);
+}
+
+static bool can_move_request(serf_request_t *request)
+{
+    return request->writing == SERF_WRITING_NONE
+           && !request->respool
+           && !request->protocol_baton
+           && !request->priority
+           && !request->ssltunnel
+           && !request->depends_on
+           && !request->depends_first;
+}
+
+/* Drops the dependencies between REQUEST and the other requests of its
+   connection, which it leaves */
+static void drop_dependencies(serf_request_t *request)
+{
+    serf_request_t *r, *next;
+
+    if (request->depends_on)
+        serf_connection_request_prioritize(request, NULL, 0, false);
+
+    for (r = request->depends_first; r; r = next) {
+        next = r->depends_next;
+
+        r->depends_on = NULL;
+        r->depends_next = NULL;
+    }
+    request->depends_first = NULL;
+}
+
+/* Unlinks REQUEST from the list starting at *LIST, updating *TAIL */
+static void unlink_request(serf_request_t *request,
+                           serf_request_t **list,
+                           serf_request_t **tail)
+{
+    serf_request_t *prev = NULL;
+    serf_request_t **pr;
+
+    for (pr = list; *pr; prev = *pr, pr = &(*pr)->next) {
+        if (*pr == request) {
+            *pr = request->next;
+            if (*tail == request)
+                *tail = prev;
+            break;
+        }
+    }
+
+    request->next = NULL;
+}
+
+/* Moves the unwritten REQUEST to the end of the unwritten requests of TO */
+static void move_unwritten(serf_request_t *request,
+                           serf_connection_t *to)
+{
+    serf_connection_t *from = request->conn;
+
+    unlink_request(request, &from->unwritten_reqs,
+                   &from->unwritten_reqs_tail);
+    from->nr_of_unwritten_reqs--;
+
+    request->conn = to;
+    serf__link_requests(&to->unwritten_reqs, &to->unwritten_reqs_tail,
+                        request);
+    to->nr_of_unwritten_reqs++;
+
+    serf_io__set_pollset_dirty(&to->io);
+}
+
+static void coalesce_requests(serf_connection_t *conn,
+                              serf_connection_t *target)
+{
+    serf_request_t *request = conn->unwritten_reqs;
+
+    serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, conn->config,
+              "sending requests of connection 0x%p over 0x%p\n",
+              conn, target);
+
+    while (request) {
+        serf_request_t *next = request->next;
+
+        if (can_move_request(request))
+            move_unwritten(request, target);
+
+        request = next;
+    }
+}
+
+apr_status_t serf__process_coalescing(serf_context_t *ctx)
+{
+    int i, j;
+
+    if (ctx->proxy_address)
+        return APR_SUCCESS;
+
+    for (i = ctx->conns->nelts; i--; ) {
+        serf_connection_t *conn = GET_CONN(ctx, i);
+
+        /* Only connections that would otherwise be opened now */
+        if (!conn->coalesce || conn->skt || !conn->unwritten_reqs
+            || !conn->host_info.hostname)
+        {
+            continue;
+        }
+
+        for (j = ctx->conns->nelts; j--; ) {
+            serf_connection_t *candidate = GET_CONN(ctx, j);
+
+            if (can_coalesce(conn, candidate)) {
+                coalesce_requests(conn, candidate);
+                break;
+            }
+        }
+    }
+
+    return APR_SUCCESS;
+}
+
+apr_status_t serf__coalesce_handle_response(bool *consumed_response,
+                                            serf_request_t *request)
+{
+    serf_connection_t *conn = request->conn;
+    serf_connection_t *origin = request->origin;
+    serf_status_line sl;
+    apr_status_t status;
+
+    if (origin == conn || !origin->coalesce
+        || !SERF_BUCKET_IS_RESPONSE(request->resp_bkt))
+    {
+        return APR_SUCCESS;
+    }
+
+    status = serf_bucket_response_status(request->resp_bkt, &sl);
+    if (!sl.version) {
+        /* Let the handler see errors and responses without a status */
+        return APR_STATUS_IS_EAGAIN(status) ? status : APR_SUCCESS;
+    }
+
+    if (sl.code != 421)
+        return APR_SUCCESS;
+
+    serf__log(LOGLVL_INFO, LOGCOMP_CONN, __FILE__, conn->config,
+              "request for %s misdirected over connection 0x%p\n",
+              origin->host_info.hostname, conn);
+
+    if (!conn->misdirected)
+        conn->misdirected = apr_hash_make(conn->pool);
+
+    apr_hash_set(conn->misdirected,
+                 apr_pstrdup(conn->pool, origin->host_info.hostname),
+                 APR_HASH_KEY_STRING, conn);
+
+    /* Discard the response and send the request again, over its own
+       connection. Requeueing may have kept its pool, or made it depend on
+       the discarded attempt, which doesn't keep it from going back; sending
+       it over CONN again would just get another 421 */
+    status = serf_connection__request_requeue(request);
+    if (status)
+        return status;
+
+    drop_dependencies(request);
+    move_unwritten(request, origin);
+
+    *consumed_response = true;
+    return APR_SUCCESS;
+}
+
+/* Hands the requests on the list starting at *LIST that were created for
+   another connection back to that connection */
+static void return_requests(serf_connection_t *conn,
+                            serf_request_t **list,
+                            serf_request_t **tail,
+                            bool written)
+{
+    serf_request_t *request = *list;
+
+    while (request) {
+        serf_request_t *next = request->next;
+        serf_connection_t *origin = request->origin;
+
+        if (origin == conn || request->priority || request->ssltunnel) {
+            request = next;
+            continue;
+        }
+
+        /* Requests that are on the wire can only go back when they can
+           be sent again without calling the application */
+        if (written && serf__request_replay(request) != APR_SUCCESS) {
+            serf_request_t *tmp = request;
+
+            unlink_request(request, list, tail);
+            conn->nr_of_written_reqs--;
+            (void)serf__cancel_request(request, &tmp, 1);
+
+            request = next;
+            continue;
+        }
+
+        unlink_request(request, list, tail);
+        if (written)
+            conn->nr_of_written_reqs--;
+        else
+            conn->nr_of_unwritten_reqs--;
+
+        request->conn = origin;
+        serf__link_requests(&origin->unwritten_reqs,
+                            &origin->unwritten_reqs_tail, request);
+        origin->nr_of_unwritten_reqs++;
+        serf_io__set_pollset_dirty(&origin->io);
+
+        request = next;
+    }
+}
+
+/* Cancels the requests of ORIGIN on the list of CONN starting at *LIST */
+static void cancel_requests(serf_connection_t *conn,
+                            serf_connection_t *origin,
+                            serf_request_t **list,
+                            serf_request_t **tail,
+                            bool written)
+{
+    serf_request_t *request = *list;
+
+    while (request) {
+        serf_request_t *next = request->next;
+
+        if (request->origin == origin) {
+            serf_request_t *tmp = request;
+
+            unlink_request(request, list, tail);
+            if (written)
+                conn->nr_of_written_reqs--;
+            else
+                conn->nr_of_unwritten_reqs--;
+
+            (void)serf__cancel_request(request, &tmp, 0);
+        }
+
+        request = next;
+    }
+}
+
+void serf__coalesce_close(serf_connection_t *conn)
+{
+    serf_context_t *ctx = conn->ctx;
+    int i;
+
+    return_requests(conn, &conn->written_reqs, &conn->written_reqs_tail,
+                    true);
+    return_requests(conn, &conn->unwritten_reqs, &conn->unwritten_reqs_tail,
+                    false);
+
+    if (!conn->coalesce)
+        return;
+
+    /* Our requests can't outlive us, even when another connection is
+       serving them */
+    for (i = ctx->conns->nelts; i--; ) {
+        serf_connection_t *other = GET_CONN(ctx, i);
+
+        if (other == conn)
+            continue;
+
+        cancel_requests(other, conn, &other->written_reqs,
+                        &other->written_reqs_tail, true);
+        cancel_requests(other, conn, &other->unwritten_reqs,
+                        &other->unwritten_reqs_tail, false);
+    }
+}
+
+void serf_connection_set_coalescing(serf_connection_t *conn,
+                                    int enabled)
+{
+    conn->coalesce = (enabled != 0);
+}
@@ -524,3 +524,43 @@ serf__config_store_get_ssl_session(serf_config_t *config,
     *session_len = ssld->session_len;
     return APR_SUCCESS;
 }
+
+#define SERF_CONFIG__PEER_NAMES        (SERF_CONFIG_PER_CONNECTION | 0xF00001)
+
+apr_status_t
+serf__config_store_set_peer_names(serf_config_t *config,
+                                  const apr_array_header_t *names)
+{
+    apr_size_t len = 1;
+    char *buf, *p;
+    int i;
+
+    for (i = 0; i < names->nelts; i++)
+        len += strlen(APR_ARRAY_IDX(names, i, const char *)) + 1;
+
+    buf = serf_bucket_mem_alloc(config->allocator, len);
+
+    /* Stored as a list of strings, terminated by an empty string */
+    for (i = 0, p = buf; i < names->nelts; i++) {
+        const char *name = APR_ARRAY_IDX(names, i, const char *);
+        apr_size_t name_len = strlen(name);
+
+        memcpy(p, name, name_len + 1);
+        p += name_len + 1;
+    }
+    *p = '\0';
+
+    return config_set_object(config, SERF_CONFIG__PEER_NAMES, buf,
+                             serf_bucket_mem_free);
+}
+
+const char *
+serf__config_store_get_peer_names(serf_config_t *config)
+{
+    void *value;
+
+    if (serf_config_get_object(config, SERF_CONFIG__PEER_NAMES, &value))
+        return NULL;
+
+    return value;
+}
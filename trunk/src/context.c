@@ -96,6 +96,91 @@ static apr_status_t check_dirty_pollsets(serf_context_t *ctx)
 }
 
 
+/* Updates the memory budget throttling state of CONN */
+static void set_conn_throttled(serf_connection_t *conn,
+                               bool throttled)
+{
+    if (conn->mem_throttled == throttled)
+        return;
+
+    conn->mem_throttled = throttled;
+
+    if (throttled)
+        conn->ctx->mem_throttle_events++;
+
+    serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, conn->config,
+              "%s connection 0x%p, holding %" APR_SIZE_T_FMT " bytes\n",
+              throttled ? "Throttling" : "Unthrottling", conn, conn->mem_used);
+
+    if (conn->perform_throttle)
+        conn->perform_throttle(conn, throttled);
+
+    serf_io__set_pollset_dirty(&conn->io);
+}
+
+/* Measures the memory held by all connections, and throttles or unthrottles
+   connections according to the configured budgets. */
+static void check_memory_budget(serf_context_t *ctx)
+{
+    serf_connection_t *heaviest = NULL;
+    apr_size_t total = 0;
+    bool any_budget = (ctx->mem_high_watermark != 0);
+    int i;
+
+    if (!ctx->mem_budget_enabled)
+        return;
+
+    for (i = ctx->conns->nelts; i--; ) {
+        serf_connection_t *conn = GET_CONN(ctx, i);
+
+        conn->mem_used = serf_connection_get_memory_used(conn);
+        total += conn->mem_used;
+
+        if (conn->mem_high_watermark) {
+            any_budget = true;
+            if (conn->mem_used > conn->mem_high_watermark)
+                conn->mem_over_budget = true;
+            else if (conn->mem_used < conn->mem_low_watermark)
+                conn->mem_over_budget = false;
+        }
+        else
+            conn->mem_over_budget = false;
+
+        if (!conn->mem_ctx_throttled
+            && (!heaviest || conn->mem_used > heaviest->mem_used)) {
+
+            heaviest = conn;
+        }
+    }
+
+    ctx->mem_used = total;
+    if (total > ctx->mem_peak)
+        ctx->mem_peak = total;
+
+    if (!ctx->mem_high_watermark || total < ctx->mem_low_watermark) {
+        for (i = ctx->conns->nelts; i--; )
+            GET_CONN(ctx, i)->mem_ctx_throttled = false;
+    }
+    else if (total > ctx->mem_high_watermark && heaviest) {
+        /* Throttle one more connection per run, to avoid stopping all
+           connections when just one of them is the problem */
+        heaviest->mem_ctx_throttled = true;
+    }
+
+    for (i = ctx->conns->nelts; i--; ) {
+        serf_connection_t *conn = GET_CONN(ctx, i);
+
+        set_conn_throttled(conn,
+                           conn->mem_over_budget || conn->mem_ctx_throttled);
+    }
+
+    /* All connections were unthrottled above when no budget is left; stop
+       measuring until a budget is configured again */
+    if (!any_budget)
+        ctx->mem_budget_enabled = false;
+}
+
+
 static apr_status_t pollset_add(void *user_baton,
                                 apr_pollfd_t *pfd,
                                 void *serf_baton)
@@ -211,9 +296,23 @@ serf_context_t *serf_context_create(apr_pool_t *pool)
 apr_status_t serf_context_prerun(serf_context_t *ctx)
 {
     apr_status_t status = APR_SUCCESS;
+    if ((status = serf__process_coalescing(ctx)) != APR_SUCCESS)
+        return status;
+
+    if ((status = serf__process_spillover(ctx)) != APR_SUCCESS)
+        return status;
+
     if ((status = serf__open_connections(ctx)) != APR_SUCCESS)
         return status;
 
+    if ((status = serf__process_pushback(ctx)) != APR_SUCCESS)
+        return status;
+
+    if ((status = serf__process_keepalive(ctx)) != APR_SUCCESS)
+        return status;
+
+    check_memory_budget(ctx);
+
     if ((status = check_dirty_pollsets(ctx)) != APR_SUCCESS)
         return status;
     return status;
@@ -233,6 +332,17 @@ apr_status_t serf_event_trigger(
 
         status = serf__process_connection(conn, desc->rtnevents);
 
+        /* An OCSP responder that can't be reached doesn't fail the context */
+        if (status && s->ocsp_fetcher)
+            status = serf__ocsp_fetch_conn_failed(conn, status);
+
+        if (status) {
+            return status;
+        }
+    }
+    else if (io->type == SERF_IO_ASYNC) {
+        status = serf__async_crypto_ready(io->u.conn);
+
         if (status) {
             return status;
         }
@@ -322,6 +432,51 @@ void serf_context_set_progress_cb(
 }
 
 
+void serf_context_set_memory_budget(
+    serf_context_t *ctx,
+    apr_size_t high_watermark,
+    apr_size_t low_watermark)
+{
+    ctx->mem_high_watermark = high_watermark;
+    ctx->mem_low_watermark = MIN(low_watermark, high_watermark);
+
+    /* Also when disabling, to let the next run unthrottle the connections.
+       check_memory_budget() clears the flag once no budget is left */
+    ctx->mem_budget_enabled = true;
+}
+
+
+void serf_context_get_memory_stats(
+    serf_context_t *ctx,
+    apr_size_t *used,
+    apr_size_t *peak,
+    unsigned int *throttled,
+    apr_uint64_t *throttle_events)
+{
+    int i;
+
+    if (used) {
+        *used = 0;
+        for (i = ctx->conns->nelts; i--; )
+            *used += serf_connection_get_memory_used(GET_CONN(ctx, i));
+    }
+
+    if (peak)
+        *peak = ctx->mem_peak;
+
+    if (throttled) {
+        *throttled = 0;
+        for (i = ctx->conns->nelts; i--; ) {
+            if (GET_CONN(ctx, i)->mem_throttled)
+                (*throttled)++;
+        }
+    }
+
+    if (throttle_events)
+        *throttle_events = ctx->mem_throttle_events;
+}
+
+
 serf_bucket_t *serf_context_bucket_socket_create(
     serf_context_t *ctx,
     apr_socket_t *skt,
@@ -0,0 +1,772 @@
+/* ====================================================================
+ *    Licensed to the Apache Software Foundation (ASF) under one
+ *    or more contributor license agreements.  See the NOTICE file
+ *    distributed with this work for additional information
+ *    regarding copyright ownership.  The ASF licenses this file
+ *    to you under the Apache License, Version 2.0 (the
+ *    "License"); you may not use this file except in compliance
+ *    with the License.  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing,
+ *    software distributed under the License is distributed on an
+ *    "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ *    KIND, either express or implied.  See the License for the
+ *    specific language governing permissions and limitations
+ *    under the License.
+ * ====================================================================
+ */
+
+#include <apr_pools.h>
+#include <apr_file_io.h>
+#include <apr_general.h>  /* for strcasecmp() */
+#include <apr_strings.h>
+#include <apr_uri.h>
+
+#include "serf.h"
+#include "serf_bucket_util.h"
+
+#include "serf_private.h"
+
+#define DEFAULT_MAX_SEGMENTS 4
+#define DEFAULT_SEGMENT_SIZE (1024 * 1024)
+
+typedef struct download_segment_t {
+    serf_download_t *dl;
+    int index;
+
+    /* The range of the resource fetched by this segment. END is exclusive,
+       or SERF_LENGTH_UNKNOWN while it is not known */
+    apr_uint64_t start;
+    apr_uint64_t end;
+
+    /* Offset of the next byte we receive */
+    apr_uint64_t pos;
+
+    serf_connection_t *conn;
+
+    /* The response body as [byteranges](saver(barrier(response))), where
+       the saver is only used for ordered delivery. Allocated from the
+       download's allocator, so saved data can outlive the request */
+    serf_bucket_t *body;
+    serf_bucket_t *saver;
+    serf_bucket_t *byteranges;
+    apr_uint64_t part_start;
+
+    bool discard;        /* The body contains no data of the resource */
+    bool received_all;   /* The saver holds the complete response */
+    bool done;           /* All data of this segment is delivered */
+} download_segment_t;
+
+struct serf_download_t {
+    apr_pool_t *pool;
+    serf_context_t *ctx;
+    apr_uri_t url;
+    const char *path;
+    serf_connection_setup_t setup;
+    void *setup_baton;
+    serf_bucket_alloc_t *allocator;
+
+    unsigned int max_segments;
+    apr_uint64_t segment_size;
+
+    apr_file_t *file;
+
+    bool ordered;
+    serf_download_data_t data_cb;
+    void *data_baton;
+    apr_size_t memory_budget;
+    const char *temp_dir;
+
+    serf_download_done_t done;
+    void *done_baton;
+
+    /* Set once the first response told us how to fetch the rest */
+    bool split;
+    apr_uint64_t size;
+
+    apr_array_header_t *segments;
+    int segments_done;
+    int head;            /* First segment with undelivered data */
+
+    bool finished;
+    apr_status_t status;
+};
+
+
+/* Finishes the download with STATUS, from the handler of segment CURRENT.
+   On failure the connections of the other segments are closed, as their
+   data is no longer needed */
+static void download_finish(serf_download_t *dl,
+                            download_segment_t *current,
+                            apr_status_t status,
+                            apr_pool_t *scratch_pool)
+{
+    int i;
+
+    if (dl->finished)
+        return;
+
+    dl->finished = true;
+    dl->status = status;
+
+    for (i = 0; status && i < dl->segments->nelts; i++) {
+        download_segment_t *seg = APR_ARRAY_IDX(dl->segments, i,
+                                                download_segment_t *);
+
+        if (seg == current || !seg->conn)
+            continue;
+
+        /* The body refers to the response, which goes away with the
+           connection */
+        if (seg->body) {
+            serf_bucket_destroy(seg->body);
+            seg->body = seg->saver = seg->byteranges = NULL;
+        }
+
+        serf_connection_close(seg->conn);
+        seg->conn = NULL;
+    }
+
+    if (dl->done)
+        dl->done(dl, dl->done_baton, status, scratch_pool);
+}
+
+static serf_bucket_t *accept_response(serf_request_t *request,
+                                      serf_bucket_t *stream,
+                                      void *acceptor_baton,
+                                      apr_pool_t *pool)
+{
+    serf_bucket_alloc_t *bkt_alloc = serf_request_get_alloc(request);
+
+    /* Ensure the socket is not destroyed with the response */
+    stream = serf_bucket_barrier_create(stream, bkt_alloc);
+
+    return serf_bucket_response_create(stream, bkt_alloc);
+}
+
+static apr_status_t handle_response(serf_request_t *request,
+                                    serf_bucket_t *response,
+                                    void *handler_baton,
+                                    apr_pool_t *pool);
+
+static apr_status_t setup_request(serf_request_t *request,
+                                  void *setup_baton,
+                                  serf_bucket_t **req_bkt,
+                                  serf_response_acceptor_t *acceptor,
+                                  void **acceptor_baton,
+                                  serf_response_handler_t *handler,
+                                  void **handler_baton,
+                                  apr_pool_t *pool)
+{
+    download_segment_t *seg = setup_baton;
+    serf_download_t *dl = seg->dl;
+    serf_bucket_t *hdrs;
+    const char *range;
+
+    *req_bkt = serf_request_bucket_request_create(request, "GET", dl->path,
+                                                  NULL,
+                                                  serf_request_get_alloc(request));
+    hdrs = serf_bucket_request_get_headers(*req_bkt);
+
+    if (seg->end != SERF_LENGTH_UNKNOWN)
+        range = apr_psprintf(pool, "bytes=%" APR_UINT64_T_FMT
+                                   "-%" APR_UINT64_T_FMT,
+                             seg->start, seg->end - 1);
+    else
+        range = apr_psprintf(pool, "bytes=%" APR_UINT64_T_FMT "-",
+                             seg->start);
+    serf_bucket_headers_setc(hdrs, "Range", range);
+
+    *acceptor = accept_response;
+    *acceptor_baton = seg;
+    *handler = handle_response;
+    *handler_baton = seg;
+
+    return APR_SUCCESS;
+}
+
+/* Adds a segment fetching START to END (exclusive) over a new connection */
+static apr_status_t segment_create(serf_download_t *dl,
+                                   apr_uint64_t start,
+                                   apr_uint64_t end)
+{
+    download_segment_t *seg;
+    apr_status_t status;
+
+    seg = apr_pcalloc(dl->pool, sizeof(*seg));
+    seg->dl = dl;
+    seg->index = dl->segments->nelts;
+    seg->start = seg->pos = start;
+    seg->end = end;
+    seg->part_start = SERF_LENGTH_UNKNOWN;
+
+    status = serf_connection_create2(&seg->conn, dl->ctx, dl->url,
+                                     dl->setup, dl->setup_baton,
+                                     NULL, NULL, dl->pool);
+    if (status)
+        return status;
+
+    APR_ARRAY_PUSH(dl->segments, download_segment_t *) = seg;
+
+    serf_connection_request_create(seg->conn, setup_request, seg);
+
+    return APR_SUCCESS;
+}
+
+/* Now that the first segment SEG told us the TOTAL size of the resource,
+   fetch whatever it doesn't cover in new segments */
+static apr_status_t download_split(download_segment_t *seg,
+                                   apr_uint64_t total)
+{
+    serf_download_t *dl = seg->dl;
+    apr_uint64_t remaining, piece, start;
+    unsigned int count;
+
+    dl->split = true;
+    dl->size = total;
+
+    if (total == SERF_LENGTH_UNKNOWN) {
+        /* Fetch the rest with an open range, as we can't divide it */
+        if (seg->end == SERF_LENGTH_UNKNOWN)
+            return APR_SUCCESS;
+
+        return segment_create(dl, seg->end, SERF_LENGTH_UNKNOWN);
+    }
+
+    if (seg->end == SERF_LENGTH_UNKNOWN || seg->end > total)
+        seg->end = total;
+
+    if (seg->end == total)
+        return APR_SUCCESS;
+
+    remaining = total - seg->end;
+    count = (unsigned int)((remaining + dl->segment_size - 1)
+                           / dl->segment_size);
+    if (count > dl->max_segments - 1)
+        count = dl->max_segments - 1;
+    if (count == 0)
+        count = 1;
+
+    piece = (remaining + count - 1) / count;
+
+    serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, seg->conn->config,
+              "download of %" APR_UINT64_T_FMT " bytes, fetching the "
+              "remaining %" APR_UINT64_T_FMT " bytes in %u segments\n",
+              total, remaining, count);
+
+    for (start = seg->end; start < total; start += piece) {
+        apr_uint64_t end = start + piece;
+        apr_status_t status;
+
+        if (end > total)
+            end = total;
+
+        status = segment_create(dl, start, end);
+        if (status)
+            return status;
+    }
+
+    return APR_SUCCESS;
+}
+
+/* Returns the boundary parameter of the multipart Content-Type CTYPE */
+static const char *get_boundary(const char *ctype, apr_pool_t *pool)
+{
+    const char *param;
+
+    for (param = strchr(ctype, ';'); param; param = strchr(param, ';')) {
+        const char *end;
+
+        param++;
+        while (*param == ' ' || *param == '\t')
+            param++;
+
+        if (strncasecmp(param, "boundary=", 9) != 0)
+            continue;
+
+        param += 9;
+        if (*param == '"') {
+            param++;
+            end = strchr(param, '"');
+        }
+        else
+            end = param + strcspn(param, " \t;");
+
+        if (!end || end == param)
+            return NULL;
+
+        return apr_pstrmemdup(pool, param, end - param);
+    }
+
+    return NULL;
+}
+
+/* Checks the status line and headers of the response of SEG, and sets up
+   the bucket to read its body from */
+static apr_status_t segment_accept(download_segment_t *seg,
+                                   serf_bucket_t *response)
+{
+    serf_download_t *dl = seg->dl;
+    serf_status_line sl;
+    serf_bucket_t *hdrs;
+    serf_bucket_t *stream;
+    const char *boundary = NULL;
+    const char *val;
+    apr_uint64_t start, end, total;
+    apr_status_t status;
+
+    status = serf_bucket_response_status(response, &sl);
+    if (SERF_BUCKET_READ_ERROR(status))
+        return status;
+    if (!sl.version) {
+        return APR_STATUS_IS_EOF(status) ? SERF_ERROR_TRUNCATED_HTTP_RESPONSE
+                                         : status;
+    }
+
+    status = serf_bucket_response_wait_for_headers(response);
+    if (SERF_BUCKET_READ_ERROR(status) || APR_STATUS_IS_EAGAIN(status))
+        return status;
+
+    hdrs = serf_bucket_response_get_headers(response);
+
+    if (sl.code == 206) {
+        val = serf_bucket_headers_get(hdrs, "Content-Type");
+
+        if (val && strncasecmp(val, "multipart/byteranges", 20) == 0) {
+            /* The ranges are checked while reading the parts */
+            boundary = get_boundary(val, dl->pool);
+            if (!boundary)
+                return SERF_ERROR_BAD_HTTP_RESPONSE;
+        }
+        else {
+            val = serf_bucket_headers_get(hdrs, "Content-Range");
+            if (!val)
+                return SERF_ERROR_BAD_HTTP_RESPONSE;
+
+            status = serf__parse_content_range(val, &start, &end, &total);
+            if (status)
+                return status;
+
+            if (start != seg->start
+                || (seg->end != SERF_LENGTH_UNKNOWN && end >= seg->end)) {
+                return SERF_ERROR_BAD_HTTP_RESPONSE;
+            }
+
+            /* Only the first segment may get less than it asked for */
+            if (dl->split && seg->end != SERF_LENGTH_UNKNOWN
+                && end + 1 != seg->end) {
+                return SERF_ERROR_BAD_HTTP_RESPONSE;
+            }
+
+            seg->end = end + 1;
+
+            if (!dl->split) {
+                status = download_split(seg, total);
+                if (status)
+                    return status;
+            }
+        }
+    }
+    else if (sl.code == 200 && !dl->split) {
+        /* The server ignores the range: fetch everything from here */
+        val = serf_bucket_headers_get(hdrs, "Content-Length");
+
+        serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, seg->conn->config,
+                  "server doesn't support ranges, not splitting download\n");
+
+        if (val) {
+            char *end_ptr;
+            apr_int64_t len = apr_strtoi64(val, &end_ptr, 10);
+
+            if (errno == ERANGE || end_ptr == val || *end_ptr || len < 0)
+                return SERF_ERROR_BAD_HTTP_RESPONSE;
+
+            seg->end = (apr_uint64_t)len;
+        }
+        else
+            seg->end = SERF_LENGTH_UNKNOWN;
+        dl->split = true;
+        dl->size = seg->end;
+    }
+    else if (sl.code == 416) {
+        /* Only valid when we asked for data at the end of the resource,
+           e.g. for the start of an empty resource */
+        val = serf_bucket_headers_get(hdrs, "Content-Range");
+        if (!val
+            || serf__parse_content_range(val, &start, &end, &total)
+            || total != seg->start
+            || (dl->split && seg->end != SERF_LENGTH_UNKNOWN)) {
+
+            return SERF_ERROR_BAD_HTTP_RESPONSE;
+        }
+
+        seg->end = seg->start;
+        seg->discard = true;
+        dl->split = true;
+        dl->size = total;
+    }
+    else {
+        serf__log(LOGLVL_WARNING, LOGCOMP_CONN, __FILE__, seg->conn->config,
+                  "unexpected status %d for segment %d of download\n",
+                  sl.code, seg->index);
+        return SERF_ERROR_BAD_HTTP_RESPONSE;
+    }
+
+    stream = serf_bucket_barrier_create(response, dl->allocator);
+
+    if (dl->ordered) {
+        seg->saver = serf_bucket_saver_create(stream, dl->memory_budget,
+                                              dl->temp_dir, dl->allocator);
+        stream = seg->saver;
+    }
+
+    if (boundary) {
+        seg->byteranges = serf_bucket_byteranges_create(stream, boundary,
+                                                        dl->allocator);
+        stream = seg->byteranges;
+    }
+
+    seg->body = stream;
+
+    return APR_SUCCESS;
+}
+
+/* Writes DATA at OFFSET to the file and passes it to the data callback */
+static apr_status_t download_deliver(serf_download_t *dl,
+                                     apr_uint64_t offset,
+                                     const char *data,
+                                     apr_size_t len,
+                                     apr_pool_t *pool)
+{
+    apr_status_t status;
+
+    if (!len)
+        return APR_SUCCESS;
+
+    if (dl->file) {
+        apr_off_t file_offset = (apr_off_t)offset;
+        apr_size_t written;
+
+        status = apr_file_seek(dl->file, APR_SET, &file_offset);
+        if (status)
+            return status;
+
+        status = apr_file_write_full(dl->file, data, len, &written);
+        if (status)
+            return status;
+    }
+
+    if (dl->data_cb)
+        return dl->data_cb(dl, dl->data_baton, offset, data, len, pool);
+
+    return APR_SUCCESS;
+}
+
+/* Handles DATA read from the body of SEG */
+static apr_status_t segment_data(download_segment_t *seg,
+                                 const char *data,
+                                 apr_size_t len,
+                                 apr_pool_t *pool)
+{
+    apr_status_t status;
+
+    if (seg->discard)
+        return APR_SUCCESS;
+
+    if (seg->byteranges) {
+        apr_uint64_t start, end, total;
+
+        status = serf_bucket_byteranges_get_range(seg->byteranges,
+                                                  &start, &end, &total);
+        if (status)
+            return status;
+
+        if (start != seg->part_start) {
+            /* A new part, which must continue where the last one ended */
+            if (start != seg->pos)
+                return SERF_ERROR_BAD_HTTP_RESPONSE;
+
+            seg->part_start = start;
+
+            if (!seg->dl->split) {
+                status = download_split(seg, total);
+                if (status)
+                    return status;
+            }
+        }
+
+        if (seg->end != SERF_LENGTH_UNKNOWN && end >= seg->end)
+            return SERF_ERROR_BAD_HTTP_RESPONSE;
+    }
+
+    if (seg->end != SERF_LENGTH_UNKNOWN && seg->pos + len > seg->end)
+        return SERF_ERROR_BAD_HTTP_RESPONSE;
+
+    status = download_deliver(seg->dl, seg->pos, data, len, pool);
+    seg->pos += len;
+
+    return status;
+}
+
+/* Called when the body of SEG is read completely. Returns APR_EOF on
+   success */
+static apr_status_t segment_complete(download_segment_t *seg)
+{
+    serf_download_t *dl = seg->dl;
+
+    if (seg->end == SERF_LENGTH_UNKNOWN) {
+        /* A complete response without Content-Length */
+        seg->end = seg->pos;
+    }
+    else if (seg->pos != seg->end && !seg->discard) {
+        return SERF_ERROR_TRUNCATED_HTTP_RESPONSE;
+    }
+
+    /* The last segment tells us the size, if the server didn't */
+    if (dl->size == SERF_LENGTH_UNKNOWN
+        && seg->index == dl->segments->nelts - 1) {
+
+        dl->size = seg->end;
+    }
+
+    seg->done = true;
+    dl->segments_done++;
+
+    serf_bucket_destroy(seg->body);
+    seg->body = seg->saver = seg->byteranges = NULL;
+
+    return APR_EOF;
+}
+
+/* Reads and delivers the body of SEG, until it would block. When
+   SAVED_ONLY is set, only data that was saved before is read */
+static apr_status_t segment_read(download_segment_t *seg,
+                                 bool saved_only,
+                                 apr_pool_t *pool)
+{
+    apr_status_t status;
+
+    while (true) {
+        const char *data;
+        apr_size_t len;
+
+        if (saved_only && !seg->received_all
+            && !serf_bucket_saver_get_saved(seg->saver)) {
+
+            return APR_EAGAIN;
+        }
+
+        status = serf_bucket_read(seg->body, SERF_READ_ALL_AVAIL,
+                                  &data, &len);
+        if (SERF_BUCKET_READ_ERROR(status))
+            return status;
+
+        if (len) {
+            apr_status_t data_status = segment_data(seg, data, len, pool);
+
+            if (data_status)
+                return data_status;
+        }
+
+        if (APR_STATUS_IS_EOF(status))
+            return segment_complete(seg);
+        else if (status)
+            return status;
+    }
+}
+
+/* Delivers the data that following segments saved while they waited for
+   the segments before them (ordered delivery only) */
+static apr_status_t download_advance(serf_download_t *dl,
+                                     apr_pool_t *pool)
+{
+    while (dl->head < dl->segments->nelts) {
+        download_segment_t *seg = APR_ARRAY_IDX(dl->segments, dl->head,
+                                                download_segment_t *);
+
+        if (!seg->done) {
+            apr_status_t status;
+
+            if (!seg->body)
+                return APR_SUCCESS;
+
+            status = segment_read(seg, true, pool);
+            if (APR_STATUS_IS_EAGAIN(status))
+                return APR_SUCCESS;
+            else if (!APR_STATUS_IS_EOF(status))
+                return status;
+        }
+
+        dl->head++;
+    }
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t discard_response(serf_bucket_t *response)
+{
+    while (true) {
+        const char *data;
+        apr_size_t len;
+        apr_status_t status;
+
+        status = serf_bucket_read(response, SERF_READ_ALL_AVAIL, &data, &len);
+        if (status)
+            return status;
+    }
+}
+
+static apr_status_t handle_response(serf_request_t *request,
+                                    serf_bucket_t *response,
+                                    void *handler_baton,
+                                    apr_pool_t *pool)
+{
+    download_segment_t *seg = handler_baton;
+    serf_download_t *dl = seg->dl;
+    apr_status_t status;
+
+    if (!response) {
+        /* The request was cancelled, e.g. because the connection broke */
+        if (!seg->done && !seg->received_all)
+            download_finish(dl, seg, SERF_ERROR_ABORTED_CONNECTION, pool);
+        return APR_SUCCESS;
+    }
+
+    /* Read away whatever is left after we are done with this response, or
+       with the whole download */
+    if (dl->finished || seg->done)
+        return discard_response(response);
+
+    if (!seg->body) {
+        status = segment_accept(seg, response);
+        if (APR_STATUS_IS_EAGAIN(status))
+            return status;
+        else if (status) {
+            download_finish(dl, seg, status, pool);
+            return discard_response(response);
+        }
+    }
+
+    if (dl->ordered && seg->index != dl->head) {
+        /* Save the data until the segments before this one are delivered */
+        status = serf_bucket_saver_drain(seg->saver);
+        if (APR_STATUS_IS_EOF(status))
+            seg->received_all = true;
+        else if (SERF_BUCKET_READ_ERROR(status))
+            download_finish(dl, seg, status, pool);
+
+        return status;
+    }
+
+    status = segment_read(seg, false, pool);
+    if (APR_STATUS_IS_EOF(status) && dl->ordered)
+        status = download_advance(dl, pool);
+
+    if (SERF_BUCKET_READ_ERROR(status)) {
+        download_finish(dl, seg, status, pool);
+        return discard_response(response);
+    }
+
+    if (dl->split && dl->segments_done == dl->segments->nelts)
+        download_finish(dl, seg, APR_SUCCESS, pool);
+
+    if (seg->done)
+        return discard_response(response);
+
+    return status;
+}
+
+apr_status_t serf_download_create(
+    serf_download_t **download,
+    serf_context_t *ctx,
+    const char *url,
+    serf_connection_setup_t setup,
+    void *setup_baton,
+    apr_pool_t *pool)
+{
+    serf_download_t *dl;
+    apr_status_t status;
+
+    dl = apr_pcalloc(pool, sizeof(*dl));
+    dl->pool = pool;
+    dl->ctx = ctx;
+    dl->setup = setup;
+    dl->setup_baton = setup_baton;
+
+    status = apr_uri_parse(pool, url, &dl->url);
+    if (status)
+        return status;
+
+    /* The fragment is never sent to the server */
+    dl->url.fragment = NULL;
+    dl->path = apr_uri_unparse(pool, &dl->url, APR_URI_UNP_OMITSITEPART);
+    if (!*dl->path)
+        dl->path = "/";
+
+    dl->allocator = serf_bucket_allocator_create(pool, NULL, NULL);
+    dl->max_segments = DEFAULT_MAX_SEGMENTS;
+    dl->segment_size = DEFAULT_SEGMENT_SIZE;
+    dl->size = SERF_LENGTH_UNKNOWN;
+    dl->segments = apr_array_make(pool, DEFAULT_MAX_SEGMENTS,
+                                  sizeof(download_segment_t *));
+
+    *download = dl;
+
+    return APR_SUCCESS;
+}
+
+void serf_download_set_segments(
+    serf_download_t *download,
+    unsigned int max_segments,
+    apr_uint64_t segment_size)
+{
+    download->max_segments = max_segments ? max_segments : 1;
+    download->segment_size = segment_size ? segment_size
+                                          : DEFAULT_SEGMENT_SIZE;
+}
+
+void serf_download_set_file(
+    serf_download_t *download,
+    apr_file_t *file)
+{
+    download->file = file;
+}
+
+void serf_download_set_ordered(
+    serf_download_t *download,
+    serf_download_data_t data_cb,
+    void *data_baton,
+    apr_size_t memory_budget,
+    const char *temp_dir)
+{
+    download->ordered = true;
+    download->data_cb = data_cb;
+    download->data_baton = data_baton;
+    download->memory_budget = memory_budget;
+    download->temp_dir = temp_dir;
+}
+
+apr_status_t serf_download_start(
+    serf_download_t *download,
+    serf_download_done_t done,
+    void *done_baton)
+{
+    if (download->segments->nelts)
+        return APR_EINVAL;
+
+    download->done = done;
+    download->done_baton = done_baton;
+
+    /* With a single segment we can just as well fetch everything at once */
+    return segment_create(download, 0,
+                          download->max_segments > 1 ? download->segment_size
+                                                     : SERF_LENGTH_UNKNOWN);
+}
+
+apr_uint64_t serf_download_get_size(
+    serf_download_t *download)
+{
+    return download->size;
+}
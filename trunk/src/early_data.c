@@ -0,0 +1,179 @@
+/* ====================================================================
+ *    Licensed to the Apache Software Foundation (ASF) under one
+ *    or more contributor license agreements.  See the NOTICE file
+ *    distributed with this work for additional information
+ *    regarding copyright ownership.  The ASF licenses this file
+ *    to you under the Apache License, Version 2.0 (the
+ *    "License"); you may not use this file except in compliance
+ *    with the License.  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing,
+ *    software distributed under the License is distributed on an
+ *    "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ *    KIND, either express or implied.  See the License for the
+ *    specific language governing permissions and limitations
+ *    under the License.
+ * ====================================================================
+ */
+
+#include <apr_pools.h>
+#include <apr_strings.h>
+
+#include "serf.h"
+#include "serf_bucket_util.h"
+
+#include "serf_private.h"
+
+/* TLS 1.3 early data (RFC 8446, section 2.3) for outgoing connections.
+
+   When the application allows it on the TLS context and a session that
+   accepts early data is resumed, the first request on the connection is
+   sent along with the ClientHello, saving a round trip. Early data can be
+   replayed by an attacker, so only requests that are safe to repeat are
+   sent this way, and no other request is written until the server
+   answered the handshake.
+
+   When the server rejects the early data it never saw the request, so it
+   is queued again to be sent after the handshake. */
+
+/* Returns whether REQUEST can safely be sent as early data */
+static bool replay_safe(serf_request_t *request)
+{
+    serf_bucket_t *body;
+    const char *method;
+
+    if (request->ssltunnel || !SERF_BUCKET_IS_REQUEST(request->req_bkt))
+        return false;
+
+    serf__bucket_request_read(request->req_bkt, &body, NULL, &method);
+
+    return !body && method
+           && (strcmp(method, "GET") == 0 || strcmp(method, "HEAD") == 0);
+}
+
+/* Implements serf__ssl_early_data_cb_t */
+static void early_data_answered(void *baton, bool resend)
+{
+    serf_connection_t *conn = baton;
+
+    if (!conn->early_request)
+        return;
+
+    /* A rejected request is sent again from read_from_connection(), as
+       we may be reading the connection right now */
+    if (resend)
+        conn->early_rejected = true;
+    else
+        conn->early_request = NULL;
+
+    /* Write the held back requests */
+    serf_io__set_pollset_dirty(&conn->io);
+}
+
+void serf__early_data_setup(serf_connection_t *conn, serf_bucket_t *ostream)
+{
+    serf__early_data_reset(conn);
+
+    if (ostream && SERF_BUCKET_IS_SSL_ENCRYPT(ostream))
+        conn->early_ssl = serf_bucket_ssl_encrypt_context_get(ostream);
+}
+
+void serf__early_data_offer(serf_connection_t *conn, serf_request_t *request)
+{
+    if (!conn->early_ssl || conn->early_tried)
+        return;
+
+    /* Only the first request on the connection can go out early */
+    conn->early_tried = true;
+
+    if (conn->framing_type != SERF_CONNECTION_FRAMING_TYPE_HTTP1
+        || !replay_safe(request))
+    {
+        return;
+    }
+
+    if (!serf__ssl_early_data_offer(conn->early_ssl, early_data_answered,
+                                    conn))
+        return;
+
+    conn->early_request = request;
+
+    serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, conn->config,
+              "Sending the first request to %s as early data\n",
+              conn->host_url);
+}
+
+apr_status_t serf__early_data_handle_response(bool *resent,
+                                              serf_request_t *request)
+{
+    serf_connection_t *conn = request->conn;
+    serf_request_t *prev = NULL;
+    serf_request_t **pr;
+    bool written;
+    apr_status_t status;
+
+    *resent = false;
+
+    if (!conn->early_rejected) {
+        const char *data;
+        apr_size_t len;
+
+        /* Reading drives the handshake, which tells whether the server
+           accepted the early data */
+        status = serf_bucket_peek(conn->pump.stream, &data, &len);
+        if (SERF_BUCKET_READ_ERROR(status))
+            return status;
+
+        if (!conn->early_rejected) {
+            /* Still waiting for the server */
+            if (conn->early_request && !len && !APR_STATUS_IS_EOF(status))
+                return APR_EAGAIN;
+
+            return APR_SUCCESS;
+        }
+    }
+
+    conn->early_rejected = false;
+    conn->early_request = NULL;
+
+    serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, conn->config,
+              "%s rejected the early data, sending the request again\n",
+              conn->host_url);
+
+    /* Requeueing puts a request to discard the response in the place of
+       REQUEST in the written requests */
+    for (pr = &conn->written_reqs; *pr && *pr != request; pr = &(*pr)->next)
+        prev = *pr;
+    written = (*pr != NULL);
+
+    status = serf_connection__request_requeue(request);
+    if (status)
+        return status;
+
+    /* The server never saw the request, so there is no response for the
+       request that took its place to discard */
+    if (written && *pr) {
+        serf_request_t *discard = *pr;
+
+        *pr = discard->next;
+        if (!*pr)
+            conn->written_reqs_tail = prev;
+        conn->nr_of_written_reqs--;
+
+        discard->next = NULL;
+        serf__destroy_request(discard);
+    }
+
+    *resent = true;
+    return APR_SUCCESS;
+}
+
+void serf__early_data_reset(serf_connection_t *conn)
+{
+    conn->early_ssl = NULL;
+    conn->early_tried = false;
+    conn->early_rejected = false;
+    conn->early_request = NULL;
+}
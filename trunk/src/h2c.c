@@ -0,0 +1,285 @@
+/* ====================================================================
+ *    Licensed to the Apache Software Foundation (ASF) under one
+ *    or more contributor license agreements.  See the NOTICE file
+ *    distributed with this work for additional information
+ *    regarding copyright ownership.  The ASF licenses this file
+ *    to you under the Apache License, Version 2.0 (the
+ *    "License"); you may not use this file except in compliance
+ *    with the License.  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing,
+ *    software distributed under the License is distributed on an
+ *    "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ *    KIND, either express or implied.  See the License for the
+ *    specific language governing permissions and limitations
+ *    under the License.
+ * ====================================================================
+ */
+
+#include <apr_pools.h>
+#include <apr_general.h>  /* for strcasecmp() */
+#include <apr_strings.h>
+
+#include "serf.h"
+#include "serf_bucket_util.h"
+
+#include "serf_private.h"
+
+/* HTTP/2 over plain TCP, RFC 7540 section 3.2 and 3.4.
+
+   Without TLS there is no ALPN to negotiate HTTP/2 in, so the first
+   request on a connection asks the server to upgrade. While that offer is
+   outstanding no other requests are written. A 101 Switching Protocols
+   answer is consumed here and the request continues as stream 1 of the
+   new HTTP/2 session; any other answer is passed to the request as usual.
+
+   The outcome is kept in the per host configuration, so later connections
+   to a server that upgraded start with the HTTP/2 connection preface
+   right away, and servers that declined are not asked again. */
+
+/* Base64url encoded SETTINGS payload sent with the offer. This is just
+   SETTINGS_HEADER_TABLE_SIZE at its default of 4096, as the header value
+   can't be empty and the real settings follow the connection preface */
+#define H2C_SETTINGS "AAEAABAA"
+
+/* Returns whether CONN may use HTTP/2 without TLS */
+static bool h2c_applies(serf_connection_t *conn)
+{
+    return conn->h2c_upgrade
+           && conn->framing_type == SERF_CONNECTION_FRAMING_TYPE_HTTP1
+           && !conn->async_responses
+           && !conn->ctx->proxy_address
+           && conn->host_info.scheme
+           && strcmp(conn->host_info.scheme, "http") == 0;
+}
+
+/* Returns the protocol the host of CONN was last seen to speak, or NULL */
+static const char *known_protocol(serf_connection_t *conn)
+{
+    const char *protocol;
+
+    if (serf_config_get_string(conn->config, SERF_CONFIG_HOST_PROTOCOL,
+                               &protocol))
+        return NULL;
+
+    return protocol;
+}
+
+void serf__h2c_record_protocol(serf_connection_t *conn,
+                               const char *protocol)
+{
+    const char *known = known_protocol(conn);
+
+    if (known && strcmp(known, protocol) == 0)
+        return;
+
+    serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, conn->config,
+              "Remembering that %s speaks %s\n", conn->host_url, protocol);
+
+    serf_config_set_stringc(conn->config, SERF_CONFIG_HOST_PROTOCOL,
+                            protocol);
+}
+
+void serf__h2c_forget_protocol(serf_connection_t *conn)
+{
+    if (!conn->h2c_from_cache)
+        return;
+
+    conn->h2c_from_cache = false;
+
+    serf__log(LOGLVL_WARNING, LOGCOMP_CONN, __FILE__, conn->config,
+              "%s no longer speaks HTTP/2 without TLS\n", conn->host_url);
+
+    serf_config_remove_value(conn->config, SERF_CONFIG_HOST_PROTOCOL);
+}
+
+void serf__h2c_connected(serf_connection_t *conn)
+{
+    const char *protocol;
+
+    if (!h2c_applies(conn))
+        return;
+
+    protocol = known_protocol(conn);
+    if (!protocol || strcmp(protocol, "h2c") != 0)
+        return;
+
+    serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, conn->config,
+              "Using HTTP/2 with prior knowledge for %s\n", conn->host_url);
+
+    conn->h2c_tried = true;
+    conn->h2c_from_cache = true;
+    serf_connection_set_framing_type(conn,
+                                     SERF_CONNECTION_FRAMING_TYPE_HTTP2);
+}
+
+void serf__h2c_offer(serf_connection_t *conn, serf_request_t *request)
+{
+    serf_bucket_t *body;
+    serf_bucket_t *hdrs;
+
+    if (conn->h2c_tried || !h2c_applies(conn))
+        return;
+
+    /* Only the first request on the socket can be upgraded */
+    conn->h2c_tried = true;
+
+    /* Declined before, or HTTP/2 was already tried and failed */
+    if (known_protocol(conn))
+        return;
+
+    if (request->ssltunnel || !SERF_BUCKET_IS_REQUEST(request->req_bkt))
+        return;
+
+    /* The server reads a request body before it switches, which could
+       stall all other requests for a long time */
+    serf__bucket_request_read(request->req_bkt, &body, NULL, NULL);
+    if (body)
+        return;
+
+    hdrs = serf_bucket_request_get_headers(request->req_bkt);
+    serf_bucket_headers_setn(hdrs, "Connection", "Upgrade, HTTP2-Settings");
+    serf_bucket_headers_setn(hdrs, "Upgrade", "h2c");
+    serf_bucket_headers_setn(hdrs, "HTTP2-Settings", H2C_SETTINGS);
+
+    conn->h2c_request = request;
+
+    serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, conn->config,
+              "Offering %s an upgrade to HTTP/2\n", conn->host_url);
+}
+
+/* Reads the status line of the response to the upgrade offer. When the
+   server switches protocols, the headers of its 101 response are read
+   from the connection by serf__h2c_handle_response() instead */
+static apr_status_t read_status(bool *switching, serf_request_t *request)
+{
+    serf_connection_t *conn = request->conn;
+    serf_status_line sl;
+    apr_status_t status;
+
+    *switching = false;
+
+    /* We can only look at the response via a response bucket. Others
+       are left alone, as if the server declined */
+    if (!SERF_BUCKET_IS_RESPONSE(request->resp_bkt))
+        return APR_SUCCESS;
+
+    status = serf_bucket_response_status(request->resp_bkt, &sl);
+    if (!sl.version)
+        return status ? status : APR_EAGAIN;
+
+    if (sl.code == 101) {
+        *switching = true;
+        return APR_SUCCESS;
+    }
+
+    serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, conn->config,
+              "%s declined the upgrade to HTTP/2\n", conn->host_url);
+
+    serf__h2c_record_protocol(conn, "http/1.1");
+    return APR_SUCCESS;
+}
+
+apr_status_t serf__h2c_handle_response(bool *upgraded,
+                                       serf_request_t *request)
+{
+    serf_connection_t *conn = request->conn;
+    serf_linebuf_t *linebuf;
+    apr_status_t status;
+
+    *upgraded = false;
+
+    if (!conn->h2c_linebuf) {
+        bool switching;
+
+        status = read_status(&switching, request);
+        if (status)
+            return status;
+
+        if (!switching) {
+            /* Continue with HTTP/1.1, and write the held back requests */
+            conn->h2c_request = NULL;
+            serf_io__set_pollset_dirty(&conn->io);
+            return APR_SUCCESS;
+        }
+
+        conn->h2c_linebuf = serf_bucket_mem_alloc(conn->allocator,
+                                                  sizeof(*linebuf));
+        serf_linebuf_init(conn->h2c_linebuf);
+    }
+
+    linebuf = conn->h2c_linebuf;
+
+    /* The response bucket stops reading after the status line of a 101,
+       so skip its headers up to the empty line before the first frame */
+    while (1) {
+        status = serf_linebuf_fetch(linebuf, conn->pump.stream,
+                                    SERF_NEWLINE_ANY);
+        if (SERF_BUCKET_READ_ERROR(status))
+            return status;
+
+        if (linebuf->state != SERF_LINEBUF_READY) {
+            if (APR_STATUS_IS_EOF(status))
+                return SERF_ERROR_BAD_HTTP_RESPONSE;
+
+            return status ? status : APR_EAGAIN;
+        }
+
+        if (!linebuf->used)
+            break;
+
+        if (strncasecmp(linebuf->line, "Upgrade:", 8) == 0) {
+            const char *v = linebuf->line + 8;
+
+            while (*v == ' ' || *v == '\t')
+                v++;
+
+            if (strncasecmp(v, "h2c", 3) != 0)
+                return SERF_ERROR_BAD_HTTP_RESPONSE;
+        }
+    }
+
+    serf_bucket_mem_free(conn->allocator, linebuf);
+    conn->h2c_linebuf = NULL;
+    conn->h2c_request = NULL;
+
+    /* The response arrives again as HTTP/2 on stream 1 */
+    serf_bucket_destroy(request->resp_bkt);
+    request->resp_bkt = NULL;
+
+    /* Let the pump release the written request, which moves it to the
+       written queue. It can't be incomplete, as it has no body */
+    serf_pump__data_pending(&conn->pump);
+    if (request->writing != SERF_WRITING_FINISHED)
+        return SERF_ERROR_BAD_HTTP_RESPONSE;
+
+    serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, conn->config,
+              "%s upgraded to HTTP/2\n", conn->host_url);
+
+    serf_connection_set_framing_type(conn,
+                                     SERF_CONNECTION_FRAMING_TYPE_HTTP2);
+    serf__http2_protocol_adopt_request(conn->protocol_baton, request);
+
+    *upgraded = true;
+    return APR_SUCCESS;
+}
+
+void serf__h2c_reset(serf_connection_t *conn)
+{
+    if (conn->h2c_linebuf) {
+        serf_bucket_mem_free(conn->allocator, conn->h2c_linebuf);
+        conn->h2c_linebuf = NULL;
+    }
+
+    conn->h2c_request = NULL;
+    conn->h2c_tried = false;
+    conn->h2c_from_cache = false;
+}
+
+void serf_connection_set_h2c_upgrade(serf_connection_t *conn,
+                                     int enabled)
+{
+    conn->h2c_upgrade = (enabled != 0);
+}
@@ -384,6 +384,13 @@ static apr_status_t hangup_client(serf_incoming_t *client)
 }
 
 
+void serf_incoming_set_http2_max_streams(
+    serf_incoming_t *client,
+    apr_uint32_t max_streams)
+{
+    client->http2_max_streams = max_streams;
+}
+
 void serf_incoming_set_framing_type(
     serf_incoming_t *client,
     serf_connection_framing_type_t framing_type)
@@ -576,6 +583,7 @@ apr_status_t serf_incoming_create2(
     ic->wait_for_connect = true;
     /* Detect HTTP 1 or 2 via peek operation */
     ic->framing_type = SERF_CONNECTION_FRAMING_TYPE_NONE;
+    ic->http2_max_streams = 0;
 
     ic->setup = setup;
     ic->setup_baton = setup_baton;
@@ -0,0 +1,567 @@
+/* ====================================================================
+ *    Licensed to the Apache Software Foundation (ASF) under one
+ *    or more contributor license agreements.  See the NOTICE file
+ *    distributed with this work for additional information
+ *    regarding copyright ownership.  The ASF licenses this file
+ *    to you under the Apache License, Version 2.0 (the
+ *    "License"); you may not use this file except in compliance
+ *    with the License.  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing,
+ *    software distributed under the License is distributed on an
+ *    "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ *    KIND, either express or implied.  See the License for the
+ *    specific language governing permissions and limitations
+ *    under the License.
+ * ====================================================================
+ */
+
+#include <apr_pools.h>
+#include <apr_hash.h>
+#include <apr_strings.h>
+#include <apr_uri.h>
+
+#include "serf.h"
+#include "serf_bucket_util.h"
+#include "serf_bucket_types.h"
+
+#include "serf_private.h"
+
+/* Online revocation checks of server certificates (RFC 6960).
+
+   When the handshake of a TLS connection verified the server certificate,
+   the SSL buckets ask the responder named in the certificate for its
+   status and hold back the application data until the answer arrives.
+   The requests are sent over plain HTTP connections of the same context,
+   one per responder, that are kept open for later queries.
+
+   OCSP requests are made without a nonce, so the request for a
+   certificate is always the same. Connections that wait for the status of
+   the same certificate share a single query. The outcome of the check is
+   kept in a verification cache until the responder promised an update. */
+
+/* Outcomes of checks kept by a context */
+#define OCSP_FETCH_RESULTS_MAX 1024
+
+typedef struct ocsp_query_t ocsp_query_t;
+
+struct serf__ocsp_waiter_t {
+    serf__ocsp_waiter_t *next;
+    ocsp_query_t *query;
+
+    serf__ocsp_fetched_t callback;
+    void *baton;
+};
+
+/* Queries are allocated from the allocator of the fetcher, as they live
+   until the pool of their request is destroyed, which may happen after
+   sibling pools are gone */
+struct ocsp_query_t {
+    serf__ocsp_fetcher_t *fetcher;
+    serf_connection_t *conn;
+    serf_request_t *req;
+    bool set_up;                /* The request pool owns the query */
+
+    char *path;
+    char *request;              /* Also the key in the queries hash */
+    apr_size_t request_len;
+
+    serf__ocsp_waiter_t *waiters;
+    bool done;
+
+    /* The body of the response, as far as it was received */
+    char *response;
+    apr_size_t response_len;
+    apr_size_t response_size;
+};
+
+struct serf__ocsp_fetcher_t {
+    serf_context_t *ctx;
+    apr_pool_t *pool;
+    serf_bucket_alloc_t *allocator;
+
+    apr_hash_t *queries;        /* request -> ocsp_query_t * */
+    apr_hash_t *connections;    /* responder host -> serf_connection_t * */
+
+    serf_ssl_verify_cache_t *results;
+};
+
+static apr_status_t ocsp_conn_setup(apr_socket_t *skt,
+                                    serf_bucket_t **input_bkt,
+                                    serf_bucket_t **output_bkt,
+                                    void *setup_baton,
+                                    apr_pool_t *pool)
+{
+    serf__ocsp_fetcher_t *fetcher = setup_baton;
+
+    *input_bkt = serf_context_bucket_socket_create(fetcher->ctx, skt,
+                                                   fetcher->allocator);
+    return APR_SUCCESS;
+}
+
+/* Passes the outcome of QUERY to its waiters, and forgets about it. The
+   query itself lives until its request is destroyed */
+static void query_done(ocsp_query_t *query, apr_status_t status)
+{
+    serf__ocsp_fetcher_t *fetcher = query->fetcher;
+    serf__ocsp_waiter_t *waiter;
+
+    if (query->done)
+        return;
+
+    query->done = true;
+    apr_hash_set(fetcher->queries, query->request, query->request_len, NULL);
+
+    while ((waiter = query->waiters) != NULL) {
+        query->waiters = waiter->next;
+
+        waiter->callback(waiter->baton, status, query->response,
+                         status ? 0 : query->response_len);
+        serf_bucket_mem_free(fetcher->allocator, waiter);
+    }
+}
+
+static apr_status_t query_cleanup(void *baton)
+{
+    ocsp_query_t *query = baton;
+    serf_bucket_alloc_t *allocator = query->fetcher->allocator;
+
+    query_done(query, SERF_ERROR_ABORTED_CONNECTION);
+
+    if (query->response)
+        serf_bucket_mem_free(allocator, query->response);
+    serf_bucket_mem_free(allocator, query);
+
+    return APR_SUCCESS;
+}
+
+/* Returns whether REQ still waits to be written on CONN */
+static bool request_queued(serf_connection_t *conn, serf_request_t *req)
+{
+    serf_request_t *rq;
+
+    for (rq = conn->unwritten_reqs; rq; rq = rq->next) {
+        if (rq == req)
+            return true;
+    }
+
+    return false;
+}
+
+/* Passes STATUS to the waiters of the queries sent over CONN. Requests
+   that were never set up are cancelled without notice and don't free
+   their query, so those queries are freed here. With KEEP_QUEUED, queries
+   whose request is still queued are left alone. */
+static void drop_queries(serf__ocsp_fetcher_t *fetcher,
+                         serf_connection_t *conn,
+                         apr_status_t status,
+                         bool keep_queued)
+{
+    apr_hash_index_t *hi;
+    apr_pool_t *scratch_pool;
+
+    apr_pool_create(&scratch_pool, fetcher->pool);
+
+    for (hi = apr_hash_first(scratch_pool, fetcher->queries); hi;
+         hi = apr_hash_next(hi))
+    {
+        ocsp_query_t *query = apr_hash_this_val(hi);
+
+        if (query->conn != conn)
+            continue;
+        if (keep_queued && request_queued(conn, query->req))
+            continue;
+
+        query_done(query, status);
+        if (!query->set_up) {
+            if (query->response)
+                serf_bucket_mem_free(fetcher->allocator, query->response);
+            serf_bucket_mem_free(fetcher->allocator, query);
+        }
+    }
+
+    apr_pool_destroy(scratch_pool);
+}
+
+static void ocsp_conn_closed(serf_connection_t *conn,
+                             void *closed_baton,
+                             apr_status_t why,
+                             apr_pool_t *pool)
+{
+    serf__ocsp_fetcher_t *fetcher = closed_baton;
+    apr_hash_index_t *hi;
+
+    /* Requests that are queued again, after a reset, keep their query */
+    drop_queries(fetcher, conn, why ? why : SERF_ERROR_ABORTED_CONNECTION,
+                 true);
+
+    for (hi = apr_hash_first(pool, fetcher->connections); hi;
+         hi = apr_hash_next(hi))
+    {
+        const void *key;
+        apr_ssize_t klen;
+        void *val;
+
+        apr_hash_this(hi, &key, &klen, &val);
+        if (val == conn) {
+            apr_hash_set(fetcher->connections, key, klen, NULL);
+            break;
+        }
+    }
+}
+
+/* Appends LEN bytes at DATA to the response of QUERY */
+static void query_append(ocsp_query_t *query,
+                         const char *data,
+                         apr_size_t len)
+{
+    if (query->response_len + len > query->response_size) {
+        serf_bucket_alloc_t *allocator = query->fetcher->allocator;
+        apr_size_t size = query->response_size ? query->response_size : 2048;
+        char *response;
+
+        while (size < query->response_len + len)
+            size *= 2;
+
+        response = serf_bucket_mem_alloc(allocator, size);
+        if (query->response) {
+            memcpy(response, query->response, query->response_len);
+            serf_bucket_mem_free(allocator, query->response);
+        }
+
+        query->response = response;
+        query->response_size = size;
+    }
+
+    memcpy(query->response + query->response_len, data, len);
+    query->response_len += len;
+}
+
+static apr_status_t discard_response(serf_bucket_t *response)
+{
+    while (true) {
+        const char *data;
+        apr_size_t len;
+        apr_status_t status;
+
+        status = serf_bucket_read(response, SERF_READ_ALL_AVAIL, &data, &len);
+        if (status)
+            return status;
+    }
+}
+
+static apr_status_t handle_response(serf_request_t *request,
+                                    serf_bucket_t *response,
+                                    void *handler_baton,
+                                    apr_pool_t *pool)
+{
+    ocsp_query_t *query = handler_baton;
+    serf_status_line sl;
+    apr_status_t status;
+
+    if (!response) {
+        /* The request was cancelled, e.g. because the connection broke */
+        query_done(query, SERF_ERROR_ABORTED_CONNECTION);
+        return APR_SUCCESS;
+    }
+
+    if (query->done)
+        return discard_response(response);
+
+    status = serf_bucket_response_status(response, &sl);
+    if (!sl.version) {
+        if (SERF_BUCKET_READ_ERROR(status) || APR_STATUS_IS_EOF(status)) {
+            query_done(query, APR_STATUS_IS_EOF(status)
+                                ? SERF_ERROR_TRUNCATED_HTTP_RESPONSE
+                                : status);
+            return discard_response(response);
+        }
+        return status;
+    }
+
+    if (sl.code != 200) {
+        serf__log(LOGLVL_WARNING, LOGCOMP_SSL, __FILE__,
+                  serf_request_get_conn(request)->config,
+                  "OCSP responder answered with status %d\n", sl.code);
+
+        query_done(query, SERF_ERROR_BAD_HTTP_RESPONSE);
+        return discard_response(response);
+    }
+
+    while (true) {
+        const char *data;
+        apr_size_t len;
+
+        status = serf_bucket_read(response, SERF_READ_ALL_AVAIL,
+                                  &data, &len);
+        if (SERF_BUCKET_READ_ERROR(status)) {
+            query_done(query, status);
+            return discard_response(response);
+        }
+
+        if (len)
+            query_append(query, data, len);
+
+        if (APR_STATUS_IS_EOF(status))
+            query_done(query, APR_SUCCESS);
+
+        if (status)
+            return status;
+    }
+}
+
+static serf_bucket_t *accept_response(serf_request_t *request,
+                                      serf_bucket_t *stream,
+                                      void *acceptor_baton,
+                                      apr_pool_t *pool)
+{
+    serf_bucket_alloc_t *bkt_alloc = serf_request_get_alloc(request);
+
+    /* Ensure the socket is not destroyed with the response */
+    stream = serf_bucket_barrier_create(stream, bkt_alloc);
+
+    return serf_bucket_response_create(stream, bkt_alloc);
+}
+
+static apr_status_t setup_request(serf_request_t *request,
+                                  void *setup_baton,
+                                  serf_bucket_t **req_bkt,
+                                  serf_response_acceptor_t *acceptor,
+                                  void **acceptor_baton,
+                                  serf_response_handler_t *handler,
+                                  void **handler_baton,
+                                  apr_pool_t *pool)
+{
+    ocsp_query_t *query = setup_baton;
+    serf_bucket_alloc_t *bkt_alloc = serf_request_get_alloc(request);
+    serf_bucket_t *body;
+    serf_bucket_t *hdrs;
+
+    body = serf_bucket_simple_copy_create(query->request, query->request_len,
+                                          bkt_alloc);
+    *req_bkt = serf_request_bucket_request_create(request, "POST",
+                                                  query->path, body,
+                                                  bkt_alloc);
+
+    hdrs = serf_bucket_request_get_headers(*req_bkt);
+    serf_bucket_headers_setn(hdrs, "Content-Type",
+                             "application/ocsp-request");
+    serf_bucket_headers_setn(hdrs, "Accept", "application/ocsp-response");
+
+    /* Free the query with the request */
+    query->set_up = true;
+    apr_pool_cleanup_register(pool, query, query_cleanup,
+                              apr_pool_cleanup_null);
+
+    *acceptor = accept_response;
+    *acceptor_baton = query;
+    *handler = handle_response;
+    *handler_baton = query;
+
+    return APR_SUCCESS;
+}
+
+/* Returns the connection to the responder at URL, creating it when there
+   is none */
+static apr_status_t get_connection(serf_connection_t **conn,
+                                   serf__ocsp_fetcher_t *fetcher,
+                                   const apr_uri_t *url,
+                                   apr_pool_t *scratch_pool)
+{
+    const char *host;
+    apr_uri_t host_info;
+    apr_status_t status;
+
+    host = apr_uri_unparse(scratch_pool, url, APR_URI_UNP_OMITPATHINFO
+                                              | APR_URI_UNP_OMITUSERINFO);
+
+    *conn = apr_hash_get(fetcher->connections, host, APR_HASH_KEY_STRING);
+    if (*conn)
+        return APR_SUCCESS;
+
+    /* The connection keeps referring to its host info */
+    host = apr_pstrdup(fetcher->pool, host);
+    status = apr_uri_parse(fetcher->pool, host, &host_info);
+    if (status)
+        return status;
+
+    status = serf_connection_create2(conn, fetcher->ctx, host_info,
+                                     ocsp_conn_setup, fetcher,
+                                     ocsp_conn_closed, fetcher,
+                                     fetcher->pool);
+    if (status)
+        return status;
+
+    apr_hash_set(fetcher->connections, host, APR_HASH_KEY_STRING, *conn);
+
+    return APR_SUCCESS;
+}
+
+apr_status_t serf_context_check_cert_status_online(serf_context_t *ctx,
+                                                   int enabled)
+{
+    serf__ocsp_fetcher_t *fetcher;
+    apr_status_t status;
+
+    if (!enabled) {
+        ctx->ocsp_fetcher = NULL;
+        return APR_SUCCESS;
+    }
+
+    if (ctx->ocsp_fetcher)
+        return APR_SUCCESS;
+
+    fetcher = apr_pcalloc(ctx->pool, sizeof(*fetcher));
+    fetcher->ctx = ctx;
+    fetcher->pool = ctx->pool;
+    fetcher->allocator = serf_bucket_allocator_create(ctx->pool, NULL, NULL);
+    fetcher->queries = apr_hash_make(ctx->pool);
+    fetcher->connections = apr_hash_make(ctx->pool);
+
+    status = serf_ssl_verify_cache_create(&fetcher->results,
+                                          OCSP_FETCH_RESULTS_MAX, 0,
+                                          ctx->pool);
+    if (status)
+        return status;
+
+    ctx->ocsp_fetcher = fetcher;
+
+    return APR_SUCCESS;
+}
+
+apr_status_t serf__ocsp_fetch_conn_failed(serf_connection_t *conn,
+                                          apr_status_t status)
+{
+    serf__ocsp_fetcher_t *fetcher = conn->ctx->ocsp_fetcher;
+
+    if (conn->closed != ocsp_conn_closed)
+        return status;
+
+    serf__log(LOGLVL_WARNING, LOGCOMP_SSL, __FILE__, conn->config,
+              "Connection to OCSP responder %s failed: %d\n",
+              conn->host_url, status);
+
+    drop_queries(fetcher, conn, status, false);
+
+    serf_connection_close(conn);
+
+    return APR_SUCCESS;
+}
+
+/* Implements serf__ssl_wakeup_t */
+static void wakeup_connection(void *baton)
+{
+    serf_connection_t *conn = baton;
+
+    /* Writing was stopped while the status was unknown */
+    conn->pump.stop_writing = false;
+    serf_io__set_pollset_dirty(&conn->io);
+}
+
+void serf__ocsp_fetch_setup(serf_connection_t *conn, serf_bucket_t *ostream)
+{
+    if (!conn->ctx->ocsp_fetcher
+        || !ostream || !SERF_BUCKET_IS_SSL_ENCRYPT(ostream))
+        return;
+
+    serf__ssl_ocsp_fetch_enable(serf_bucket_ssl_encrypt_context_get(ostream),
+                                conn->ctx->ocsp_fetcher,
+                                wakeup_connection, conn);
+}
+
+serf_ssl_verify_cache_t *
+serf__ocsp_fetch_results(serf__ocsp_fetcher_t *fetcher)
+{
+    return fetcher->results;
+}
+
+apr_status_t serf__ocsp_fetch(serf__ocsp_waiter_t **waiter,
+                              serf__ocsp_fetcher_t *fetcher,
+                              const char *responder,
+                              const void *request,
+                              apr_size_t request_len,
+                              serf__ocsp_fetched_t callback,
+                              void *baton)
+{
+    ocsp_query_t *query;
+    serf__ocsp_waiter_t *w;
+
+    query = apr_hash_get(fetcher->queries, request, request_len);
+    if (!query) {
+        serf_connection_t *conn;
+        const char *path;
+        apr_size_t path_len;
+        apr_uri_t url;
+        apr_pool_t *scratch_pool;
+        apr_status_t status;
+
+        apr_pool_create(&scratch_pool, fetcher->pool);
+
+        /* Responders are queried over plain HTTP; their answers are
+           signed, and fetching them over TLS would need checks of its
+           own */
+        status = apr_uri_parse(scratch_pool, responder, &url);
+        if (!status && (!url.scheme || strcmp(url.scheme, "http") != 0
+                        || !url.hostname))
+            status = APR_EGENERAL;
+        if (!status)
+            status = get_connection(&conn, fetcher, &url, scratch_pool);
+        if (status) {
+            apr_pool_destroy(scratch_pool);
+            return status;
+        }
+
+        path = (url.path && *url.path) ? url.path : "/";
+        path_len = strlen(path) + 1;
+
+        /* Path and request share the allocation of the query */
+        query = serf_bucket_mem_calloc(fetcher->allocator,
+                                       sizeof(*query) + path_len
+                                       + request_len);
+        query->fetcher = fetcher;
+        query->conn = conn;
+        query->path = (char *)(query + 1);
+        query->request = query->path + path_len;
+        query->request_len = request_len;
+        memcpy(query->path, path, path_len);
+        memcpy(query->request, request, request_len);
+
+        apr_hash_set(fetcher->queries, query->request, request_len, query);
+
+        serf__log(LOGLVL_DEBUG, LOGCOMP_SSL, __FILE__, conn->config,
+                  "Asking %s for the status of a server certificate\n",
+                  responder);
+
+        query->req = serf_connection_request_create(conn, setup_request,
+                                                    query);
+
+        apr_pool_destroy(scratch_pool);
+    }
+
+    w = serf_bucket_mem_alloc(fetcher->allocator, sizeof(*w));
+    w->query = query;
+    w->callback = callback;
+    w->baton = baton;
+    w->next = query->waiters;
+    query->waiters = w;
+
+    *waiter = w;
+    return APR_SUCCESS;
+}
+
+void serf__ocsp_fetch_cancel(serf__ocsp_fetcher_t *fetcher,
+                             serf__ocsp_waiter_t *waiter)
+{
+    serf__ocsp_waiter_t **w;
+
+    for (w = &waiter->query->waiters; *w; w = &(*w)->next) {
+        if (*w == waiter) {
+            *w = waiter->next;
+            break;
+        }
+    }
+
+    serf_bucket_mem_free(fetcher->allocator, waiter);
+}
@@ -33,6 +33,8 @@
 static apr_status_t read_from_connection(serf_connection_t *conn);
 static apr_status_t write_to_connection(serf_connection_t *conn);
 static apr_status_t hangup_connection(serf_connection_t *conn);
+static apr_status_t reset_connection(serf_connection_t *conn,
+                                     int requeue_requests);
 
 #define REQS_IN_PROGRESS(conn) \
                 ((conn)->completed_requests - (conn)->completed_responses)
@@ -78,6 +80,21 @@ request_pending(serf_request_t **next_req, serf_connection_t *conn)
          waiting for a response. */
         serf_request_t *request = conn->unwritten_reqs;
 
+        /* Nothing else goes out before the server answered the upgrade
+           offer, as it might switch protocols */
+        if (conn->h2c_request && request != conn->h2c_request)
+            request = NULL;
+
+        /* Nor before the server answered the early data */
+        if (conn->early_request && request != conn->early_request)
+            request = NULL;
+
+        /* Nor while the application applied pushback on a response, as
+           everything read from the connection is saved for that response
+           until it is resumed */
+        if (conn->written_reqs && conn->written_reqs->pushback_bkt)
+            request = NULL;
+
         if (next_req)
             *next_req = request;
 
@@ -109,6 +126,37 @@ request_or_data_pending(serf_request_t **next_req, serf_connection_t *conn)
     return serf_pump__data_pending(&conn->pump);
 }
 
+/* Returns the request whose response is currently read from CONN */
+static serf_request_t *
+response_request(serf_connection_t *conn)
+{
+    return conn->written_reqs ? conn->written_reqs : conn->unwritten_reqs;
+}
+
+/* Returns TRUE if the application applied pushback on the response that is
+   currently read from CONN, and it isn't time for a keepalive drain yet. */
+static int
+response_paused(serf_connection_t *conn)
+{
+    serf_request_t *request = response_request(conn);
+
+    if (!request || !request->pushback_bkt)
+        return FALSE;
+
+    if (request->pushback_interval <= 0)
+        return TRUE;
+
+    return apr_time_now() < request->pushback_drain_at;
+}
+
+/* Returns TRUE if the memory budget throttles CONN, and the protocol doesn't
+   handle that itself. In that case we just stop reading from the socket. */
+static int
+read_throttled(serf_connection_t *conn)
+{
+    return conn->mem_throttled && !conn->perform_throttle;
+}
+
 /* Update the pollset for this connection. We tweak the pollset based on
  * whether we want to read and/or write, given conditions within the
  * connection. If the connection is not (yet) in the pollset, then it
@@ -163,7 +211,8 @@ apr_status_t serf__conn_update_pollset(serf_connection_t *conn)
         conn->state != SERF_CONN_INIT) {
         /* If there are any outstanding events, then we want to read. */
         /* ### not true. we only want to read IF we have sent some data */
-        desc.reqevents |= APR_POLLIN;
+        if (!response_paused(conn) && !read_throttled(conn))
+            desc.reqevents |= APR_POLLIN;
 
         /* Don't write if OpenSSL told us that it needs to read data first. */
         if (! conn->pump.stop_writing && !data_waiting) {
@@ -183,8 +232,9 @@ apr_status_t serf__conn_update_pollset(serf_connection_t *conn)
     }
 
     /* If we can have async responses, always look for something to read. */
-    if (conn->framing_type != SERF_CONNECTION_FRAMING_TYPE_HTTP1
-        || conn->async_responses)
+    if ((conn->framing_type != SERF_CONNECTION_FRAMING_TYPE_HTTP1
+         || conn->async_responses)
+        && !read_throttled(conn))
     {
         desc.reqevents |= APR_POLLIN;
     }
@@ -277,6 +327,10 @@ apr_status_t serf_connection__perform_setup(serf_connection_t *conn)
 
     serf_pump__complete_setup(&conn->pump, stream, ostream);
 
+    serf__early_data_setup(conn, ostream);
+    serf__ocsp_fetch_setup(conn, ostream);
+    serf__async_crypto_setup(conn, ostream);
+
     /* We typically have one of two scenarios, based on whether the
        application decided to encrypt this connection:
 
@@ -332,6 +386,89 @@ static apr_status_t connect_connection(serf_connection_t *conn)
 
         if (status)
             return status;
+
+        serf__h2c_connected(conn);
+    }
+
+    return APR_SUCCESS;
+}
+
+/* Handle application pushback on the connections of CTX.
+
+   Connections with a paused response are not polled for input. Once a
+   keepalive drain is due we poll again, to allow read_from_connection() to
+   save the available data. Resumed responses get their saved data delivered
+   here, as there might not be any new network activity to trigger that. */
+apr_status_t serf__process_pushback(serf_context_t *ctx)
+{
+    int i;
+
+    for (i = ctx->conns->nelts; i--; ) {
+        serf_connection_t *conn = GET_CONN(ctx, i);
+        serf_request_t *request = response_request(conn);
+        apr_status_t status;
+
+        if (!conn->skt || !request)
+            continue;
+
+        if (request->pushback_bkt) {
+            if (!(conn->io.reqevents & APR_POLLIN)
+                && !response_paused(conn)) {
+
+                serf_io__set_pollset_dirty(&conn->io);
+            }
+        }
+        else if (request->pushback_resumed) {
+            request->pushback_resumed = false;
+
+            status = conn->perform_read(conn);
+            if (status)
+                return status;
+        }
+    }
+
+    return APR_SUCCESS;
+}
+
+/* Sends keepalive PINGs on HTTP/2 connections that didn't receive anything
+   for a while, and reopens the connections whose peer stopped answering.
+   A connection that fails only affects itself: it is reopened as well, and
+   the other connections are still checked */
+apr_status_t serf__process_keepalive(serf_context_t *ctx)
+{
+    apr_time_t now = 0;
+    int i;
+
+    for (i = ctx->conns->nelts; i--; ) {
+        serf_connection_t *conn = GET_CONN(ctx, i);
+        apr_status_t status;
+
+        if (!conn->keepalive_interval || !conn->skt
+            || conn->framing_type != SERF_CONNECTION_FRAMING_TYPE_HTTP2
+            || !conn->protocol_baton)
+        {
+            continue;
+        }
+
+        if (!now)
+            now = apr_time_now();
+
+        status = serf__http2_protocol_keepalive(conn->protocol_baton, now);
+        if (status == APR_SUCCESS)
+            continue;
+
+        if (APR_STATUS_IS_TIMEUP(status)) {
+            serf__log(LOGLVL_WARNING, LOGCOMP_CONN, __FILE__, conn->config,
+                      "no answer to keepalive PING on connection 0x%p, "
+                      "reconnecting\n", conn);
+        }
+        else {
+            serf__log(LOGLVL_WARNING, LOGCOMP_CONN, __FILE__, conn->config,
+                      "sending keepalive PING on connection 0x%p failed "
+                      "(%d), reconnecting\n", conn, status);
+        }
+
+        (void)reset_connection(conn, 1);
     }
 
     return APR_SUCCESS;
@@ -499,8 +636,22 @@ static apr_status_t reset_connection(serf_connection_t *conn,
        response yet. Inform the application that the request is cancelled,
        so it can requeue them if needed. */
     while (conn->written_reqs) {
-        serf__cancel_request(conn->written_reqs, &conn->written_reqs,
-                             requeue_requests);
+        serf_request_t *req = conn->written_reqs;
+
+        /* Unless we can just send it again, because nothing of the
+           response was received */
+        if (requeue_requests && !req->ssltunnel
+            && serf__request_replay(req) == APR_SUCCESS) {
+
+            conn->written_reqs = req->next;
+            req->next = NULL;
+            serf__link_requests(&conn->unwritten_reqs,
+                                &conn->unwritten_reqs_tail,
+                                req);
+            continue;
+        }
+
+        serf__cancel_request(req, &conn->written_reqs, requeue_requests);
     }
     conn->written_reqs_tail = NULL;
 
@@ -522,6 +673,17 @@ static apr_status_t reset_connection(serf_connection_t *conn,
                                 &conn->unwritten_reqs_tail,
                                 req);
         }
+        else if (requeue_requests && !old_reqs->ssltunnel
+                 && serf__request_replay(old_reqs) == APR_SUCCESS) {
+
+            /* Partially written, but we can write it again */
+            serf_request_t *req = old_reqs;
+            old_reqs = old_reqs->next;
+            req->next = NULL;
+            serf__link_requests(&conn->unwritten_reqs,
+                                &conn->unwritten_reqs_tail,
+                                req);
+        }
         else {
             /* We don't want to requeue the request or this request was partially
                written. Inform the application that the request is cancelled. */
@@ -529,6 +691,9 @@ static apr_status_t reset_connection(serf_connection_t *conn,
         }
     }
 
+    /* Stop polling async crypto jobs before their TLS context goes away */
+    serf__async_crypto_reset(conn);
+
     /* Requests queue has been prepared for a new socket, close the old one. */
     if (conn->skt != NULL) {
         remove_connection(ctx, conn);
@@ -563,6 +728,9 @@ static apr_status_t reset_connection(serf_connection_t *conn,
         conn->protocol_baton = NULL;
     }
 
+    serf__h2c_reset(conn);
+    serf__early_data_reset(conn);
+
     conn->perform_read = read_from_connection;
     conn->perform_write = write_to_connection;
     conn->perform_hangup = hangup_connection;
@@ -570,6 +738,7 @@ static apr_status_t reset_connection(serf_connection_t *conn,
     conn->perform_pre_teardown = NULL;
     conn->perform_cancel_request = NULL;
     conn->perform_prioritize_request = NULL;
+    conn->perform_throttle = NULL;
 
     conn->status = APR_SUCCESS;
 
@@ -742,6 +911,9 @@ static apr_status_t write_to_connection(serf_connection_t *conn)
                 }
             }
 
+            serf__h2c_offer(conn, request);
+            serf__early_data_offer(conn, request);
+
             request->writing = SERF_WRITING_STARTED;
 
             /* And now add an event bucket to keep track of when the request
@@ -886,6 +1058,37 @@ static apr_status_t read_from_connection(serf_connection_t *conn)
         if (conn->framing_type != SERF_CONNECTION_FRAMING_TYPE_HTTP1)
             break;
 
+        /* The application applied pushback on this response. Don't call the
+           handler, but just save what the server sent, to keep the
+           connection alive. */
+        if (request->pushback_bkt) {
+            status = serf_bucket_saver_drain(request->pushback_bkt);
+
+            request->pushback_drain_at = apr_time_now()
+                                         + request->pushback_interval;
+            serf_io__set_pollset_dirty(&conn->io);
+
+            if (!SERF_BUCKET_READ_ERROR(status))
+                status = APR_SUCCESS;
+            goto error;
+        }
+
+        /* The server may have rejected the request sent as early data */
+        if (request == conn->early_request) {
+            bool resent;
+
+            status = serf__early_data_handle_response(&resent, request);
+            if (APR_STATUS_IS_EAGAIN(status)) {
+                status = APR_SUCCESS;
+                goto error;
+            }
+            else if (status)
+                goto error;
+
+            if (resent)
+                continue;
+        }
+
         /* If the request doesn't have a response bucket, then call the
          * acceptor to get one created.
          */
@@ -905,6 +1108,25 @@ static apr_status_t read_from_connection(serf_connection_t *conn)
             serf_bucket_set_config(request->resp_bkt, conn->config);
         }
 
+        /* The server might switch to HTTP/2 in its answer to our offer */
+        if (request == conn->h2c_request) {
+            bool upgraded;
+
+            status = serf__h2c_handle_response(&upgraded, request);
+            if (APR_STATUS_IS_EAGAIN(status)) {
+                status = APR_SUCCESS;
+                goto error;
+            }
+            else if (status)
+                goto error;
+
+            if (upgraded) {
+                /* Process the frames that came with the 101 response */
+                status = conn->perform_read(conn);
+                goto error;
+            }
+        }
+
         status = serf__handle_response(request, tmppool);
 
         /* If we received APR_SUCCESS, run this loop again. */
@@ -1255,6 +1477,7 @@ serf_connection_t *serf_connection_create(
     conn->perform_pre_teardown = NULL;
     conn->perform_cancel_request = NULL;
     conn->perform_prioritize_request = NULL;
+    conn->perform_throttle = NULL;
     conn->protocol_baton = NULL;
 
     conn->written_reqs = conn->written_reqs_tail = NULL;
@@ -1381,6 +1604,9 @@ apr_status_t serf_connection_close(
 
         if (conn_seq == conn) {
 
+            serf__spillover_close(conn);
+            serf__coalesce_close(conn);
+
             /* Clean up the write bucket first, as this marks all partially written
                requests as fully written, allowing more efficient cleanup */
             serf__connection_pre_cleanup(conn);
@@ -1396,6 +1622,7 @@ apr_status_t serf_connection_close(
             while (conn->unwritten_reqs) {
                 serf__cancel_request(conn->unwritten_reqs, &conn->unwritten_reqs, 0);
             }
+            serf__async_crypto_reset(conn);
             if (conn->skt != NULL) {
                 remove_connection(ctx, conn);
                 status = clean_skt(conn);
@@ -1413,6 +1640,9 @@ apr_status_t serf_connection_close(
                 conn->protocol_baton = NULL;
             }
 
+            serf__h2c_reset(conn);
+            serf__early_data_reset(conn);
+
             /* Remove the connection from the context. We don't want to
              * deal with it any more.
              */
@@ -1455,6 +1685,112 @@ void serf_connection_set_max_outstanding_requests(
     conn->max_outstanding_requests = max_requests;
 }
 
+void serf_connection_set_memory_budget(
+    serf_connection_t *conn,
+    apr_size_t high_watermark,
+    apr_size_t low_watermark)
+{
+    serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, conn->config,
+              "Set memory budget for connection 0x%p to %" APR_SIZE_T_FMT
+              "/%" APR_SIZE_T_FMT " bytes.\n", conn,
+              high_watermark, low_watermark);
+
+    conn->mem_high_watermark = high_watermark;
+    conn->mem_low_watermark = MIN(low_watermark, high_watermark);
+
+    /* See serf_context_set_memory_budget() */
+    conn->ctx->mem_budget_enabled = true;
+}
+
+/* Sums the memory used by the allocators of the requests in LIST. A discard
+   request reading for a replayed request borrows the allocator of that
+   request, which is counted with the request itself */
+static apr_size_t requests_memory_used(serf_request_t *list)
+{
+    apr_size_t used = 0;
+
+    for (; list; list = list->next) {
+        if (list->allocator && !list->replay_owner)
+            used += serf__bucket_allocator_get_used(list->allocator);
+    }
+
+    return used;
+}
+
+apr_size_t serf_connection_get_memory_used(
+    serf_connection_t *conn)
+{
+    return serf__bucket_allocator_get_used(conn->allocator)
+           + requests_memory_used(conn->written_reqs)
+           + requests_memory_used(conn->unwritten_reqs)
+           + requests_memory_used(conn->done_reqs);
+}
+
+void serf_connection_get_write_stats(
+    serf_connection_t *conn,
+    apr_uint64_t *write_calls,
+    apr_uint64_t *bytes_written)
+{
+    if (write_calls)
+        *write_calls = conn->pump.write_calls;
+    if (bytes_written)
+        *bytes_written = conn->pump.bytes_written;
+}
+
+void serf_connection_set_http2_window_tuning(
+    serf_connection_t *conn,
+    apr_uint32_t max_window)
+{
+    conn->http2_window_max = max_window;
+}
+
+apr_status_t serf_connection_get_http2_stats(
+    serf_connection_t *conn,
+    apr_uint32_t *recv_window,
+    apr_uint32_t *send_window,
+    apr_uint64_t *bdp_estimate,
+    apr_interval_time_t *rtt)
+{
+    if (conn->framing_type != SERF_CONNECTION_FRAMING_TYPE_HTTP2
+        || !conn->protocol_baton)
+    {
+        return APR_ENOTIMPL;
+    }
+
+    serf__http2_protocol_get_stats(conn->protocol_baton, recv_window,
+                                   send_window, bdp_estimate, rtt);
+    return APR_SUCCESS;
+}
+
+void serf_connection_set_keepalive(
+    serf_connection_t *conn,
+    apr_interval_time_t interval,
+    apr_interval_time_t timeout)
+{
+    conn->keepalive_interval = interval;
+    conn->keepalive_timeout = timeout;
+}
+
+apr_status_t serf_connection_get_rtt(
+    serf_connection_t *conn,
+    apr_interval_time_t *srtt,
+    apr_interval_time_t *rttvar)
+{
+    if (conn->framing_type != SERF_CONNECTION_FRAMING_TYPE_HTTP2
+        || !conn->protocol_baton)
+    {
+        return APR_ENOTIMPL;
+    }
+
+    serf__http2_protocol_get_rtt(conn->protocol_baton, srtt, rttvar);
+    return APR_SUCCESS;
+}
+
+serf_config_t *serf_connection_get_config(serf_connection_t *conn)
+{
+    return conn->config;
+}
+
 /* Disable HTTP pipelining, ensure that only one request is outstanding at a
    time. This is an internal method, an application that wants to disable
    HTTP pipelining can achieve this by calling:
@@ -1505,6 +1841,7 @@ void serf_connection_set_framing_type(
     conn->perform_hangup = hangup_connection;
     conn->perform_cancel_request = NULL;
     conn->perform_prioritize_request = NULL;
+    conn->perform_throttle = NULL;
     conn->perform_teardown = NULL;
     conn->perform_pre_teardown = NULL;
 
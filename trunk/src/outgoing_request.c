@@ -20,6 +20,7 @@
 
 #include <stdlib.h>
 
+#include <apr_general.h>  /* for strcasecmp() */
 #include <apr_pools.h>
 #include <apr_poll.h>
 #include <apr_version.h>
@@ -74,11 +75,40 @@ static apr_status_t clean_resp(void *data)
         serf_bucket_destroy(request->resp_bkt);
         request->resp_bkt = NULL;
     }
+    request->pushback_bkt = NULL; /* Part of resp_bkt */
+    request->pushback_resumed = false;
     if (request->req_bkt) {
         if (request->writing == SERF_WRITING_NONE)
             serf_bucket_destroy(request->req_bkt);
         request->req_bkt = NULL;
     }
+    if (request->replay_body) {
+        serf_bucket_destroy(request->replay_body);
+        request->replay_body = NULL;
+    }
+    if (request->replay_headers) {
+        serf_bucket_destroy(request->replay_headers);
+        request->replay_headers = NULL;
+    }
+    if (request->replay_discard) {
+        /* The discard request of an earlier attempt still uses buckets
+           from our pool. */
+        serf_request_t *discard = request->replay_discard;
+
+        if (respool && discard->writing >= SERF_WRITING_STARTED
+                    && discard->writing < SERF_WRITING_FINISHED) {
+            serf__connection_pre_cleanup(discard->conn);
+        }
+
+        if (discard->resp_bkt) {
+            serf_bucket_destroy(discard->resp_bkt);
+            discard->resp_bkt = NULL;
+        }
+        discard->req_bkt = NULL;
+        discard->allocator = NULL;
+        discard->replay_owner = NULL;
+        request->replay_discard = NULL;
+    }
 
 #ifdef SERF_DEBUG_BUCKET_USE
     if (respool && request->allocator) {
@@ -104,6 +134,43 @@ void serf__link_requests(serf_request_t **list, serf_request_t **tail,
     }
 }
 
+/* Destroy the buckets of REQUEST, but hand its pool over to the discard
+   request of an earlier attempt, which is still reading from it */
+static void replay_handover_pool(serf_request_t *request)
+{
+    serf_request_t *discard = request->replay_discard;
+    apr_pool_t *respool = request->respool;
+
+    apr_pool_cleanup_kill(respool, request, clean_resp);
+
+    if (request->resp_bkt) {
+        serf_bucket_destroy(request->resp_bkt);
+        request->resp_bkt = NULL;
+    }
+    if (request->req_bkt) {
+        if (request->writing == SERF_WRITING_NONE)
+            serf_bucket_destroy(request->req_bkt);
+        request->req_bkt = NULL;
+    }
+    if (request->replay_body) {
+        serf_bucket_destroy(request->replay_body);
+        request->replay_body = NULL;
+    }
+    if (request->replay_headers) {
+        serf_bucket_destroy(request->replay_headers);
+        request->replay_headers = NULL;
+    }
+
+    request->respool = NULL;
+    request->allocator = NULL;
+    request->replay_discard = NULL;
+
+    discard->respool = respool;
+    discard->replay_owner = NULL;
+    apr_pool_cleanup_register(respool, discard,
+                              clean_resp, apr_pool_cleanup_null);
+}
+
 apr_status_t serf__destroy_request(serf_request_t *request)
 {
     serf_connection_t *conn = request->conn;
@@ -154,7 +221,7 @@ apr_status_t serf__destroy_request(serf_request_t *request)
         serf_request_t *r, *next;
 
         for (r = request->depends_first; r; r = next) {
-            next = r->next;
+            next = r->depends_next;
 
             r->depends_on = NULL;
             r->depends_next = NULL;
@@ -190,6 +257,19 @@ apr_status_t serf__destroy_request(serf_request_t *request)
     }
     else {
 
+        if (request->replay_owner) {
+            /* We borrowed the buckets of our owner's pool */
+            if (request->resp_bkt) {
+                serf_bucket_destroy(request->resp_bkt);
+                request->resp_bkt = NULL;
+            }
+            request->replay_owner->replay_discard = NULL;
+            request->replay_owner = NULL;
+        }
+        else if (request->replay_discard) {
+            replay_handover_pool(request);
+        }
+
         if (request->respool) {
           apr_pool_t *pool = request->respool;
 
@@ -197,7 +277,7 @@ apr_status_t serf__destroy_request(serf_request_t *request)
           apr_pool_destroy(pool);
         }
 
-        serf_bucket_mem_free(conn->allocator, request);
+        serf_bucket_mem_free(request->origin->allocator, request);
     }
 
     return APR_SUCCESS;
@@ -253,13 +333,79 @@ unsigned int serf__req_list_length(serf_request_t *req)
     return length;
 }
 
+/* Copy all headers, except those that serf itself sets for every attempt */
+static int replay_save_header(void *baton,
+                              const char *key,
+                              const char *value)
+{
+    serf_request_t *request = baton;
+
+    if (request->conn->ctx->cred_cb
+        && (strcasecmp(key, "Authorization") == 0
+            || strcasecmp(key, "Proxy-Authorization") == 0)) {
+        return 0;
+    }
+
+    serf_bucket_headers_setc(request->replay_headers, key, value);
+    return 0;
+}
+
+static int replay_restore_header(void *baton,
+                                 const char *key,
+                                 const char *value)
+{
+    serf_bucket_t *hdrs = baton;
+
+    /* Don't duplicate what serf_request_bucket_request_create() added */
+    if ((strcasecmp(key, "Host") == 0
+         || strcasecmp(key, "Authorization") == 0
+         || strcasecmp(key, "Proxy-Authorization") == 0)
+        && serf_bucket_headers_get(hdrs, key)) {
+        return 0;
+    }
+
+    serf_bucket_headers_setn(hdrs, key, value);
+    return 0;
+}
+
+/* Captures what we need to replay REQUEST, right after setup. The body
+   is wrapped in a replay bucket that is owned by the request */
+static void replay_capture(serf_request_t *request)
+{
+    serf_bucket_t *req_bkt = request->req_bkt;
+    serf_bucket_t *body;
+
+    if (!req_bkt || !SERF_BUCKET_IS_REQUEST(req_bkt))
+        return;
+
+    serf__bucket_request_read(req_bkt, &body, &request->replay_uri,
+                              &request->replay_method);
+    request->replay_len = serf__bucket_request_get_CL(req_bkt);
+
+    if (body) {
+        request->replay_body = serf_bucket_replay_create(
+                                            body,
+                                            request->replay_budget,
+                                            request->replay_temp_dir,
+                                            request->allocator);
+        serf__bucket_request_set_body(
+                req_bkt,
+                serf_bucket_barrier_create(request->replay_body,
+                                           request->allocator));
+    }
+
+    request->replay_headers = serf_bucket_headers_create(request->allocator);
+    serf_bucket_headers_do(serf_bucket_request_get_headers(req_bkt),
+                           replay_save_header, request);
+}
+
 apr_status_t serf__setup_request(serf_request_t *request)
 {
-    serf_connection_t *conn = request->conn;
     apr_status_t status;
 
-    /* Now that we are about to serve the request, allocate a pool. */
-    apr_pool_create(&request->respool, conn->pool);
+    /* Now that we are about to serve the request, allocate a pool. The
+       connection it was created for might outlive the one serving it */
+    apr_pool_create(&request->respool, request->origin->pool);
     request->allocator = serf_bucket_allocator_create(request->respool,
                                                       NULL, NULL);
     apr_pool_cleanup_register(request->respool, request,
@@ -273,15 +419,76 @@ apr_status_t serf__setup_request(serf_request_t *request)
                             &request->handler,
                             &request->handler_baton,
                             request->respool);
+
+    if (!status && request->replay_enabled)
+        replay_capture(request);
+
     return status;
 }
 
+apr_status_t serf__request_replay(serf_request_t *request)
+{
+    serf_bucket_t *body = NULL;
+    apr_status_t status;
+
+    if (!request->replay_headers || request->resp_bkt)
+        return APR_ENOTIMPL;
+
+    if (request->replay_body) {
+        status = serf_bucket_replay_rewind(request->replay_body);
+        if (status)
+            return status;
+    }
+
+    /* Tell the protocol handler (if any) that this attempt is gone */
+    if (request->protocol_baton && request->conn->perform_cancel_request)
+        request->conn->perform_cancel_request(request, SERF_ERROR_HTTP2_CANCEL);
+
+    /* Once writing started the old request bucket is owned by the
+       connection */
+    if (request->req_bkt && request->writing == SERF_WRITING_NONE)
+        serf_bucket_destroy(request->req_bkt);
+
+    request->req_bkt = NULL;
+    request->writing = SERF_WRITING_NONE;
+    request->auth_baton = NULL;
+    request->protocol_baton = NULL;
+    request->auth_done = false;
+
+    if (request->replay_body)
+        body = serf_bucket_barrier_create(request->replay_body,
+                                          request->allocator);
+
+    request->req_bkt = serf_request_bucket_request_create(
+                                                request,
+                                                request->replay_method,
+                                                request->replay_uri,
+                                                body,
+                                                request->allocator);
+    if (request->replay_len >= 0)
+        serf_bucket_request_set_CL(request->req_bkt, request->replay_len);
+
+    serf_bucket_headers_do(request->replay_headers, replay_restore_header,
+                           serf_bucket_request_get_headers(request->req_bkt));
+
+    serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, request->conn->config,
+              "replaying request 0x%p without setup\n", request);
+
+    return APR_SUCCESS;
+}
+
 /* A response message was received from the server, so call
    the handler as specified on the original request. */
 apr_status_t serf__handle_response(serf_request_t *request,
                                    apr_pool_t *pool)
 {
     bool consumed_response = false;
+    apr_status_t status;
+
+    /* A coalesced request might have to go over its own connection */
+    status = serf__coalesce_handle_response(&consumed_response, request);
+    if (status || consumed_response)
+        return status;
 
     /* Only enable the new authentication framework if the program has
      * registered an authentication credential callback.
@@ -290,8 +497,6 @@ apr_status_t serf__handle_response(serf_request_t *request,
      * themselves by not registering credential callbacks.
      */
     if (!request->auth_done && request->conn->ctx->cred_cb) {
-        apr_status_t status;
-
         if (!SERF_BUCKET_IS_RESPONSE(request->resp_bkt)) {
             request->auth_done = true;
             status = APR_SUCCESS;
@@ -428,6 +633,7 @@ create_request(serf_connection_t *conn,
 
     request = serf_bucket_mem_alloc(conn->allocator, sizeof(*request));
     request->conn = conn;
+    request->origin = conn;
     request->setup = setup;
     request->setup_baton = setup_baton;
     request->handler = NULL;
@@ -446,6 +652,20 @@ create_request(serf_connection_t *conn,
     request->depends_next = NULL;
     request->depends_first = NULL;
     request->dep_priority = SERF_REQUEST_PRIORITY_DEFAULT;
+    request->pushback_bkt = NULL;
+    request->pushback_interval = 0;
+    request->pushback_drain_at = 0;
+    request->pushback_resumed = false;
+    request->replay_enabled = false;
+    request->replay_budget = 0;
+    request->replay_temp_dir = NULL;
+    request->replay_method = NULL;
+    request->replay_uri = NULL;
+    request->replay_len = -1;
+    request->replay_headers = NULL;
+    request->replay_body = NULL;
+    request->replay_discard = NULL;
+    request->replay_owner = NULL;
 
     return request;
 }
@@ -509,6 +729,8 @@ insert_priority_request(serf_request_t *request)
         request->next = iter;
         conn->unwritten_reqs = request;
     }
+    if (!iter)
+        conn->unwritten_reqs_tail = request;
     conn->nr_of_unwritten_reqs++;
 
     /* Ensure our pollset becomes writable in context run */
@@ -574,6 +796,7 @@ apr_status_t serf_connection__request_requeue(serf_request_t *request)
 {
     serf_request_t *discard;
     serf_request_t **pr;
+    bool replay;
 
     /* For some reason, somebody wants to restart this request, that was
        at least partially written and partially read. Most likely to
@@ -584,13 +807,29 @@ apr_status_t serf_connection__request_requeue(serf_request_t *request)
        ready to write it again.. preferably as the first new request.
      */
 
+    /* When we captured everything at setup we can build the request again
+       ourselves, instead of calling setup again. The discard request then
+       borrows our pool, which must outlive the application's batons. Only
+       on HTTP/1, where the discard request is guaranteed to complete before
+       the new attempt. */
+    replay = (request->replay_headers != NULL
+              && request->writing == SERF_WRITING_FINISHED
+              && request->conn->framing_type
+                            == SERF_CONNECTION_FRAMING_TYPE_HTTP1
+              && !request->replay_discard);
+
+    if (replay && request->replay_body
+        && serf_bucket_replay_rewind(request->replay_body)) {
+        replay = false;
+    }
+
     /* Setup a new request to handle discarding the remaining body */
     discard = create_request(request->conn,
                              NULL, NULL,
                              request->priority,
                              request->ssltunnel);
 
-    discard->respool = request->respool;
+    discard->respool = replay ? NULL : request->respool;
     discard->allocator = request->allocator;
     discard->req_bkt = request->req_bkt;
     discard->resp_bkt = request->resp_bkt;
@@ -610,6 +849,18 @@ apr_status_t serf_connection__request_requeue(serf_request_t *request)
 
     discard->writing = request->writing;
 
+    if (replay) {
+        discard->replay_owner = request;
+        request->replay_discard = discard;
+    }
+    else {
+        /* The captured buckets live in the pool that we hand over */
+        discard->replay_body = request->replay_body;
+        discard->replay_headers = request->replay_headers;
+        request->replay_body = NULL;
+        request->replay_headers = NULL;
+    }
+
     if (discard->respool) {
         apr_pool_cleanup_kill(discard->respool, request, clean_resp);
         apr_pool_cleanup_register(discard->respool, discard,
@@ -663,20 +914,30 @@ apr_status_t serf_connection__request_requeue(serf_request_t *request)
         request->conn->perform_cancel_request(discard, SERF_ERROR_HTTP2_CANCEL);
 
     /* And now unhook the existing request */
-    request->allocator = NULL;
-    request->respool = NULL;
     request->req_bkt = NULL;
     request->resp_bkt = NULL;
     request->writing = SERF_WRITING_NONE;
     request->auth_baton = NULL;
     request->protocol_baton = NULL;
-
-    request->acceptor = NULL;
-    request->acceptor_baton = NULL;
-    request->handler = NULL;
-    request->handler_baton = NULL;
     request->auth_done = false;
 
+    if (replay) {
+        /* Keeps our pool, acceptor and handler */
+        apr_status_t status = serf__request_replay(request);
+
+        if (status)
+            return status;
+    }
+    else {
+        request->allocator = NULL;
+        request->respool = NULL;
+
+        request->acceptor = NULL;
+        request->acceptor_baton = NULL;
+        request->handler = NULL;
+        request->handler_baton = NULL;
+    }
+
     if (discard->depends_first || discard->depends_on) {
         serf_connection_request_prioritize(request, discard, 0xFFFF,
                                            TRUE);
@@ -711,7 +972,8 @@ void serf_connection_request_prioritize(serf_request_t *request,
     if (request->depends_on != depends_on) {
         serf_request_t *r;
 
-        if (depends_on->conn != request->conn || depends_on == request)
+        if (depends_on
+            && (depends_on->conn != request->conn || depends_on == request))
             abort();
 
         /* If we are indirectly made dependent on ourself, we first
@@ -767,7 +1029,7 @@ void serf_connection_request_prioritize(serf_request_t *request,
 
                 if (r) {
                     r->depends_next = request->depends_first;
-                    r->depends_first = depends_on->depends_first;
+                    request->depends_first = depends_on->depends_first;
                 }
                 request->depends_next = NULL;
             }
@@ -827,6 +1089,81 @@ void serf_request_set_handler(
 }
 
 
+apr_status_t serf_request_pushback(
+    serf_request_t *request,
+    serf_bucket_t *saver,
+    apr_interval_time_t drain_interval)
+{
+    serf_connection_t *conn = request->conn;
+    serf_request_t *other;
+
+    if (!SERF_BUCKET_IS_SAVER(saver))
+        return APR_EINVAL;
+
+    /* Pausing a single stream on a multiplexed connection needs flow
+       control, instead of just not reading the socket */
+    if (conn->framing_type != SERF_CONNECTION_FRAMING_TYPE_HTTP1
+        || conn->async_responses) {
+
+        return APR_ENOTIMPL;
+    }
+
+    /* The saver drains whatever arrives on the connection, which would
+       include the responses to pipelined requests */
+    for (other = conn->written_reqs; other; other = other->next) {
+        if (other != request)
+            return APR_EBUSY;
+    }
+    for (other = conn->unwritten_reqs; other; other = other->next) {
+        if (other != request && other->writing != SERF_WRITING_NONE)
+            return APR_EBUSY;
+    }
+
+    request->pushback_bkt = saver;
+    request->pushback_interval = drain_interval;
+    request->pushback_drain_at = apr_time_now() + drain_interval;
+    request->pushback_resumed = false;
+
+#ifdef SERF_DEBUG_BUCKET_USE
+    /* The handler is allowed to stop reading before EAGAIN now */
+    serf_debug__pushback(saver->allocator);
+#endif
+
+    serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, conn->config,
+              "Pushback applied on response of request 0x%p\n", request);
+
+    /* Stop polling for input */
+    serf_io__set_pollset_dirty(&conn->io);
+
+    return APR_SUCCESS;
+}
+
+
+void serf_request_resume(
+    serf_request_t *request)
+{
+    if (!request->pushback_bkt)
+        return;
+
+    request->pushback_bkt = NULL;
+
+    /* Make sure the handler gets to see the saved data, even when no
+       new data arrives on the connection */
+    request->pushback_resumed = true;
+    serf_io__set_pollset_dirty(&request->conn->io);
+}
+
+void serf_request_set_replayable(
+    serf_request_t *request,
+    apr_size_t memory_budget,
+    const char *temp_dir)
+{
+    request->replay_enabled = true;
+    request->replay_budget = memory_budget;
+    request->replay_temp_dir = temp_dir;
+}
+
+
 serf_bucket_t *serf_request_bucket_request_create(
     serf_request_t *request,
     const char *method,
@@ -836,7 +1173,7 @@ serf_bucket_t *serf_request_bucket_request_create(
 {
     serf_bucket_t *req_bkt;
     serf_bucket_t *hdrs_bkt;
-    serf_connection_t *conn = request->conn;
+    serf_connection_t *conn = request->origin;
     serf_context_t *ctx = conn->ctx;
     int tunneled;
 
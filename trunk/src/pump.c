@@ -227,6 +227,8 @@ static apr_status_t socket_writev(serf_pump_t *pump)
 
     status = apr_socket_sendv(pump->skt, pump->vec,
                               pump->vec_len, &written);
+    pump->write_calls++;
+    pump->bytes_written += written;
     if (status && !APR_STATUS_IS_EAGAIN(status))
         serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, pump->config,
                   "socket_sendv error %d on 0x%p\n", status, pump->io->u.v);
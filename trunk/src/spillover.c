@@ -0,0 +1,338 @@
+/* ====================================================================
+ *    Licensed to the Apache Software Foundation (ASF) under one
+ *    or more contributor license agreements.  See the NOTICE file
+ *    distributed with this work for additional information
+ *    regarding copyright ownership.  The ASF licenses this file
+ *    to you under the Apache License, Version 2.0 (the
+ *    "License"); you may not use this file except in compliance
+ *    with the License.  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing,
+ *    software distributed under the License is distributed on an
+ *    "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ *    KIND, either express or implied.  See the License for the
+ *    specific language governing permissions and limitations
+ *    under the License.
+ * ====================================================================
+ */
+
+#include <stdlib.h>
+
+#include <apr_pools.h>
+#include <apr_time.h>
+
+#include "serf.h"
+#include "serf_private.h"
+
+/* Spillover of HTTP/2 requests to additional connections.
+
+   A connection with a spawn callback is the primary of a group. Before
+   every run the requests that the HTTP/2 session of a group member can't
+   start are moved to the member with the most room, and new members are
+   spawned when none has room. Members that stay idle are closed again. */
+
+#define DEFAULT_MAX_CONNS 4
+
+/* How long an additional connection may stay idle before it is closed */
+#define SPILLOVER_IDLE_TIME apr_time_from_sec(5)
+
+/* Returns whether CONN runs an HTTP/2 session that knows its limits */
+static bool is_http2(serf_connection_t *conn)
+{
+    return conn->framing_type == SERF_CONNECTION_FRAMING_TYPE_HTTP2
+           && conn->protocol_baton != NULL;
+}
+
+/* Returns the number of requests CONN could have in flight. Members that
+   didn't set up their session yet are assumed to get LIMIT streams, like
+   the primary */
+static apr_uint32_t stream_limit(serf_connection_t *conn,
+                                 apr_uint32_t limit)
+{
+    apr_uint32_t send_window;
+
+    if (!is_http2(conn))
+        return limit;
+
+    /* New requests can't send their bodies while the connection window
+       is exhausted */
+    serf__http2_protocol_get_stats(conn->protocol_baton, NULL, &send_window,
+                                   NULL, NULL);
+    if (send_window == 0)
+        return 0;
+
+    return serf__http2_protocol_max_streams(conn->protocol_baton);
+}
+
+/* Returns how many more requests can be queued on CONN before they have
+   to wait for a stream */
+static apr_int64_t conn_room(serf_connection_t *conn,
+                             apr_uint32_t limit)
+{
+    return (apr_int64_t)stream_limit(conn, limit)
+           - conn->nr_of_written_reqs - conn->nr_of_unwritten_reqs;
+}
+
+static unsigned int group_max_conns(serf_connection_t *primary)
+{
+    const char *value;
+
+    if (serf_config_get_string(primary->config, SERF_CONFIG_HOST_MAX_CONNS,
+                               &value) == APR_SUCCESS
+        && value)
+    {
+        int max_conns = atoi(value);
+
+        return max_conns > 0 ? (unsigned int)max_conns : 1;
+    }
+
+    return DEFAULT_MAX_CONNS;
+}
+
+static bool can_move_request(serf_request_t *request)
+{
+    return request->writing == SERF_WRITING_NONE
+           && !request->respool
+           && !request->protocol_baton
+           && !request->priority
+           && !request->ssltunnel
+           && !request->auth_baton
+           && !request->depends_on
+           && !request->depends_first;
+}
+
+/* Moves REQUEST, which follows PREV in the unwritten list of FROM, to the
+   end of the unwritten list of TO */
+static void move_request(serf_request_t *request,
+                         serf_request_t *prev,
+                         serf_connection_t *from,
+                         serf_connection_t *to)
+{
+    if (prev)
+        prev->next = request->next;
+    else
+        from->unwritten_reqs = request->next;
+
+    if (from->unwritten_reqs_tail == request)
+        from->unwritten_reqs_tail = prev;
+
+    from->nr_of_unwritten_reqs--;
+
+    request->next = NULL;
+    request->conn = to;
+    serf__link_requests(&to->unwritten_reqs, &to->unwritten_reqs_tail,
+                        request);
+    to->nr_of_unwritten_reqs++;
+
+    to->spill_idle_since = 0;
+    serf_io__set_pollset_dirty(&to->io);
+}
+
+static apr_status_t spawn_member(serf_connection_t **member,
+                                 serf_connection_t *primary)
+{
+    serf_connection_t *conn;
+    apr_pool_t *pool;
+    apr_status_t status;
+
+    apr_pool_create(&pool, primary->pool);
+
+    status = primary->spill_spawn(&conn, primary, primary->spill_spawn_baton,
+                                  pool);
+    if (status) {
+        apr_pool_destroy(pool);
+        return status;
+    }
+
+    conn->spill_primary = primary;
+    conn->spill_next = primary->spill_next;
+    primary->spill_next = conn;
+
+    if (!conn->http2_window_max)
+        conn->http2_window_max = primary->http2_window_max;
+
+    serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, primary->config,
+              "spawned connection 0x%p for requests of 0x%p\n",
+              conn, primary);
+
+    *member = conn;
+    return APR_SUCCESS;
+}
+
+/* Moves the requests that CONN can't start to other members of the group
+   of PRIMARY */
+static apr_status_t spill_requests(serf_connection_t *conn,
+                                   serf_connection_t *primary,
+                                   apr_uint32_t limit)
+{
+    serf_request_t *request, *prev;
+    apr_int64_t keep = stream_limit(conn, limit)
+                       - (apr_int64_t)conn->nr_of_written_reqs;
+
+    prev = NULL;
+    request = conn->unwritten_reqs;
+    while (request) {
+        serf_request_t *next = request->next;
+        serf_connection_t *target = NULL;
+        serf_connection_t *m;
+        apr_int64_t best_room = 0;
+        unsigned int count = 0;
+
+        /* The requests that fit stay where they are */
+        if (keep > 0 || !can_move_request(request)) {
+            keep--;
+            prev = request;
+            request = next;
+            continue;
+        }
+
+        for (m = primary; m; m = m->spill_next) {
+            apr_int64_t room;
+
+            count++;
+            if (m == conn)
+                continue;
+
+            room = conn_room(m, limit);
+            if (room > best_room) {
+                best_room = room;
+                target = m;
+            }
+        }
+
+        if (!target) {
+            apr_status_t status;
+
+            if (count >= group_max_conns(primary))
+                break;
+
+            status = spawn_member(&target, primary);
+            if (status)
+                return status;
+        }
+
+        move_request(request, prev, conn, target);
+        request = next;
+    }
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t process_group(serf_connection_t *primary,
+                                  apr_time_t now)
+{
+    serf_connection_t *m, *next;
+    apr_uint32_t limit;
+    apr_status_t status;
+
+    /* Nothing to balance until we know how many streams the server
+       allows us */
+    if (!is_http2(primary))
+        return APR_SUCCESS;
+
+    limit = serf__http2_protocol_max_streams(primary->protocol_baton);
+
+    for (m = primary; m; m = m->spill_next) {
+        if (m->unwritten_reqs && is_http2(m)
+            && conn_room(m, limit) < 0)
+        {
+            status = spill_requests(m, primary, limit);
+            if (status)
+                return status;
+        }
+    }
+
+    /* Consolidate when the primary can handle the traffic again */
+    if (conn_room(primary, limit) <= 0)
+        return APR_SUCCESS;
+
+    for (m = primary->spill_next; m; m = next) {
+        next = m->spill_next;
+
+        if (m->nr_of_written_reqs || m->nr_of_unwritten_reqs) {
+            m->spill_idle_since = 0;
+        }
+        else if (!m->spill_idle_since) {
+            m->spill_idle_since = now;
+        }
+        else if (now - m->spill_idle_since > SPILLOVER_IDLE_TIME) {
+            serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, primary->config,
+                      "closing idle connection 0x%p spawned for 0x%p\n",
+                      m, primary);
+            apr_pool_destroy(m->pool);
+        }
+    }
+
+    return APR_SUCCESS;
+}
+
+apr_status_t serf__process_spillover(serf_context_t *ctx)
+{
+    apr_time_t now = 0;
+    int i;
+
+    /* Members are always added after their primary, so spawning and closing
+       them doesn't move the connections we still have to visit */
+    for (i = ctx->conns->nelts; i--; ) {
+        serf_connection_t *conn = GET_CONN(ctx, i);
+        apr_status_t status;
+
+        if (!conn->spill_spawn || conn->spill_primary)
+            continue;
+
+        if (!now)
+            now = apr_time_now();
+
+        status = process_group(conn, now);
+        if (status)
+            return status;
+    }
+
+    return APR_SUCCESS;
+}
+
+void serf__spillover_close(serf_connection_t *conn)
+{
+    serf_connection_t **pm;
+
+    /* Closing the primary closes the whole group */
+    while (conn->spill_next) {
+        serf_connection_t *m = conn->spill_next;
+
+        conn->spill_next = m->spill_next;
+        m->spill_next = NULL;
+        apr_pool_destroy(m->pool);
+    }
+
+    if (!conn->spill_primary)
+        return;
+
+    for (pm = &conn->spill_primary->spill_next; *pm; pm = &(*pm)->spill_next)
+    {
+        if (*pm == conn) {
+            *pm = conn->spill_next;
+            break;
+        }
+    }
+}
+
+void serf_connection_set_spillover(serf_connection_t *conn,
+                                   serf_connection_spawn_t spawn,
+                                   void *spawn_baton)
+{
+    conn->spill_spawn = spawn;
+    conn->spill_spawn_baton = spawn_baton;
+}
+
+unsigned int serf_connection_get_spillover_count(serf_connection_t *conn)
+{
+    serf_connection_t *m;
+    unsigned int count = 0;
+
+    for (m = conn->spill_next; m; m = m->spill_next)
+        count++;
+
+    return count;
+}
@@ -0,0 +1,509 @@
+/* ====================================================================
+ *    Licensed to the Apache Software Foundation (ASF) under one
+ *    or more contributor license agreements.  See the NOTICE file
+ *    distributed with this work for additional information
+ *    regarding copyright ownership.  The ASF licenses this file
+ *    to you under the Apache License, Version 2.0 (the
+ *    "License"); you may not use this file except in compliance
+ *    with the License.  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing,
+ *    software distributed under the License is distributed on an
+ *    "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ *    KIND, either express or implied.  See the License for the
+ *    specific language governing permissions and limitations
+ *    under the License.
+ * ====================================================================
+ */
+
+#include <apr_pools.h>
+#include <apr_strings.h>
+#include <apr_file_io.h>
+#include <apr_base64.h>
+#if APR_HAS_THREADS
+#include <apr_thread_mutex.h>
+#endif
+
+#include "serf.h"
+#include "serf_bucket_util.h"
+#include "serf_bucket_types.h"
+
+#include "serf_private.h"
+
+/* TLS sessions shared by the connections of several contexts.
+
+   Sessions are kept per host in least recently used order. TLS 1.3
+   servers send several tickets per connection, which should each be used
+   only once, so a few of them are kept per host and handed out one by one.
+   Older sessions can be resumed any number of times and stay in the cache
+   until they expire or are pushed out.
+
+   With a file configured, new sessions are also appended to that file and
+   the sessions in it are loaded when the file is set, so later processes
+   can resume them. Each line in the file holds one session:
+
+     EXPIRES SINGLE_USE HOST:PORT BASE64-DER
+
+   Expired sessions are dropped from the file when it is loaded. Tickets
+   handed out by one process remain in the file for the others; servers
+   accept those as well, at some cost in privacy. Once the file holds
+   SESSION_CACHE_FILE_FACTOR times as many sessions as the cache, it is
+   rewritten with the sessions in the cache of this process.
+
+   Resuming a session skips the verification of the server certificate,
+   so only sessions whose certificate chain passed all checks, without
+   exceptions made by the application, are stored. */
+
+/* Tickets kept per host */
+#define SESSION_CACHE_HOST_MAX 4
+
+/* Bound of the cache file, relative to the size of the cache */
+#define SESSION_CACHE_FILE_FACTOR 2
+
+#define SERF_CONFIG__SSL_SESSION_CACHE  (SERF_CONFIG_PER_CONTEXT | 0xF00001)
+
+typedef struct session_entry_t {
+    struct session_entry_t *next;  /* Less recently used */
+    struct session_entry_t *prev;  /* More recently used */
+
+    char *host;
+    unsigned char *session;
+    apr_size_t session_len;
+    apr_time_t expires;
+    bool single_use;
+} session_entry_t;
+
+struct serf_ssl_session_cache_t {
+    apr_pool_t *pool;
+    serf_bucket_alloc_t *allocator;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *lock;
+#endif
+
+    session_entry_t *first;
+    session_entry_t *last;
+    apr_size_t count;
+    apr_size_t max_sessions;
+
+    const char *path;       /* Optional file shared with other processes */
+    apr_pool_t *file_pool;  /* Cleared after each access to the file */
+    apr_size_t file_lines;  /* Sessions in the file, as far as we know */
+};
+
+static void cache_lock(serf_ssl_session_cache_t *cache)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(cache->lock);
+#endif
+}
+
+static void cache_unlock(serf_ssl_session_cache_t *cache)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(cache->lock);
+#endif
+}
+
+static void unlink_entry(serf_ssl_session_cache_t *cache,
+                         session_entry_t *entry)
+{
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        cache->first = entry->next;
+
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        cache->last = entry->prev;
+
+    entry->next = entry->prev = NULL;
+}
+
+static void link_first(serf_ssl_session_cache_t *cache,
+                       session_entry_t *entry)
+{
+    entry->prev = NULL;
+    entry->next = cache->first;
+
+    if (cache->first)
+        cache->first->prev = entry;
+    else
+        cache->last = entry;
+
+    cache->first = entry;
+}
+
+static void remove_entry(serf_ssl_session_cache_t *cache,
+                         session_entry_t *entry)
+{
+    unlink_entry(cache, entry);
+    cache->count--;
+
+    /* Host and session share the allocation of the entry */
+    serf_bucket_mem_free(cache->allocator, entry);
+}
+
+static session_entry_t *add_entry(serf_ssl_session_cache_t *cache,
+                                  const char *host,
+                                  const unsigned char *session,
+                                  apr_size_t session_len,
+                                  apr_time_t expires,
+                                  bool single_use)
+{
+    apr_size_t host_len = strlen(host) + 1;
+    session_entry_t *entry;
+    session_entry_t *oldest = NULL;
+    int for_host = 0;
+
+    for (entry = cache->first; entry; entry = entry->next) {
+        if (strcmp(entry->host, host) == 0) {
+            oldest = entry;
+            for_host++;
+        }
+    }
+
+    if (for_host >= SESSION_CACHE_HOST_MAX)
+        remove_entry(cache, oldest);
+
+    while (cache->count >= cache->max_sessions && cache->last)
+        remove_entry(cache, cache->last);
+
+    entry = serf_bucket_mem_alloc(cache->allocator,
+                                  sizeof(*entry) + host_len + session_len);
+    entry->host = (char *)(entry + 1);
+    entry->session = (unsigned char *)entry->host + host_len;
+    entry->session_len = session_len;
+    entry->expires = expires;
+    entry->single_use = single_use;
+
+    memcpy(entry->host, host, host_len);
+    memcpy(entry->session, session, session_len);
+
+    link_first(cache, entry);
+    cache->count++;
+
+    return entry;
+}
+
+/* Returns ENTRY as a line of the cache file */
+static const char *format_entry(const session_entry_t *entry,
+                                apr_pool_t *pool)
+{
+    char *encoded;
+
+    encoded = apr_palloc(pool, apr_base64_encode_len((int)entry->session_len));
+    apr_base64_encode_binary(encoded, entry->session,
+                             (int)entry->session_len);
+
+    return apr_psprintf(pool, "%" APR_TIME_T_FMT " %d %s %s\n",
+                        entry->expires, entry->single_use ? 1 : 0,
+                        entry->host, encoded);
+}
+
+/* Adds the session in LINE of the cache file, unless it expired before
+   NOW or the line is damaged. Returns whether it was added */
+static bool parse_entry(serf_ssl_session_cache_t *cache,
+                        char *line,
+                        apr_time_t now,
+                        apr_pool_t *pool)
+{
+    char *expires, *single_use, *host, *encoded, *last;
+    unsigned char *session;
+    int session_len;
+    apr_time_t when;
+
+    expires = apr_strtok(line, " ", &last);
+    single_use = apr_strtok(NULL, " ", &last);
+    host = apr_strtok(NULL, " ", &last);
+    encoded = apr_strtok(NULL, " \r", &last);
+
+    if (!expires || !single_use || !host || !encoded)
+        return false;
+
+    when = apr_strtoi64(expires, NULL, 10);
+    if (when <= now)
+        return false;
+
+    session = apr_palloc(pool, apr_base64_decode_len(encoded));
+    session_len = apr_base64_decode_binary(session, encoded);
+    if (session_len <= 0)
+        return false;
+
+    add_entry(cache, host, session, session_len, when,
+              strcmp(single_use, "0") != 0);
+    return true;
+}
+
+/* Replaces the content of the locked FILE with the sessions in CACHE */
+static apr_status_t write_file(serf_ssl_session_cache_t *cache,
+                               apr_file_t *file,
+                               apr_pool_t *pool)
+{
+    session_entry_t *entry;
+    apr_off_t offset = 0;
+    apr_status_t status;
+
+    status = apr_file_trunc(file, 0);
+    if (!status)
+        status = apr_file_seek(file, APR_SET, &offset);
+
+    /* Oldest first, so the order is the same when loaded again */
+    for (entry = cache->last; entry && !status; entry = entry->prev) {
+        const char *out = format_entry(entry, pool);
+
+        status = apr_file_write_full(file, out, strlen(out), NULL);
+    }
+
+    cache->file_lines = cache->count;
+
+    return status;
+}
+
+/* Loads the sessions in the cache file, and rewrites the file without
+   the sessions that weren't kept */
+static apr_status_t load_file(serf_ssl_session_cache_t *cache,
+                              apr_pool_t *pool)
+{
+    apr_time_t now = apr_time_now();
+    apr_file_t *file;
+    apr_finfo_t finfo;
+    apr_size_t len;
+    apr_size_t lines = 0;
+    apr_size_t kept = 0;
+    apr_size_t count = cache->count;
+    char *buf, *line, *next;
+    apr_status_t status;
+
+    status = apr_file_open(&file, cache->path,
+                           APR_FOPEN_READ | APR_FOPEN_WRITE
+                           | APR_FOPEN_CREATE | APR_FOPEN_BINARY,
+                           APR_FPROT_UREAD | APR_FPROT_UWRITE, pool);
+    if (status)
+        return status;
+
+    status = apr_file_lock(file, APR_FLOCK_EXCLUSIVE);
+    if (status) {
+        apr_file_close(file);
+        return status;
+    }
+
+    status = apr_file_info_get(&finfo, APR_FINFO_SIZE, file);
+    if (status)
+        goto cleanup;
+
+    len = (apr_size_t)finfo.size;
+    buf = apr_palloc(pool, len + 1);
+    if (len) {
+        status = apr_file_read_full(file, buf, len, &len);
+        if (status)
+            goto cleanup;
+    }
+    buf[len] = '\0';
+
+    for (line = buf; *line; line = next) {
+        next = strchr(line, '\n');
+
+        /* A partial line, from a process that died while writing */
+        if (!next) {
+            lines++;
+            break;
+        }
+
+        *next++ = '\0';
+        lines++;
+
+        if (parse_entry(cache, line, now, pool))
+            kept++;
+    }
+
+    /* Every line was kept, and no session was pushed out of the cache */
+    if (kept == lines && cache->count == count + kept) {
+        cache->file_lines = lines;
+        goto cleanup;
+    }
+
+    status = write_file(cache, file, pool);
+
+cleanup:
+    apr_file_unlock(file);
+    apr_file_close(file);
+
+    return status;
+}
+
+/* Appends ENTRY to the cache file, or rewrites the file once it grew
+   too large */
+static apr_status_t append_to_file(serf_ssl_session_cache_t *cache,
+                                   const session_entry_t *entry)
+{
+    apr_pool_t *pool = cache->file_pool;
+    bool rewrite;
+    apr_file_t *file;
+    apr_status_t status;
+
+    rewrite = (cache->file_lines
+               >= SESSION_CACHE_FILE_FACTOR * cache->max_sessions);
+
+    status = apr_file_open(&file, cache->path,
+                           APR_FOPEN_WRITE
+                           | (rewrite ? 0 : APR_FOPEN_APPEND)
+                           | APR_FOPEN_CREATE | APR_FOPEN_BINARY,
+                           APR_FPROT_UREAD | APR_FPROT_UWRITE, pool);
+    if (!status) {
+        status = apr_file_lock(file, APR_FLOCK_EXCLUSIVE);
+        if (!status) {
+            if (rewrite) {
+                status = write_file(cache, file, pool);
+            }
+            else {
+                const char *out = format_entry(entry, pool);
+
+                status = apr_file_write_full(file, out, strlen(out), NULL);
+                cache->file_lines++;
+            }
+            apr_file_unlock(file);
+        }
+        apr_file_close(file);
+    }
+
+    apr_pool_clear(pool);
+    return status;
+}
+
+apr_status_t serf_ssl_session_cache_create(serf_ssl_session_cache_t **cache,
+                                           apr_size_t max_sessions,
+                                           apr_pool_t *pool)
+{
+    serf_ssl_session_cache_t *c = apr_pcalloc(pool, sizeof(*c));
+
+    c->pool = pool;
+    c->allocator = serf_bucket_allocator_create(pool, NULL, NULL);
+    c->max_sessions = max_sessions ? max_sessions : 1;
+
+#if APR_HAS_THREADS
+    {
+        apr_status_t status;
+
+        status = apr_thread_mutex_create(&c->lock, APR_THREAD_MUTEX_DEFAULT,
+                                         pool);
+        if (status)
+            return status;
+    }
+#endif
+
+    *cache = c;
+    return APR_SUCCESS;
+}
+
+apr_status_t serf_ssl_session_cache_set_file(serf_ssl_session_cache_t *cache,
+                                             const char *path,
+                                             apr_pool_t *scratch_pool)
+{
+    apr_status_t status;
+
+    cache_lock(cache);
+
+    if (!cache->file_pool) {
+        status = apr_pool_create(&cache->file_pool, cache->pool);
+        if (status) {
+            cache_unlock(cache);
+            return status;
+        }
+    }
+
+    cache->path = apr_pstrdup(cache->pool, path);
+    status = load_file(cache, scratch_pool);
+
+    cache_unlock(cache);
+
+    return status;
+}
+
+void serf_context_set_ssl_session_cache(serf_context_t *ctx,
+                                        serf_ssl_session_cache_t *cache)
+{
+    serf_config_set_object(ctx->config, SERF_CONFIG__SSL_SESSION_CACHE,
+                           cache);
+}
+
+serf_ssl_session_cache_t *
+serf__ssl_session_cache_from_config(serf_config_t *config)
+{
+    void *cache;
+
+    if (serf_config_get_object(config, SERF_CONFIG__SSL_SESSION_CACHE,
+                               &cache))
+        return NULL;
+
+    return cache;
+}
+
+void serf__ssl_session_cache_store(serf_ssl_session_cache_t *cache,
+                                   const char *host,
+                                   const unsigned char *session,
+                                   apr_size_t session_len,
+                                   apr_time_t expires,
+                                   bool single_use)
+{
+    session_entry_t *entry;
+
+    if (expires <= apr_time_now())
+        return;
+
+    cache_lock(cache);
+
+    entry = add_entry(cache, host, session, session_len, expires,
+                      single_use);
+
+    if (cache->path)
+        (void)append_to_file(cache, entry);
+
+    cache_unlock(cache);
+}
+
+apr_status_t serf__ssl_session_cache_lookup(unsigned char **session,
+                                            apr_size_t *session_len,
+                                            serf_ssl_session_cache_t *cache,
+                                            const char *host,
+                                            serf_bucket_alloc_t *allocator)
+{
+    apr_time_t now = apr_time_now();
+    session_entry_t *entry, *next;
+    apr_status_t status = APR_ENOENT;
+
+    cache_lock(cache);
+
+    for (entry = cache->first; entry; entry = next) {
+        next = entry->next;
+
+        if (entry->expires <= now) {
+            remove_entry(cache, entry);
+            continue;
+        }
+
+        if (strcmp(entry->host, host) != 0)
+            continue;
+
+        *session = serf_bucket_mem_alloc(allocator, entry->session_len);
+        *session_len = entry->session_len;
+        memcpy(*session, entry->session, entry->session_len);
+
+        if (entry->single_use) {
+            remove_entry(cache, entry);
+        }
+        else {
+            unlink_entry(cache, entry);
+            link_first(cache, entry);
+        }
+
+        status = APR_SUCCESS;
+        break;
+    }
+
+    cache_unlock(cache);
+
+    return status;
+}
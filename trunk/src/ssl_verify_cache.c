@@ -0,0 +1,258 @@
+/* ====================================================================
+ *    Licensed to the Apache Software Foundation (ASF) under one
+ *    or more contributor license agreements.  See the NOTICE file
+ *    distributed with this work for additional information
+ *    regarding copyright ownership.  The ASF licenses this file
+ *    to you under the Apache License, Version 2.0 (the
+ *    "License"); you may not use this file except in compliance
+ *    with the License.  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing,
+ *    software distributed under the License is distributed on an
+ *    "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ *    KIND, either express or implied.  See the License for the
+ *    specific language governing permissions and limitations
+ *    under the License.
+ * ====================================================================
+ */
+
+#include <apr_pools.h>
+#include <apr_hash.h>
+#if APR_HAS_THREADS
+#include <apr_thread_mutex.h>
+#endif
+
+#include "serf.h"
+#include "serf_bucket_util.h"
+#include "serf_bucket_types.h"
+
+#include "serf_private.h"
+
+/* Outcomes of server certificate checks, shared by the connections of
+   several contexts.
+
+   The SSL buckets compute the keys: for a certificate chain the
+   fingerprint of the server certificate followed by a hash of the rest of
+   the chain and everything else the outcome depends on, for a stapled
+   OCSP response the fingerprint of the server certificate followed by a
+   hash of the response. The cache only keeps the outcomes in least
+   recently used order, and drops them when they expire. */
+
+#define SERF_CONFIG__SSL_VERIFY_CACHE  (SERF_CONFIG_PER_CONTEXT | 0xF00002)
+
+/* How long a verified chain is kept when the application set no maximum.
+   Trust stores and revocation lists change while certificates remain
+   valid for months */
+#define VERIFY_CACHE_MAX_AGE_DEFAULT apr_time_from_sec(3600)
+
+/* The kind of check, followed by the key */
+#define VERIFY_ENTRY_KEY_SIZE (1 + SERF__SSL_VERIFY_KEY_SIZE)
+
+typedef struct verify_entry_t {
+    struct verify_entry_t *next;  /* Less recently used */
+    struct verify_entry_t *prev;  /* More recently used */
+
+    unsigned char key[VERIFY_ENTRY_KEY_SIZE];
+    apr_time_t expires;
+    int failures;
+} verify_entry_t;
+
+struct serf_ssl_verify_cache_t {
+    apr_pool_t *pool;
+    serf_bucket_alloc_t *allocator;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *lock;
+#endif
+
+    apr_hash_t *entries;  /* key -> verify_entry_t */
+    verify_entry_t *first;
+    verify_entry_t *last;
+    apr_size_t max_entries;
+    apr_interval_time_t max_age;
+};
+
+static void cache_lock(serf_ssl_verify_cache_t *cache)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(cache->lock);
+#endif
+}
+
+static void cache_unlock(serf_ssl_verify_cache_t *cache)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(cache->lock);
+#endif
+}
+
+static void unlink_entry(serf_ssl_verify_cache_t *cache,
+                         verify_entry_t *entry)
+{
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        cache->first = entry->next;
+
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        cache->last = entry->prev;
+
+    entry->next = entry->prev = NULL;
+}
+
+static void link_first(serf_ssl_verify_cache_t *cache,
+                       verify_entry_t *entry)
+{
+    entry->prev = NULL;
+    entry->next = cache->first;
+
+    if (cache->first)
+        cache->first->prev = entry;
+    else
+        cache->last = entry;
+
+    cache->first = entry;
+}
+
+static void remove_entry(serf_ssl_verify_cache_t *cache,
+                         verify_entry_t *entry)
+{
+    unlink_entry(cache, entry);
+    apr_hash_set(cache->entries, entry->key, VERIFY_ENTRY_KEY_SIZE, NULL);
+
+    serf_bucket_mem_free(cache->allocator, entry);
+}
+
+static void make_key(unsigned char *entry_key,
+                     serf__ssl_verify_kind_t kind,
+                     const unsigned char *key)
+{
+    entry_key[0] = (unsigned char)kind;
+    memcpy(entry_key + 1, key, SERF__SSL_VERIFY_KEY_SIZE);
+}
+
+apr_status_t serf_ssl_verify_cache_create(serf_ssl_verify_cache_t **cache,
+                                          apr_size_t max_entries,
+                                          apr_interval_time_t max_age,
+                                          apr_pool_t *pool)
+{
+    serf_ssl_verify_cache_t *c = apr_pcalloc(pool, sizeof(*c));
+
+    c->pool = pool;
+    c->allocator = serf_bucket_allocator_create(pool, NULL, NULL);
+    c->entries = apr_hash_make(pool);
+    c->max_entries = max_entries ? max_entries : 1;
+    c->max_age = max_age > 0 ? max_age : VERIFY_CACHE_MAX_AGE_DEFAULT;
+
+#if APR_HAS_THREADS
+    {
+        apr_status_t status;
+
+        status = apr_thread_mutex_create(&c->lock, APR_THREAD_MUTEX_DEFAULT,
+                                         pool);
+        if (status)
+            return status;
+    }
+#endif
+
+    *cache = c;
+    return APR_SUCCESS;
+}
+
+void serf_context_set_ssl_verify_cache(serf_context_t *ctx,
+                                       serf_ssl_verify_cache_t *cache)
+{
+    serf_config_set_object(ctx->config, SERF_CONFIG__SSL_VERIFY_CACHE,
+                           cache);
+}
+
+serf_ssl_verify_cache_t *
+serf__ssl_verify_cache_from_config(serf_config_t *config)
+{
+    void *cache;
+
+    if (serf_config_get_object(config, SERF_CONFIG__SSL_VERIFY_CACHE,
+                               &cache))
+        return NULL;
+
+    return cache;
+}
+
+void serf__ssl_verify_cache_store(serf_ssl_verify_cache_t *cache,
+                                  serf__ssl_verify_kind_t kind,
+                                  const unsigned char *key,
+                                  int failures,
+                                  apr_time_t expires)
+{
+    unsigned char entry_key[VERIFY_ENTRY_KEY_SIZE];
+    apr_time_t now = apr_time_now();
+    verify_entry_t *entry;
+
+    if (kind == SERF__SSL_VERIFY_CHAIN && expires > now + cache->max_age)
+    {
+        expires = now + cache->max_age;
+    }
+
+    if (expires <= now)
+        return;
+
+    make_key(entry_key, kind, key);
+
+    cache_lock(cache);
+
+    entry = apr_hash_get(cache->entries, entry_key, VERIFY_ENTRY_KEY_SIZE);
+    if (entry) {
+        unlink_entry(cache, entry);
+    }
+    else {
+        while (apr_hash_count(cache->entries) >= cache->max_entries
+               && cache->last)
+        {
+            remove_entry(cache, cache->last);
+        }
+
+        entry = serf_bucket_mem_alloc(cache->allocator, sizeof(*entry));
+        memcpy(entry->key, entry_key, VERIFY_ENTRY_KEY_SIZE);
+        apr_hash_set(cache->entries, entry->key, VERIFY_ENTRY_KEY_SIZE,
+                     entry);
+    }
+
+    entry->expires = expires;
+    entry->failures = failures;
+    link_first(cache, entry);
+
+    cache_unlock(cache);
+}
+
+bool serf__ssl_verify_cache_lookup(int *failures,
+                                   serf_ssl_verify_cache_t *cache,
+                                   serf__ssl_verify_kind_t kind,
+                                   const unsigned char *key)
+{
+    unsigned char entry_key[VERIFY_ENTRY_KEY_SIZE];
+    verify_entry_t *entry;
+    bool found = false;
+
+    make_key(entry_key, kind, key);
+
+    cache_lock(cache);
+
+    entry = apr_hash_get(cache->entries, entry_key, VERIFY_ENTRY_KEY_SIZE);
+    if (entry && entry->expires <= apr_time_now()) {
+        remove_entry(cache, entry);
+    }
+    else if (entry) {
+        *failures = entry->failures;
+
+        unlink_entry(cache, entry);
+        link_first(cache, entry);
+        found = true;
+    }
+
+    cache_unlock(cache);
+
+    return found;
+}
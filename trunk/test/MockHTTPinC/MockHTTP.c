@@ -113,6 +113,9 @@ void mhCleanup(MockHTTP *mh)
         mhStopServer(mh->proxyCtx);
     }
 
+    if (mh->ocspRespCtx) {
+        mhStopServer(mh->ocspRespCtx);
+    }
 
     /* The MockHTTP * is also allocated from mh->pool, so this will destroy
        the MockHTTP structure and all its allocated memory. */
@@ -145,6 +148,14 @@ static apr_status_t runServerLoop(MockHTTP *mh, loopRequestState_t *reqState)
             status = _mhRunServerLoop(mh->servCtx);
             *reqState |= mh->servCtx->reqState;
         }
+        if (mh->ocspRespCtx && mh->ocspRespCtx->threading != mhThreadSeparate) {
+            apr_status_t ocsp_status = _mhRunServerLoop(mh->ocspRespCtx);
+
+            /* Keep looping while either of them has work */
+            if (status != APR_SUCCESS)
+                status = ocsp_status;
+            *reqState |= mh->ocspRespCtx->reqState;
+        }
     } while (status == APR_SUCCESS);
 
     return status;
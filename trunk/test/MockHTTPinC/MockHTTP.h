@@ -90,6 +90,7 @@ typedef struct mhResponseBldr_t mhResponseBldr_t;
 
 #define DEFAULT_SERVER_ID "server"
 #define DEFAULT_PROXY_ID  "proxy"
+#define DEFAULT_OCSP_RESPONDER_ID "ocsp_responder"
 
 /******************************************************************************
  * MockHTTPinC API                                                            *
@@ -178,6 +179,16 @@ typedef struct mhResponseBldr_t mhResponseBldr_t;
                 mhConfigServer(__servctx, __VA_ARGS__, NULL);\
                 mhStartServer(__servctx);
 
+/* An OCSP responder answers each POSTed OCSP request with a response signed
+   with its certificate and key, configured like those of a HTTPS server:
+
+     SetupOCSPResponder(WithPort(17080),
+                        WithCertificateFilesPrefix("test/certs"),
+                        WithCertificateKeyFile("private/serfserverkey.pem"),
+                        WithCertificateKeyPassPhrase("serftest"),
+                        WithCertificateFiles("serfocspresponder.pem"),
+                        WithOCSPCertStatus(mhOCSPCertStatusRevoked))
+ */
 #define   SetupOCSPResponder(...)\
                 __servctx = mhNewOCSPResponder(__mh);\
                 mhConfigServer(__servctx, __VA_ARGS__, NULL);\
@@ -212,6 +223,20 @@ typedef struct mhResponseBldr_t mhResponseBldr_t;
 
 #define     WithOCSPEnabled mhSetServerEnableOCSP(__servctx)
 
+/* The status an OCSP responder reports for each certificate, default is
+   mhOCSPCertStatusGood */
+#define     WithOCSPCertStatus(status)\
+                mhSetOCSPResponderCertStatus(__servctx, (status))
+
+/* Issue session tickets that all connections to this server can resume,
+   and that allow TLS 1.3 early data. The server doesn't read early data,
+   so it rejects what clients send early. */
+#define     WithEarlyDataTickets mhSetServerEarlyDataTickets(__servctx)
+
+/* Like WithEarlyDataTickets, but the server reads and accepts the early
+   data clients send */
+#define     WithEarlyDataAccepted mhSetServerAcceptEarlyData(__servctx)
+
 /* Finalize MockHTTP library initialization */
 #define EndInit\
             }
@@ -483,6 +508,12 @@ typedef struct mhResponseBldr_t mhResponseBldr_t;
 #define EndVerify\
             }
 
+typedef enum mhOCSPCertStatus_t {
+    mhOCSPCertStatusGood,
+    mhOCSPCertStatusRevoked,
+    mhOCSPCertStatusUnknown,
+} mhOCSPCertStatus_t;
+
 typedef enum mhOCSPRespnseStatus_t {
     mhOCSPRespnseStatusSuccessful,
     mhOCSPRespnseStatusMalformedRequest,
@@ -585,6 +616,17 @@ apr_port_t mhProxyPortNr(const MockHTTP *mh);
  */
 apr_port_t mhServerByIDPortNr(const MockHTTP *mh, const char *serverID);
 
+/**
+ * Get the number of bytes of TLS early data that the server accepted, over
+ * all its connections.
+ */
+apr_size_t mhServerEarlyDataReceived(const MockHTTP *mh);
+
+/**
+ * Get the number of OCSP requests the OCSP responder answered.
+ */
+apr_size_t mhOCSPResponderRequestsReceived(const MockHTTP *mh);
+
 
 /******************************************************************************
  * Semi-public API                                                            *
@@ -624,6 +666,10 @@ mhServerSetupBldr_t *mhAddServerCertFileArray(mhServCtx_t *ctx,
 mhServerSetupBldr_t *mhSetServerRequestClientCert(mhServCtx_t *ctx,
                                                   mhClientCertVerification_t v);
 mhServerSetupBldr_t *mhSetServerEnableOCSP(mhServCtx_t *ctx);
+mhServerSetupBldr_t *mhSetServerEarlyDataTickets(mhServCtx_t *ctx);
+mhServerSetupBldr_t *mhSetServerAcceptEarlyData(mhServCtx_t *ctx);
+mhServerSetupBldr_t *mhSetOCSPResponderCertStatus(mhServCtx_t *ctx,
+                                                  mhOCSPCertStatus_t status);
 
 mhServerSetupBldr_t *mhAddSSLProtocol(mhServCtx_t *ctx, mhSSLProtocol_t proto);
 
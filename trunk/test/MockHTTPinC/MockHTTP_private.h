@@ -138,6 +138,13 @@ struct mhServCtx_t {
     mhClientCertVerification_t clientCert;
     int protocols;              /* SSL protocol versions */
     bool ocspEnabled;
+    bool earlyDataTickets;
+    bool acceptEarlyData;
+    apr_size_t earlyDataReceived;       /* bytes, over all connections */
+
+    /* OCSP responder specific */
+    mhOCSPCertStatus_t ocspCertStatus;
+    apr_size_t ocspRequestsReceived;
 
     apr_array_header_t *reqsReceived;   /* array of mhRequest_t *'s */
     apr_array_header_t *connMatchers;   /* array of mhConnMatcherBldr_t *'s */
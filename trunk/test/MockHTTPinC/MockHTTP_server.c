@@ -63,6 +63,9 @@ static apr_status_t sslSocketRead(apr_socket_t *skt, void *baton, char *data,
 static apr_status_t sslSocketShutdown(_mhClientCtx_t *cctx, apr_shutdown_how_e how);
 
 static apr_status_t renegotiateSSLSession(_mhClientCtx_t *cctx);
+static mhResponse_t *ocspResponderAnswer(mhServCtx_t *ctx,
+                                         _mhClientCtx_t *cctx,
+                                         mhRequest_t *req);
 
 typedef apr_status_t (*handshake_func_t)(_mhClientCtx_t *cctx);
 typedef apr_status_t (*reset_conn_func_t)(_mhClientCtx_t *cctx);
@@ -128,6 +131,8 @@ struct _mhClientCtx_t {
     apr_array_header_t *certFiles;
     mhClientCertVerification_t clientCert;
     bool ocspEnabled;
+    bool earlyDataTickets;
+    bool acceptEarlyData;
 };
 
 /**
@@ -1366,8 +1371,21 @@ static apr_status_t processServer(mhServCtx_t *ctx, _mhClientCtx_t *cctx,
                 cctx->reqsReceived++;
                 ctx->reqState = FullReqReceived;
                 *((mhRequest_t **)apr_array_push(ctx->reqsReceived)) = cctx->req;
-                if (_mhMatchRequest(ctx, cctx, cctx->req,
-                                    &resp, &action) == YES) {
+                if (ctx->type == mhOCSPResponder) {
+                    /* The responder answers all requests itself */
+                    resp = ocspResponderAnswer(ctx, cctx, cctx->req);
+                    if (resp) {
+                        _mhLog(MH_VERBOSE, cctx->skt,
+                               "OCSP request answered, queueing response.\n");
+                    } else {
+                        _mhLog(MH_VERBOSE, cctx->skt,
+                               "Can't answer OCSP request, queueing error "
+                               "response.\n");
+                        resp = cloneResponse(cctx->pool,
+                                             ctx->mh->defErrorResponse);
+                    }
+                } else if (_mhMatchRequest(ctx, cctx, cctx->req,
+                                           &resp, &action) == YES) {
                     ctx->mh->verifyStats->requestsMatched++;
                     if (resp) {
                         _mhLog(MH_VERBOSE, cctx->skt,
@@ -1500,7 +1518,8 @@ static apr_status_t initClientCtx(_mhClientCtx_t **ppctx,
     cctx->currResp = NULL;
     cctx->mode = ModeServer;
     if (type == mhHTTPv1Server || type == mhHTTPv11Server ||
-        type == mhHTTPv1Proxy || type == mhHTTPv11Proxy) {
+        type == mhHTTPv1Proxy || type == mhHTTPv11Proxy ||
+        type == mhOCSPResponder) {
         cctx->read = socketRead;
         cctx->send = socketWrite;
         cctx->shutdown = socketShutdown;
@@ -1519,6 +1538,8 @@ static apr_status_t initClientCtx(_mhClientCtx_t **ppctx,
         cctx->clientCert = serv_ctx->clientCert;
         cctx->protocols = serv_ctx->protocols;
         cctx->ocspEnabled = serv_ctx->ocspEnabled;
+        cctx->earlyDataTickets = serv_ctx->earlyDataTickets;
+        cctx->acceptEarlyData = serv_ctx->acceptEarlyData;
 
         status = initSSLCtx(cctx);
 
@@ -1730,6 +1751,11 @@ mhServCtx_t *mhFindServerByID(const MockHTTP *mh, const char *serverID)
         strcmp(mh->proxyCtx->serverID, serverID) == 0) {
         return mh->proxyCtx;
     }
+
+    if (mh->ocspRespCtx && mh->ocspRespCtx->serverID &&
+        strcmp(mh->ocspRespCtx->serverID, serverID) == 0) {
+        return mh->ocspRespCtx;
+    }
     return NULL;
 }
 
@@ -1765,6 +1791,8 @@ void mhConfigServer(mhServCtx_t *serv_ctx, ...)
     if (!serv_ctx->serverID) {
         if (serv_ctx->type == mhGenericProxy) {
             serv_ctx->serverID = DEFAULT_PROXY_ID;
+        } else if (serv_ctx->type == mhOCSPResponder) {
+            serv_ctx->serverID = DEFAULT_OCSP_RESPONDER_ID;
         } else {
             serv_ctx->serverID = DEFAULT_SERVER_ID;
         }
@@ -1891,6 +1919,18 @@ apr_port_t mhServerPortNr(const MockHTTP *mh)
     return mhServerByIDPortNr(mh, DEFAULT_SERVER_ID);
 }
 
+apr_size_t mhServerEarlyDataReceived(const MockHTTP *mh)
+{
+    mhServCtx_t *ctx = mhFindServerByID(mh, DEFAULT_SERVER_ID);
+
+    return ctx ? ctx->earlyDataReceived : 0;
+}
+
+apr_size_t mhOCSPResponderRequestsReceived(const MockHTTP *mh)
+{
+    return mh->ocspRespCtx ? mh->ocspRespCtx->ocspRequestsReceived : 0;
+}
+
 apr_port_t mhProxyPortNr(const MockHTTP *mh)
 {
     return mhServerByIDPortNr(mh, DEFAULT_PROXY_ID);
@@ -2230,6 +2270,78 @@ mhSetServerEnableOCSP(mhServCtx_t *ctx)
     return ssb;
 }
 
+static bool
+set_server_early_data_tickets(const mhServerSetupBldr_t *ssb,
+                              mhServCtx_t *ctx)
+{
+    ctx->earlyDataTickets = ssb->ibaton;
+    return YES;
+}
+
+/**
+ * Create a builder of type mhServerSetupBldr_t, make session tickets
+ * resumable over all connections and allow early data in them.
+ */
+mhServerSetupBldr_t *
+mhSetServerEarlyDataTickets(mhServCtx_t *ctx)
+{
+    apr_pool_t *pool = ctx->pool;
+    mhServerSetupBldr_t *ssb = createServerSetupBldr(pool);
+    ssb->ibaton = YES;
+    ssb->serversetup = set_server_early_data_tickets;
+    return ssb;
+}
+
+static bool
+set_server_accept_early_data(const mhServerSetupBldr_t *ssb,
+                             mhServCtx_t *ctx)
+{
+    ctx->earlyDataTickets = ssb->ibaton;
+    ctx->acceptEarlyData = ssb->ibaton;
+    return YES;
+}
+
+/**
+ * Create a builder of type mhServerSetupBldr_t, issue tickets that allow
+ * early data like mhSetServerEarlyDataTickets, and accept the early data
+ * clients send with them.
+ */
+mhServerSetupBldr_t *
+mhSetServerAcceptEarlyData(mhServCtx_t *ctx)
+{
+    apr_pool_t *pool = ctx->pool;
+    mhServerSetupBldr_t *ssb = createServerSetupBldr(pool);
+    ssb->ibaton = YES;
+    ssb->serversetup = set_server_accept_early_data;
+    return ssb;
+}
+
+/**
+ * Builder callback, sets the certificate status reported by OCSP responder
+ * CTX.
+ */
+static bool
+set_ocsp_responder_cert_status(const mhServerSetupBldr_t *ssb,
+                               mhServCtx_t *ctx)
+{
+    ctx->ocspCertStatus = ssb->ibaton;
+    return YES;
+}
+
+/**
+ * Create a builder of type mhServerSetupBldr_t, sets the certificate status
+ * the OCSP responder reports.
+ */
+mhServerSetupBldr_t *
+mhSetOCSPResponderCertStatus(mhServCtx_t *ctx, mhOCSPCertStatus_t status)
+{
+    apr_pool_t *pool = ctx->pool;
+    mhServerSetupBldr_t *ssb = createServerSetupBldr(pool);
+    ssb->ibaton = status;
+    ssb->serversetup = set_ocsp_responder_cert_status;
+    return ssb;
+}
+
 
 #ifdef MOCKHTTP_OPENSSL
 /******************************************************************************/
@@ -2238,12 +2350,19 @@ mhSetServerEnableOCSP(mhServCtx_t *ctx)
 #include <openssl/bio.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <openssl/pem.h>
 
 struct sslCtx_t {
     bool handshake_done;
     bool renegotiate;
+    bool early_done;
     apr_status_t bio_status;
 
+    /* Early data received with the handshake, read before the rest */
+    char *early_data;
+    apr_size_t early_len;
+    apr_size_t early_pos;
+
     SSL_CTX* ctx;
     SSL* ssl;
     BIO *bio;
@@ -2525,6 +2644,170 @@ static int ocspStatusCallback(SSL *ssl, void *userdata)
 }
 #endif  /* OPENSSL_NO_TLSEXT && OPENSSL_NO_OCSP */
 
+/**
+ * Answers the OCSP request in the body of REQ, received by OCSP responder CTX,
+ * with a response signed with the certificate and key of the responder. The
+ * first certificate file holds the signing certificate, the others its chain.
+ * Returns NULL if the request can't be answered.
+ */
+static mhResponse_t *ocspResponderAnswer(mhServCtx_t *ctx,
+                                         _mhClientCtx_t *cctx,
+                                         mhRequest_t *req)
+{
+#ifndef OPENSSL_NO_OCSP
+    apr_pool_t *pool = cctx->pool;
+    const apr_array_header_t *body = req->chunked ? req->chunks : req->body;
+    OCSP_REQUEST *ocspReq = NULL;
+    OCSP_BASICRESP *basicResp = NULL;
+    OCSP_RESPONSE *ocspResp = NULL;
+    X509 *signer = NULL;
+    STACK_OF(X509) *chain = NULL;
+    EVP_PKEY *key = NULL;
+    ASN1_TIME *thisUpdate = NULL;
+    ASN1_TIME *nextUpdate = NULL;
+    ASN1_TIME *revokedTime = NULL;
+    mhResponse_t *resp = NULL;
+    const unsigned char *in;
+    unsigned char *out;
+    const char *head;
+    char *data;
+    apr_size_t len, headLen;
+    int derLen;
+    int i;
+    BIO *bio;
+
+    ctx->ocspRequestsReceived++;
+
+    data = apr_pstrcatv(pool, (const struct iovec *)body->elts, body->nelts,
+                        &len);
+    in = (const unsigned char *)data;
+    ocspReq = d2i_OCSP_REQUEST(NULL, &in, (long)len);
+    if (!ocspReq || OCSP_request_onereq_count(ocspReq) < 1)
+        goto cleanup;
+
+    if (!ctx->keyFile || !ctx->certFiles || !ctx->certFiles->nelts)
+        goto cleanup;
+
+    chain = sk_X509_new_null();
+    for (i = 0; i < ctx->certFiles->nelts; i++) {
+        const char *certFile = APR_ARRAY_IDX(ctx->certFiles, i, const char *);
+        X509 *cert = NULL;
+
+        bio = BIO_new_file(certFile, "r");
+        if (bio) {
+            cert = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+            BIO_free(bio);
+        }
+        if (!cert) {
+            _mhLog(MH_VERBOSE, cctx->skt,
+                   "Cannot load certificate from file '%s'\n", certFile);
+            goto cleanup;
+        }
+
+        if (!signer)
+            signer = cert;
+        else
+            sk_X509_push(chain, cert);
+    }
+
+    /* Without a callback the passphrase is used as is */
+    bio = BIO_new_file(ctx->keyFile, "r");
+    if (bio) {
+        key = PEM_read_bio_PrivateKey(bio, NULL, NULL,
+                                      (void *)ctx->passphrase);
+        BIO_free(bio);
+    }
+    if (!key) {
+        _mhLog(MH_VERBOSE, cctx->skt,
+               "Cannot load private key from file '%s'\n", ctx->keyFile);
+        goto cleanup;
+    }
+
+    thisUpdate = X509_gmtime_adj(NULL, 0);
+    nextUpdate = X509_gmtime_adj(NULL, 3600);
+    revokedTime = X509_gmtime_adj(NULL, -3600);
+    basicResp = OCSP_BASICRESP_new();
+    if (!thisUpdate || !nextUpdate || !revokedTime || !basicResp)
+        goto cleanup;
+
+    for (i = 0; i < OCSP_request_onereq_count(ocspReq); i++) {
+        OCSP_ONEREQ *oneReq = OCSP_request_onereq_get0(ocspReq, i);
+        OCSP_CERTID *certId = OCSP_onereq_get0_id(oneReq);
+        OCSP_SINGLERESP *single;
+
+        switch (ctx->ocspCertStatus) {
+            case mhOCSPCertStatusRevoked:
+                single = OCSP_basic_add1_status(basicResp, certId,
+                                                V_OCSP_CERTSTATUS_REVOKED,
+                                                OCSP_REVOKED_STATUS_NOSTATUS,
+                                                revokedTime,
+                                                thisUpdate, nextUpdate);
+                break;
+            case mhOCSPCertStatusUnknown:
+                single = OCSP_basic_add1_status(basicResp, certId,
+                                                V_OCSP_CERTSTATUS_UNKNOWN,
+                                                0, NULL,
+                                                thisUpdate, nextUpdate);
+                break;
+            default:
+                single = OCSP_basic_add1_status(basicResp, certId,
+                                                V_OCSP_CERTSTATUS_GOOD,
+                                                0, NULL,
+                                                thisUpdate, nextUpdate);
+                break;
+        }
+        if (!single)
+            goto cleanup;
+    }
+
+    OCSP_copy_nonce(basicResp, ocspReq);
+
+    if (!OCSP_basic_sign(basicResp, signer, key, EVP_sha256(), chain, 0))
+        goto cleanup;
+
+    ocspResp = OCSP_response_create(OCSP_RESPONSE_STATUS_SUCCESSFUL,
+                                    basicResp);
+    if (!ocspResp)
+        goto cleanup;
+
+    derLen = i2d_OCSP_RESPONSE(ocspResp, NULL);
+    if (derLen <= 0)
+        goto cleanup;
+
+    /* The DER encoded response isn't a string, so send it as raw data */
+    head = apr_psprintf(pool, "HTTP/1.1 200 OK\r\n"
+                              "Content-Type: application/ocsp-response\r\n"
+                              "Content-Length: %d\r\n"
+                              "\r\n", derLen);
+    headLen = strlen(head);
+    data = apr_palloc(pool, headLen + derLen);
+    memcpy(data, head, headLen);
+    out = (unsigned char *)data + headLen;
+    i2d_OCSP_RESPONSE(ocspResp, &out);
+
+    resp = cloneResponse(pool, ctx->mh->defResponse);
+    _mhBuildResponse(resp);
+    resp->raw_data = data;
+    resp->raw_data_length = headLen + derLen;
+
+  cleanup:
+    OCSP_REQUEST_free(ocspReq);
+    OCSP_BASICRESP_free(basicResp);
+    OCSP_RESPONSE_free(ocspResp);
+    ASN1_TIME_free(thisUpdate);
+    ASN1_TIME_free(nextUpdate);
+    ASN1_TIME_free(revokedTime);
+    EVP_PKEY_free(key);
+    X509_free(signer);
+    sk_X509_pop_free(chain, X509_free);
+
+    return resp;
+#else
+    ctx->ocspRequestsReceived++;
+    return NULL;
+#endif
+}
+
 /* Convert an ssl error into an apr status code for a specific context */
 static apr_status_t status_from_ssl(sslCtx_t *ssl_ctx, int ret_code)
 {
@@ -2781,6 +3064,26 @@ static apr_status_t initSSLCtx(_mhClientCtx_t *cctx)
         }
 #endif
 
+#ifdef SSL_EARLY_DATA_ACCEPTED
+        if (cctx->earlyDataTickets) {
+            /* Each connection has its own SSL_CTX, so they need the same
+               keys to decrypt each other's tickets. Unless the server
+               accepts early data, the handshake doesn't read it, so it is
+               rejected. */
+            static unsigned char ticket_keys[80] =
+                "MockHTTP session ticket keys, the same for all connections";
+
+            /* OpenSSL rejects early data with stateless tickets, unless
+               its replay protection is off */
+            if (cctx->acceptEarlyData)
+                SSL_CTX_set_options(ssl_ctx->ctx, SSL_OP_NO_ANTI_REPLAY);
+
+            SSL_CTX_set_tlsext_ticket_keys(ssl_ctx->ctx, ticket_keys,
+                                           sizeof(ticket_keys));
+            SSL_CTX_set_max_early_data(ssl_ctx->ctx, 16384);
+        }
+#endif
+
         SSL_CTX_set_mode(ssl_ctx->ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER
                                        | SSL_MODE_ENABLE_PARTIAL_WRITE
                                        | SSL_MODE_AUTO_RETRY);
@@ -2862,6 +3165,16 @@ sslSocketRead(apr_socket_t *skt, void *baton, char *data, apr_size_t *len)
     sslCtx_t *ssl_ctx = baton;
     int result;
 
+    if (ssl_ctx->early_pos < ssl_ctx->early_len) {
+        apr_size_t left = ssl_ctx->early_len - ssl_ctx->early_pos;
+
+        if (*len > left)
+            *len = left;
+        memcpy(data, ssl_ctx->early_data + ssl_ctx->early_pos, *len);
+        ssl_ctx->early_pos += *len;
+        return APR_SUCCESS;
+    }
+
     if (*len > sizeof(ssl_ctx->read_buffer))
       *len = sizeof(ssl_ctx->read_buffer);
 
@@ -3015,6 +3328,46 @@ static apr_status_t sslHandshake(_mhClientCtx_t *cctx)
     if (ssl_ctx->handshake_done)
         return APR_SUCCESS;
 
+#ifdef SSL_EARLY_DATA_ACCEPTED
+    /* Read the early data before the handshake completes */
+    while (cctx->acceptEarlyData && !ssl_ctx->early_done) {
+        size_t readbytes;
+
+        result = SSL_read_early_data(ssl_ctx->ssl, ssl_ctx->read_buffer,
+                                     sizeof(ssl_ctx->read_buffer),
+                                     &readbytes);
+        if (result == SSL_READ_EARLY_DATA_SUCCESS) {
+            char *buf = apr_palloc(cctx->pool,
+                                   ssl_ctx->early_len + readbytes);
+
+            if (ssl_ctx->early_len)
+                memcpy(buf, ssl_ctx->early_data, ssl_ctx->early_len);
+            memcpy(buf + ssl_ctx->early_len, ssl_ctx->read_buffer,
+                   readbytes);
+            ssl_ctx->early_data = buf;
+            ssl_ctx->early_len += readbytes;
+        }
+        else if (result == SSL_READ_EARLY_DATA_FINISH) {
+            ssl_ctx->early_done = YES;
+            cctx->serv_ctx->earlyDataReceived += ssl_ctx->early_len;
+            _mhLog(MH_VERBOSE, cctx->skt, "Received %d bytes of early "
+                   "data.\n", (int)ssl_ctx->early_len);
+        }
+        else {
+            int ssl_err = SSL_get_error(ssl_ctx->ssl, result);
+
+            if (ssl_err == SSL_ERROR_WANT_READ
+                || ssl_err == SSL_ERROR_WANT_WRITE)
+                return APR_EAGAIN;
+            if (ssl_err == SSL_ERROR_SYSCALL)
+                return ssl_ctx->bio_status;
+
+            /* Let the handshake report the problem */
+            ssl_ctx->early_done = YES;
+        }
+    }
+#endif
+
     /* Initial SSL handshake */
     result = SSL_accept(ssl_ctx->ssl);
     if (result == 1) {
@@ -3066,5 +3419,13 @@ static apr_status_t sslHandshake(_mhClientCtx_t *cctx)
 
 #else /* TODO: OpenSSL not available => empty implementations */
 
+static mhResponse_t *ocspResponderAnswer(mhServCtx_t *ctx,
+                                         _mhClientCtx_t *cctx,
+                                         mhRequest_t *req)
+{
+    ctx->ocspRequestsReceived++;
+    return NULL;
+}
+
 #endif
 
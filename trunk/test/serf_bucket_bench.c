@@ -0,0 +1,316 @@
+/* ====================================================================
+ *    Licensed to the Apache Software Foundation (ASF) under one
+ *    or more contributor license agreements.  See the NOTICE file
+ *    distributed with this work for additional information
+ *    regarding copyright ownership.  The ASF licenses this file
+ *    to you under the Apache License, Version 2.0 (the
+ *    "License"); you may not use this file except in compliance
+ *    with the License.  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing,
+ *    software distributed under the License is distributed on an
+ *    "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ *    KIND, either express or implied.  See the License for the
+ *    specific language governing permissions and limitations
+ *    under the License.
+ * ====================================================================
+ */
+
+/* Measures the throughput of bucket chains in memory, without any network
+   io in the way.
+
+   The digest benchmark reads a body of the given size once through a plain
+   aggregate of blocks, and once through a digest bucket calculating the
+   selected digests, which shows the cost of hashing while reading.
+
+   The frame benchmark (-f) creates HTTP/2 frames like the protocol does,
+   and reports how many bucket allocations each frame holds on top of its
+   payload, and how long creating, reading and destroying a frame takes. */
+
+#include <stdlib.h>
+
+#include <apr.h>
+#include <apr_strings.h>
+#include <apr_getopt.h>
+
+#include "serf.h"
+
+/* Frames are internal, this benchmark links statically */
+#include "serf_private.h"
+#include "protocols/http2_protocol.h"
+#include "protocols/http2_buckets.h"
+
+#define BLOCK_SIZE 16384
+
+/* Frames created (and alive) at once by the frame benchmark */
+#define FRAME_BATCH 10000
+
+/* Creates an aggregate bucket returning SIZE bytes from BLOCK */
+static serf_bucket_t *create_body(const char *block, apr_uint64_t size,
+                                  serf_bucket_alloc_t *alloc)
+{
+    serf_bucket_t *agg = serf_bucket_aggregate_create(alloc);
+
+    while (size) {
+        apr_size_t len = size < BLOCK_SIZE ? (apr_size_t)size : BLOCK_SIZE;
+
+        serf_bucket_aggregate_append(
+            agg, serf_bucket_simple_create(block, len, NULL, NULL, alloc));
+        size -= len;
+    }
+
+    return agg;
+}
+
+/* Reads BUCKET until EOF, like a response handler would */
+static apr_status_t drain(serf_bucket_t *bucket, apr_uint64_t *total)
+{
+    apr_status_t status;
+
+    *total = 0;
+    do {
+        struct iovec vecs[64];
+        int vecs_used;
+        int i;
+
+        status = serf_bucket_read_iovec(bucket, SERF_READ_ALL_AVAIL, 64,
+                                        vecs, &vecs_used);
+        if (SERF_BUCKET_READ_ERROR(status))
+            return status;
+
+        for (i = 0; i < vecs_used; i++)
+            *total += vecs[i].iov_len;
+    } while (!APR_STATUS_IS_EOF(status));
+
+    return APR_SUCCESS;
+}
+
+/* Reads SIZE bytes COUNT times, through a digest bucket when ALGORITHMS
+   is not 0 */
+static apr_status_t bench_read(const char *name, int algorithms,
+                               const char *block, apr_uint64_t size,
+                               int count, serf_bucket_alloc_t *alloc)
+{
+    apr_uint64_t bytes = 0;
+    apr_time_t start;
+    double secs;
+    int i;
+
+    start = apr_time_now();
+    for (i = 0; i < count; i++) {
+        serf_bucket_t *bkt = create_body(block, size, alloc);
+        apr_uint64_t total;
+        apr_status_t status;
+
+        if (algorithms)
+            bkt = serf_bucket_digest_create(bkt, algorithms, alloc);
+
+        status = drain(bkt, &total);
+        serf_bucket_destroy(bkt);
+        if (status) {
+            printf("Error reading %s: %d\n", name, status);
+            return status;
+        }
+        bytes += total;
+    }
+    secs = (double)(apr_time_now() - start) / APR_USEC_PER_SEC;
+
+    printf("%-8s %" APR_UINT64_T_FMT " bytes in %.3f s (%.1f MB/s)\n",
+           name, bytes, secs,
+           secs > 0 ? (double)bytes / 1048576 / secs : 0.0);
+
+    return APR_SUCCESS;
+}
+
+typedef struct frame_kind_t {
+    const char *name;
+    unsigned char frame_type;
+    apr_size_t payload_len;     /* Inline payload, or a DATA body if 0 */
+} frame_kind_t;
+
+static const frame_kind_t frame_kinds[] =
+{
+    { "WINDOW_UPDATE", HTTP2_FRAME_TYPE_WINDOW_UPDATE, 4 },
+    { "RST_STREAM",    HTTP2_FRAME_TYPE_RST_STREAM,    4 },
+    { "SETTINGS",      HTTP2_FRAME_TYPE_SETTINGS,      6 },
+    { "PING",          HTTP2_FRAME_TYPE_PING,          8 },
+    { "DATA",          HTTP2_FRAME_TYPE_DATA,          0 },
+    { NULL }
+};
+
+/* Creates FRAME_BATCH frames of KIND COUNT times */
+static apr_status_t bench_frames(const frame_kind_t *kind,
+                                 const char *block, int count,
+                                 serf_bucket_alloc_t *alloc,
+                                 apr_pool_t *pool)
+{
+    serf_bucket_t **frames = apr_palloc(pool, FRAME_BATCH * sizeof(*frames));
+    apr_uint64_t allocs = 0;
+    apr_time_t start;
+    double secs;
+    int i, j;
+
+    start = apr_time_now();
+    for (i = 0; i < count; i++) {
+        apr_uint32_t before;
+
+        /* The payload of DATA frames comes from the request body */
+        if (!kind->payload_len) {
+            for (j = 0; j < FRAME_BATCH; j++)
+                frames[j] = serf_bucket_simple_create(block, 1024, NULL,
+                                                      NULL, alloc);
+        }
+
+        before = serf__bucket_allocator_get_count(alloc);
+        for (j = 0; j < FRAME_BATCH; j++) {
+            apr_int32_t stream_id = 1;
+
+            if (kind->payload_len)
+                frames[j] = serf__bucket_http2_frame_create_inline(
+                                    block, kind->payload_len,
+                                    kind->frame_type, 0, 0, alloc);
+            else
+                frames[j] = serf__bucket_http2_frame_create(
+                                    frames[j], kind->frame_type, 0,
+                                    &stream_id, NULL, NULL,
+                                    HTTP2_DEFAULT_MAX_FRAMESIZE, alloc);
+        }
+        allocs += serf__bucket_allocator_get_count(alloc) - before;
+
+        for (j = 0; j < FRAME_BATCH; j++) {
+            apr_uint64_t total;
+            apr_status_t status = drain(frames[j], &total);
+
+            serf_bucket_destroy(frames[j]);
+            if (status) {
+                printf("Error reading %s frame: %d\n", kind->name, status);
+                return status;
+            }
+        }
+    }
+    secs = (double)(apr_time_now() - start) / APR_USEC_PER_SEC;
+
+    printf("%-14s %.2f allocations/frame, %.1f ns/frame\n",
+           kind->name, (double)allocs / ((double)count * FRAME_BATCH),
+           secs * 1e9 / ((double)count * FRAME_BATCH));
+
+    return APR_SUCCESS;
+}
+
+static const apr_getopt_option_t options[] =
+{
+    {"help",    'h', 0, "Display this help"},
+    {NULL,      'v', 0, "Display version"},
+    {NULL,      's', 1, "<MB> Size of the body in MB (default 64)"},
+    {NULL,      'n', 1, "<count> Read the body <count> times (default 4)"},
+    {NULL,      'f', 0, "Benchmark HTTP/2 frames instead, <count> times "
+                        "10000 of each kind"},
+    { NULL, 0 }
+};
+
+static void print_usage(apr_pool_t *pool)
+{
+    int i = 0;
+
+    puts("serf_bucket_bench [options]\n");
+    puts("Options:");
+
+    while (options[i].optch > 0) {
+        const apr_getopt_option_t* o = &options[i];
+
+        printf(" -%c", o->optch);
+        if (o->name)
+            printf(", ");
+
+        printf("%s%s\t%s\n",
+               o->name ? "--" : "\t",
+               o->name ? o->name : "",
+               o->description);
+
+        i++;
+    }
+}
+
+int main(int argc, const char **argv)
+{
+    apr_status_t status;
+    apr_pool_t *pool;
+    serf_bucket_alloc_t *alloc;
+    apr_getopt_t *opt;
+    int opt_c;
+    const char *opt_arg;
+    apr_int64_t size_mb;
+    int count;
+    int frames;
+    char *block;
+
+    apr_initialize();
+    atexit(apr_terminate);
+
+    apr_pool_create(&pool, NULL);
+
+    size_mb = 64;
+    count = 4;
+    frames = 0;
+
+    apr_getopt_init(&opt, pool, argc, argv);
+    while ((status = apr_getopt_long(opt, options, &opt_c, &opt_arg)) ==
+           APR_SUCCESS) {
+
+        switch (opt_c) {
+        case 'h':
+            print_usage(pool);
+            exit(0);
+            break;
+        case 's':
+            size_mb = apr_atoi64(opt_arg);
+            break;
+        case 'n':
+            count = (int)apr_atoi64(opt_arg);
+            break;
+        case 'f':
+            frames = 1;
+            break;
+        case 'v':
+            puts("Serf version: " SERF_VERSION_STRING);
+            exit(0);
+        default:
+            break;
+        }
+    }
+
+    if (opt->ind != opt->argc || size_mb <= 0 || count <= 0) {
+        print_usage(pool);
+        exit(-1);
+    }
+
+    alloc = serf_bucket_allocator_create(pool, NULL, NULL);
+    block = apr_palloc(pool, BLOCK_SIZE);
+    memset(block, 'x', BLOCK_SIZE);
+
+    if (frames) {
+        const frame_kind_t *kind;
+
+        status = APR_SUCCESS;
+        for (kind = frame_kinds; kind->name && !status; kind++)
+            status = bench_frames(kind, block, count, alloc, pool);
+
+        apr_pool_destroy(pool);
+        return status ? 1 : 0;
+    }
+
+    status = bench_read("plain", 0, block, size_mb * 1048576, count,
+                        alloc);
+    if (!status)
+        status = bench_read("SHA-256", SERF_DIGEST_SHA256, block,
+                            size_mb * 1048576, count, alloc);
+    if (!status)
+        status = bench_read("all", SERF_DIGEST_MD5 | SERF_DIGEST_SHA1
+                                   | SERF_DIGEST_SHA256,
+                            block, size_mb * 1048576, count, alloc);
+
+    apr_pool_destroy(pool);
+    return status ? 1 : 0;
+}
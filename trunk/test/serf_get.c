@@ -494,6 +494,7 @@ credentials_callback(char **username,
 #define CERTPWD  257
 #define HTTP2FLAG 258
 #define H2DIRECT 259
+#define STATSFLAG 260
 
 static const apr_getopt_option_t options[] =
 {
@@ -515,6 +516,7 @@ static const apr_getopt_option_t options[] =
     {"debug",   'd', 0, "Enable debugging"},
     {"http2",   HTTP2FLAG, 0, "Enable http2 (https only) (Experimental)"},
     {"h2direct",H2DIRECT, 0, "Enable h2direct (Experimental)"},
+    {"stats",   STATSFLAG, 0, "Print socket write statistics"},
 
     { NULL, 0 }
 };
@@ -561,7 +563,7 @@ int main(int argc, const char **argv)
     const char *raw_url, *method, *req_body_path = NULL;
     int count, inflight, conn_count;
     int i;
-    int print_headers, debug, negotiate_http2, use_h2direct;
+    int print_headers, debug, negotiate_http2, use_h2direct, print_stats;
     const char *username = NULL;
     const char *password = "";
     const char *pem_path = NULL, *pem_pwd = NULL;
@@ -588,6 +590,7 @@ int main(int argc, const char **argv)
     debug = 0;
     negotiate_http2 = 0;
     use_h2direct = 0;
+    print_stats = 0;
 
     apr_getopt_init(&opt, pool, argc, argv);
     while ((status = apr_getopt_long(opt, options, &opt_c, &opt_arg)) ==
@@ -686,6 +689,9 @@ int main(int argc, const char **argv)
         case H2DIRECT:
             use_h2direct = 1;
             break;
+        case STATSFLAG:
+            print_stats = 1;
+            break;
         case 'v':
             puts("Serf version: " SERF_VERSION_STRING);
             exit(0);
@@ -891,6 +897,32 @@ int main(int argc, const char **argv)
 
     for (i = 0; i < conn_count; i++)
     {
+        if (print_stats) {
+            apr_uint64_t write_calls, bytes_written;
+            apr_uint32_t recv_window, send_window;
+            apr_uint64_t bdp_estimate;
+            apr_interval_time_t rtt;
+
+            serf_connection_get_write_stats(connections[i], &write_calls,
+                                            &bytes_written);
+
+            fprintf(stderr, "Connection %d: %" APR_UINT64_T_FMT " writes, %"
+                    APR_UINT64_T_FMT " bytes (%.1f writes per MB)\n",
+                    i, write_calls, bytes_written,
+                    bytes_written ? (double)write_calls * 1048576
+                                    / (double)bytes_written
+                                  : 0.0);
+
+            if (!serf_connection_get_http2_stats(connections[i],
+                                                 &recv_window, &send_window,
+                                                 &bdp_estimate, &rtt)) {
+                fprintf(stderr, "Connection %d: HTTP/2 receive window %u, "
+                        "send window %u, BDP %" APR_UINT64_T_FMT
+                        " bytes, rtt %" APR_TIME_T_FMT " usec\n",
+                        i, recv_window, send_window, bdp_estimate, rtt);
+            }
+        }
+
         serf_connection_close(connections[i]);
     }
 
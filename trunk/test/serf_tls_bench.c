@@ -0,0 +1,571 @@
+/* ====================================================================
+ *    Licensed to the Apache Software Foundation (ASF) under one
+ *    or more contributor license agreements.  See the NOTICE file
+ *    distributed with this work for additional information
+ *    regarding copyright ownership.  The ASF licenses this file
+ *    to you under the Apache License, Version 2.0 (the
+ *    "License"); you may not use this file except in compliance
+ *    with the License.  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing,
+ *    software distributed under the License is distributed on an
+ *    "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ *    KIND, either express or implied.  See the License for the
+ *    specific language governing permissions and limitations
+ *    under the License.
+ * ====================================================================
+ */
+
+/* Measures the TLS handshake rate and the bulk throughput of the TLS
+   library serf was built with, against an https server.
+
+   Handshakes are timed as a HEAD request on a new connection each, which
+   includes connecting; run the server on the same host to keep that out
+   of the way. Bulk throughput is timed as GET requests for the URL on a
+   single connection. With -u, it is timed as POST requests with a body of
+   the given size instead, which measures how fast serf encrypts; the
+   server must read and discard the body. Throughput is reported with the
+   processor time serf used, as a percentage of the elapsed time (on
+   Windows clock() measures elapsed time, so this is always near 100%).
+
+   Resumed handshakes (-r) reuse one context, which keeps the session of
+   the server. With -s each handshake uses a new context that shares a
+   session cache with the others instead, and with -f FILE a new context
+   and a new session cache that loads the sessions from FILE, as a new
+   process would. Only sessions of servers that passed all certificate
+   checks are shared, so these need -t with the CA of a test server. The
+   first handshake, which fills the cache, isn't timed.
+
+   To compare TLS libraries, build serf once per SSL_BACKEND and run this
+   program of each build against the same server; build/tls_bench.py runs
+   them and prints their results side by side. */
+
+#include <stdlib.h>
+#include <time.h>
+
+#include <apr.h>
+#include <apr_uri.h>
+#include <apr_strings.h>
+#include <apr_getopt.h>
+
+#include "serf.h"
+
+#define UPLOAD_BLOCK_SIZE 16384
+
+typedef struct app_baton_t {
+    serf_context_t *serf_ctx;
+    serf_bucket_alloc_t *bkt_alloc;
+    const char *hostname;
+    const char *path;
+    int head_request;
+    serf_ssl_certificate_t *trusted_ca;
+
+    /* Size of the body of POST requests, which repeats UPLOAD_BLOCK */
+    apr_uint64_t upload_size;
+    const char *upload_block;
+
+    int completed_requests;
+    apr_uint64_t bytes_read;
+} app_baton_t;
+
+static apr_status_t ignore_all_cert_errors(void *data, int failures,
+                                           const serf_ssl_certificate_t *cert)
+{
+    /* Benchmarks are usually run against test servers */
+    return APR_SUCCESS;
+}
+
+static apr_status_t conn_setup(apr_socket_t *skt,
+                               serf_bucket_t **input_bkt,
+                               serf_bucket_t **output_bkt,
+                               void *setup_baton,
+                               apr_pool_t *pool)
+{
+    app_baton_t *app = setup_baton;
+    serf_ssl_context_t *ssl_ctx;
+    serf_bucket_t *c;
+
+    c = serf_context_bucket_socket_create(app->serf_ctx, skt,
+                                          app->bkt_alloc);
+    c = serf_bucket_ssl_decrypt_create(c, NULL, app->bkt_alloc);
+    ssl_ctx = serf_bucket_ssl_decrypt_context_get(c);
+
+    if (app->trusted_ca)
+        serf_ssl_trust_cert(ssl_ctx, app->trusted_ca);
+    else
+        serf_ssl_server_cert_callback_set(ssl_ctx, ignore_all_cert_errors,
+                                          NULL);
+    serf_ssl_set_hostname(ssl_ctx, app->hostname);
+
+    *output_bkt = serf_bucket_ssl_encrypt_create(*output_bkt, ssl_ctx,
+                                                 app->bkt_alloc);
+    *input_bkt = c;
+
+    return APR_SUCCESS;
+}
+
+static serf_bucket_t* accept_response(serf_request_t *request,
+                                      serf_bucket_t *stream,
+                                      void *acceptor_baton,
+                                      apr_pool_t *pool)
+{
+    app_baton_t *app = acceptor_baton;
+    serf_bucket_alloc_t *bkt_alloc = serf_request_get_alloc(request);
+    serf_bucket_t *response;
+
+    /* Create a barrier so the response doesn't eat us! */
+    response = serf_bucket_response_create(
+                    serf_bucket_barrier_create(stream, bkt_alloc),
+                    bkt_alloc);
+
+    if (app->head_request)
+        serf_bucket_response_set_head(response);
+
+    return response;
+}
+
+static apr_status_t handle_response(serf_request_t *request,
+                                    serf_bucket_t *response,
+                                    void *handler_baton,
+                                    apr_pool_t *pool)
+{
+    app_baton_t *app = handler_baton;
+    serf_status_line sl;
+    apr_status_t status;
+
+    if (!response)
+        return SERF_ERROR_ABORTED_CONNECTION;
+
+    status = serf_bucket_response_status(response, &sl);
+    if (status)
+        return status;
+
+    while (1) {
+        struct iovec vecs[64];
+        int vecs_read;
+        int i;
+
+        status = serf_bucket_read_iovec(response, SERF_READ_ALL_AVAIL, 64,
+                                        vecs, &vecs_read);
+        if (SERF_BUCKET_READ_ERROR(status))
+            return status;
+
+        for (i = 0; i < vecs_read; i++)
+            app->bytes_read += vecs[i].iov_len;
+
+        if (APR_STATUS_IS_EOF(status)) {
+            app->completed_requests++;
+            return APR_EOF;
+        }
+
+        if (status)
+            return status;
+    }
+    /* NOTREACHED */
+}
+
+static apr_status_t setup_request(serf_request_t *request,
+                                  void *setup_baton,
+                                  serf_bucket_t **req_bkt,
+                                  serf_response_acceptor_t *acceptor,
+                                  void **acceptor_baton,
+                                  serf_response_handler_t *handler,
+                                  void **handler_baton,
+                                  apr_pool_t *pool)
+{
+    app_baton_t *app = setup_baton;
+    serf_bucket_alloc_t *alloc = serf_request_get_alloc(request);
+    serf_bucket_t *body_bkt = NULL;
+    serf_bucket_t *hdrs_bkt;
+    const char *method = app->head_request ? "HEAD" : "GET";
+
+    if (app->upload_size && !app->head_request) {
+        apr_uint64_t remaining = app->upload_size;
+
+        /* The blocks aren't copied, like data an application sends from
+           its own buffers */
+        body_bkt = serf_bucket_aggregate_create(alloc);
+        while (remaining) {
+            apr_size_t len = remaining < UPLOAD_BLOCK_SIZE
+                                ? (apr_size_t)remaining : UPLOAD_BLOCK_SIZE;
+
+            serf_bucket_aggregate_append(
+                body_bkt, serf_bucket_simple_create(app->upload_block, len,
+                                                    NULL, NULL, alloc));
+            remaining -= len;
+        }
+        method = "POST";
+    }
+
+    *req_bkt = serf_request_bucket_request_create(request, method, app->path,
+                                                  body_bkt, alloc);
+    if (body_bkt)
+        serf_bucket_request_set_CL(*req_bkt, app->upload_size);
+
+    hdrs_bkt = serf_bucket_request_get_headers(*req_bkt);
+    serf_bucket_headers_setn(hdrs_bkt, "User-Agent",
+                             "Serf/" SERF_VERSION_STRING);
+
+    *acceptor = accept_response;
+    *acceptor_baton = app;
+    *handler = handle_response;
+    *handler_baton = app;
+
+    return APR_SUCCESS;
+}
+
+/* Runs the context of APP until COUNT requests completed */
+static apr_status_t run_requests(app_baton_t *app, int count,
+                                 apr_pool_t *pool)
+{
+    while (app->completed_requests < count) {
+        apr_status_t status;
+
+        status = serf_context_run(app->serf_ctx, SERF_DURATION_FOREVER,
+                                  pool);
+        if (APR_STATUS_IS_TIMEUP(status))
+            continue;
+        if (status) {
+            char buf[200];
+            const char *err_string;
+
+            err_string = serf_error_string(status);
+            if (!err_string)
+                err_string = apr_strerror(status, buf, sizeof(buf));
+
+            printf("Error running context: (%d) %s\n", status, err_string);
+            return status;
+        }
+    }
+
+    return APR_SUCCESS;
+}
+
+/* How the handshakes of bench_handshakes() resume sessions */
+typedef enum resume_mode_t {
+    RESUME_NONE,     /* Full handshakes */
+    RESUME_CONTEXT,  /* One context, which keeps the session */
+    RESUME_SHARED,   /* A context per handshake, sharing a session cache */
+    RESUME_FILE      /* A context and session cache per handshake, loading
+                        the sessions from a file */
+} resume_mode_t;
+
+/* Connects to the server at URL once, using the context of APP */
+static apr_status_t handshake(app_baton_t *app, apr_uri_t *url,
+                              apr_pool_t *pool)
+{
+    serf_connection_t *conn;
+    apr_status_t status;
+
+    status = serf_connection_create2(&conn, app->serf_ctx, *url,
+                                     conn_setup, app, NULL, NULL, pool);
+    if (status) {
+        printf("Error creating connection: %d\n", status);
+        return status;
+    }
+
+    app->completed_requests = 0;
+    serf_connection_request_create(conn, setup_request, app);
+
+    status = run_requests(app, 1, pool);
+    serf_connection_close(conn);
+
+    return status;
+}
+
+/* Times COUNT handshakes with the server at URL, resuming sessions as
+   MODE says. Sessions are kept in SESSION_FILE with RESUME_FILE */
+static apr_status_t bench_handshakes(app_baton_t *app, apr_uri_t *url,
+                                     int count, resume_mode_t mode,
+                                     const char *session_file,
+                                     apr_pool_t *pool)
+{
+    static const char *const labels[] = {
+        "", " resumed", " resumed from a shared cache",
+        " resumed from a cache file"
+    };
+    serf_ssl_session_cache_t *cache = NULL;
+    apr_pool_t *iterpool;
+    apr_time_t start;
+    clock_t cpu_start;
+    double secs, cpu_secs;
+    int i;
+
+    apr_pool_create(&iterpool, pool);
+
+    app->head_request = 1;
+    app->serf_ctx = serf_context_create(pool);
+
+    if (mode == RESUME_SHARED) {
+        apr_status_t status;
+
+        status = serf_ssl_session_cache_create(&cache, 64, pool);
+        if (status)
+            return status;
+    }
+
+    start = apr_time_now();
+    cpu_start = clock();
+
+    /* When resuming, an untimed first handshake fills the session cache */
+    for (i = (mode == RESUME_NONE ? 0 : -1); i < count; i++) {
+        apr_status_t status;
+
+        if (i == 0) {
+            start = apr_time_now();
+            cpu_start = clock();
+        }
+
+        apr_pool_clear(iterpool);
+
+        if (mode == RESUME_FILE) {
+            status = serf_ssl_session_cache_create(&cache, 64, iterpool);
+            if (!status)
+                status = serf_ssl_session_cache_set_file(cache, session_file,
+                                                         iterpool);
+            if (status) {
+                printf("Error loading session cache file: %d\n", status);
+                return status;
+            }
+        }
+
+        if (mode != RESUME_CONTEXT)
+            app->serf_ctx = serf_context_create(iterpool);
+        if (cache)
+            serf_context_set_ssl_session_cache(app->serf_ctx, cache);
+
+        status = handshake(app, url, iterpool);
+        if (status)
+            return status;
+    }
+    secs = (double)(apr_time_now() - start) / APR_USEC_PER_SEC;
+    cpu_secs = (double)(clock() - cpu_start) / CLOCKS_PER_SEC;
+
+    apr_pool_destroy(iterpool);
+
+    printf("Handshakes: %d%s in %.3f s (%.1f per second, %.2f ms each, "
+           "%.2f ms CPU each)\n",
+           count, labels[mode], secs,
+           secs > 0 ? count / secs : 0.0,
+           count ? secs * 1000 / count : 0.0,
+           count ? cpu_secs * 1000 / count : 0.0);
+
+    return APR_SUCCESS;
+}
+
+/* Times COUNT requests for URL on one connection, uploading the body of
+   APP if it has one */
+static apr_status_t bench_bulk(app_baton_t *app, apr_uri_t *url, int count,
+                               apr_pool_t *pool)
+{
+    serf_connection_t *conn;
+    apr_status_t status;
+    apr_time_t start;
+    clock_t cpu_start;
+    double secs, cpu_secs;
+    apr_uint64_t bytes;
+    int i;
+
+    app->head_request = 0;
+    app->serf_ctx = serf_context_create(pool);
+    app->completed_requests = 0;
+    app->bytes_read = 0;
+
+    status = serf_connection_create2(&conn, app->serf_ctx, *url,
+                                     conn_setup, app, NULL, NULL, pool);
+    if (status) {
+        printf("Error creating connection: %d\n", status);
+        return status;
+    }
+
+    /* Complete the handshake first, so only the transfers are timed */
+    serf_connection_request_create(conn, setup_request, app);
+    status = run_requests(app, 1, pool);
+    if (status)
+        return status;
+
+    app->completed_requests = 0;
+    app->bytes_read = 0;
+
+    start = apr_time_now();
+    cpu_start = clock();
+    for (i = 0; i < count; i++)
+        serf_connection_request_create(conn, setup_request, app);
+
+    status = run_requests(app, count, pool);
+    if (status)
+        return status;
+    secs = (double)(apr_time_now() - start) / APR_USEC_PER_SEC;
+    cpu_secs = (double)(clock() - cpu_start) / CLOCKS_PER_SEC;
+
+    serf_connection_close(conn);
+
+    bytes = app->upload_size ? app->upload_size * count : app->bytes_read;
+    printf("%s: %d %s, %" APR_UINT64_T_FMT " bytes in %.3f s "
+           "(%.1f MB/s, %.0f%% CPU)\n",
+           app->upload_size ? "Upload" : "Bulk", count,
+           app->upload_size ? "requests" : "responses", bytes, secs,
+           secs > 0 ? (double)bytes / 1048576 / secs : 0.0,
+           secs > 0 ? cpu_secs * 100 / secs : 0.0);
+
+    return APR_SUCCESS;
+}
+
+static const apr_getopt_option_t options[] =
+{
+    {"help",    'h', 0, "Display this help"},
+    {NULL,      'v', 0, "Display version"},
+    {NULL,      'n', 1, "<count> Time <count> handshakes (default 100)"},
+    {NULL,      'b', 1, "<count> Time <count> fetches of URL (default 10)"},
+    {"resume",  'r', 0, "Resume the TLS session in the handshakes"},
+    {"shared",  's', 0, "Resume from a session cache shared by contexts"},
+    {"file",    'f', 1, "<file> Resume from a session cache in <file>"},
+    {"trust",   't', 1, "<file> Trust the CA certificate in <file>, and "
+                        "check the server certificate"},
+    {"upload",  'u', 1, "<kbytes> POST <kbytes> KB -b times, instead of "
+                        "fetching URL"},
+    { NULL, 0 }
+};
+
+static void print_usage(apr_pool_t *pool)
+{
+    int i = 0;
+
+    puts("serf_tls_bench [options] URL\n");
+    puts("Options:");
+
+    while (options[i].optch > 0) {
+        const apr_getopt_option_t* o = &options[i];
+
+        printf(" -%c", o->optch);
+        if (o->name)
+            printf(", ");
+
+        printf("%s%s\t%s\n",
+               o->name ? "--" : "\t",
+               o->name ? o->name : "",
+               o->description);
+
+        i++;
+    }
+}
+
+int main(int argc, const char **argv)
+{
+    apr_status_t status;
+    apr_pool_t *pool;
+    app_baton_t app_ctx;
+    apr_uri_t url;
+    int handshakes, fetches;
+    resume_mode_t resume;
+    const char *session_file, *trust_file;
+    apr_uint64_t upload_size;
+    apr_getopt_t *opt;
+    int opt_c;
+    const char *opt_arg;
+
+    apr_initialize();
+    atexit(apr_terminate);
+
+    apr_pool_create(&pool, NULL);
+
+    handshakes = 100;
+    fetches = 10;
+    resume = RESUME_NONE;
+    session_file = NULL;
+    trust_file = NULL;
+    upload_size = 0;
+
+    apr_getopt_init(&opt, pool, argc, argv);
+    while ((status = apr_getopt_long(opt, options, &opt_c, &opt_arg)) ==
+           APR_SUCCESS) {
+
+        switch (opt_c) {
+        case 'h':
+            print_usage(pool);
+            exit(0);
+            break;
+        case 'n':
+            handshakes = (int)apr_atoi64(opt_arg);
+            break;
+        case 'b':
+            fetches = (int)apr_atoi64(opt_arg);
+            break;
+        case 'r':
+            resume = RESUME_CONTEXT;
+            break;
+        case 's':
+            resume = RESUME_SHARED;
+            break;
+        case 'f':
+            resume = RESUME_FILE;
+            session_file = opt_arg;
+            break;
+        case 't':
+            trust_file = opt_arg;
+            break;
+        case 'u':
+            upload_size = (apr_uint64_t)apr_atoi64(opt_arg) * 1024;
+            break;
+        case 'v':
+            puts("Serf version: " SERF_VERSION_STRING);
+            exit(0);
+        default:
+            break;
+        }
+    }
+
+    if (opt->ind != opt->argc - 1 || handshakes < 0 || fetches < 0) {
+        print_usage(pool);
+        exit(-1);
+    }
+
+    apr_uri_parse(pool, argv[opt->ind], &url);
+    if (!url.scheme || strcasecmp(url.scheme, "https") != 0
+        || !url.hostname) {
+        printf("An https URL is required\n");
+        exit(-1);
+    }
+    if (!url.port) {
+        url.port = apr_uri_port_of_scheme(url.scheme);
+    }
+
+    memset(&app_ctx, 0, sizeof(app_ctx));
+    app_ctx.bkt_alloc = serf_bucket_allocator_create(pool, NULL, NULL);
+    app_ctx.hostname = url.hostname;
+    app_ctx.path = apr_pstrcat(pool,
+                               url.path ? url.path : "/",
+                               url.query ? "?" : "",
+                               url.query ? url.query : "",
+                               NULL);
+
+    if (upload_size) {
+        char *block = apr_palloc(pool, UPLOAD_BLOCK_SIZE);
+
+        memset(block, 'x', UPLOAD_BLOCK_SIZE);
+        app_ctx.upload_block = block;
+        app_ctx.upload_size = upload_size;
+    }
+
+    if (trust_file) {
+        status = serf_ssl_load_cert_file(&app_ctx.trusted_ca, trust_file,
+                                         pool);
+        if (status) {
+            printf("Error loading CA certificate '%s': %d\n", trust_file,
+                   status);
+            exit(-1);
+        }
+    }
+
+    printf("TLS library: %s\n", serf_ssl_backend_version());
+
+    status = bench_handshakes(&app_ctx, &url, handshakes, resume,
+                              session_file, pool);
+    if (!status)
+        status = bench_bulk(&app_ctx, &url, fetches, pool);
+
+    apr_pool_destroy(pool);
+    return status ? 1 : 0;
+}
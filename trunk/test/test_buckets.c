@@ -2432,6 +2432,263 @@ static void test_limit_buckets(CuTest *tc)
   }
 }
 
+/* Test that the saver bucket stores data in memory and on disk, and
+   returns it in the original order */
+static void test_saver_buckets(CuTest *tc)
+{
+  test_baton_t *tb = tc->testBaton;
+  serf_bucket_alloc_t *alloc = tb->bkt_alloc;
+  serf_bucket_t *mock_bkt, *saver;
+  const char *data;
+  apr_size_t len;
+
+  {
+    mockbkt_action actions[]= {
+      { 1, "ABCDE", APR_SUCCESS },
+      { 1, "", APR_EAGAIN },
+      { 1, "FGHIJ", APR_SUCCESS },
+      { 1, "", APR_EAGAIN },
+      { 1, "KLMNOPQRST", APR_EOF },
+    };
+
+    mock_bkt = serf_bucket_mock_create(actions, COUNT_OF(actions), alloc);
+    saver = serf_bucket_saver_create(mock_bkt, 8, NULL, alloc);
+
+    CuAssertIntEquals(tc, APR_EAGAIN, serf_bucket_saver_drain(saver));
+    CuAssertIntEquals(tc, 5, (int)serf_bucket_saver_get_saved(saver));
+
+    /* Over budget: spills to disk */
+    CuAssertIntEquals(tc, APR_EAGAIN, serf_bucket_saver_drain(saver));
+    CuAssertIntEquals(tc, 10, (int)serf_bucket_saver_get_saved(saver));
+
+    CuAssertIntEquals(tc, APR_EOF, serf_bucket_saver_drain(saver));
+    CuAssertIntEquals(tc, 20, (int)serf_bucket_saver_get_saved(saver));
+    CuAssertIntEquals(tc, 20, (int)serf_bucket_get_remaining(saver));
+
+    read_and_check_bucket(tc, saver, "ABCDEFGHIJKLMNOPQRST");
+    CuAssertIntEquals(tc, 0, (int)serf_bucket_saver_get_saved(saver));
+    serf_bucket_destroy(saver);
+  }
+
+  /* Everything on disk, reading while still saving */
+  {
+    mockbkt_action actions[]= {
+      { 1, "ABCDE", APR_SUCCESS },
+      { 1, "", APR_EAGAIN },
+      { 1, "FGHIJ", APR_EOF },
+    };
+
+    mock_bkt = serf_bucket_mock_create(actions, COUNT_OF(actions), alloc);
+    saver = serf_bucket_saver_create(mock_bkt, 0, NULL, alloc);
+
+    CuAssertIntEquals(tc, APR_EAGAIN, serf_bucket_saver_drain(saver));
+    CuAssertIntEquals(tc, 5, (int)serf_bucket_saver_get_saved(saver));
+
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf_bucket_read(saver, 3, &data, &len));
+    CuAssertIntEquals(tc, 3, (int)len);
+    CuAssertStrnEquals(tc, "ABC", len, data);
+
+    CuAssertIntEquals(tc, APR_EOF, serf_bucket_saver_drain(saver));
+    CuAssertIntEquals(tc, 7, (int)serf_bucket_saver_get_saved(saver));
+
+    read_and_check_bucket(tc, saver, "DEFGHIJ");
+    serf_bucket_destroy(saver);
+  }
+
+  /* Nothing saved: plain pass through */
+  mock_bkt = SERF_BUCKET_SIMPLE_STRING("ABCDEFGHIJ", alloc);
+  saver = serf_bucket_saver_create(mock_bkt, 8, NULL, alloc);
+  read_and_check_bucket(tc, saver, "ABCDEFGHIJ");
+  serf_bucket_destroy(saver);
+}
+
+static void test_replay_buckets(CuTest *tc)
+{
+  test_baton_t *tb = tc->testBaton;
+  serf_bucket_alloc_t *alloc = tb->bkt_alloc;
+  serf_bucket_t *mock_bkt, *replay;
+  const char *data;
+  apr_size_t len;
+
+  {
+    mockbkt_action actions[]= {
+      { 1, "ABCDE", APR_SUCCESS },
+      { 1, "", APR_EAGAIN },
+      { 1, "FGHIJ", APR_SUCCESS },
+      { 1, "KLMNOPQRST", APR_EOF },
+    };
+
+    mock_bkt = serf_bucket_mock_create(actions, COUNT_OF(actions), alloc);
+    replay = serf_bucket_replay_create(mock_bkt, 8, NULL, alloc);
+
+    /* Rewind before we reached the end */
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf_bucket_read(replay, 3, &data, &len));
+    CuAssertStrnEquals(tc, "ABC", len, data);
+    CuAssertIntEquals(tc, APR_SUCCESS, serf_bucket_replay_rewind(replay));
+
+    /* Memory journal, then the stream. Over budget: spills to disk */
+    read_and_check_bucket(tc, replay, "ABCDEFGHIJKLMNOPQRST");
+    CuAssertIntEquals(tc, 0, (int)serf_bucket_get_remaining(replay));
+
+    CuAssertIntEquals(tc, APR_SUCCESS, serf_bucket_replay_rewind(replay));
+    CuAssertIntEquals(tc, 20, (int)serf_bucket_get_remaining(replay));
+    read_and_check_bucket(tc, replay, "ABCDEFGHIJKLMNOPQRST");
+
+    /* And once more, from memory and disk only */
+    CuAssertIntEquals(tc, APR_SUCCESS, serf_bucket_replay_rewind(replay));
+    read_and_check_bucket(tc, replay, "ABCDEFGHIJKLMNOPQRST");
+    serf_bucket_destroy(replay);
+  }
+
+  /* Everything on disk */
+  {
+    mockbkt_action actions[]= {
+      { 1, "ABCDE", APR_SUCCESS },
+      { 1, "FGHIJ", APR_EOF },
+    };
+
+    mock_bkt = serf_bucket_mock_create(actions, COUNT_OF(actions), alloc);
+    replay = serf_bucket_replay_create(mock_bkt, 0, NULL, alloc);
+
+    read_and_check_bucket(tc, replay, "ABCDEFGHIJ");
+    CuAssertIntEquals(tc, APR_SUCCESS, serf_bucket_replay_rewind(replay));
+    read_and_check_bucket(tc, replay, "ABCDEFGHIJ");
+    serf_bucket_destroy(replay);
+  }
+
+  /* Iovecs of the stream are passed through, and journaled */
+  {
+    serf_bucket_t *agg;
+    struct iovec vecs[4];
+    int vecs_used;
+
+    agg = serf_bucket_aggregate_create(alloc);
+    serf_bucket_aggregate_append(agg,
+                                 SERF_BUCKET_SIMPLE_STRING("ABCDE", alloc));
+    serf_bucket_aggregate_append(agg,
+                                 SERF_BUCKET_SIMPLE_STRING("FGHIJ", alloc));
+    replay = serf_bucket_replay_create(agg, 8, NULL, alloc);
+
+    CuAssertIntEquals(tc, APR_EOF,
+                      serf_bucket_read_iovec(replay, SERF_READ_ALL_AVAIL,
+                                             COUNT_OF(vecs), vecs,
+                                             &vecs_used));
+    CuAssertIntEquals(tc, 2, vecs_used);
+    CuAssertStrnEquals(tc, "ABCDE", vecs[0].iov_len, vecs[0].iov_base);
+    CuAssertStrnEquals(tc, "FGHIJ", vecs[1].iov_len, vecs[1].iov_base);
+
+    CuAssertIntEquals(tc, APR_SUCCESS, serf_bucket_replay_rewind(replay));
+    read_and_check_bucket(tc, replay, "ABCDEFGHIJ");
+    serf_bucket_destroy(replay);
+  }
+}
+
+static void check_digest(CuTest *tc, serf_bucket_t *bkt, int algorithm,
+                         const char *expected_hex)
+{
+  const unsigned char *digest;
+  apr_size_t digest_len;
+  char hex[2 * 64 + 1];
+  apr_size_t i;
+
+  CuAssertIntEquals(tc, APR_SUCCESS,
+                    serf_bucket_digest_get(bkt, algorithm,
+                                           &digest, &digest_len));
+
+  for (i = 0; i < digest_len; i++)
+    apr_snprintf(&hex[2 * i], 3, "%02x", digest[i]);
+  hex[2 * digest_len] = '\0';
+
+  CuAssertStrEquals(tc, expected_hex, hex);
+}
+
+static void test_digest_buckets(CuTest *tc)
+{
+  test_baton_t *tb = tc->testBaton;
+  serf_bucket_alloc_t *alloc = tb->bkt_alloc;
+  serf_bucket_t *bkt, *digest_bkt, *trailers;
+  const unsigned char *digest;
+  apr_size_t digest_len;
+
+  {
+    mockbkt_action actions[]= {
+      { 1, "abcde", APR_SUCCESS },
+      { 1, "", APR_EAGAIN },
+      { 1, "fghij", APR_EOF },
+    };
+
+    bkt = serf_bucket_mock_create(actions, COUNT_OF(actions), alloc);
+    digest_bkt = serf_bucket_digest_create(bkt,
+                                           SERF_DIGEST_MD5 | SERF_DIGEST_SHA1
+                                           | SERF_DIGEST_SHA256,
+                                           alloc);
+
+    CuAssertIntEquals(tc, APR_EINCOMPLETE,
+                      serf_bucket_digest_get(digest_bkt, SERF_DIGEST_MD5,
+                                             &digest, &digest_len));
+
+    read_and_check_bucket(tc, digest_bkt, "abcdefghij");
+
+    check_digest(tc, digest_bkt, SERF_DIGEST_MD5,
+                 "a925576942e94b2ef57a066101b48876");
+    check_digest(tc, digest_bkt, SERF_DIGEST_SHA1,
+                 "d68c19a0a345b7eab78d5e11e991c026ec60db63");
+    check_digest(tc, digest_bkt, SERF_DIGEST_SHA256,
+                 "72399361da6a7754fec986dca5b7cbaf"
+                 "1c810a28ded4abaf56b2106d06cb78b0");
+    serf_bucket_destroy(digest_bkt);
+  }
+
+  /* As request trailers */
+  bkt = SERF_BUCKET_SIMPLE_STRING("abcdefghij", alloc);
+  digest_bkt = serf_bucket_digest_create(bkt,
+                                         SERF_DIGEST_MD5 | SERF_DIGEST_SHA256,
+                                         alloc);
+  CuAssertIntEquals(tc, APR_EINVAL,
+                    serf_bucket_digest_get(digest_bkt, SERF_DIGEST_SHA1,
+                                           &digest, &digest_len));
+
+  trailers = serf_bucket_headers_create(alloc);
+  serf_bucket_digest_set_trailers(digest_bkt, trailers);
+
+  bkt = serf_bucket_request_create("PUT", "/", digest_bkt, alloc);
+  serf_bucket_request_set_trailers(bkt, trailers);
+
+  read_and_check_bucket(tc, bkt,
+                        "PUT / HTTP/1.1" CRLF
+                        "Transfer-Encoding: chunked" CRLF
+                        CRLF
+                        "a" CRLF
+                        "abcdefghij" CRLF
+                        "0" CRLF
+                        "Content-MD5: qSVXaULpSy71egZhAbSIdg==" CRLF
+                        "Digest: MD5=qSVXaULpSy71egZhAbSIdg==,"
+                        "SHA-256=cjmTYdpqd1T+yYbcpbfLrxyBCije1KuvVrIQbQbLeLA="
+                        CRLF
+                        CRLF);
+  serf_bucket_destroy(bkt);
+
+  /* With a Content-Length the trailers are dropped, but they must stay
+     valid until the digest bucket is done with them */
+  bkt = SERF_BUCKET_SIMPLE_STRING("abcdefghij", alloc);
+  digest_bkt = serf_bucket_digest_create(bkt, SERF_DIGEST_MD5, alloc);
+  trailers = serf_bucket_headers_create(alloc);
+  serf_bucket_digest_set_trailers(digest_bkt, trailers);
+
+  bkt = serf_bucket_request_create("PUT", "/", digest_bkt, alloc);
+  serf_bucket_request_set_CL(bkt, 10);
+  serf_bucket_request_set_trailers(bkt, trailers);
+
+  read_and_check_bucket(tc, bkt,
+                        "PUT / HTTP/1.1" CRLF
+                        "Content-Length: 10" CRLF
+                        CRLF
+                        "abcdefghij");
+  serf_bucket_destroy(bkt);
+}
+
 /* Implements serf_bucket_event_callback_t */
 static apr_status_t update_total(void *baton,
                          apr_uint64_t bytes_read)
@@ -2785,6 +3042,72 @@ static void test_http2_unpad_buckets(CuTest *tc)
   serf_bucket_destroy(unpad);
 }
 
+/* Basic test for frame buckets, with inline and stream payloads. */
+static void test_http2_frame_buckets(CuTest *tc)
+{
+  test_baton_t *tb = tc->testBaton;
+  serf_bucket_alloc_t *alloc;
+  serf_bucket_t *frame;
+  char result[32];
+  apr_status_t status;
+  apr_size_t read_len;
+  apr_int32_t stream_id = 7;
+
+  alloc = test__create_bucket_allocator(tc, tb->pool);
+
+  /* PING, with the payload stored in the frame bucket */
+  frame = serf__bucket_http2_frame_create_inline("\1\2\3\4\5\6\7\x08", 8,
+                                                 0x06, 0x01, 0, alloc);
+  CuAssertTrue(tc, SERF__BUCKET_IS_HTTP2_FRAME(frame));
+
+  status = read_all(frame, result, sizeof(result), &read_len);
+  CuAssertIntEquals(tc, APR_EOF, status);
+  CuAssertIntEquals(tc, 17, read_len);
+  CuAssertIntEquals(tc, 0, memcmp(result, "\x00\x00\x08\x06\x01"
+                                  "\x00\x00\x00\x00"
+                                  "\1\2\3\4\5\6\7\x08", read_len));
+  serf_bucket_destroy(frame);
+
+  /* SETTINGS ack, without payload */
+  frame = serf__bucket_http2_frame_create_inline(NULL, 0, 0x04, 0x01, 0,
+                                                 alloc);
+  status = read_all(frame, result, sizeof(result), &read_len);
+  CuAssertIntEquals(tc, APR_EOF, status);
+  CuAssertIntEquals(tc, 9, read_len);
+  CuAssertIntEquals(tc, 0, memcmp(result, "\x00\x00\x00\x04\x01"
+                                  "\x00\x00\x00\x00", read_len));
+  serf_bucket_destroy(frame);
+
+  /* DATA, with the header and payload read as separate iovecs */
+  frame = serf__bucket_http2_frame_create(
+                      SERF_BUCKET_SIMPLE_STRING("abcde", alloc),
+                      0x00, 0x01, &stream_id, NULL, NULL, 16384, alloc);
+  {
+    struct iovec vecs[4];
+    int vecs_used;
+
+    status = serf_bucket_read_iovec(frame, SERF_READ_ALL_AVAIL,
+                                    COUNT_OF(vecs), vecs, &vecs_used);
+    CuAssertIntEquals(tc, APR_EOF, status);
+    CuAssertIntEquals(tc, 2, vecs_used);
+    CuAssertIntEquals(tc, 9, vecs[0].iov_len);
+    CuAssertIntEquals(tc, 0, memcmp(vecs[0].iov_base,
+                                    "\x00\x00\x05\x00\x01"
+                                    "\x00\x00\x00\x07", 9));
+    CuAssertIntEquals(tc, 5, vecs[1].iov_len);
+    CuAssertIntEquals(tc, 0, memcmp(vecs[1].iov_base, "abcde", 5));
+  }
+  serf_bucket_destroy(frame);
+
+  /* And a payload larger than allowed */
+  frame = serf__bucket_http2_frame_create(
+                      SERF_BUCKET_SIMPLE_STRING("abcde", alloc),
+                      0x00, 0x01, &stream_id, NULL, NULL, 4, alloc);
+  status = read_all(frame, result, sizeof(result), &read_len);
+  CuAssertIntEquals(tc, SERF_ERROR_HTTP2_FRAME_SIZE_ERROR, status);
+  serf_bucket_destroy(frame);
+}
+
 static void test_hpack_huffman_decode(CuTest *tc)
 {
   char result[64];
@@ -3028,6 +3351,78 @@ static void test_hpack_header_encode(CuTest *tc)
   serf_bucket_destroy(hpack);
 }
 
+static void test_hpack_header_decode(CuTest *tc)
+{
+  test_baton_t *tb = tc->testBaton;
+  serf_bucket_alloc_t *alloc;
+  serf_hpack_table_t *tbl;
+  serf_bucket_t *raw;
+  serf_bucket_t *decode;
+  /* RFC 7541, C.6.1 and C.6.2: Huffman encoded literals that are added
+     to the table, followed by references to those table entries */
+  const char response1[] = "\x48\x82\x64\x02\x58\x85\xae\xc3\x77\x1a\x4b"
+                           "\x61\x96\xd0\x7a\xbe\x94\x10\x54\xd4\x44\xa8"
+                           "\x20\x05\x95\x04\x0b\x81\x66\xe0\x82\xa6\x2d"
+                           "\x1b\xff\x6e\x91\x9d\x29\xad\x17\x18\x63\xc7"
+                           "\x8f\x0b\x97\xc8\xe9\xae\x82\xae\x43\xd3";
+  const char response2[] = "\x48\x83\x64\x0e\xff\xc1\xc0\xbf";
+  /* A static entry and never indexed literals */
+  const char response3[] = "\x88"
+                           "\x10\x89\xf2\xb5\x67\xf0\x5b\x0b\x22\xd1\xfa"
+                           "\x83\x41\x6c\x97"
+                           "\x1f\x0d\x82\x68\x5f";
+  const char *expected;
+  char resultbuffer[1024];
+  apr_size_t sz;
+
+  alloc = test__create_bucket_allocator(tc, tb->pool);
+  tbl = serf__hpack_table_create(TRUE, 16384, tb->pool);
+
+  raw = serf_bucket_simple_create(response1, sizeof(response1) - 1,
+                                  NULL, NULL, alloc);
+  decode = serf__bucket_hpack_decode_create(raw, 16384, tbl, alloc);
+
+  CuAssertIntEquals(tc, APR_EOF,
+                    read_all(decode, resultbuffer, sizeof(resultbuffer), &sz));
+  expected = "HTTP/2.0 302 <http2>\r\n"
+             "cache-control: private\r\n"
+             "date: Mon, 21 Oct 2013 20:13:21 GMT\r\n"
+             "location: https://www.example.com\r\n"
+             "\r\n";
+  CuAssertIntEquals(tc, strlen(expected), sz);
+  CuAssertStrnEquals(tc, expected, sz, resultbuffer);
+  serf_bucket_destroy(decode);
+
+  raw = serf_bucket_simple_create(response2, sizeof(response2) - 1,
+                                  NULL, NULL, alloc);
+  decode = serf__bucket_hpack_decode_create(raw, 16384, tbl, alloc);
+
+  CuAssertIntEquals(tc, APR_EOF,
+                    read_all(decode, resultbuffer, sizeof(resultbuffer), &sz));
+  expected = "HTTP/2.0 307 <http2>\r\n"
+             "cache-control: private\r\n"
+             "date: Mon, 21 Oct 2013 20:13:21 GMT\r\n"
+             "location: https://www.example.com\r\n"
+             "\r\n";
+  CuAssertIntEquals(tc, strlen(expected), sz);
+  CuAssertStrnEquals(tc, expected, sz, resultbuffer);
+  serf_bucket_destroy(decode);
+
+  raw = serf_bucket_simple_create(response3, sizeof(response3) - 1,
+                                  NULL, NULL, alloc);
+  decode = serf__bucket_hpack_decode_create(raw, 16384, tbl, alloc);
+
+  CuAssertIntEquals(tc, APR_EOF,
+                    read_all(decode, resultbuffer, sizeof(resultbuffer), &sz));
+  expected = "HTTP/2.0 200 <http2>\r\n"
+             "x-powered-by: serf\r\n"
+             "content-length: 42\r\n"
+             "\r\n";
+  CuAssertIntEquals(tc, strlen(expected), sz);
+  CuAssertStrnEquals(tc, expected, sz, resultbuffer);
+  serf_bucket_destroy(decode);
+}
+
 static void test_http2_frame_bucket_basic(CuTest *tc)
 {
   test_baton_t *tb = tc->testBaton;
@@ -3339,12 +3734,17 @@ CuSuite *test_buckets(void)
     SUITE_ADD_TEST(suite, test_prefix_buckets);
     SUITE_ADD_TEST(suite, test_limit_buckets);
     SUITE_ADD_TEST(suite, test_split_buckets);
+    SUITE_ADD_TEST(suite, test_saver_buckets);
+    SUITE_ADD_TEST(suite, test_replay_buckets);
+    SUITE_ADD_TEST(suite, test_digest_buckets);
     SUITE_ADD_TEST(suite, test_deflate_compress_buckets);
     SUITE_ADD_TEST(suite, test_http2_unframe_buckets);
     SUITE_ADD_TEST(suite, test_http2_unpad_buckets);
+    SUITE_ADD_TEST(suite, test_http2_frame_buckets);
     SUITE_ADD_TEST(suite, test_hpack_huffman_decode);
     SUITE_ADD_TEST(suite, test_hpack_huffman_encode);
     SUITE_ADD_TEST(suite, test_hpack_header_encode);
+    SUITE_ADD_TEST(suite, test_hpack_header_decode);
     SUITE_ADD_TEST(suite, test_http2_frame_bucket_basic);
     if (serf_bucket_is_brotli_supported()) {
         SUITE_ADD_TEST(suite, test_brotli_decompress_bucket_basic);
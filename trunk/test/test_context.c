@@ -26,6 +26,7 @@
 #include <apr_version.h>
 
 #include "serf.h"
+#include "serf_bucket_util.h"
 
 #include "test_serf.h"
 
@@ -1017,6 +1018,583 @@ static void test_outgoing_request_err(CuTest *tc)
     CuAssertIntEquals(tc, 0, tb->handled_requests->nelts);
 }
 
+#define DOWNLOAD_SIZE 60000
+#define DOWNLOAD_SEGMENT_SIZE 10000
+
+typedef struct download_baton_t {
+    handler_baton_t handler_ctx;
+    apr_status_t status;
+    char *received;
+    apr_uint64_t received_len;
+} download_baton_t;
+
+static apr_status_t download_data(serf_download_t *download,
+                                  void *baton,
+                                  apr_uint64_t offset,
+                                  const char *data,
+                                  apr_size_t len,
+                                  apr_pool_t *pool)
+{
+    download_baton_t *db = baton;
+
+    /* Data must arrive in order */
+    if (offset != db->received_len
+        || db->received_len + len > DOWNLOAD_SIZE)
+        return REPORT_TEST_SUITE_ERROR();
+
+    memcpy(db->received + offset, data, len);
+    db->received_len += len;
+
+    return APR_SUCCESS;
+}
+
+static void download_done(serf_download_t *download,
+                          void *baton,
+                          apr_status_t status,
+                          apr_pool_t *pool)
+{
+    download_baton_t *db = baton;
+
+    db->status = status;
+    db->handler_ctx.done = TRUE;
+}
+
+static char *create_download_body(apr_pool_t *pool)
+{
+    char *body = apr_palloc(pool, DOWNLOAD_SIZE + 1);
+    int i;
+
+    for (i = 0; i < DOWNLOAD_SIZE; i++)
+        body[i] = 'a' + (i % 23);
+    body[DOWNLOAD_SIZE] = '\0';
+
+    return body;
+}
+
+/* Returns a 0 terminated copy of LEN bytes of BODY at OFFSET */
+static const char *download_part(const char *body, int offset, int len,
+                                 apr_pool_t *pool)
+{
+    return apr_pstrmemdup(pool, body + offset, len);
+}
+
+/* Test a download that is split in segments, where one segment is returned
+   as multipart/byteranges, delivered in order */
+static void test_download_segments(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    serf_download_t *download;
+    download_baton_t db = { { 0 } };
+    const char *body = create_download_body(tb->pool);
+    const char *multipart;
+    apr_status_t status;
+
+    setup_test_mock_server(tb);
+    status = setup_test_client_context(tb, NULL, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    /* The remaining 50000 bytes are fetched in 3 segments */
+    multipart = apr_pstrcat(tb->pool,
+                            "--SEP\r\n"
+                            "Content-Type: text/plain\r\n"
+                            "Content-Range: bytes 26667-30000/60000\r\n"
+                            "\r\n",
+                            download_part(body, 26667, 3334, tb->pool),
+                            "\r\n--SEP\r\n"
+                            "Content-Range: bytes 30001-43333/60000\r\n"
+                            "\r\n",
+                            download_part(body, 30001, 13333, tb->pool),
+                            "\r\n--SEP--\r\n",
+                            NULL);
+
+    Given(tb->mh)
+      GETRequest(URLEqualTo("/big"), HeaderEqualTo("Range", "bytes=0-9999"))
+        Respond(WithCode(206),
+                WithHeader("Content-Range", "bytes 0-9999/60000"),
+                WithBody(download_part(body, 0, 10000, tb->pool)))
+      GETRequest(URLEqualTo("/big"),
+                 HeaderEqualTo("Range", "bytes=10000-26666"))
+        Respond(WithCode(206),
+                WithHeader("Content-Range", "bytes 10000-26666/60000"),
+                WithBody(download_part(body, 10000, 16667, tb->pool)))
+      GETRequest(URLEqualTo("/big"),
+                 HeaderEqualTo("Range", "bytes=26667-43333"))
+        Respond(WithCode(206),
+                WithHeader("Content-Type",
+                           "multipart/byteranges; boundary=SEP"),
+                WithBody(multipart))
+      GETRequest(URLEqualTo("/big"),
+                 HeaderEqualTo("Range", "bytes=43334-59999"))
+        Respond(WithCode(206),
+                WithHeader("Content-Range", "bytes 43334-59999/60000"),
+                WithBody(download_part(body, 43334, 16666, tb->pool)))
+    EndGiven
+
+    status = serf_download_create(&download, tb->context,
+                                  apr_pstrcat(tb->pool, tb->serv_url, "/big",
+                                              NULL),
+                                  tb->conn_setup, tb, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    db.received = apr_palloc(tb->pool, DOWNLOAD_SIZE);
+    serf_download_set_segments(download, 4, DOWNLOAD_SEGMENT_SIZE);
+    serf_download_set_ordered(download, download_data, &db, 4096, NULL);
+
+    status = serf_download_start(download, download_done, &db);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    status = run_client_and_mock_servers_loops(tb, 1, &db.handler_ctx,
+                                               tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, APR_SUCCESS, db.status);
+
+    CuAssertTrue(tc, serf_download_get_size(download) == DOWNLOAD_SIZE);
+    CuAssertTrue(tc, db.received_len == DOWNLOAD_SIZE);
+    CuAssertTrue(tc, memcmp(db.received, body, DOWNLOAD_SIZE) == 0);
+}
+
+/* Test that a failing segment fails the download, while the other segments
+   are still being fetched */
+static void test_download_segment_failure(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    serf_download_t *download;
+    download_baton_t db = { { 0 } };
+    const char *body = create_download_body(tb->pool);
+    apr_status_t status;
+    int i;
+
+    setup_test_mock_server(tb);
+    status = setup_test_client_context(tb, NULL, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    Given(tb->mh)
+      GETRequest(URLEqualTo("/big"), HeaderEqualTo("Range", "bytes=0-9999"))
+        Respond(WithCode(206),
+                WithHeader("Content-Range", "bytes 0-9999/60000"),
+                WithBody(download_part(body, 0, 10000, tb->pool)))
+      GETRequest(URLEqualTo("/big"),
+                 HeaderEqualTo("Range", "bytes=10000-26666"))
+        Respond(WithCode(404), WithBody("gone"))
+      GETRequest(URLEqualTo("/big"),
+                 HeaderEqualTo("Range", "bytes=26667-43333"))
+        Respond(WithCode(206),
+                WithHeader("Content-Range", "bytes 26667-43333/60000"),
+                WithBody(download_part(body, 26667, 16667, tb->pool)))
+      GETRequest(URLEqualTo("/big"),
+                 HeaderEqualTo("Range", "bytes=43334-59999"))
+        Respond(WithCode(206),
+                WithHeader("Content-Range", "bytes 43334-59999/60000"),
+                WithBody(download_part(body, 43334, 16666, tb->pool)))
+    EndGiven
+
+    status = serf_download_create(&download, tb->context,
+                                  apr_pstrcat(tb->pool, tb->serv_url, "/big",
+                                              NULL),
+                                  tb->conn_setup, tb, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    db.received = apr_palloc(tb->pool, DOWNLOAD_SIZE);
+    serf_download_set_segments(download, 4, DOWNLOAD_SEGMENT_SIZE);
+    serf_download_set_ordered(download, download_data, &db, 4096, NULL);
+
+    status = serf_download_start(download, download_done, &db);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    status = run_client_and_mock_servers_loops(tb, 1, &db.handler_ctx,
+                                               tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, SERF_ERROR_BAD_HTTP_RESPONSE, db.status);
+
+    /* The other segments were closed with their saved data, and nothing
+       is delivered after the failure */
+    for (i = 0; i < 10; i++) {
+        status = run_client_and_mock_servers_loops(tb, 0, &db.handler_ctx,
+                                                   tb->pool);
+        CuAssertIntEquals(tc, APR_SUCCESS, status);
+    }
+    CuAssertTrue(tc, db.received_len <= 10000);
+}
+
+/* Test that an invalid Content-Length fails the download */
+static void test_download_bad_length(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    serf_download_t *download;
+    download_baton_t db = { { 0 } };
+    apr_status_t status;
+
+    setup_test_mock_server(tb);
+    status = setup_test_client_context(tb, NULL, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    Given(tb->mh)
+      GETRequest(URLEqualTo("/big"))
+        Respond(WithCode(200), WithHeader("Content-Length", "-5"),
+                WithChunkedBody("abcde"))
+    EndGiven
+
+    status = serf_download_create(&download, tb->context,
+                                  apr_pstrcat(tb->pool, tb->serv_url, "/big",
+                                              NULL),
+                                  tb->conn_setup, tb, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    db.received = apr_palloc(tb->pool, DOWNLOAD_SIZE);
+    serf_download_set_ordered(download, download_data, &db, 4096, NULL);
+
+    status = serf_download_start(download, download_done, &db);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    status = run_client_and_mock_servers_loops(tb, 1, &db.handler_ctx,
+                                               tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, SERF_ERROR_BAD_HTTP_RESPONSE, db.status);
+    CuAssertIntEquals(tc, 0, (int)db.received_len);
+}
+
+/* Test downloading into a file from a server that ignores Range */
+static void test_download_range_ignored(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    serf_download_t *download;
+    download_baton_t db = { { 0 } };
+    const char *body = create_download_body(tb->pool);
+    const char *temp_dir;
+    char *path;
+    char *received;
+    apr_file_t *file;
+    apr_off_t offset = 0;
+    apr_size_t len;
+    apr_status_t status;
+
+    setup_test_mock_server(tb);
+    status = setup_test_client_context(tb, NULL, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    Given(tb->mh)
+      GETRequest(URLEqualTo("/big"))
+        Respond(WithCode(200), WithBody(body))
+    EndGiven
+
+    status = apr_temp_dir_get(&temp_dir, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    path = apr_pstrcat(tb->pool, temp_dir, "/serf-testXXXXXX", NULL);
+    status = apr_file_mktemp(&file, path,
+                             APR_FOPEN_CREATE | APR_FOPEN_READ
+                             | APR_FOPEN_WRITE | APR_FOPEN_EXCL
+                             | APR_FOPEN_BINARY | APR_FOPEN_DELONCLOSE,
+                             tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    status = serf_download_create(&download, tb->context,
+                                  apr_pstrcat(tb->pool, tb->serv_url, "/big",
+                                              NULL),
+                                  tb->conn_setup, tb, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    serf_download_set_segments(download, 4, DOWNLOAD_SEGMENT_SIZE);
+    serf_download_set_file(download, file);
+
+    status = serf_download_start(download, download_done, &db);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    status = run_client_and_mock_servers_loops(tb, 1, &db.handler_ctx,
+                                               tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, APR_SUCCESS, db.status);
+    CuAssertTrue(tc, serf_download_get_size(download) == DOWNLOAD_SIZE);
+
+    received = apr_palloc(tb->pool, DOWNLOAD_SIZE + 1);
+    status = apr_file_seek(file, APR_SET, &offset);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    status = apr_file_read_full(file, received, DOWNLOAD_SIZE + 1, &len);
+    CuAssertIntEquals(tc, APR_EOF, status);
+    CuAssertIntEquals(tc, DOWNLOAD_SIZE, (int)len);
+    CuAssertTrue(tc, memcmp(received, body, DOWNLOAD_SIZE) == 0);
+}
+
+typedef struct pushback_baton_t {
+    int pushback_id;    /* Request to apply pushback on */
+    int tried;
+    apr_status_t pushback_status;
+    int paused;
+    serf_request_t *paused_request;
+    serf_bucket_t *saver;
+    handler_baton_t *follow_ctx;  /* Created while paused */
+} pushback_baton_t;
+
+static serf_bucket_t *pushback_accept(serf_request_t *request,
+                                      serf_bucket_t *stream,
+                                      void *acceptor_baton,
+                                      apr_pool_t *pool)
+{
+    handler_baton_t *ctx = acceptor_baton;
+    pushback_baton_t *pb = ctx->tb->user_baton;
+    serf_bucket_alloc_t *bkt_alloc = serf_request_get_alloc(request);
+    serf_bucket_t *c;
+
+    c = serf_bucket_barrier_create(stream, bkt_alloc);
+    pb->saver = serf_bucket_saver_create(c, 16, NULL, bkt_alloc);
+
+    APR_ARRAY_PUSH(ctx->accepted_requests, int) = ctx->req_id;
+
+    return serf_bucket_response_create(pb->saver, bkt_alloc);
+}
+
+static apr_status_t pushback_handle_response(serf_request_t *request,
+                                             serf_bucket_t *response,
+                                             void *handler_baton,
+                                             apr_pool_t *pool)
+{
+    handler_baton_t *ctx = handler_baton;
+    pushback_baton_t *pb = ctx->tb->user_baton;
+
+    if (response && ctx->req_id == pb->pushback_id && !pb->tried) {
+        pb->tried = TRUE;
+        pb->pushback_status = serf_request_pushback(request, pb->saver, 0);
+
+        if (pb->pushback_status == APR_SUCCESS) {
+            pb->paused = TRUE;
+            pb->paused_request = request;
+
+            /* Not written before the response is resumed */
+            create_new_request(ctx->tb, pb->follow_ctx, "GET", "/", 2);
+            return APR_EAGAIN;
+        }
+    }
+
+    return handle_response(request, response, handler_baton, pool);
+}
+
+/* Test that pushback on a pipelined connection holds back the next request
+   until the response is resumed, and is refused while the responses of
+   other requests would follow */
+static void test_pushback_pipelined(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    handler_baton_t handler_ctx[4];
+    pushback_baton_t pb = { 0 };
+    apr_status_t status;
+    int i;
+
+    setup_test_mock_server(tb);
+    status = setup_test_client_context(tb, NULL, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    Given(tb->mh)
+      GETRequest(URLEqualTo("/"), ChunkedBodyEqualTo("1"),
+                 HeaderEqualTo("Host", tb->serv_host))
+        Respond(WithCode(200), WithChunkedBody("The first response"))
+      GETRequest(URLEqualTo("/"), ChunkedBodyEqualTo("2"),
+                 HeaderEqualTo("Host", tb->serv_host))
+        Respond(WithCode(200), WithChunkedBody("The second response"))
+      GETRequest(URLEqualTo("/"), ChunkedBodyEqualTo("3"),
+                 HeaderEqualTo("Host", tb->serv_host))
+        Respond(WithCode(200), WithChunkedBody("The third response"))
+      GETRequest(URLEqualTo("/"), ChunkedBodyEqualTo("4"),
+                 HeaderEqualTo("Host", tb->serv_host))
+        Respond(WithCode(200), WithChunkedBody("The fourth response"))
+    EndGiven
+
+    tb->user_baton = &pb;
+    pb.pushback_id = 1;
+    pb.follow_ctx = &handler_ctx[1];
+
+    create_new_request_ex(tb, &handler_ctx[0], "GET", "/", 1, NULL,
+                          pushback_handle_response);
+    handler_ctx[0].acceptor = pushback_accept;
+
+    status = run_client_and_mock_servers_until(tb, &pb.paused, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, APR_SUCCESS, pb.pushback_status);
+
+    /* The second request stays queued while the first response is paused */
+    for (i = 0; i < 20; i++) {
+        status = run_client_and_mock_servers_loops(tb, 0, handler_ctx,
+                                                   tb->pool);
+        CuAssertIntEquals(tc, APR_SUCCESS, status);
+    }
+    CuAssertIntEquals(tc, 1, tb->sent_requests->nelts);
+    CuAssertTrue(tc, !handler_ctx[0].done);
+
+    serf_request_resume(pb.paused_request);
+
+    run_client_and_mock_servers_loops_expect_ok(tc, tb, 2, handler_ctx,
+                                                tb->pool);
+
+    /* Two pipelined requests: the second response would be saved along
+       with the first */
+    pb.pushback_id = 3;
+    pb.tried = FALSE;
+    create_new_request_ex(tb, &handler_ctx[2], "GET", "/", 3, NULL,
+                          pushback_handle_response);
+    handler_ctx[2].acceptor = pushback_accept;
+    create_new_request(tb, &handler_ctx[3], "GET", "/", 4);
+
+    run_client_and_mock_servers_loops_expect_ok(tc, tb, 4, handler_ctx,
+                                                tb->pool);
+    CuAssertTrue(tc, pb.tried);
+    CuAssertIntEquals(tc, APR_EBUSY, pb.pushback_status);
+}
+
+typedef struct budget_baton_t {
+    apr_array_header_t *held;  /* Copies of the body, from ALLOC */
+    serf_bucket_alloc_t *alloc;
+    int release;
+    apr_size_t read;
+} budget_baton_t;
+
+/* Reads the response and holds on to a copy of everything read, until the
+   test releases the memory */
+static apr_status_t budget_handle_response(serf_request_t *request,
+                                           serf_bucket_t *response,
+                                           void *handler_baton,
+                                           apr_pool_t *pool)
+{
+    handler_baton_t *ctx = handler_baton;
+    budget_baton_t *bb = ctx->tb->user_baton;
+    apr_status_t status;
+
+    if (!response)
+        return APR_SUCCESS;
+
+    bb->alloc = serf_request_get_alloc(request);
+
+    do {
+        const char *data;
+        apr_size_t len;
+
+        status = serf_bucket_read(response, SERF_READ_ALL_AVAIL, &data, &len);
+        if (SERF_BUCKET_READ_ERROR(status))
+            return status;
+
+        bb->read += len;
+        if (len && !bb->release) {
+            void *copy = serf_bucket_mem_alloc(bb->alloc, len);
+
+            memcpy(copy, data, len);
+            APR_ARRAY_PUSH(bb->held, void *) = copy;
+        }
+    } while (status == APR_SUCCESS);
+
+    if (APR_STATUS_IS_EOF(status)) {
+        APR_ARRAY_PUSH(ctx->handled_requests, int) = ctx->req_id;
+        ctx->done = TRUE;
+        return APR_EOF;
+    }
+
+    return status;
+}
+
+/* Test that reading stalls while a connection is over its memory budget,
+   and resumes once the memory drops below the low watermark */
+static void test_memory_budget_stall(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    handler_baton_t handler_ctx[1];
+    budget_baton_t bb = { 0 };
+    unsigned int throttled = 0;
+    apr_size_t stalled_at;
+    char *body;
+    apr_size_t body_len = 256 * 1024;
+    apr_status_t status;
+    int i;
+
+    body = apr_palloc(tb->pool, body_len + 1);
+    memset(body, 'x', body_len);
+    body[body_len] = '\0';
+
+    setup_test_mock_server(tb);
+    status = setup_test_client_context(tb, NULL, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    Given(tb->mh)
+      GETRequest(URLEqualTo("/"), ChunkedBodyEqualTo("1"),
+                 HeaderEqualTo("Host", tb->serv_host))
+        Respond(WithCode(200), WithBody(body))
+    EndGiven
+
+    bb.held = apr_array_make(tb->pool, 16, sizeof(void *));
+    tb->user_baton = &bb;
+
+    serf_connection_set_memory_budget(tb->connection, 32 * 1024, 16 * 1024);
+
+    create_new_request_ex(tb, &handler_ctx[0], "GET", "/", 1, NULL,
+                          budget_handle_response);
+
+    for (i = 0; i < 1000 && !throttled; i++) {
+        status = run_client_and_mock_servers_loops(tb, 0, handler_ctx,
+                                                   tb->pool);
+        CuAssertIntEquals(tc, APR_SUCCESS, status);
+        serf_context_get_memory_stats(tb->context, NULL, NULL, &throttled,
+                                      NULL);
+    }
+    CuAssertIntEquals(tc, 1, throttled);
+    CuAssertTrue(tc, !handler_ctx[0].done);
+
+    /* Nothing more is read while over budget */
+    for (i = 0; i < 5; i++)
+        run_client_and_mock_servers_loops(tb, 0, handler_ctx, tb->pool);
+    stalled_at = bb.read;
+    for (i = 0; i < 20; i++)
+        run_client_and_mock_servers_loops(tb, 0, handler_ctx, tb->pool);
+    CuAssertIntEquals(tc, (int)stalled_at, (int)bb.read);
+    CuAssertTrue(tc, bb.read < body_len);
+
+    /* Dropping below the low watermark resumes reading */
+    bb.release = TRUE;
+    for (i = 0; i < bb.held->nelts; i++)
+        serf_bucket_mem_free(bb.alloc, APR_ARRAY_IDX(bb.held, i, void *));
+    apr_array_clear(bb.held);
+
+    run_client_and_mock_servers_loops_expect_ok(tc, tb, 1, handler_ctx,
+                                                tb->pool);
+    CuAssertIntEquals(tc, (int)body_len, (int)bb.read);
+
+    serf_context_get_memory_stats(tb->context, NULL, NULL, &throttled, NULL);
+    CuAssertIntEquals(tc, 0, throttled);
+}
+
+/* Test that replayable requests that were written but not answered when the
+   connection was closed are sent again without calling setup again */
+static void test_replay_after_reset(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    handler_baton_t handler_ctx[3];
+    apr_status_t status;
+    int i;
+
+    setup_test_mock_server(tb);
+    status = setup_test_client_context(tb, NULL, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    Given(tb->mh)
+      GETRequest(URLEqualTo("/"), ChunkedBodyEqualTo("1"))
+        Respond(WithCode(200), WithRequestBody)
+        CloseConnection
+      GETRequest(URLEqualTo("/"), ChunkedBodyEqualTo("2"))
+        Respond(WithCode(200), WithRequestBody)
+      GETRequest(URLEqualTo("/"), ChunkedBodyEqualTo("3"))
+        Respond(WithCode(200), WithRequestBody)
+    EndGiven
+
+    for (i = 0; i < 3; i++)
+        create_new_request_ex(tb, &handler_ctx[i], "GET", "/", i + 1,
+                              setup_replayable_request, NULL);
+
+    status = run_client_and_mock_servers_loops(tb, 3, handler_ctx,
+                                               tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    /* setup_request() records each call */
+    CuAssertIntEquals(tc, 3, tb->sent_requests->nelts);
+    CuAssertIntEquals(tc, 3, tb->handled_requests->nelts);
+    for (i = 0; i < 3; i++)
+        CuAssertIntEquals(tc, i + 1,
+                          APR_ARRAY_IDX(tb->sent_requests, i, int));
+}
+
 /*****************************************************************************/
 CuSuite *test_context(void)
 {
@@ -1043,6 +1621,13 @@ CuSuite *test_context(void)
     SUITE_ADD_TEST(suite, test_connection_large_request);
     SUITE_ADD_TEST(suite, test_max_keepalive_requests);
     SUITE_ADD_TEST(suite, test_outgoing_request_err);
+    SUITE_ADD_TEST(suite, test_download_segments);
+    SUITE_ADD_TEST(suite, test_download_range_ignored);
+    SUITE_ADD_TEST(suite, test_download_segment_failure);
+    SUITE_ADD_TEST(suite, test_download_bad_length);
+    SUITE_ADD_TEST(suite, test_pushback_pipelined);
+    SUITE_ADD_TEST(suite, test_memory_budget_stall);
+    SUITE_ADD_TEST(suite, test_replay_after_reset);
 
     return suite;
 }
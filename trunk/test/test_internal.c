@@ -34,6 +34,7 @@
 /* These test cases have access to internal functions. */
 #include "serf_private.h"
 #include "serf_bucket_util.h"
+#include "protocols/http2_protocol.h"
 
 #define PER_CONN_UNKNOWN_KEY    SERF_CONFIG_PER_CONNECTION | 0xFF0001
 /* #define PER_HOST_UNKNOWN_KEY    SERF_CONFIG_PER_HOST | 0xFF0002 */
@@ -391,6 +392,218 @@ static void test_header_buckets_remove(CuTest *tc)
     serf_bucket_destroy(hdrs);
 }
 
+/* Check the memory accounting of the bucket allocator, used for the
+   memory budget */
+/* Note: serf__bucket_allocator_get_used is an internal function */
+static void test_allocator_memory_used(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    serf_bucket_alloc_t *alloc = test__create_bucket_allocator(tc, tb->pool);
+    void *small, *large;
+    apr_size_t used;
+
+    CuAssertIntEquals(tc, 0, (int)serf__bucket_allocator_get_used(alloc));
+
+    small = serf_bucket_mem_alloc(alloc, 10);
+    used = serf__bucket_allocator_get_used(alloc);
+    CuAssertTrue(tc, used >= 10);
+
+    large = serf_bucket_mem_alloc(alloc, 20000);
+    CuAssertTrue(tc, serf__bucket_allocator_get_used(alloc) >= used + 20000);
+
+    serf_bucket_mem_free(alloc, large);
+    CuAssertIntEquals(tc, (int)used,
+                      (int)serf__bucket_allocator_get_used(alloc));
+
+    serf_bucket_mem_free(alloc, small);
+    CuAssertIntEquals(tc, 0, (int)serf__bucket_allocator_get_used(alloc));
+}
+
+/* Creates an open stream with data to send in the HTTP/2 dependency tree */
+static serf_http2_stream_t *
+create_prio_stream(serf_http2_priority_tree_t *tree,
+                   apr_int32_t streamid,
+                   serf_http2_stream_t *parent,
+                   apr_uint16_t weight,
+                   serf_bucket_alloc_t *alloc)
+{
+    serf_http2_stream_t *stream;
+
+    stream = serf_http2__stream_create(NULL, streamid,
+                                       HTTP2_WINDOW_MAX_ALLOWED,
+                                       HTTP2_DEFAULT_WINDOW_SIZE, alloc);
+    stream->status = H2S_OPEN;
+
+    serf_http2__priority_set(tree, stream, parent, weight, false);
+    serf_http2__priority_activate(tree, stream);
+
+    return stream;
+}
+
+/* Lets the scheduler send FRAMES DATA frames of 1000 bytes, accounting
+   them on the window of the sending stream */
+static void send_prio_frames(CuTest *tc,
+                             serf_http2_priority_tree_t *tree,
+                             int frames)
+{
+    while (frames--) {
+        serf_http2_stream_t *stream = serf_http2__priority_next(tree);
+
+        CuAssertPtrNotNull(tc, stream);
+
+        stream->lr_window -= 1000;
+        serf_http2__priority_charge(tree, stream, 1000);
+    }
+}
+
+#define PRIO_SENT(stream) (HTTP2_WINDOW_MAX_ALLOWED - (stream)->lr_window)
+
+/* Note: serf_http2__priority_* are internal functions */
+static void test_http2_priority_weights(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    serf_bucket_alloc_t *alloc = test__create_bucket_allocator(tc, tb->pool);
+    serf_http2_priority_tree_t tree = { NULL, 0 };
+    serf_http2_stream_t *a, *b, *c, *d;
+    apr_uint32_t sent_b, sent_c;
+
+    a = create_prio_stream(&tree, 1, NULL, 16, alloc);
+    b = create_prio_stream(&tree, 3, NULL, 32, alloc);
+    c = create_prio_stream(&tree, 5, a, 16, alloc);
+
+    /* Siblings share by weight: 1:2. The dependency of a gets nothing as
+       long as a can send */
+    send_prio_frames(tc, &tree, 3000);
+    CuAssertIntEquals(tc, 1000000, (int)PRIO_SENT(a));
+    CuAssertIntEquals(tc, 2000000, (int)PRIO_SENT(b));
+    CuAssertIntEquals(tc, 0, (int)PRIO_SENT(c));
+
+    /* When a is blocked, c takes over its share */
+    a->writable = false;
+    sent_b = PRIO_SENT(b);
+    send_prio_frames(tc, &tree, 3000);
+    CuAssertIntEquals(tc, 1000000, (int)PRIO_SENT(c));
+    CuAssertIntEquals(tc, 2000000, (int)(PRIO_SENT(b) - sent_b));
+
+    /* A window of 0 blocks just like not having data */
+    serf_http2__priority_activate(&tree, a);
+    c->lr_window = 0;
+    sent_b = PRIO_SENT(b);
+    send_prio_frames(tc, &tree, 300);
+    CuAssertIntEquals(tc, 1100000, (int)PRIO_SENT(a));
+    CuAssertIntEquals(tc, 200000, (int)(PRIO_SENT(b) - sent_b));
+
+    /* An exclusive dependency on the root adopts all streams */
+    d = create_prio_stream(&tree, 7, NULL, 64, alloc);
+    serf_http2__priority_set(&tree, d, NULL, 64, true);
+    CuAssertPtrEquals(tc, d, a->dep_parent);
+    CuAssertPtrEquals(tc, d, b->dep_parent);
+    CuAssertPtrEquals(tc, NULL, d->dep_next_sibling);
+    CuAssertPtrEquals(tc, d, serf_http2__priority_next(&tree));
+
+    /* Making a dependent on its own dependency c first moves c to the
+       former parent of a (RFC 7540, section 5.3.3) */
+    d->writable = false;
+    c->lr_window = HTTP2_WINDOW_MAX_ALLOWED;
+    sent_c = PRIO_SENT(c);
+    serf_http2__priority_set(&tree, a, c, 16, false);
+    CuAssertPtrEquals(tc, d, c->dep_parent);
+    CuAssertPtrEquals(tc, c, a->dep_parent);
+    CuAssertIntEquals(tc, 16, c->weight);
+
+    sent_b = PRIO_SENT(b);
+    send_prio_frames(tc, &tree, 300);
+    CuAssertIntEquals(tc, 100000, (int)(PRIO_SENT(c) - sent_c));
+    CuAssertIntEquals(tc, 200000, (int)(PRIO_SENT(b) - sent_b));
+
+    /* Nothing can be sent */
+    b->writable = c->writable = a->writable = false;
+    CuAssertPtrEquals(tc, NULL, serf_http2__priority_next(&tree));
+
+    serf_http2__stream_cleanup(a);
+    serf_http2__stream_cleanup(b);
+    serf_http2__stream_cleanup(c);
+    serf_http2__stream_cleanup(d);
+}
+
+/* Note: serf_http2__priority_weight is an internal function */
+static void test_http2_priority_mapping(CuTest *tc)
+{
+    CuAssertIntEquals(tc, HTTP2_PRIORITY_WEIGHT_DEFAULT,
+                      serf_http2__priority_weight(
+                                            SERF_REQUEST_PRIORITY_DEFAULT));
+    CuAssertIntEquals(tc, 1, serf_http2__priority_weight(0));
+    CuAssertIntEquals(tc, 1, serf_http2__priority_weight(0x1FF));
+    CuAssertIntEquals(tc, 255, serf_http2__priority_weight(0xFFFF));
+}
+
+/* Closed streams leave the tree, and their dependencies take their place
+   with a share of their weight */
+static void test_http2_priority_prune(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    serf_bucket_alloc_t *alloc = test__create_bucket_allocator(tc, tb->pool);
+    serf_http2_priority_tree_t tree = { NULL, 0 };
+    serf_http2_stream_t *a, *b, *c, *d;
+
+    a = create_prio_stream(&tree, 1, NULL, 32, alloc);
+    b = create_prio_stream(&tree, 3, a, 16, alloc);
+    c = create_prio_stream(&tree, 5, a, 48, alloc);
+    d = create_prio_stream(&tree, 7, NULL, 16, alloc);
+
+    a->status = H2S_CLOSED;
+    CuAssertPtrNotNull(tc, serf_http2__priority_next(&tree));
+
+    CuAssertPtrEquals(tc, NULL, b->dep_parent);
+    CuAssertPtrEquals(tc, NULL, c->dep_parent);
+    CuAssertIntEquals(tc, 8, b->weight);
+    CuAssertIntEquals(tc, 24, c->weight);
+    CuAssertPtrEquals(tc, NULL, a->dep_first_child);
+
+    /* a is replaced by its dependencies on the root level (new streams
+       are added in front) */
+    CuAssertPtrEquals(tc, d, tree.first_child);
+    CuAssertPtrEquals(tc, c, d->dep_next_sibling);
+    CuAssertPtrEquals(tc, b, c->dep_next_sibling);
+    CuAssertPtrEquals(tc, NULL, b->dep_next_sibling);
+
+    /* A dependency on a closed stream gets the default priority */
+    serf_http2__priority_set(&tree, d, a, 200, true);
+    CuAssertPtrEquals(tc, NULL, d->dep_parent);
+    CuAssertIntEquals(tc, HTTP2_PRIORITY_WEIGHT_DEFAULT, d->weight);
+
+    b->status = c->status = d->status = H2S_CLOSED;
+    CuAssertPtrEquals(tc, NULL, serf_http2__priority_next(&tree));
+    CuAssertPtrEquals(tc, NULL, tree.first_child);
+}
+
+/* Certificate names allow a wildcard only as the complete left-most label,
+   matching exactly one label */
+static void test_coalesce_name_matches(CuTest *tc)
+{
+    CuAssertTrue(tc, serf__coalesce_name_matches("localhost", "localhost"));
+    CuAssertTrue(tc, serf__coalesce_name_matches("LocalHost", "localhost"));
+    CuAssertTrue(tc, serf__coalesce_name_matches("*.example.com",
+                                                 "www.example.com"));
+    CuAssertTrue(tc, serf__coalesce_name_matches("*.example.com",
+                                                 "WWW.Example.COM"));
+
+    CuAssertTrue(tc, !serf__coalesce_name_matches("example.com",
+                                                  "www.example.com"));
+    CuAssertTrue(tc, !serf__coalesce_name_matches("*.example.com",
+                                                  "example.com"));
+    CuAssertTrue(tc, !serf__coalesce_name_matches("*.example.com",
+                                                  "a.b.example.com"));
+    CuAssertTrue(tc, !serf__coalesce_name_matches("*.example.com",
+                                                  ".example.com"));
+    CuAssertTrue(tc, !serf__coalesce_name_matches("*.example.com",
+                                                  "www.example.org"));
+    CuAssertTrue(tc, !serf__coalesce_name_matches("w*.example.com",
+                                                  "www.example.com"));
+    CuAssertTrue(tc, !serf__coalesce_name_matches("*.localhost",
+                                                  "localhost"));
+}
+
 static void test_runtime_versions(CuTest *tc)
 {
   apr_version_t version_of_apr;
@@ -431,6 +644,11 @@ CuSuite *test_internal(void)
     SUITE_ADD_TEST(suite, test_config_store_error_handling);
     SUITE_ADD_TEST(suite, test_config_store_remove_objects);
     SUITE_ADD_TEST(suite, test_header_buckets_remove);
+    SUITE_ADD_TEST(suite, test_allocator_memory_used);
+    SUITE_ADD_TEST(suite, test_http2_priority_weights);
+    SUITE_ADD_TEST(suite, test_http2_priority_mapping);
+    SUITE_ADD_TEST(suite, test_http2_priority_prune);
+    SUITE_ADD_TEST(suite, test_coalesce_name_matches);
     SUITE_ADD_TEST(suite, test_runtime_versions);
 
     return suite;
@@ -160,6 +160,7 @@ typedef struct handler_baton_t {
 #define TEST_RESULT_AUTHNCB_CALLED           0x0010
 #define TEST_RESULT_HANDLE_RESPONSECB_CALLED 0x0020
 #define TEST_RESULT_OCSP_CHECK_SUCCESSFUL    0x0040
+#define TEST_RESULT_SPAWNCB_CALLED           0x0080
 
 serf_bucket_t* accept_response(serf_request_t *request,
                                serf_bucket_t *stream,
@@ -173,6 +174,10 @@ apr_status_t setup_request(serf_request_t *request,
                            serf_response_handler_t *handler,
                            void **handler_baton,
                            apr_pool_t *pool);
+apr_status_t setup_replayable_request(serf_request_t *request,
+                                      void *setup_baton,
+                                      serf_bucket_t **req_bkt,
+                                      apr_pool_t *pool);
 apr_status_t handle_response(serf_request_t *request,
                              serf_bucket_t *response,
                              void *handler_baton,
@@ -287,6 +292,13 @@ run_client_and_mock_servers_loops(test_baton_t *tb,
                                   handler_baton_t handler_ctx[],
                                   apr_pool_t *pool);
 
+/* Helper function, runs the client and server context loops until *DONE
+   is set. */
+apr_status_t
+run_client_and_mock_servers_until(test_baton_t *tb,
+                                  const int *done,
+                                  apr_pool_t *pool);
+
 /* Helper function, runs the client and server context loops and validates
    that no errors were encountered, and all messages were sent and received
    in order. */
@@ -29,6 +29,9 @@
 
 #include "test_serf.h"
 
+/* For serf__config_store_set_peer_names() */
+#include "serf_private.h"
+
 static apr_status_t client_setup(apr_socket_t *skt,
                                  serf_bucket_t **read_bkt,
                                  serf_bucket_t **write_bkt,
@@ -66,6 +69,26 @@ static apr_status_t client_request_handler(serf_incoming_request_t *req,
     return status;
 }
 
+/* Size of the response bodies when tb->user_baton_l is set to it */
+#define LARGE_BODY_SIZE (4 * 1024 * 1024)
+
+/* Returns a body of LARGE_BODY_SIZE bytes */
+static serf_bucket_t *create_large_body(serf_bucket_alloc_t *allocator)
+{
+    static char block[16384];
+    serf_bucket_t *body = serf_bucket_aggregate_create(allocator);
+    int i;
+
+    memset(block, 'x', sizeof(block));
+
+    for (i = 0; i < LARGE_BODY_SIZE / (int)sizeof(block); i++)
+        serf_bucket_aggregate_append(
+            body, serf_bucket_simple_create(block, sizeof(block), NULL, NULL,
+                                            allocator));
+
+    return body;
+}
+
 static apr_status_t client_generate_response(serf_bucket_t **resp_bkt,
                                              serf_incoming_request_t *req,
                                              void *setup_baton,
@@ -91,8 +114,20 @@ static apr_status_t client_generate_response(serf_bucket_t **resp_bkt,
         serf_bucket_headers_set(headers, "WWW-Authenticate",
                                 "Basic realm=\"Test Suite\"");
     }
+    else if (tb->user_baton_l == 421) {
+        tb->user_baton_l = 0;
+
+        body = SERF_BUCKET_SIMPLE_STRING("WRONG SERVER" CRLF, allocator);
+
+        resp = serf_bucket_outgoing_response_create(body, 421,
+                                                    "Misdirected Request",
+                                                    SERF_HTTP_11, allocator);
+    }
     else {
-        body = SERF_BUCKET_SIMPLE_STRING("OK" CRLF, allocator);
+        if (tb->user_baton_l == LARGE_BODY_SIZE)
+            body = create_large_body(allocator);
+        else
+            body = SERF_BUCKET_SIMPLE_STRING("OK" CRLF, allocator);
 
         resp = serf_bucket_outgoing_response_create(body, 200, "OK",
                                                     SERF_HTTP_11, allocator);
@@ -142,7 +177,31 @@ static apr_status_t client_acceptor(serf_context_t *ctx,
                                  pool);
 }
 
-static void setup_test_server(test_baton_t *tb)
+/* Accepts clients that may open at most 4 concurrent HTTP/2 streams */
+static apr_status_t limited_client_acceptor(serf_context_t *ctx,
+                                            serf_listener_t *l,
+                                            void *accept_baton,
+                                            apr_socket_t *insock,
+                                            apr_pool_t *pool)
+{
+    serf_incoming_t *incoming;
+    test_baton_t *tb = accept_baton;
+    apr_status_t status;
+
+    status = serf_incoming_create2(&incoming, ctx, insock,
+                                   client_setup, tb,
+                                   client_closed, tb,
+                                   client_request_acceptor, tb,
+                                   pool);
+    if (status)
+        return status;
+
+    serf_incoming_set_http2_max_streams(incoming, 4);
+    return APR_SUCCESS;
+}
+
+static void setup_test_server_ex(test_baton_t *tb,
+                                 serf_accept_client_t acceptor)
 {
     serf_listener_t *listener;
     apr_status_t status;
@@ -155,7 +214,7 @@ static void setup_test_server(test_baton_t *tb)
 
     while ((status = serf_listener_create(&listener, tb->context,
                                           "localhost", listen_port,
-                                          tb, client_acceptor,
+                                          tb, acceptor,
                                           tb->pool)) != APR_SUCCESS)
     {
         listen_port++;
@@ -167,6 +226,11 @@ static void setup_test_server(test_baton_t *tb)
     tb->serv_url = apr_psprintf(tb->pool, "http://%s", tb->serv_host);
 }
 
+static void setup_test_server(test_baton_t *tb)
+{
+    setup_test_server_ex(tb, client_acceptor);
+}
+
 static apr_status_t
 run_client_server_loop(test_baton_t *tb,
                        int num_requests,
@@ -236,6 +300,10 @@ static void test_listen_http(CuTest *tc)
     status = run_client_server_loop(tb, num_requests,
                                     handler_ctx, tb->pool);
     CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    CuAssertIntEquals(tc, APR_ENOTIMPL,
+                      serf_connection_get_http2_stats(tb->connection, NULL,
+                                                      NULL, NULL, NULL));
 }
 
 static void test_listen_http2(CuTest *tc)
@@ -259,6 +327,1128 @@ static void test_listen_http2(CuTest *tc)
     CuAssertIntEquals(tc, APR_SUCCESS, status);
 }
 
+static void test_listen_http2_window_tuning(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    apr_status_t status;
+    handler_baton_t handler_ctx[2];
+    const int num_requests = sizeof(handler_ctx) / sizeof(handler_ctx[0]);
+    apr_uint32_t recv_window;
+    apr_uint64_t bdp;
+    apr_interval_time_t rtt;
+
+    setup_test_server(tb);
+
+    status = setup_test_client_context(tb, connection_setup_http2,
+                                       tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    serf_connection_set_http2_window_tuning(tb->connection,
+                                            16 * 1024 * 1024);
+
+    create_new_request(tb, &handler_ctx[0], "GET", "/", 1);
+    create_new_request(tb, &handler_ctx[1], "GET", "/", 2);
+
+    status = run_client_server_loop(tb, num_requests,
+                                    handler_ctx, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    status = serf_connection_get_http2_stats(tb->connection, &recv_window,
+                                             NULL, NULL, &rtt);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    /* The tiny responses don't come close to filling the initial window,
+       so it must not have grown */
+    CuAssertIntEquals(tc, 65535, (int)recv_window);
+
+    /* A large response fills the window within a round trip, which makes
+       the windows grow */
+    tb->user_baton_l = LARGE_BODY_SIZE;
+    create_new_request(tb, &handler_ctx[0], "GET", "/", 3);
+
+    status = run_client_server_loop(tb, 1, handler_ctx, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    status = serf_connection_get_http2_stats(tb->connection, &recv_window,
+                                             NULL, &bdp, &rtt);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertTrue(tc, rtt >= 0);
+    CuAssertTrue(tc, bdp > 0);
+    CuAssertTrue(tc, recv_window > 65535);
+    CuAssertTrue(tc, recv_window <= 16 * 1024 * 1024);
+}
+
+typedef struct spill_conn_baton_t {
+    test_baton_t *tb;
+    serf_connection_t *conn;
+} spill_conn_baton_t;
+
+static apr_status_t spill_conn_setup(apr_socket_t *skt,
+                                     serf_bucket_t **read_bkt,
+                                     serf_bucket_t **write_bkt,
+                                     void *setup_baton,
+                                     apr_pool_t *pool)
+{
+    spill_conn_baton_t *scb = setup_baton;
+
+    *read_bkt = serf_bucket_socket_create(skt, scb->tb->bkt_alloc);
+
+    serf_connection_set_framing_type(scb->conn,
+                                     SERF_CONNECTION_FRAMING_TYPE_HTTP2);
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t spawn_http2(serf_connection_t **new_conn,
+                                serf_connection_t *conn,
+                                void *spawn_baton,
+                                apr_pool_t *pool)
+{
+    test_baton_t *tb = spawn_baton;
+    spill_conn_baton_t *scb = apr_pcalloc(pool, sizeof(*scb));
+    apr_uri_t url;
+    apr_status_t status;
+
+    scb->tb = tb;
+
+    status = apr_uri_parse(pool, tb->serv_url, &url);
+    if (status)
+        return status;
+
+    status = serf_connection_create2(&scb->conn, tb->context, url,
+                                     spill_conn_setup, scb,
+                                     NULL, NULL, pool);
+    if (status)
+        return status;
+
+    tb->result_flags |= TEST_RESULT_SPAWNCB_CALLED;
+    tb->user_baton = scb->conn;
+    *new_conn = scb->conn;
+    return APR_SUCCESS;
+}
+
+/* A server that doesn't limit the number of streams never saturates the
+   connection, so spillover must keep all requests on it */
+static void test_listen_http2_spillover(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    apr_status_t status;
+    handler_baton_t handler_ctx[16];
+    const int num_requests = sizeof(handler_ctx) / sizeof(handler_ctx[0]);
+    serf_config_t *config;
+    const char *value;
+    int i;
+
+    setup_test_server(tb);
+
+    status = setup_test_client_context(tb, connection_setup_http2,
+                                       tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    serf_connection_set_spillover(tb->connection, spawn_http2, tb);
+
+    config = serf_connection_get_config(tb->connection);
+    CuAssertPtrNotNull(tc, config);
+    status = serf_config_set_string(config, SERF_CONFIG_HOST_MAX_CONNS, "2");
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    status = serf_config_get_string(config, SERF_CONFIG_HOST_MAX_CONNS,
+                                    &value);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertStrEquals(tc, "2", value);
+
+    for (i = 0; i < num_requests; i++)
+        create_new_request(tb, &handler_ctx[i], "GET", "/", i + 1);
+
+    status = run_client_server_loop(tb, num_requests,
+                                    handler_ctx, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    CuAssertIntEquals(tc, 0, tb->result_flags & TEST_RESULT_SPAWNCB_CALLED);
+    CuAssertIntEquals(tc, 0,
+                      (int)serf_connection_get_spillover_count(
+                                tb->connection));
+}
+
+/* A server that allows 4 streams can't take 16 requests at once, so the
+   requests that don't fit must spill over to a second connection, which is
+   closed again once it stayed idle */
+static void test_listen_http2_spillover_limited(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    apr_status_t status;
+    handler_baton_t handler_ctx[16];
+    const int num_requests = sizeof(handler_ctx) / sizeof(handler_ctx[0]);
+    serf_config_t *config;
+    apr_uint64_t write_calls, bytes_written;
+    apr_time_t finish_time;
+    apr_pool_t *iter_pool;
+    int i;
+
+    setup_test_server_ex(tb, limited_client_acceptor);
+
+    status = setup_test_client_context(tb, connection_setup_http2,
+                                       tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    serf_connection_set_spillover(tb->connection, spawn_http2, tb);
+
+    config = serf_connection_get_config(tb->connection);
+    status = serf_config_set_string(config, SERF_CONFIG_HOST_MAX_CONNS, "2");
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    /* Let the session learn the stream limit of the server first */
+    create_new_request(tb, &handler_ctx[0], "GET", "/", 1);
+    status = run_client_server_loop(tb, 1, handler_ctx, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, 0, tb->result_flags & TEST_RESULT_SPAWNCB_CALLED);
+
+    for (i = 0; i < num_requests; i++)
+        create_new_request(tb, &handler_ctx[i], "GET", "/", i + 2);
+
+    status = run_client_server_loop(tb, num_requests,
+                                    handler_ctx, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    /* Spawned once, limited by SERF_CONFIG_HOST_MAX_CONNS */
+    CuAssertIntEquals(tc, TEST_RESULT_SPAWNCB_CALLED,
+                      tb->result_flags & TEST_RESULT_SPAWNCB_CALLED);
+    CuAssertIntEquals(tc, 1,
+                      (int)serf_connection_get_spillover_count(
+                                tb->connection));
+
+    /* And the second connection really sent requests */
+    CuAssertPtrNotNull(tc, tb->user_baton);
+    serf_connection_get_write_stats(tb->user_baton, &write_calls,
+                                    &bytes_written);
+    CuAssertTrue(tc, bytes_written > 0);
+
+    /* Once idle, the spawned connection is closed again */
+    apr_pool_create(&iter_pool, tb->pool);
+    finish_time = apr_time_now() + apr_time_from_sec(15);
+    while (serf_connection_get_spillover_count(tb->connection)
+           && apr_time_now() < finish_time)
+    {
+        apr_pool_clear(iter_pool);
+
+        status = serf_context_run(tb->context, 100000, iter_pool);
+        if (!APR_STATUS_IS_TIMEUP(status))
+            CuAssertIntEquals(tc, APR_SUCCESS, status);
+    }
+    apr_pool_destroy(iter_pool);
+
+    CuAssertIntEquals(tc, 0,
+                      (int)serf_connection_get_spillover_count(
+                                tb->connection));
+}
+
+/* Without a verified server certificate the connection can't prove it is
+   valid for other hosts, so a coalescing connection must use its own */
+static void test_listen_http2_no_coalescing_without_cert(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    apr_status_t status;
+    handler_baton_t handler_ctx[2];
+    const int num_requests = sizeof(handler_ctx) / sizeof(handler_ctx[0]);
+    spill_conn_baton_t *scb;
+    serf_connection_t *primary;
+    apr_uri_t url;
+    apr_uint64_t write_calls, bytes_written;
+
+    setup_test_server(tb);
+
+    status = setup_test_client_context(tb, connection_setup_http2,
+                                       tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    primary = tb->connection;
+
+    create_new_request(tb, &handler_ctx[0], "GET", "/", 1);
+    status = run_client_server_loop(tb, 1, handler_ctx, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    scb = apr_pcalloc(tb->pool, sizeof(*scb));
+    scb->tb = tb;
+    status = apr_uri_parse(tb->pool, tb->serv_url, &url);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    status = serf_connection_create2(&scb->conn, tb->context, url,
+                                     spill_conn_setup, scb,
+                                     NULL, NULL, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    serf_connection_set_coalescing(scb->conn, 1);
+
+    tb->connection = scb->conn;
+    create_new_request(tb, &handler_ctx[1], "GET", "/", 2);
+    tb->connection = primary;
+
+    status = run_client_server_loop(tb, num_requests, handler_ctx,
+                                    tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    serf_connection_get_write_stats(scb->conn, &write_calls,
+                                    &bytes_written);
+    CuAssertTrue(tc, write_calls > 0);
+    serf_connection_close(scb->conn);
+}
+
+/* Creates a coalescing connection to the test server, whose requests may
+   go over PRIMARY, as that claims to have a verified certificate for
+   localhost */
+static serf_connection_t *create_coalescing_conn(CuTest *tc,
+                                                 serf_connection_t *primary)
+{
+    test_baton_t *tb = tc->testBaton;
+    spill_conn_baton_t *scb;
+    apr_array_header_t *names;
+    apr_uri_t url;
+    apr_status_t status;
+
+    names = apr_array_make(tb->pool, 1, sizeof(const char *));
+    APR_ARRAY_PUSH(names, const char *) = "*.localdomain";
+    APR_ARRAY_PUSH(names, const char *) = "LOCALHOST";
+    status = serf__config_store_set_peer_names(
+                        serf_connection_get_config(primary), names);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    scb = apr_pcalloc(tb->pool, sizeof(*scb));
+    scb->tb = tb;
+    status = apr_uri_parse(tb->pool, tb->serv_url, &url);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    status = serf_connection_create2(&scb->conn, tb->context, url,
+                                     spill_conn_setup, scb,
+                                     NULL, NULL, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    serf_connection_set_coalescing(scb->conn, 1);
+
+    return scb->conn;
+}
+
+/* Returns how often the request with REQ_ID was set up */
+static int count_setups(test_baton_t *tb, int req_id)
+{
+    int i, count = 0;
+
+    for (i = 0; i < tb->sent_requests->nelts; i++)
+        if (APR_ARRAY_IDX(tb->sent_requests, i, int) == req_id)
+            count++;
+
+    return count;
+}
+
+/* With a certificate that covers its host, the requests of a coalescing
+   connection are sent over the established connection */
+static void test_listen_http2_coalescing(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    apr_status_t status;
+    handler_baton_t handler_ctx[2];
+    const int num_requests = sizeof(handler_ctx) / sizeof(handler_ctx[0]);
+    serf_connection_t *primary, *coalescing;
+    apr_uint64_t write_calls, bytes_written, primary_calls;
+
+    setup_test_server(tb);
+
+    status = setup_test_client_context(tb, connection_setup_http2,
+                                       tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    primary = tb->connection;
+
+    create_new_request(tb, &handler_ctx[0], "GET", "/", 1);
+    status = run_client_server_loop(tb, 1, handler_ctx, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    coalescing = create_coalescing_conn(tc, primary);
+    serf_connection_get_write_stats(primary, &primary_calls, NULL);
+
+    tb->connection = coalescing;
+    create_new_request(tb, &handler_ctx[1], "GET", "/", 2);
+    tb->connection = primary;
+
+    status = run_client_server_loop(tb, num_requests, handler_ctx,
+                                    tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    /* The coalescing connection never opened its own socket */
+    serf_connection_get_write_stats(coalescing, &write_calls,
+                                    &bytes_written);
+    CuAssertIntEquals(tc, 0, (int)bytes_written);
+
+    serf_connection_get_write_stats(primary, &write_calls, NULL);
+    CuAssertTrue(tc, write_calls > primary_calls);
+    CuAssertIntEquals(tc, 1, count_setups(tb, 2));
+
+    serf_connection_close(coalescing);
+}
+
+/* A 421 answer to a coalesced request sends it again over the connection
+   it was created for, which isn't used for its host any more */
+static void test_listen_http2_coalescing_misdirected(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    apr_status_t status;
+    handler_baton_t handler_ctx[3];
+    serf_connection_t *primary, *coalescing;
+    apr_uint64_t write_calls, bytes_written;
+
+    setup_test_server(tb);
+
+    status = setup_test_client_context(tb, connection_setup_http2,
+                                       tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    primary = tb->connection;
+
+    create_new_request(tb, &handler_ctx[0], "GET", "/", 1);
+    status = run_client_server_loop(tb, 1, handler_ctx, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    coalescing = create_coalescing_conn(tc, primary);
+
+    /* The first request over the primary gets a 421 */
+    tb->user_baton_l = 421;
+    tb->connection = coalescing;
+    create_new_request(tb, &handler_ctx[1], "GET", "/", 2);
+    tb->connection = primary;
+
+    status = run_client_server_loop(tb, 2, handler_ctx, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    /* The 421 was consumed, and the request was set up again for its own
+       connection, which got the answer */
+    CuAssertIntEquals(tc, 0, (int)tb->user_baton_l);
+    CuAssertIntEquals(tc, 2, count_setups(tb, 2));
+    serf_connection_get_write_stats(coalescing, &write_calls,
+                                    &bytes_written);
+    CuAssertTrue(tc, bytes_written > 0);
+
+    /* New requests don't go over the primary any more */
+    tb->connection = coalescing;
+    create_new_request(tb, &handler_ctx[2], "GET", "/", 3);
+    tb->connection = primary;
+
+    status = run_client_server_loop(tb, 3, handler_ctx, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, 1, count_setups(tb, 3));
+
+    serf_connection_close(coalescing);
+}
+
+static int count_push_accept(void *accept_baton,
+                             const char *method,
+                             const char *authority,
+                             const char *path)
+{
+    int *calls = accept_baton;
+
+    (*calls)++;
+    return 1;
+}
+
+/* Enabling the push cache doesn't change anything for requests the server
+   doesn't push, which are still sent over the connection */
+static void test_listen_http2_push_cache_without_pushes(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    apr_status_t status;
+    handler_baton_t handler_ctx[4];
+    const int num_requests = sizeof(handler_ctx) / sizeof(handler_ctx[0]);
+    int accept_calls = 0;
+    int i;
+
+    setup_test_server(tb);
+
+    status = setup_test_client_context(tb, connection_setup_http2,
+                                       tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    serf_connection_set_push_cache(tb->connection, 64 * 1024,
+                                   count_push_accept, &accept_calls);
+
+    for (i = 0; i < num_requests; i++)
+        create_new_request(tb, &handler_ctx[i], "GET", "/", i + 1);
+
+    status = run_client_server_loop(tb, num_requests,
+                                    handler_ctx, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    CuAssertIntEquals(tc, 0, accept_calls);
+    CuAssertIntEquals(tc, 0, serf_connection_queued_requests(tb->connection));
+}
+
+/* A scripted HTTP/2 server, for testing frames that the serf server doesn't
+   send. It answers the request on stream 1 with three pushes:
+     /old     (stream 2), accepted and completed
+     /refused (stream 4), which the client is expected to refuse
+     /pushed  (stream 6), accepted, evicting /old from the cache
+   when PUSH is set, and every other request with a response of its own.
+   With H2C set, it expects an HTTP/1.1 request offering an upgrade first,
+   and answers it on stream 1 after switching protocols. Each new
+   connection replaces the previous one */
+typedef struct h2_script_server_t {
+    apr_pool_t *pool;
+    apr_socket_t *listener;
+    apr_socket_t *skt;
+    const char *authority;
+    bool push;
+    bool ignore_pings;
+    bool h2c;
+    int accepts;
+    int upgrades;
+    bool await_upgrade;
+
+    char buf[16384];
+    apr_size_t buf_len;
+    apr_size_t preface_left;
+
+    int headers_received;
+    int resets_received;
+    apr_int32_t reset_stream;
+} h2_script_server_t;
+
+#define H2S_PUSHED_BODY_SIZE 600
+
+static void h2ss_send(h2_script_server_t *ss, const char *data,
+                      apr_size_t len)
+{
+    while (len) {
+        apr_size_t written = len;
+        apr_status_t status = apr_socket_send(ss->skt, data, &written);
+
+        if (status && !APR_STATUS_IS_EAGAIN(status))
+            return;
+
+        data += written;
+        len -= written;
+    }
+}
+
+static void h2ss_frame(h2_script_server_t *ss, unsigned char type,
+                       unsigned char flags, apr_int32_t stream,
+                       const char *payload, apr_size_t len)
+{
+    char hdr[9];
+
+    hdr[0] = (char)((len >> 16) & 0xFF);
+    hdr[1] = (char)((len >> 8) & 0xFF);
+    hdr[2] = (char)(len & 0xFF);
+    hdr[3] = (char)type;
+    hdr[4] = (char)flags;
+    hdr[5] = (char)((stream >> 24) & 0x7F);
+    hdr[6] = (char)((stream >> 16) & 0xFF);
+    hdr[7] = (char)((stream >> 8) & 0xFF);
+    hdr[8] = (char)(stream & 0xFF);
+
+    h2ss_send(ss, hdr, sizeof(hdr));
+    if (len)
+        h2ss_send(ss, payload, len);
+}
+
+/* Appends an HPACK literal header field without indexing, whose name is
+   entry INDEX of the static table */
+static char *h2ss_literal(char *p, int index, const char *value)
+{
+    apr_size_t len = strlen(value);
+
+    *p++ = (char)index;
+    *p++ = (char)len;
+    memcpy(p, value, len);
+
+    return p + len;
+}
+
+static void h2ss_promise(h2_script_server_t *ss, apr_int32_t promised,
+                         const char *path)
+{
+    char payload[256];
+    char *p = payload;
+
+    *p++ = (char)((promised >> 24) & 0x7F);
+    *p++ = (char)((promised >> 16) & 0xFF);
+    *p++ = (char)((promised >> 8) & 0xFF);
+    *p++ = (char)(promised & 0xFF);
+
+    *p++ = (char)0x82;                  /* :method GET */
+    *p++ = (char)0x86;                  /* :scheme http */
+    p = h2ss_literal(p, 4, path);       /* :path */
+    p = h2ss_literal(p, 1, ss->authority);
+
+    h2ss_frame(ss, 5 /* PUSH_PROMISE */, 0x04 /* END_HEADERS */, 1,
+               payload, p - payload);
+}
+
+static void h2ss_respond(h2_script_server_t *ss, apr_int32_t stream,
+                         const char *body, apr_size_t len)
+{
+    const char status_200 = (char)0x88;
+
+    h2ss_frame(ss, 1 /* HEADERS */, 0x04 /* END_HEADERS */, stream,
+               &status_200, 1);
+    h2ss_frame(ss, 0 /* DATA */, 0x01 /* END_STREAM */, stream, body, len);
+}
+
+static void h2ss_handle_frame(h2_script_server_t *ss, unsigned char type,
+                              unsigned char flags, apr_int32_t stream,
+                              const char *payload, apr_size_t len)
+{
+    static char pushed[H2S_PUSHED_BODY_SIZE];
+
+    switch (type) {
+        case 1: /* HEADERS */
+            ss->headers_received++;
+
+            if (stream != 1 || !ss->push) {
+                h2ss_respond(ss, stream, "served", 6);
+                break;
+            }
+
+            memset(pushed, 'p', sizeof(pushed));
+            h2ss_promise(ss, 2, "/old");
+            h2ss_promise(ss, 4, "/refused");
+            h2ss_promise(ss, 6, "/pushed");
+            h2ss_respond(ss, 1, "served", 6);
+            h2ss_respond(ss, 2, pushed, sizeof(pushed));
+            h2ss_respond(ss, 6, pushed, sizeof(pushed));
+            break;
+        case 3: /* RST_STREAM */
+            ss->resets_received++;
+            ss->reset_stream = stream;
+            break;
+        case 4: /* SETTINGS */
+            if (!(flags & 0x01))
+                h2ss_frame(ss, 4, 0x01 /* ACK */, 0, NULL, 0);
+            break;
+        case 6: /* PING */
+            if (!(flags & 0x01) && !ss->ignore_pings)
+                h2ss_frame(ss, 6, 0x01 /* ACK */, 0, payload, len);
+            break;
+    }
+}
+
+static void h2ss_run(h2_script_server_t *ss)
+{
+    apr_socket_t *skt;
+    const unsigned char *b;
+    apr_size_t len;
+    apr_status_t status;
+
+    if (apr_socket_accept(&skt, ss->listener, ss->pool) == APR_SUCCESS) {
+        if (ss->skt)
+            apr_socket_close(ss->skt);
+
+        ss->skt = skt;
+        ss->accepts++;
+        ss->buf_len = 0;
+        ss->preface_left = 24; /* PRI * HTTP/2.0... */
+        ss->await_upgrade = ss->h2c;
+        apr_socket_timeout_set(ss->skt, 0);
+
+        /* Our connection preface */
+        if (!ss->await_upgrade)
+            h2ss_frame(ss, 4 /* SETTINGS */, 0, 0, NULL, 0);
+    }
+
+    if (!ss->skt)
+        return;
+
+    len = sizeof(ss->buf) - 1 - ss->buf_len;
+    status = apr_socket_recv(ss->skt, ss->buf + ss->buf_len, &len);
+    if (status && !APR_STATUS_IS_EAGAIN(status))
+        return;
+    ss->buf_len += len;
+    ss->buf[ss->buf_len] = '\0';
+
+    if (ss->await_upgrade) {
+        static const char switching[] = "HTTP/1.1 101 Switching Protocols"
+                                        CRLF "Connection: Upgrade"
+                                        CRLF "Upgrade: h2c" CRLF CRLF;
+        const char *end = strstr(ss->buf, CRLF CRLF);
+
+        if (!end)
+            return;
+
+        if (strstr(ss->buf, "Upgrade: h2c" CRLF))
+            ss->upgrades++;
+
+        len = end + 4 - ss->buf;
+        memmove(ss->buf, ss->buf + len, ss->buf_len - len + 1);
+        ss->buf_len -= len;
+        ss->await_upgrade = false;
+
+        /* The request continues as stream 1 */
+        h2ss_send(ss, switching, sizeof(switching) - 1);
+        h2ss_frame(ss, 4 /* SETTINGS */, 0, 0, NULL, 0);
+        h2ss_respond(ss, 1, "served", 6);
+    }
+
+    if (ss->preface_left) {
+        len = MIN(ss->preface_left, ss->buf_len);
+
+        memmove(ss->buf, ss->buf + len, ss->buf_len - len);
+        ss->buf_len -= len;
+        ss->preface_left -= len;
+    }
+
+    b = (const unsigned char *)ss->buf;
+    while (!ss->preface_left && ss->buf_len >= 9) {
+        apr_size_t frame_len = (b[0] << 16) | (b[1] << 8) | b[2];
+        apr_int32_t stream = ((b[5] & 0x7F) << 24) | (b[6] << 16)
+                             | (b[7] << 8) | b[8];
+
+        if (ss->buf_len < 9 + frame_len)
+            break;
+
+        h2ss_handle_frame(ss, b[3], b[4], stream, ss->buf + 9, frame_len);
+
+        memmove(ss->buf, ss->buf + 9 + frame_len,
+                ss->buf_len - 9 - frame_len);
+        ss->buf_len -= 9 + frame_len;
+    }
+}
+
+static void setup_h2_script_server(CuTest *tc, h2_script_server_t *ss)
+{
+    test_baton_t *tb = tc->testBaton;
+    apr_sockaddr_t *sa;
+    apr_port_t port = 47180;
+    apr_status_t status;
+
+    memset(ss, 0, sizeof(*ss));
+    ss->pool = tb->pool;
+
+    do {
+        status = apr_sockaddr_info_get(&sa, "localhost", APR_UNSPEC, port,
+                                       0, tb->pool);
+        CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+        if (!ss->listener) {
+            status = apr_socket_create(&ss->listener, sa->family,
+                                       SOCK_STREAM, APR_PROTO_TCP,
+                                       tb->pool);
+            CuAssertIntEquals(tc, APR_SUCCESS, status);
+            apr_socket_opt_set(ss->listener, APR_SO_REUSEADDR, 1);
+        }
+
+        status = apr_socket_bind(ss->listener, sa);
+    } while (status && ++port < 47280);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    status = apr_socket_listen(ss->listener, 5);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    apr_socket_timeout_set(ss->listener, 0);
+
+    tb->serv_port = port;
+    tb->serv_host = apr_psprintf(tb->pool, "%s:%d", "localhost", port);
+    tb->serv_url = apr_psprintf(tb->pool, "http://%s", tb->serv_host);
+    ss->authority = tb->serv_host;
+}
+
+static apr_status_t run_h2_script_loop(test_baton_t *tb,
+                                       h2_script_server_t *ss,
+                                       handler_baton_t *handler_ctx)
+{
+    apr_time_t finish_time = apr_time_now() + apr_time_from_sec(15);
+    apr_pool_t *iter_pool;
+    apr_status_t status;
+
+    apr_pool_create(&iter_pool, tb->pool);
+
+    while (!handler_ctx->done) {
+        apr_pool_clear(iter_pool);
+
+        status = serf_context_run(tb->context, 0, iter_pool);
+        if (!APR_STATUS_IS_TIMEUP(status) && SERF_BUCKET_READ_ERROR(status))
+            return status;
+
+        h2ss_run(ss);
+
+        if (apr_time_now() > finish_time)
+            return APR_ETIMEDOUT;
+    }
+    apr_pool_destroy(iter_pool);
+
+    return APR_SUCCESS;
+}
+
+/* Collects the response bodies of the push test in TB->user_baton */
+typedef struct push_body_t {
+    char data[H2S_PUSHED_BODY_SIZE + 1];
+    apr_size_t len;
+} push_body_t;
+
+static apr_status_t push_handle_response(serf_request_t *request,
+                                         serf_bucket_t *response,
+                                         void *handler_baton,
+                                         apr_pool_t *pool)
+{
+    handler_baton_t *ctx = handler_baton;
+    push_body_t *pb = ctx->tb->user_baton;
+    serf_status_line sl;
+    apr_status_t status;
+
+    if (!response)
+        return APR_SUCCESS;
+
+    status = serf_bucket_response_status(response, &sl);
+    if (status)
+        return status;
+    if (sl.code != 200)
+        return APR_EGENERAL;
+
+    while (1) {
+        const char *data;
+        apr_size_t len;
+
+        status = serf_bucket_read(response, SERF_READ_ALL_AVAIL, &data,
+                                  &len);
+        if (SERF_BUCKET_READ_ERROR(status))
+            return status;
+
+        len = MIN(len, sizeof(pb->data) - 1 - pb->len);
+        memcpy(pb->data + pb->len, data, len);
+        pb->len += len;
+        pb->data[pb->len] = '\0';
+
+        if (APR_STATUS_IS_EOF(status)) {
+            ctx->done = TRUE;
+            return APR_EOF;
+        }
+        if (status)
+            return status;
+    }
+}
+
+static int accept_some_pushes(void *accept_baton,
+                              const char *method,
+                              const char *authority,
+                              const char *path)
+{
+    int *calls = accept_baton;
+
+    (*calls)++;
+    return strcmp(path, "/refused") != 0;
+}
+
+/* Pushed responses are served from the cache without sending the request,
+   refused pushes are reset, and the oldest push makes room for newer ones
+   when the cache is full */
+static void test_http2_push_cache(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    h2_script_server_t *ss = apr_palloc(tb->pool, sizeof(*ss));
+    push_body_t pb = { "", 0 };
+    handler_baton_t handler_ctx[3];
+    int accept_calls = 0;
+    apr_time_t finish_time;
+    apr_status_t status;
+
+    setup_h2_script_server(tc, ss);
+    ss->push = true;
+    tb->user_baton = &pb;
+
+    status = setup_test_client_context(tb, connection_setup_http2,
+                                       tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    /* Room for one of the pushed responses */
+    serf_connection_set_push_cache(tb->connection,
+                                   H2S_PUSHED_BODY_SIZE * 3 / 2,
+                                   accept_some_pushes, &accept_calls);
+
+    create_new_request_ex(tb, &handler_ctx[0], "GET", "/", 1, NULL,
+                          push_handle_response);
+    status = run_h2_script_loop(tb, ss, &handler_ctx[0]);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertStrEquals(tc, "served", pb.data);
+
+    /* Wait until the pushes are received */
+    finish_time = apr_time_now() + apr_time_from_sec(5);
+    while (!ss->resets_received && apr_time_now() < finish_time) {
+        status = serf_context_run(tb->context, 0, tb->pool);
+        if (!APR_STATUS_IS_TIMEUP(status))
+            CuAssertIntEquals(tc, APR_SUCCESS, status);
+        h2ss_run(ss);
+    }
+
+    CuAssertIntEquals(tc, 3, accept_calls);
+    CuAssertIntEquals(tc, 1, ss->resets_received);
+    CuAssertIntEquals(tc, 4, ss->reset_stream);
+
+    /* Served from the cache; requests without a body can use pushes */
+    pb.len = 0;
+    create_new_request_ex(tb, &handler_ctx[1], "GET", "/pushed", -1, NULL,
+                          push_handle_response);
+    status = run_h2_script_loop(tb, ss, &handler_ctx[1]);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, H2S_PUSHED_BODY_SIZE, (int)pb.len);
+    CuAssertIntEquals(tc, 1, ss->headers_received);
+
+    /* Evicted to make room for /pushed, so it is requested */
+    pb.len = 0;
+    create_new_request_ex(tb, &handler_ctx[2], "GET", "/old", -1, NULL,
+                          push_handle_response);
+    status = run_h2_script_loop(tb, ss, &handler_ctx[2]);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertStrEquals(tc, "served", pb.data);
+    CuAssertIntEquals(tc, 2, ss->headers_received);
+
+    CuAssertIntEquals(tc, 0, serf_connection_queued_requests(tb->connection));
+}
+
+/* Keepalive PINGs on an idle connection measure the round trip */
+static void test_listen_http2_keepalive_rtt(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    apr_status_t status;
+    handler_baton_t handler_ctx[1];
+    apr_interval_time_t srtt, rttvar;
+    apr_time_t finish_time;
+
+    setup_test_server(tb);
+
+    status = setup_test_client_context(tb, connection_setup_http2,
+                                       tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    serf_connection_set_keepalive(tb->connection, 1,
+                                  apr_time_from_sec(10));
+
+    create_new_request(tb, &handler_ctx[0], "GET", "/", 1);
+    status = run_client_server_loop(tb, 1, handler_ctx, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    finish_time = apr_time_now() + apr_time_from_sec(15);
+    do {
+        status = serf_context_run(tb->context, 0, tb->pool);
+        if (!APR_STATUS_IS_TIMEUP(status))
+            CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+        status = serf_connection_get_rtt(tb->connection, &srtt, &rttvar);
+        CuAssertIntEquals(tc, APR_SUCCESS, status);
+    } while (srtt < 0 && apr_time_now() < finish_time);
+
+    CuAssertTrue(tc, srtt >= 0);
+    CuAssertTrue(tc, rttvar >= 0);
+    CuAssertTrue(tc, serf_connection_get_latency(tb->connection) == srtt);
+}
+
+/* A peer that stops answering keepalive PINGs gets its connection closed,
+   and the next request goes over a new one */
+static void test_http2_keepalive_reconnect(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    h2_script_server_t *ss = apr_palloc(tb->pool, sizeof(*ss));
+    push_body_t pb = { "", 0 };
+    handler_baton_t handler_ctx[2];
+    apr_interval_time_t srtt, rttvar;
+    apr_time_t finish_time;
+    apr_status_t status;
+
+    setup_h2_script_server(tc, ss);
+    ss->ignore_pings = true;
+    tb->user_baton = &pb;
+
+    status = setup_test_client_context(tb, connection_setup_http2,
+                                       tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    serf_connection_set_keepalive(tb->connection,
+                                  apr_time_from_msec(100),
+                                  apr_time_from_msec(200));
+
+    create_new_request_ex(tb, &handler_ctx[0], "GET", "/", 1, NULL,
+                          push_handle_response);
+    status = run_h2_script_loop(tb, ss, &handler_ctx[0]);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, 1, ss->accepts);
+
+    /* Idle until the unanswered PING closes the HTTP/2 session */
+    finish_time = apr_time_now() + apr_time_from_sec(5);
+    do {
+        status = serf_context_run(tb->context, apr_time_from_msec(10),
+                                  tb->pool);
+        if (!APR_STATUS_IS_TIMEUP(status))
+            CuAssertIntEquals(tc, APR_SUCCESS, status);
+        h2ss_run(ss);
+
+        status = serf_connection_get_rtt(tb->connection, &srtt, &rttvar);
+    } while (status == APR_SUCCESS && apr_time_now() < finish_time);
+    CuAssertIntEquals(tc, APR_ENOTIMPL, status);
+
+    /* The next request opens a new connection */
+    pb.len = 0;
+    create_new_request_ex(tb, &handler_ctx[1], "GET", "/", 2, NULL,
+                          push_handle_response);
+    status = run_h2_script_loop(tb, ss, &handler_ctx[1]);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertStrEquals(tc, "served", pb.data);
+    CuAssertIntEquals(tc, 2, ss->accepts);
+}
+
+/* A host remembered to speak HTTP/2 without TLS gets it right away */
+static void test_listen_h2c_prior_knowledge(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    apr_status_t status;
+    handler_baton_t handler_ctx[2];
+    const int num_requests = sizeof(handler_ctx) / sizeof(handler_ctx[0]);
+    serf_config_t *config;
+    const char *protocol;
+
+    setup_test_server(tb);
+
+    status = setup_test_client_context(tb, NULL, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    config = serf_connection_get_config(tb->connection);
+    status = serf_config_set_string(config, SERF_CONFIG_HOST_PROTOCOL, "h2c");
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    serf_connection_set_h2c_upgrade(tb->connection, 1);
+
+    create_new_request(tb, &handler_ctx[0], "GET", "/", 1);
+    create_new_request(tb, &handler_ctx[1], "GET", "/", 2);
+
+    status = run_client_server_loop(tb, num_requests,
+                                    handler_ctx, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf_connection_get_http2_stats(tb->connection, NULL,
+                                                      NULL, NULL, NULL));
+
+    status = serf_config_get_string(config, SERF_CONFIG_HOST_PROTOCOL,
+                                    &protocol);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertStrEquals(tc, "h2c", protocol);
+}
+
+/* A server that ignores the upgrade offer keeps speaking HTTP/1.1, and
+   that is remembered */
+static void test_listen_h2c_upgrade_declined(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    apr_status_t status;
+    handler_baton_t handler_ctx[3];
+    const int num_requests = sizeof(handler_ctx) / sizeof(handler_ctx[0]);
+    serf_config_t *config;
+    const char *protocol;
+    int i;
+
+    setup_test_server(tb);
+
+    status = setup_test_client_context(tb, NULL, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    serf_connection_set_h2c_upgrade(tb->connection, 1);
+
+    /* Only requests without a body offer the upgrade */
+    create_new_request(tb, &handler_ctx[0], "GET", "/", -1);
+    for (i = 1; i < num_requests; i++)
+        create_new_request(tb, &handler_ctx[i], "GET", "/", i + 1);
+
+    status = run_client_server_loop(tb, num_requests,
+                                    handler_ctx, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    CuAssertIntEquals(tc, APR_ENOTIMPL,
+                      serf_connection_get_http2_stats(tb->connection, NULL,
+                                                      NULL, NULL, NULL));
+
+    config = serf_connection_get_config(tb->connection);
+    status = serf_config_get_string(config, SERF_CONFIG_HOST_PROTOCOL,
+                                    &protocol);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertStrEquals(tc, "http/1.1", protocol);
+}
+
+/* A server that accepts the upgrade offer answers the offering request
+   over HTTP/2, which is used for the next requests as well */
+static void test_h2c_upgrade(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    h2_script_server_t *ss = apr_palloc(tb->pool, sizeof(*ss));
+    push_body_t pb = { "", 0 };
+    handler_baton_t handler_ctx[2];
+    serf_config_t *config;
+    const char *protocol;
+    apr_status_t status;
+
+    setup_h2_script_server(tc, ss);
+    ss->h2c = true;
+    tb->user_baton = &pb;
+
+    status = setup_test_client_context(tb, NULL, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    serf_connection_set_h2c_upgrade(tb->connection, 1);
+
+    /* Only requests without a body offer the upgrade */
+    create_new_request_ex(tb, &handler_ctx[0], "GET", "/", -1, NULL,
+                          push_handle_response);
+    status = run_h2_script_loop(tb, ss, &handler_ctx[0]);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertStrEquals(tc, "served", pb.data);
+    CuAssertIntEquals(tc, 1, ss->upgrades);
+
+    /* The request was adopted as stream 1 instead of being sent again */
+    CuAssertIntEquals(tc, 0, ss->headers_received);
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf_connection_get_http2_stats(tb->connection, NULL,
+                                                      NULL, NULL, NULL));
+
+    config = serf_connection_get_config(tb->connection);
+    status = serf_config_get_string(config, SERF_CONFIG_HOST_PROTOCOL,
+                                    &protocol);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertStrEquals(tc, "h2c", protocol);
+
+    pb.len = 0;
+    create_new_request_ex(tb, &handler_ctx[1], "GET", "/", 2, NULL,
+                          push_handle_response);
+    status = run_h2_script_loop(tb, ss, &handler_ctx[1]);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertStrEquals(tc, "served", pb.data);
+    CuAssertIntEquals(tc, 1, ss->headers_received);
+    CuAssertIntEquals(tc, 1, ss->accepts);
+}
+
+/* Frames of requests that are ready at the same time should be written
+   together instead of with a write call per frame */
+static void test_listen_http2_batched_writes(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    apr_status_t status;
+    handler_baton_t handler_ctx[5];
+    const int num_requests = sizeof(handler_ctx) / sizeof(handler_ctx[0]);
+    apr_uint64_t write_calls, bytes_written;
+    apr_uint64_t setup_calls, setup_bytes;
+    int i;
+
+    setup_test_server(tb);
+
+    status = setup_test_client_context(tb, connection_setup_http2,
+                                       tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    /* Get the preface and the SETTINGS exchange out of the way */
+    create_new_request(tb, &handler_ctx[0], "GET", "/", 1);
+    status = run_client_server_loop(tb, 1, handler_ctx, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    serf_connection_get_write_stats(tb->connection, &setup_calls,
+                                    &setup_bytes);
+
+    for (i = 1; i < num_requests; i++)
+        create_new_request(tb, &handler_ctx[i], "GET", "/", i + 1);
+
+    status = run_client_server_loop(tb, num_requests,
+                                    handler_ctx, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    /* One write for the HEADERS of all requests, and one for their DATA */
+    serf_connection_get_write_stats(tb->connection, &write_calls,
+                                    &bytes_written);
+    CuAssertTrue(tc, bytes_written > setup_bytes);
+    CuAssertIntEquals(tc, 2, (int)(write_calls - setup_calls));
+}
+
 static apr_status_t authn_callback(char **username,
                                    char **password,
                                    serf_request_t *request, void *baton,
@@ -344,6 +1534,20 @@ CuSuite *test_server(void)
 
     SUITE_ADD_TEST(suite, test_listen_http);
     SUITE_ADD_TEST(suite, test_listen_http2);
+    SUITE_ADD_TEST(suite, test_listen_http2_batched_writes);
+    SUITE_ADD_TEST(suite, test_listen_http2_window_tuning);
+    SUITE_ADD_TEST(suite, test_listen_http2_spillover);
+    SUITE_ADD_TEST(suite, test_listen_http2_spillover_limited);
+    SUITE_ADD_TEST(suite, test_listen_http2_no_coalescing_without_cert);
+    SUITE_ADD_TEST(suite, test_listen_http2_coalescing);
+    SUITE_ADD_TEST(suite, test_listen_http2_coalescing_misdirected);
+    SUITE_ADD_TEST(suite, test_listen_http2_push_cache_without_pushes);
+    SUITE_ADD_TEST(suite, test_http2_push_cache);
+    SUITE_ADD_TEST(suite, test_listen_http2_keepalive_rtt);
+    SUITE_ADD_TEST(suite, test_http2_keepalive_reconnect);
+    SUITE_ADD_TEST(suite, test_listen_h2c_prior_knowledge);
+    SUITE_ADD_TEST(suite, test_listen_h2c_upgrade_declined);
+    SUITE_ADD_TEST(suite, test_h2c_upgrade);
 
     SUITE_ADD_TEST(suite, test_listen_auth_http);
     SUITE_ADD_TEST(suite, test_listen_auth_http2);
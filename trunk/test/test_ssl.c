@@ -18,6 +18,8 @@
  * ====================================================================
  */
 
+#include <time.h>
+
 #include <apr.h>
 #include <apr_pools.h>
 #include <apr_strings.h>
@@ -26,11 +28,16 @@
 
 #include "serf.h"
 #include "serf_bucket_types.h"
+#include "serf_bucket_util.h"
 
 #include "test_serf.h"
 
 #include <openssl/ssl.h>
 #include <openssl/x509v3.h>
+#if defined(SSL_MODE_ASYNC) && !defined(WIN32)
+#include <openssl/async.h>
+#include <unistd.h>
+#endif
 #ifndef OPENSSL_NO_OCSP /* requires openssl 0.9.7 or later */
 #include <openssl/ocsp.h>
 #endif
@@ -79,6 +86,367 @@ static void test_ssl_init(CuTest *tc)
     serf_bucket_destroy(encrypt_bkt);
 }
 
+/* A TLS server in memory, talking to a pair of serf ssl buckets */
+typedef struct tls_peer_t {
+    SSL_CTX *ctx;
+    SSL *ssl;
+    BIO *rbio;                 /* Ciphertext from the client */
+    BIO *wbio;                 /* Ciphertext to the client */
+
+    serf_bucket_alloc_t *alloc;
+    serf_ssl_context_t *ssl_context;
+    serf_bucket_t *plain;      /* Plaintext the client sends */
+    serf_bucket_t *network;    /* Ciphertext the client receives */
+    serf_bucket_t *encrypt;
+    serf_bucket_t *decrypt;
+
+    char *received;            /* Plaintext the server received */
+    apr_size_t received_len;
+    apr_array_header_t *records; /* Plaintext size of each record */
+} tls_peer_t;
+
+static apr_status_t tls_peer_cleanup(void *baton)
+{
+    tls_peer_t *peer = baton;
+
+    SSL_free(peer->ssl); /* Frees the BIOs */
+    SSL_CTX_free(peer->ctx);
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t tls_peer_hold_open(void *baton,
+                                       serf_bucket_t *aggregate)
+{
+    return APR_EAGAIN;
+}
+
+static apr_status_t tls_peer_accept_cert(void *baton, int failures,
+                                         const serf_ssl_certificate_t *cert)
+{
+    return APR_SUCCESS;
+}
+
+/* Sets up a client ssl bucket pair, and a server receiving up to
+   EXPECTED bytes of plaintext from it */
+static tls_peer_t *setup_tls_peer(CuTest *tc, apr_size_t expected)
+{
+    test_baton_t *tb = tc->testBaton;
+    tls_peer_t *peer = apr_pcalloc(tb->pool, sizeof(*peer));
+    int rv;
+
+    peer->ctx = SSL_CTX_new(SSLv23_server_method());
+    CuAssertPtrNotNull(tc, peer->ctx);
+    SSL_CTX_set_default_passwd_cb_userdata(peer->ctx, "serftest");
+
+    rv = SSL_CTX_use_certificate_chain_file(peer->ctx,
+             get_srcdir_file(tb->pool, "test/certs/serfservercert.pem"));
+    CuAssertIntEquals(tc, 1, rv);
+    rv = SSL_CTX_use_PrivateKey_file(peer->ctx,
+             get_srcdir_file(tb->pool, "test/certs/private/serfserverkey.pem"),
+             SSL_FILETYPE_PEM);
+    CuAssertIntEquals(tc, 1, rv);
+
+    peer->ssl = SSL_new(peer->ctx);
+    peer->rbio = BIO_new(BIO_s_mem());
+    peer->wbio = BIO_new(BIO_s_mem());
+    SSL_set_bio(peer->ssl, peer->rbio, peer->wbio);
+    SSL_set_accept_state(peer->ssl);
+    apr_pool_cleanup_register(tb->pool, peer, tls_peer_cleanup,
+                              apr_pool_cleanup_null);
+
+    peer->alloc = tb->bkt_alloc;
+    peer->plain = serf_bucket_aggregate_create(peer->alloc);
+    serf_bucket_aggregate_hold_open(peer->plain, tls_peer_hold_open, peer);
+    peer->network = serf_bucket_aggregate_create(peer->alloc);
+    serf_bucket_aggregate_hold_open(peer->network, tls_peer_hold_open, peer);
+
+    peer->decrypt = serf_bucket_ssl_decrypt_create(peer->network, NULL,
+                                                   peer->alloc);
+    peer->ssl_context = serf_bucket_ssl_decrypt_context_get(peer->decrypt);
+    peer->encrypt = serf_bucket_ssl_encrypt_create(peer->plain,
+                                                   peer->ssl_context,
+                                                   peer->alloc);
+    serf_ssl_server_cert_callback_set(peer->ssl_context,
+                                      tls_peer_accept_cert, NULL);
+
+    peer->received = apr_palloc(tb->pool, expected);
+    peer->records = apr_array_make(tb->pool, 16, sizeof(apr_size_t));
+
+    return peer;
+}
+
+/* Moves data between the client buckets and the server until the server
+   received LEN bytes of plaintext in total */
+static void tls_peer_pump(CuTest *tc, tls_peer_t *peer, apr_size_t len)
+{
+    char buf[16384];
+    int rounds;
+
+    for (rounds = 0; peer->received_len < len; rounds++) {
+        const char *data;
+        apr_size_t data_len;
+        apr_status_t status;
+        int n;
+
+        CuAssertTrue(tc, rounds < 1000);
+
+        /* Client to server */
+        do {
+            status = serf_bucket_read(peer->encrypt, SERF_READ_ALL_AVAIL,
+                                      &data, &data_len);
+            CuAssertTrue(tc, !SERF_BUCKET_READ_ERROR(status));
+            if (data_len)
+                BIO_write(peer->rbio, data, (int)data_len);
+        } while (!status);
+
+        /* SSL_read() returns the plaintext of at most one record */
+        while ((n = SSL_read(peer->ssl, buf, sizeof(buf))) > 0) {
+            CuAssertTrue(tc, peer->received_len + n <= len);
+            memcpy(peer->received + peer->received_len, buf, n);
+            peer->received_len += n;
+            APR_ARRAY_PUSH(peer->records, apr_size_t) = n;
+        }
+        CuAssertIntEquals(tc, SSL_ERROR_WANT_READ,
+                          SSL_get_error(peer->ssl, n));
+
+        /* Server to client */
+        while ((n = BIO_read(peer->wbio, buf, sizeof(buf))) > 0) {
+            serf_bucket_aggregate_append(peer->network,
+                serf_bucket_simple_copy_create(buf, n, peer->alloc));
+        }
+
+        /* Lets the client finish the handshake, and read tickets */
+        do {
+            status = serf_bucket_read(peer->decrypt, SERF_READ_ALL_AVAIL,
+                                      &data, &data_len);
+            CuAssertTrue(tc, !SERF_BUCKET_READ_ERROR(status));
+            CuAssertIntEquals(tc, 0, (int)data_len);
+        } while (!status);
+    }
+}
+
+static void tls_peer_destroy(tls_peer_t *peer)
+{
+    serf_bucket_destroy(peer->encrypt);
+    serf_bucket_destroy(peer->decrypt);
+}
+
+/* Fills BUF with LEN bytes of a pattern that differs per offset */
+static void fill_pattern(char *buf, apr_size_t offset, apr_size_t len)
+{
+    apr_size_t i;
+
+    for (i = 0; i < len; i++)
+        buf[i] = 'a' + (char)((offset + i) % 26);
+}
+
+/* Appends LEN bytes of the pattern at OFFSET to the plaintext stream */
+static void tls_peer_send(tls_peer_t *peer, apr_size_t offset, apr_size_t len)
+{
+    char *data = serf_bucket_mem_alloc(peer->alloc, len);
+
+    fill_pattern(data, offset, len);
+    serf_bucket_aggregate_append(peer->plain,
+        serf_bucket_simple_own_create(data, len, peer->alloc));
+}
+
+static void assert_pattern(CuTest *tc, const char *data, apr_size_t len)
+{
+    apr_size_t i;
+
+    for (i = 0; i < len; i++) {
+        if (data[i] != 'a' + (char)(i % 26))
+            CuFail(tc, apr_psprintf(((test_baton_t *)tc->testBaton)->pool,
+                                    "plaintext differs at %" APR_SIZE_T_FMT,
+                                    i));
+    }
+}
+
+/* Small pieces of plaintext are gathered in records, instead of sending a
+   record per piece */
+static void test_ssl_encrypt_gather(CuTest *tc)
+{
+    tls_peer_t *peer;
+    apr_size_t offset;
+    const apr_size_t piece = 100;
+    const apr_size_t total = 64 * 100 + 1;
+
+    peer = setup_tls_peer(tc, total);
+
+    /* Complete the handshake first */
+    tls_peer_send(peer, 0, 1);
+    tls_peer_pump(tc, peer, 1);
+    apr_array_clear(peer->records);
+
+    for (offset = 1; offset < total; offset += piece)
+        tls_peer_send(peer, offset, piece);
+    tls_peer_pump(tc, peer, total);
+
+    assert_pattern(tc, peer->received, total);
+
+    /* Even small records hold 1400 bytes */
+    CuAssertTrue(tc, peer->records->nelts <= 5);
+
+    tls_peer_destroy(peer);
+}
+
+/* Plaintext passed to an SSL_write() that has to be repeated, because the
+   handshake wasn't done yet, is kept and written again; the pieces that
+   weren't taken go back in front of the stream in order */
+static void test_ssl_encrypt_retry(CuTest *tc)
+{
+    tls_peer_t *peer;
+    apr_size_t offset = 0;
+    int i;
+    const apr_size_t total = 300 + 40000 + 5 * 300;
+
+    peer = setup_tls_peer(tc, total);
+
+    /* A small piece to gather, a piece written directly, and split in
+       slices of a record, then more small pieces */
+    tls_peer_send(peer, offset, 300);
+    offset += 300;
+    tls_peer_send(peer, offset, 40000);
+    offset += 40000;
+    for (i = 0; i < 5; i++, offset += 300)
+        tls_peer_send(peer, offset, 300);
+
+    /* Nothing is taken before the server answers */
+    tls_peer_pump(tc, peer, total);
+
+    assert_pattern(tc, peer->received, total);
+
+    /* The repeated write was the full record of the first attempt, the
+       same size as the slices of the large piece after it */
+    CuAssertTrue(tc, peer->records->nelts > 2);
+    CuAssertIntEquals(tc, (int)APR_ARRAY_IDX(peer->records, 1, apr_size_t),
+                      (int)APR_ARRAY_IDX(peer->records, 0, apr_size_t));
+    for (i = 0; i < peer->records->nelts; i++)
+        CuAssertTrue(tc, APR_ARRAY_IDX(peer->records, i, apr_size_t)
+                             <= 16384);
+
+    tls_peer_destroy(peer);
+}
+
+/* A write that fails in the middle of a large piece keeps the slice for
+   the retry, and puts the rest of the piece back, without loss or
+   duplication */
+static void test_ssl_encrypt_unread(CuTest *tc)
+{
+    tls_peer_t *peer;
+    apr_size_t offset = 0;
+    int i;
+    const apr_size_t total = 4 * 20000;
+
+    peer = setup_tls_peer(tc, total);
+
+    /* Every piece is written directly; the first write fails and the
+       remains of all of them are put back */
+    for (i = 0; i < 4; i++, offset += 20000)
+        tls_peer_send(peer, offset, 20000);
+
+    tls_peer_pump(tc, peer, total);
+
+    assert_pattern(tc, peer->received, total);
+
+    tls_peer_destroy(peer);
+}
+
+/* Never called, the connection only holds the config */
+static apr_status_t record_conn_setup(apr_socket_t *skt,
+                                      serf_bucket_t **input_bkt,
+                                      serf_bucket_t **output_bkt,
+                                      void *setup_baton,
+                                      apr_pool_t *pool)
+{
+    return APR_SUCCESS;
+}
+
+static void record_conn_closed(serf_connection_t *conn, void *closed_baton,
+                               apr_status_t why, apr_pool_t *pool)
+{
+}
+
+/* Returns the config of a new connection, with the TLS record settings */
+static serf_config_t *record_config(CuTest *tc, const char *ramp,
+                                    const char *idle)
+{
+    test_baton_t *tb = tc->testBaton;
+    serf_context_t *ctx = serf_context_create(tb->pool);
+    serf_connection_t *conn;
+    serf_config_t *config;
+    apr_uri_t url;
+
+    apr_uri_parse(tb->pool, "https://localhost:12345", &url);
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf_connection_create2(&conn, ctx, url,
+                                              record_conn_setup, NULL,
+                                              record_conn_closed, NULL,
+                                              tb->pool));
+    config = serf_connection_get_config(conn);
+    serf_config_set_string(config, SERF_CONFIG_CONN_PIPELINING, "N");
+    serf_config_set_string(config, SERF_CONFIG_CTX_TLS_RECORD_RAMP, ramp);
+    serf_config_set_string(config, SERF_CONFIG_CTX_TLS_RECORD_IDLE, idle);
+
+    return config;
+}
+
+/* Sends LEN bytes of plaintext as one piece, and returns the size of the
+   first record that carried it */
+static apr_size_t tls_peer_first_record(CuTest *tc, tls_peer_t *peer,
+                                        apr_size_t len)
+{
+    apr_size_t offset = peer->received_len;
+
+    apr_array_clear(peer->records);
+    tls_peer_send(peer, offset, len);
+    tls_peer_pump(tc, peer, offset + len);
+
+    return APR_ARRAY_IDX(peer->records, 0, apr_size_t);
+}
+
+/* Full records are sent unless dynamic record sizing is configured. Then
+   small records go first, until the ramp was sent, and again after the
+   connection was idle */
+static void test_ssl_encrypt_record_ramp(CuTest *tc)
+{
+    tls_peer_t *peer;
+    const apr_size_t total = 1 + 3 * 20000 + 8000 + 5000;
+
+    peer = setup_tls_peer(tc, total);
+
+    tls_peer_send(peer, 0, 1);
+    tls_peer_pump(tc, peer, 1);
+
+    /* Off by default */
+    CuAssertIntEquals(tc, 16384, (int)tls_peer_first_record(tc, peer, 20000));
+
+    /* Invalid values are rejected */
+    CuAssertIntEquals(tc, APR_EINVAL,
+                      serf_bucket_set_config(peer->encrypt,
+                                             record_config(tc, "12k", "500")));
+    CuAssertIntEquals(tc, APR_EINVAL,
+                      serf_bucket_set_config(peer->encrypt,
+                                             record_config(tc, "99999999999",
+                                                           "500")));
+    CuAssertIntEquals(tc, 16384, (int)tls_peer_first_record(tc, peer, 20000));
+
+    /* 40001 bytes were sent, short of a ramp of 45000 */
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf_bucket_set_config(peer->encrypt,
+                                             record_config(tc, "45000",
+                                                           "500")));
+    CuAssertIntEquals(tc, 1400, (int)tls_peer_first_record(tc, peer, 8000));
+    CuAssertIntEquals(tc, 16384, (int)tls_peer_first_record(tc, peer, 20000));
+
+    /* Idle for longer than 500 msec */
+    apr_sleep(apr_time_from_msec(700));
+    CuAssertIntEquals(tc, 1400, (int)tls_peer_first_record(tc, peer, 5000));
+
+    tls_peer_destroy(peer);
+}
+
 
 /* Test that loading a custom CA certificate file works. */
 static void test_ssl_load_cert_file(CuTest *tc)
@@ -1083,6 +1451,246 @@ static void test_ssl_client_certificate(CuTest *tc)
     EndVerify
 }
 
+/* Validate that a client certificate loaded into the cache up front is
+   used without asking for its password. */
+static void test_ssl_client_cert_cache(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    handler_baton_t handler_ctx[1];
+    const int num_requests = sizeof(handler_ctx)/sizeof(handler_ctx[0]);
+    serf_ssl_client_cert_cache_t *cache;
+    apr_status_t status;
+
+    setup_test_mock_https_server(tb, server_key,
+                                 all_server_certs,
+                                 test_clientcert_optional);
+    status = setup_test_client_https_context(tb,
+                                             client_cert_conn_setup,
+                                             NULL, /* No server cert callback */
+                                             tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    status = serf_ssl_client_cert_cache_create(&cache, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    status = serf_ssl_client_cert_cache_load(
+                 cache,
+                 get_srcdir_file(tb->pool, "test/certs/serfclientcert.p12"),
+                 "wrong", tb->pool);
+    CuAssertIntEquals(tc, SERF_ERROR_SSL_CERT_FAILED, status);
+
+    status = serf_ssl_client_cert_cache_load(
+                 cache,
+                 get_srcdir_file(tb->pool, "test/certs/serfclientcert.p12"),
+                 "serftest", tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    serf_context_set_ssl_client_cert_cache(tb->context, cache);
+
+    Given(tb->mh)
+      ConnectionSetup(ClientCertificateIsValid,
+                      ClientCertificateCNEqualTo("Serf Client"))
+
+      GETRequest(URLEqualTo("/"), ChunkedBodyEqualTo("1"),
+                 HeaderEqualTo("Host", tb->serv_host))
+        Respond(WithCode(200), WithChunkedBody(""))
+    EndGiven
+
+    create_new_request(tb, &handler_ctx[0], "GET", "/", 1);
+
+    run_client_and_mock_servers_loops_expect_ok(tc, tb, num_requests,
+                                                handler_ctx, tb->pool);
+    CuAssertTrue(tc, tb->result_flags & TEST_RESULT_CLIENT_CERTCB_CALLED);
+    CuAssertTrue(tc, !(tb->result_flags & TEST_RESULT_CLIENT_CERTPWCB_CALLED));
+    Verify(tb->mh)
+      CuAssert(tc, ErrorMessage, VerifyConnectionSetupOk);
+    EndVerify
+}
+
+static apr_status_t cached_client_cert_cb(void *data, const char **cert_path)
+{
+    test_baton_t *tb = data;
+
+    tb->result_flags |= TEST_RESULT_CLIENT_CERTCB_CALLED;
+
+    *cert_path = tb->user_baton;
+
+    return APR_SUCCESS;
+}
+
+/* Counts the calls in tb->user_baton_l, as each one means the file was
+   parsed again */
+static apr_status_t cached_client_cert_pw_cb(void *data,
+                                             const char *cert_path,
+                                             const char **password)
+{
+    test_baton_t *tb = data;
+
+    tb->result_flags |= TEST_RESULT_CLIENT_CERTPWCB_CALLED;
+    tb->user_baton_l++;
+
+    *password = "serftest";
+    return APR_SUCCESS;
+}
+
+/* Like client_cert_conn_setup, for the file at tb->user_baton, without
+   remembering the path or password in the connection pool */
+static apr_status_t
+cached_client_cert_conn_setup(apr_socket_t *skt,
+                              serf_bucket_t **input_bkt,
+                              serf_bucket_t **output_bkt,
+                              void *setup_baton,
+                              apr_pool_t *pool)
+{
+    test_baton_t *tb = setup_baton;
+    apr_status_t status;
+
+    status = https_set_root_ca_conn_setup(skt, input_bkt, output_bkt,
+                                          setup_baton, pool);
+    if (status)
+        return status;
+
+    serf_ssl_client_cert_provider_set(tb->ssl_context,
+                                      cached_client_cert_cb,
+                                      tb,
+                                      NULL);
+
+    serf_ssl_client_cert_password_set(tb->ssl_context,
+                                      cached_client_cert_pw_cb,
+                                      tb,
+                                      NULL);
+
+    return APR_SUCCESS;
+}
+
+/* Sets up a server asking for the client certificate stored at
+   CERT_PATH, and a client context with an empty client certificate
+   cache, then sends the first request over a first connection */
+static void setup_client_cert_cache_test(CuTest *tc,
+                                         test_baton_t *tb,
+                                         handler_baton_t *handler_ctx,
+                                         const char *cert_path)
+{
+    serf_ssl_client_cert_cache_t *cache;
+    apr_status_t status;
+
+    setup_test_mock_https_server(tb, server_key,
+                                 all_server_certs,
+                                 test_clientcert_optional);
+    status = setup_test_client_https_context(tb,
+                                             cached_client_cert_conn_setup,
+                                             NULL, /* No server cert callback */
+                                             tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    status = serf_ssl_client_cert_cache_create(&cache, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    serf_context_set_ssl_client_cert_cache(tb->context, cache);
+
+    tb->user_baton = (void *)cert_path;
+    tb->user_baton_l = 0;
+
+    Given(tb->mh)
+      ConnectionSetup(ClientCertificateIsValid,
+                      ClientCertificateCNEqualTo("Serf Client"))
+
+      GETRequest(URLEqualTo("/"), ChunkedBodyEqualTo("1"),
+                 HeaderEqualTo("Host", tb->serv_host))
+        Respond(WithCode(200), WithChunkedBody(""))
+      GETRequest(URLEqualTo("/"), ChunkedBodyEqualTo("2"),
+                 HeaderEqualTo("Host", tb->serv_host))
+        Respond(WithCode(200), WithChunkedBody(""))
+    EndGiven
+
+    create_new_request(tb, &handler_ctx[0], "GET", "/", 1);
+
+    run_client_and_mock_servers_loops_expect_ok(tc, tb, 1, &handler_ctx[0],
+                                                tb->pool);
+    CuAssertTrue(tc, tb->result_flags & TEST_RESULT_CLIENT_CERTCB_CALLED);
+    CuAssertIntEquals(tc, 1, (int)tb->user_baton_l);
+}
+
+/* Validate that a client certificate parsed for the first connection is
+   kept in the cache, and used by the next one without parsing it again */
+static void test_ssl_client_cert_cache_reuse(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    handler_baton_t handler_ctx[2];
+    apr_status_t status;
+
+    setup_client_cert_cache_test(tc, tb, handler_ctx,
+                                 get_srcdir_file(tb->pool,
+                                                 "test/certs/serfclientcert.p12"));
+
+    status = use_new_connection(tb, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    tb->result_flags = 0;
+    create_new_request(tb, &handler_ctx[1], "GET", "/", 2);
+
+    run_client_and_mock_servers_loops_expect_ok(tc, tb, 1, &handler_ctx[1],
+                                                tb->pool);
+    CuAssertTrue(tc, tb->result_flags & TEST_RESULT_CLIENT_CERTCB_CALLED);
+    CuAssertIntEquals(tc, 1, (int)tb->user_baton_l);
+
+    Verify(tb->mh)
+      CuAssert(tc, ErrorMessage, VerifyConnectionSetupOk);
+      CuAssertTrue(tc, VerifyAllRequestsReceivedInOrder);
+    EndVerify
+}
+
+/* Validate that a cached client certificate is parsed again when its file
+   was modified since */
+static void test_ssl_client_cert_cache_reload(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    handler_baton_t handler_ctx[2];
+    const char *temp_dir;
+    char *path;
+    apr_file_t *file;
+    apr_finfo_t finfo;
+    apr_status_t status;
+
+    status = apr_temp_dir_get(&temp_dir, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    path = apr_pstrcat(tb->pool, temp_dir, "/serf-testXXXXXX", NULL);
+    status = apr_file_mktemp(&file, path,
+                             APR_FOPEN_CREATE | APR_FOPEN_READ
+                             | APR_FOPEN_WRITE | APR_FOPEN_EXCL
+                             | APR_FOPEN_BINARY | APR_FOPEN_DELONCLOSE,
+                             tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    status = apr_file_copy(get_srcdir_file(tb->pool,
+                                           "test/certs/serfclientcert.p12"),
+                           path, APR_FPROT_FILE_SOURCE_PERMS, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    setup_client_cert_cache_test(tc, tb, handler_ctx, path);
+
+    /* Same size, other time: the cached copy may be stale */
+    status = apr_stat(&finfo, path, APR_FINFO_MTIME, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    status = apr_file_mtime_set(path, finfo.mtime - apr_time_from_sec(3600),
+                                tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    status = use_new_connection(tb, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    tb->result_flags = 0;
+    create_new_request(tb, &handler_ctx[1], "GET", "/", 2);
+
+    run_client_and_mock_servers_loops_expect_ok(tc, tb, 1, &handler_ctx[1],
+                                                tb->pool);
+    CuAssertTrue(tc, tb->result_flags & TEST_RESULT_CLIENT_CERTPWCB_CALLED);
+    CuAssertIntEquals(tc, 2, (int)tb->user_baton_l);
+
+    Verify(tb->mh)
+      CuAssert(tc, ErrorMessage, VerifyConnectionSetupOk);
+      CuAssertTrue(tc, VerifyAllRequestsReceivedInOrder);
+    EndVerify
+}
+
 /* Validate that the expired certificate is reported as failure in the
    callback. */
 static void test_ssl_expired_server_cert(CuTest *tc)
@@ -1286,8 +1894,217 @@ static void test_ssl_revoked_server_cert(CuTest *tc)
     }
 }
 
-/* Test if serf is sets up an SSL tunnel to the proxy and doesn't contact the
- https server directly. */
+/* Validate that the CRLs of a store shared by the context are used to
+   check the server certificate. */
+static void test_ssl_crl_store(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    handler_baton_t handler_ctx[1];
+    const int num_requests = sizeof(handler_ctx)/sizeof(handler_ctx[0]);
+    serf_ssl_crl_store_t *store;
+    int depth;
+    apr_status_t status;
+
+    static const char *server_certs[] = {
+        "serfservercert.pem",
+        "serfcacert.pem",
+        "serfrootcacert.pem",
+        NULL };
+
+    static int expected_failures[] = {
+        SERF_SSL_CERT_REVOKED,
+        SERF_SSL_CERT_UNABLE_TO_GET_CRL,
+        SERF_SSL_CERT_UNABLE_TO_GET_CRL
+    };
+
+    setup_test_mock_https_server(tb, server_key,
+                                 server_certs,
+                                 test_clientcert_none);
+    status = setup_test_client_https_context(tb,
+                                             https_set_root_ca_conn_setup,
+                                             ssl_server_cert_cb_log_failures,
+                                             tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    status = serf_ssl_crl_store_create(&store, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    status = serf_ssl_crl_store_add_file(
+                 store,
+                 get_srcdir_file(tb->pool, "test/certs/serfservercert.pem"),
+                 tb->pool);
+    CuAssertIntEquals(tc, SERF_ERROR_SSL_CERT_FAILED, status);
+
+    status = serf_ssl_crl_store_add_file(
+                 store,
+                 get_srcdir_file(tb->pool, "test/certs/serfservercrl.pem"),
+                 tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    serf_context_set_ssl_crl_store(tb->context, store);
+
+    Given(tb->mh)
+      GETRequest(URLEqualTo("/"), ChunkedBodyEqualTo("1"),
+                 HeaderEqualTo("Host", tb->serv_host))
+        Respond(WithCode(200), WithChunkedBody(""))
+    EndGiven
+
+    create_new_request(tb, &handler_ctx[0], "GET", "/", 1);
+
+    run_client_and_mock_servers_loops_expect_ok(tc, tb, num_requests,
+                                                handler_ctx, tb->pool);
+    CuAssertTrue(tc, tb->result_flags & TEST_RESULT_SERVERCERTCB_CALLED);
+    for (depth = 0; depth < 3; depth++) {
+        apr_array_header_t *ary = tb->user_baton;
+
+        CuAssertIntEquals(tc, expected_failures[depth],
+                          APR_ARRAY_IDX(ary, depth, int));
+    }
+}
+
+/* Writes a CRL of the test CA that revokes nothing to the file at PATH */
+static apr_status_t write_empty_ca_crl(test_baton_t *tb, const char *path)
+{
+    X509 *cacert = NULL;
+    EVP_PKEY *cakey = NULL;
+    X509_CRL *crl = NULL;
+    ASN1_TIME *tm = NULL;
+    BIO *bio;
+    apr_status_t status = APR_EGENERAL;
+
+    bio = BIO_new_file(get_srcdir_file(tb->pool, "test/certs/serfcacert.pem"),
+                       "r");
+    if (bio) {
+        cacert = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+        BIO_free(bio);
+    }
+    bio = BIO_new_file(get_srcdir_file(tb->pool,
+                                       "test/certs/private/serfcakey.pem"),
+                       "r");
+    if (bio) {
+        cakey = PEM_read_bio_PrivateKey(bio, NULL, NULL, "serftest");
+        BIO_free(bio);
+    }
+    if (!cacert || !cakey)
+        goto cleanup;
+
+    crl = X509_CRL_new();
+    tm = X509_gmtime_adj(NULL, -3600);
+    if (!crl || !tm
+        || !X509_CRL_set_issuer_name(crl, X509_get_subject_name(cacert))
+        || !X509_CRL_set1_lastUpdate(crl, tm)
+        || !X509_gmtime_adj(tm, 24 * 3600)
+        || !X509_CRL_set1_nextUpdate(crl, tm)
+        || !X509_CRL_sign(crl, cakey, EVP_sha256()))
+        goto cleanup;
+
+    bio = BIO_new_file(path, "w");
+    if (bio) {
+        if (PEM_write_bio_X509_CRL(bio, crl))
+            status = APR_SUCCESS;
+        BIO_free(bio);
+    }
+
+cleanup:
+    ASN1_TIME_free(tm);
+    X509_CRL_free(crl);
+    EVP_PKEY_free(cakey);
+    X509_free(cacert);
+
+    return status;
+}
+
+/* Validate that a CRL file of a store that is rewritten is loaded again,
+   and that the next connection sees the new CRL */
+static void test_ssl_crl_store_reload(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    handler_baton_t handler_ctx[2];
+    serf_ssl_crl_store_t *store;
+    apr_array_header_t *failures;
+    const char *temp_dir;
+    char *path;
+    apr_file_t *file;
+    apr_status_t status;
+
+    static const char *server_certs[] = {
+        "serfservercert.pem",
+        "serfcacert.pem",
+        "serfrootcacert.pem",
+        NULL };
+
+    setup_test_mock_https_server(tb, server_key,
+                                 server_certs,
+                                 test_clientcert_none);
+    status = setup_test_client_https_context(tb,
+                                             https_set_root_ca_conn_setup,
+                                             ssl_server_cert_cb_log_failures,
+                                             tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    status = apr_temp_dir_get(&temp_dir, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    path = apr_pstrcat(tb->pool, temp_dir, "/serf-testXXXXXX", NULL);
+    status = apr_file_mktemp(&file, path,
+                             APR_FOPEN_CREATE | APR_FOPEN_READ
+                             | APR_FOPEN_WRITE | APR_FOPEN_EXCL
+                             | APR_FOPEN_BINARY | APR_FOPEN_DELONCLOSE,
+                             tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    status = apr_file_copy(get_srcdir_file(tb->pool,
+                                           "test/certs/serfservercrl.pem"),
+                           path, APR_FPROT_FILE_SOURCE_PERMS, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    status = serf_ssl_crl_store_create(&store, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    serf_ssl_crl_store_set_check_interval(store, 0);
+    status = serf_ssl_crl_store_add_file(store, path, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    serf_context_set_ssl_crl_store(tb->context, store);
+
+    Given(tb->mh)
+      GETRequest(URLEqualTo("/"), ChunkedBodyEqualTo("1"),
+                 HeaderEqualTo("Host", tb->serv_host))
+        Respond(WithCode(200), WithChunkedBody(""))
+      GETRequest(URLEqualTo("/"), ChunkedBodyEqualTo("2"),
+                 HeaderEqualTo("Host", tb->serv_host))
+        Respond(WithCode(200), WithChunkedBody(""))
+    EndGiven
+
+    create_new_request(tb, &handler_ctx[0], "GET", "/", 1);
+
+    run_client_and_mock_servers_loops_expect_ok(tc, tb, 1, &handler_ctx[0],
+                                                tb->pool);
+    failures = tb->user_baton;
+    CuAssertPtrNotNull(tc, failures);
+    CuAssertTrue(tc, APR_ARRAY_IDX(failures, 0, int) & SERF_SSL_CERT_REVOKED);
+
+    /* The server certificate isn't revoked anymore */
+    status = write_empty_ca_crl(tb, path);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    status = use_new_connection(tb, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    tb->user_baton = NULL;
+    create_new_request(tb, &handler_ctx[1], "GET", "/", 2);
+
+    run_client_and_mock_servers_loops_expect_ok(tc, tb, 1, &handler_ctx[1],
+                                                tb->pool);
+    failures = tb->user_baton;
+    CuAssertPtrNotNull(tc, failures);
+    CuAssertTrue(tc,
+                 !(APR_ARRAY_IDX(failures, 0, int) & SERF_SSL_CERT_REVOKED));
+
+    Verify(tb->mh)
+      CuAssertTrue(tc, VerifyAllRequestsReceivedInOrder);
+    EndVerify
+}
+
+/* Test if serf is sets up an SSL tunnel to the proxy and doesn't contact the
+ https server directly. */
 static void test_setup_ssltunnel(CuTest *tc)
 {
     test_baton_t *tb = tc->testBaton;
@@ -2555,6 +3372,1048 @@ static apr_status_t verify_ocsp_response(CuTest *tc,
 }
 #endif  /* OPENSSL_NO_OCSP */
 
+static apr_status_t early_data_conn_setup(apr_socket_t *skt,
+                                          serf_bucket_t **input_bkt,
+                                          serf_bucket_t **output_bkt,
+                                          void *setup_baton,
+                                          apr_pool_t *pool)
+{
+    test_baton_t *tb = setup_baton;
+    apr_status_t status;
+
+    status = default_https_conn_setup(skt, input_bkt, output_bkt,
+                                      setup_baton, pool);
+    if (status)
+        return status;
+
+    return serf_ssl_allow_early_data(tb->ssl_context, 1);
+}
+
+/* Validate that a request sent as TLS 1.3 early data is sent again after
+   the handshake when the server rejects the early data */
+static void test_ssl_early_data_rejected(CuTest *tc)
+{
+#ifdef SSL_EARLY_DATA_ACCEPTED
+    test_baton_t *tb = tc->testBaton;
+    handler_baton_t handler_ctx[2];
+    int expected_failures;
+    apr_status_t status;
+    static const char *server_cert[] = { "serfservercert.pem",
+                                         NULL };
+
+    tb->mh = mhInit();
+
+    InitMockServers(tb->mh)
+      SetupServer(WithHTTPS, WithID("server"), WithPort(30080),
+                  WithCertificateFilesPrefix(get_srcdir_file(tb->pool,
+                                                             "test/certs")),
+                  WithCertificateKeyFile(server_key),
+                  WithCertificateKeyPassPhrase("serftest"),
+                  WithCertificateFileArray(server_cert),
+                  WithEarlyDataTickets)
+    EndInit
+
+    tb->serv_port = mhServerPortNr(tb->mh);
+    tb->serv_host = apr_psprintf(tb->pool, "%s:%d", "localhost", tb->serv_port);
+    tb->serv_url = apr_psprintf(tb->pool, "https://%s", tb->serv_host);
+
+    status = setup_test_client_https_context(tb,
+                                             early_data_conn_setup,
+                                             ssl_server_cert_cb_expect_failures,
+                                             tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    expected_failures = SERF_SSL_CERT_UNKNOWNCA;
+    tb->user_baton = &expected_failures;
+
+    Given(tb->mh)
+      GETRequest(URLEqualTo("/first"), HeaderEqualTo("Host", tb->serv_host))
+        Respond(WithCode(200), WithBody(""))
+      GETRequest(URLEqualTo("/second"), HeaderEqualTo("Host", tb->serv_host))
+        Respond(WithCode(200), WithBody(""))
+    EndGiven
+
+    create_new_request(tb, &handler_ctx[0], "GET", "/first", -1);
+
+    status = run_client_and_mock_servers_loops(tb, 1, &handler_ctx[0],
+                                               tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    /* This connection resumes the session, which allows early data */
+    status = use_new_connection(tb, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    create_new_request(tb, &handler_ctx[1], "GET", "/second", -1);
+
+    status = run_client_and_mock_servers_loops(tb, 1, &handler_ctx[1],
+                                               tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, 2, tb->handled_requests->nelts);
+    CuAssertIntEquals(tc, 0, (int)mhServerEarlyDataReceived(tb->mh));
+
+    Verify(tb->mh)
+      CuAssertTrue(tc, VerifyAllRequestsReceivedInOrder);
+    EndVerify
+#endif
+}
+
+/* Validate that a request sent as TLS 1.3 early data is answered once,
+   when the server accepts the early data */
+static void test_ssl_early_data_accepted(CuTest *tc)
+{
+#ifdef SSL_EARLY_DATA_ACCEPTED
+    test_baton_t *tb = tc->testBaton;
+    handler_baton_t handler_ctx[2];
+    int expected_failures;
+    apr_status_t status;
+    static const char *server_cert[] = { "serfservercert.pem",
+                                         NULL };
+
+    tb->mh = mhInit();
+
+    InitMockServers(tb->mh)
+      SetupServer(WithHTTPS, WithID("server"), WithPort(30080),
+                  WithCertificateFilesPrefix(get_srcdir_file(tb->pool,
+                                                             "test/certs")),
+                  WithCertificateKeyFile(server_key),
+                  WithCertificateKeyPassPhrase("serftest"),
+                  WithCertificateFileArray(server_cert),
+                  WithEarlyDataAccepted)
+    EndInit
+
+    tb->serv_port = mhServerPortNr(tb->mh);
+    tb->serv_host = apr_psprintf(tb->pool, "%s:%d", "localhost", tb->serv_port);
+    tb->serv_url = apr_psprintf(tb->pool, "https://%s", tb->serv_host);
+
+    status = setup_test_client_https_context(tb,
+                                             early_data_conn_setup,
+                                             ssl_server_cert_cb_expect_failures,
+                                             tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    expected_failures = SERF_SSL_CERT_UNKNOWNCA;
+    tb->user_baton = &expected_failures;
+
+    Given(tb->mh)
+      GETRequest(URLEqualTo("/first"), HeaderEqualTo("Host", tb->serv_host))
+        Respond(WithCode(200), WithBody(""))
+      GETRequest(URLEqualTo("/second"), HeaderEqualTo("Host", tb->serv_host))
+        Respond(WithCode(200), WithBody(""))
+    EndGiven
+
+    create_new_request(tb, &handler_ctx[0], "GET", "/first", -1);
+
+    status = run_client_and_mock_servers_loops(tb, 1, &handler_ctx[0],
+                                               tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    /* This connection resumes the session, which allows early data */
+    status = use_new_connection(tb, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    create_new_request(tb, &handler_ctx[1], "GET", "/second", -1);
+
+    status = run_client_and_mock_servers_loops(tb, 1, &handler_ctx[1],
+                                               tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, 2, tb->handled_requests->nelts);
+
+    /* The second request went out early, and the server took it */
+    CuAssertTrue(tc, mhServerEarlyDataReceived(tb->mh) > 0);
+
+    Verify(tb->mh)
+      CuAssertTrue(tc, VerifyAllRequestsReceivedInOrder);
+    EndVerify
+#endif
+}
+
+/* Validate that the sessions of a context with a session cache are kept
+   in the file of the cache, and resumed by a context that loads it */
+static void test_ssl_session_cache_file(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    handler_baton_t handler_ctx[2];
+    serf_ssl_session_cache_t *cache;
+    const char *temp_dir;
+    char *path;
+    apr_file_t *file;
+    apr_finfo_t finfo;
+    apr_status_t status;
+
+    setup_test_mock_https_server(tb, server_key,
+                                 server_certs,
+                                 test_clientcert_none);
+    status = setup_test_client_https_context(tb,
+                                             https_set_root_ca_conn_setup,
+                                             ssl_server_cert_cb_expect_allok,
+                                             tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    status = apr_temp_dir_get(&temp_dir, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    path = apr_pstrcat(tb->pool, temp_dir, "/serf-testXXXXXX", NULL);
+    status = apr_file_mktemp(&file, path,
+                             APR_FOPEN_CREATE | APR_FOPEN_READ
+                             | APR_FOPEN_WRITE | APR_FOPEN_EXCL
+                             | APR_FOPEN_BINARY | APR_FOPEN_DELONCLOSE,
+                             tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    status = serf_ssl_session_cache_create(&cache, 16, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    status = serf_ssl_session_cache_set_file(cache, path, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    serf_context_set_ssl_session_cache(tb->context, cache);
+
+    Given(tb->mh)
+      GETRequest(URLEqualTo("/"), ChunkedBodyEqualTo("1"),
+                 HeaderEqualTo("Host", tb->serv_host))
+        Respond(WithCode(200), WithChunkedBody(""))
+      GETRequest(URLEqualTo("/"), ChunkedBodyEqualTo("2"),
+                 HeaderEqualTo("Host", tb->serv_host))
+        Respond(WithCode(200), WithChunkedBody(""))
+    EndGiven
+
+    create_new_request(tb, &handler_ctx[0], "GET", "/", 1);
+
+    status = run_client_and_mock_servers_loops(tb, 1, &handler_ctx[0],
+                                               tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertTrue(tc, tb->result_flags & TEST_RESULT_SERVERCERTCB_CALLED);
+
+    status = apr_stat(&finfo, path, APR_FINFO_SIZE, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertTrue(tc, finfo.size > 0);
+
+    /* Another process loads what is still valid, and resumes the session
+       on its first connection: the certificate isn't checked again */
+    status = serf_ssl_session_cache_create(&cache, 16, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    status = serf_ssl_session_cache_set_file(cache, path, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    tb->context = serf_context_create(tb->pool);
+    serf_context_set_ssl_session_cache(tb->context, cache);
+    status = use_new_connection(tb, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    tb->result_flags = 0;
+    create_new_request(tb, &handler_ctx[1], "GET", "/", 2);
+
+    status = run_client_and_mock_servers_loops(tb, 1, &handler_ctx[1],
+                                               tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, 2, tb->handled_requests->nelts);
+    CuAssertTrue(tc, !(tb->result_flags & TEST_RESULT_SERVERCERTCB_CALLED));
+
+    Verify(tb->mh)
+      CuAssertTrue(tc, VerifyAllRequestsReceivedInOrder);
+    EndVerify
+}
+
+#define SESSION_TIMING_HANDSHAKES 10
+
+/* Sends a request over a new connection of a new context COUNT times.
+   The context uses SHARED as its session cache, or a new cache that loads
+   the file at PATH when that is set, or no cache at all. Logs the time the
+   handshakes took, and returns how many of them resumed a session */
+static int time_handshakes(CuTest *tc, test_baton_t *tb,
+                           handler_baton_t *handler_ctx,
+                           const char *label, int count,
+                           serf_ssl_session_cache_t *shared,
+                           const char *path)
+{
+    apr_time_t start = apr_time_now();
+    clock_t cpu_start = clock();
+    double secs, cpu_secs;
+    int resumed = 0;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        serf_ssl_session_cache_t *cache = shared;
+        apr_status_t status;
+
+        if (path) {
+            status = serf_ssl_session_cache_create(&cache, 16, tb->pool);
+            CuAssertIntEquals(tc, APR_SUCCESS, status);
+            status = serf_ssl_session_cache_set_file(cache, path, tb->pool);
+            CuAssertIntEquals(tc, APR_SUCCESS, status);
+        }
+
+        tb->context = serf_context_create(tb->pool);
+        if (cache)
+            serf_context_set_ssl_session_cache(tb->context, cache);
+        status = use_new_connection(tb, tb->pool);
+        CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+        tb->result_flags = 0;
+        create_new_request(tb, handler_ctx, "GET", "/", i + 1);
+
+        status = run_client_and_mock_servers_loops(tb, 1, handler_ctx,
+                                                   tb->pool);
+        CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+        /* A resumed session isn't checked again */
+        if (!(tb->result_flags & TEST_RESULT_SERVERCERTCB_CALLED))
+            resumed++;
+    }
+
+    secs = (double)(apr_time_now() - start) / APR_USEC_PER_SEC;
+    cpu_secs = (double)(clock() - cpu_start) / CLOCKS_PER_SEC;
+    test__log(TEST_VERBOSE, __FILE__,
+              "%d handshakes %s, %d resumed: %.2f ms each, "
+              "%.2f ms CPU each (client and server)\n",
+              count, label, resumed, secs * 1000 / count,
+              cpu_secs * 1000 / count);
+
+    return resumed;
+}
+
+/* Times full handshakes with the mock server against handshakes that
+   resume a session from a session cache shared by contexts, and from the
+   file of a session cache. The times are logged with TEST_VERBOSE; the
+   test checks that the handshakes are resumed when they should be */
+static void test_ssl_session_cache_handshake_times(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    handler_baton_t handler_ctx[1];
+    serf_ssl_session_cache_t *cache;
+    const char *temp_dir;
+    char *path;
+    apr_file_t *file;
+    int resumed;
+    apr_status_t status;
+
+    setup_test_mock_https_server(tb, server_key,
+                                 server_certs,
+                                 test_clientcert_none);
+    status = setup_test_client_https_context(tb,
+                                             https_set_root_ca_conn_setup,
+                                             ssl_server_cert_cb_expect_allok,
+                                             tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    Given(tb->mh)
+      GETRequest(URLEqualTo("/"), HeaderEqualTo("Host", tb->serv_host))
+        Respond(WithCode(200), WithChunkedBody(""))
+    EndGiven
+
+    resumed = time_handshakes(tc, tb, handler_ctx, "without a cache",
+                              SESSION_TIMING_HANDSHAKES, NULL, NULL);
+    CuAssertIntEquals(tc, 0, resumed);
+
+    /* The first handshake fills the cache */
+    status = serf_ssl_session_cache_create(&cache, 16, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    resumed = time_handshakes(tc, tb, handler_ctx, "to fill a shared cache",
+                              1, cache, NULL);
+    CuAssertIntEquals(tc, 0, resumed);
+    resumed = time_handshakes(tc, tb, handler_ctx, "with a shared cache",
+                              SESSION_TIMING_HANDSHAKES, cache, NULL);
+    CuAssertIntEquals(tc, SESSION_TIMING_HANDSHAKES, resumed);
+
+    status = apr_temp_dir_get(&temp_dir, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    path = apr_pstrcat(tb->pool, temp_dir, "/serf-testXXXXXX", NULL);
+    status = apr_file_mktemp(&file, path,
+                             APR_FOPEN_CREATE | APR_FOPEN_READ
+                             | APR_FOPEN_WRITE | APR_FOPEN_EXCL
+                             | APR_FOPEN_BINARY | APR_FOPEN_DELONCLOSE,
+                             tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    resumed = time_handshakes(tc, tb, handler_ctx, "to fill a cache file",
+                              1, NULL, path);
+    CuAssertIntEquals(tc, 0, resumed);
+    resumed = time_handshakes(tc, tb, handler_ctx, "with a cache file",
+                              SESSION_TIMING_HANDSHAKES, NULL, path);
+    CuAssertIntEquals(tc, SESSION_TIMING_HANDSHAKES, resumed);
+}
+
+/* Validate that a session whose certificate the application accepted
+   despite failures isn't shared through the session cache */
+static void test_ssl_session_cache_untrusted(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    handler_baton_t handler_ctx[2];
+    serf_ssl_session_cache_t *cache;
+    int expected_failures;
+    apr_status_t status;
+    static const char *server_cert[] = { "serfservercert.pem",
+        NULL };
+
+    setup_test_mock_https_server(tb, server_key,
+                                 server_cert,
+                                 test_clientcert_none);
+    status = setup_test_client_https_context(tb, NULL,
+                                             ssl_server_cert_cb_expect_failures,
+                                             tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    expected_failures = SERF_SSL_CERT_UNKNOWNCA;
+    tb->user_baton = &expected_failures;
+
+    status = serf_ssl_session_cache_create(&cache, 16, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    serf_context_set_ssl_session_cache(tb->context, cache);
+
+    Given(tb->mh)
+      GETRequest(URLEqualTo("/"), ChunkedBodyEqualTo("1"),
+                 HeaderEqualTo("Host", tb->serv_host))
+        Respond(WithCode(200), WithChunkedBody(""))
+      GETRequest(URLEqualTo("/"), ChunkedBodyEqualTo("2"),
+                 HeaderEqualTo("Host", tb->serv_host))
+        Respond(WithCode(200), WithChunkedBody(""))
+    EndGiven
+
+    create_new_request(tb, &handler_ctx[0], "GET", "/", 1);
+
+    status = run_client_and_mock_servers_loops(tb, 1, &handler_ctx[0],
+                                               tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    /* Another context sharing the cache has to check the certificate */
+    tb->context = serf_context_create(tb->pool);
+    serf_context_set_ssl_session_cache(tb->context, cache);
+    status = use_new_connection(tb, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    tb->result_flags = 0;
+    create_new_request(tb, &handler_ctx[1], "GET", "/", 2);
+
+    status = run_client_and_mock_servers_loops(tb, 1, &handler_ctx[1],
+                                               tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertTrue(tc, tb->result_flags & TEST_RESULT_SERVERCERTCB_CALLED);
+}
+
+/* Validate that a certificate chain accepted before is accepted by a new
+   connection without asking the application again */
+static void test_ssl_verify_cache(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    handler_baton_t handler_ctx[2];
+    serf_ssl_verify_cache_t *cache;
+    int expected_failures;
+    apr_status_t status;
+    static const char *server_cert[] = { "serfservercert.pem",
+        NULL };
+
+    setup_test_mock_https_server(tb, server_key,
+                                 server_cert,
+                                 test_clientcert_none);
+    status = setup_test_client_https_context(tb, NULL,
+                                             ssl_server_cert_cb_expect_failures,
+                                             tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    expected_failures = SERF_SSL_CERT_UNKNOWNCA;
+    tb->user_baton = &expected_failures;
+
+    status = serf_ssl_verify_cache_create(&cache, 16, 0, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    serf_context_set_ssl_verify_cache(tb->context, cache);
+
+    Given(tb->mh)
+      GETRequest(URLEqualTo("/"), ChunkedBodyEqualTo("1"),
+                 HeaderEqualTo("Host", tb->serv_host))
+        Respond(WithCode(200), WithChunkedBody(""))
+      GETRequest(URLEqualTo("/"), ChunkedBodyEqualTo("2"),
+                 HeaderEqualTo("Host", tb->serv_host))
+        Respond(WithCode(200), WithChunkedBody(""))
+    EndGiven
+
+    create_new_request(tb, &handler_ctx[0], "GET", "/", 1);
+
+    status = run_client_and_mock_servers_loops(tb, 1, &handler_ctx[0],
+                                               tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertTrue(tc, tb->result_flags & TEST_RESULT_SERVERCERTCB_CALLED);
+
+    /* A new context has no session to resume, so the server certificate
+       is checked again */
+    tb->context = serf_context_create(tb->pool);
+    serf_context_set_ssl_verify_cache(tb->context, cache);
+    status = use_new_connection(tb, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    tb->result_flags = 0;
+    create_new_request(tb, &handler_ctx[1], "GET", "/", 2);
+
+    status = run_client_and_mock_servers_loops(tb, 1, &handler_ctx[1],
+                                               tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, 2, tb->handled_requests->nelts);
+    CuAssertTrue(tc, !(tb->result_flags & TEST_RESULT_SERVERCERTCB_CALLED));
+
+    Verify(tb->mh)
+      CuAssertTrue(tc, VerifyAllRequestsReceivedInOrder);
+    EndVerify
+}
+
+static apr_status_t
+ssl_server_cert_cb_accept(void *baton, int failures,
+                          const serf_ssl_certificate_t *cert)
+{
+    test_baton_t *tb = baton;
+    tb->result_flags |= TEST_RESULT_SERVERCERTCB_CALLED;
+
+    return APR_SUCCESS;
+}
+
+/* Validate that a certificate chain checked by a connection that doesn't
+   trust its root isn't accepted from the cache by one that does, and the
+   other way around */
+static void test_ssl_verify_cache_trust(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    handler_baton_t handler_ctx[3];
+    serf_ssl_verify_cache_t *cache;
+    apr_status_t status;
+    int i;
+
+    setup_test_mock_https_server(tb, server_key,
+                                 server_certs,
+                                 test_clientcert_none);
+    status = setup_test_client_https_context(tb, NULL,
+                                             ssl_server_cert_cb_accept,
+                                             tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    status = serf_ssl_verify_cache_create(&cache, 16, 0, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    serf_context_set_ssl_verify_cache(tb->context, cache);
+
+    Given(tb->mh)
+      GETRequest(URLEqualTo("/"), ChunkedBodyEqualTo("1"),
+                 HeaderEqualTo("Host", tb->serv_host))
+        Respond(WithCode(200), WithChunkedBody(""))
+      GETRequest(URLEqualTo("/"), ChunkedBodyEqualTo("2"),
+                 HeaderEqualTo("Host", tb->serv_host))
+        Respond(WithCode(200), WithChunkedBody(""))
+      GETRequest(URLEqualTo("/"), ChunkedBodyEqualTo("3"),
+                 HeaderEqualTo("Host", tb->serv_host))
+        Respond(WithCode(200), WithChunkedBody(""))
+    EndGiven
+
+    for (i = 0; i < 3; i++) {
+        /* The first connection doesn't trust the root, the others do */
+        if (i > 0) {
+            tb->conn_setup = https_set_root_ca_conn_setup;
+            tb->context = serf_context_create(tb->pool);
+            serf_context_set_ssl_verify_cache(tb->context, cache);
+            status = use_new_connection(tb, tb->pool);
+            CuAssertIntEquals(tc, APR_SUCCESS, status);
+        }
+
+        tb->result_flags = 0;
+        create_new_request(tb, &handler_ctx[i], "GET", "/", i + 1);
+
+        status = run_client_and_mock_servers_loops(tb, 1, &handler_ctx[i],
+                                                   tb->pool);
+        CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+        /* Only the last connection finds a chain checked with its trust
+           store in the cache */
+        if (i < 2)
+            CuAssertTrue(tc,
+                         tb->result_flags & TEST_RESULT_SERVERCERTCB_CALLED);
+        else
+            CuAssertTrue(tc,
+                         !(tb->result_flags & TEST_RESULT_SERVERCERTCB_CALLED));
+    }
+
+    Verify(tb->mh)
+      CuAssertTrue(tc, VerifyAllRequestsReceivedInOrder);
+    EndVerify
+}
+
+/* Validate that a server certificate whose OCSP responder can't be reached
+   is accepted once the responder failed. */
+static void test_ssl_ocsp_fetch_unreachable(CuTest *tc)
+{
+#ifndef OPENSSL_NO_OCSP
+    test_baton_t *tb = tc->testBaton;
+    handler_baton_t handler_ctx[2];
+    const int num_requests = sizeof(handler_ctx)/sizeof(handler_ctx[0]);
+    int expected_failures;
+    apr_status_t status;
+
+    /* The OCSP responder of this certificate is at localhost:17080, where
+       no server listens */
+    static const char *server_certs[] = {
+        "serfserver_san_ocsp_cert.pem",
+        "serfcacert.pem",
+        "serfrootcacert.pem",
+        NULL };
+
+    setup_test_mock_https_server(tb, server_key,
+                                 server_certs,
+                                 test_clientcert_none);
+    status = setup_test_client_https_context(tb,
+                                             NULL, /* default conn setup */
+                                             ssl_server_cert_cb_expect_failures,
+                                             tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    expected_failures = SERF_SSL_CERT_SELF_SIGNED;
+    tb->user_baton = &expected_failures;
+
+    status = serf_context_check_cert_status_online(tb->context, 1);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    Given(tb->mh)
+      GETRequest(URLEqualTo("/"), ChunkedBodyEqualTo("1"),
+                 HeaderEqualTo("Host", tb->serv_host))
+        Respond(WithCode(200), WithChunkedBody(""))
+      GETRequest(URLEqualTo("/"), ChunkedBodyEqualTo("2"),
+                 HeaderEqualTo("Host", tb->serv_host))
+        Respond(WithCode(200), WithChunkedBody(""))
+    EndGiven
+
+    create_new_request(tb, &handler_ctx[0], "GET", "/", 1);
+    create_new_request(tb, &handler_ctx[1], "GET", "/", 2);
+
+    run_client_and_mock_servers_loops_expect_ok(tc, tb, num_requests,
+                                                handler_ctx, tb->pool);
+    CuAssertTrue(tc, tb->result_flags & TEST_RESULT_SERVERCERTCB_CALLED);
+#endif /* OPENSSL_NO_OCSP */
+}
+
+#ifndef OPENSSL_NO_OCSP
+/* Collects the failures of the server certificate, including those found
+   by the OCSP responder, and accepts them */
+static apr_status_t
+ssl_server_cert_cb_collect_failures(void *baton, int failures,
+                                    const serf_ssl_certificate_t *cert)
+{
+    test_baton_t *tb = baton;
+
+    tb->result_flags |= TEST_RESULT_SERVERCERTCB_CALLED;
+    *(int *)tb->user_baton |= failures;
+
+    return APR_SUCCESS;
+}
+
+/* Sets up the mock https server with a certificate whose OCSP responder is
+   at localhost:17080, a mock OCSP responder there that reports
+   CERT_STATUS, and a client that trusts the root CA and checks the
+   status online */
+static void setup_ocsp_fetch_test(CuTest *tc,
+                                  mhOCSPCertStatus_t cert_status,
+                                  int *failures)
+{
+    test_baton_t *tb = tc->testBaton;
+    apr_status_t status;
+    static const char *server_certs[] = {
+        "serfserver_san_ocsp_cert.pem",
+        "serfcacert.pem",
+        "serfrootcacert.pem",
+        NULL };
+
+    setup_test_mock_https_server(tb, server_key,
+                                 server_certs,
+                                 test_clientcert_none);
+
+    InitMockServers(tb->mh)
+      SetupOCSPResponder(WithPort(17080),
+                         WithCertificateFilesPrefix(
+                             get_srcdir_file(tb->pool, "test/certs")),
+                         WithCertificateKeyFile(server_key),
+                         WithCertificateKeyPassPhrase("serftest"),
+                         WithCertificateFiles("serfocspresponder.pem",
+                                              "serfcacert.pem"),
+                         WithOCSPCertStatus(cert_status))
+    EndInit
+
+    status = setup_test_client_https_context(
+                 tb, https_set_root_ca_conn_setup,
+                 ssl_server_cert_cb_collect_failures,
+                 tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    status = serf_context_check_cert_status_online(tb->context, 1);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    *failures = 0;
+    tb->user_baton = failures;
+
+    Given(tb->mh)
+      GETRequest(URLEqualTo("/"), ChunkedBodyEqualTo("1"),
+                 HeaderEqualTo("Host", tb->serv_host))
+        Respond(WithCode(200), WithChunkedBody(""))
+      GETRequest(URLEqualTo("/"), ChunkedBodyEqualTo("2"),
+                 HeaderEqualTo("Host", tb->serv_host))
+        Respond(WithCode(200), WithChunkedBody(""))
+      GETRequest(URLEqualTo("/"), ChunkedBodyEqualTo("3"),
+                 HeaderEqualTo("Host", tb->serv_host))
+        Respond(WithCode(200), WithChunkedBody(""))
+    EndGiven
+}
+#endif /* OPENSSL_NO_OCSP */
+
+/* Validate that the status of the server certificate is fetched from its
+   OCSP responder, and that a good status passes without failures */
+static void test_ssl_ocsp_fetch_good(CuTest *tc)
+{
+#ifndef OPENSSL_NO_OCSP
+    test_baton_t *tb = tc->testBaton;
+    handler_baton_t handler_ctx[1];
+    const int num_requests = sizeof(handler_ctx)/sizeof(handler_ctx[0]);
+    int failures;
+
+    setup_ocsp_fetch_test(tc, mhOCSPCertStatusGood, &failures);
+
+    create_new_request(tb, &handler_ctx[0], "GET", "/", 1);
+
+    run_client_and_mock_servers_loops_expect_ok(tc, tb, num_requests,
+                                                handler_ctx, tb->pool);
+
+    CuAssertIntEquals(tc, 1, (int)mhOCSPResponderRequestsReceived(tb->mh));
+    CuAssertIntEquals(tc, 0, failures);
+#endif /* OPENSSL_NO_OCSP */
+}
+
+/* Validate that a revoked status from the OCSP responder reaches the server
+   certificate callback */
+static void test_ssl_ocsp_fetch_revoked(CuTest *tc)
+{
+#ifndef OPENSSL_NO_OCSP
+    test_baton_t *tb = tc->testBaton;
+    handler_baton_t handler_ctx[1];
+    const int num_requests = sizeof(handler_ctx)/sizeof(handler_ctx[0]);
+    int failures;
+
+    setup_ocsp_fetch_test(tc, mhOCSPCertStatusRevoked, &failures);
+
+    create_new_request(tb, &handler_ctx[0], "GET", "/", 1);
+
+    /* The callback accepts the failure, so the request still succeeds */
+    run_client_and_mock_servers_loops_expect_ok(tc, tb, num_requests,
+                                                handler_ctx, tb->pool);
+
+    CuAssertIntEquals(tc, 1, (int)mhOCSPResponderRequestsReceived(tb->mh));
+    CuAssertIntEquals(tc, SERF_SSL_CERT_REVOKED,
+                      failures & SERF_SSL_CERT_REVOKED);
+#endif /* OPENSSL_NO_OCSP */
+}
+
+/* Validate that connections that wait for the status of the same
+   certificate share a single query to the OCSP responder */
+static void test_ssl_ocsp_fetch_shared(CuTest *tc)
+{
+#ifndef OPENSSL_NO_OCSP
+    test_baton_t *tb = tc->testBaton;
+    handler_baton_t handler_ctx[3];
+    const int num_requests = sizeof(handler_ctx)/sizeof(handler_ctx[0]);
+    int failures;
+    int i;
+
+    setup_ocsp_fetch_test(tc, mhOCSPCertStatusRevoked, &failures);
+
+    for (i = 0; i < num_requests; i++) {
+        if (i > 0) {
+            apr_status_t status = use_new_connection(tb, tb->pool);
+            CuAssertIntEquals(tc, APR_SUCCESS, status);
+        }
+        create_new_request(tb, &handler_ctx[i], "GET", "/", i + 1);
+    }
+
+    run_client_and_mock_servers_loops_expect_ok(tc, tb, num_requests,
+                                                handler_ctx, tb->pool);
+
+    CuAssertIntEquals(tc, 1, (int)mhOCSPResponderRequestsReceived(tb->mh));
+    CuAssertIntEquals(tc, SERF_SSL_CERT_REVOKED,
+                      failures & SERF_SSL_CERT_REVOKED);
+#endif /* OPENSSL_NO_OCSP */
+}
+
+/* Validate that a new connection uses the status fetched by an earlier one,
+   without asking the OCSP responder again */
+static void test_ssl_ocsp_fetch_cached(CuTest *tc)
+{
+#ifndef OPENSSL_NO_OCSP
+    test_baton_t *tb = tc->testBaton;
+    handler_baton_t handler_ctx[2];
+    int failures;
+    apr_status_t status;
+
+    setup_ocsp_fetch_test(tc, mhOCSPCertStatusRevoked, &failures);
+
+    create_new_request(tb, &handler_ctx[0], "GET", "/", 1);
+    run_client_and_mock_servers_loops_expect_ok(tc, tb, 1,
+                                                &handler_ctx[0], tb->pool);
+    CuAssertIntEquals(tc, 1, (int)mhOCSPResponderRequestsReceived(tb->mh));
+    CuAssertIntEquals(tc, SERF_SSL_CERT_REVOKED,
+                      failures & SERF_SSL_CERT_REVOKED);
+
+    /* The known status is still reported to the new connection */
+    failures = 0;
+    status = use_new_connection(tb, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    create_new_request(tb, &handler_ctx[1], "GET", "/", 2);
+    run_client_and_mock_servers_loops_expect_ok(tc, tb, 1,
+                                                &handler_ctx[1], tb->pool);
+    CuAssertIntEquals(tc, 1, (int)mhOCSPResponderRequestsReceived(tb->mh));
+    CuAssertIntEquals(tc, SERF_SSL_CERT_REVOKED,
+                      failures & SERF_SSL_CERT_REVOKED);
+#endif /* OPENSSL_NO_OCSP */
+}
+
+static apr_status_t async_crypto_conn_setup(apr_socket_t *skt,
+                                            serf_bucket_t **input_bkt,
+                                            serf_bucket_t **output_bkt,
+                                            void *setup_baton,
+                                            apr_pool_t *pool)
+{
+    test_baton_t *tb = setup_baton;
+    apr_status_t status;
+
+    status = default_https_conn_setup(skt, input_bkt, output_bkt,
+                                      setup_baton, pool);
+    if (status)
+        return status;
+
+    status = serf_ssl_allow_async_crypto(tb->ssl_context, 1);
+    if (status == APR_ENOTIMPL)
+        status = APR_SUCCESS;
+
+    return status;
+}
+
+/* Validate that requests succeed with async crypto allowed. Without an
+   async engine the crypto completes inline, just as before. */
+static void test_ssl_async_crypto(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    handler_baton_t handler_ctx[2];
+    const int num_requests = sizeof(handler_ctx)/sizeof(handler_ctx[0]);
+    int expected_failures;
+    apr_status_t status;
+    static const char *server_cert[] = { "serfservercert.pem",
+        NULL };
+
+    setup_test_mock_https_server(tb, server_key,
+                                 server_cert,
+                                 test_clientcert_none);
+    status = setup_test_client_https_context(tb,
+                                             async_crypto_conn_setup,
+                                             ssl_server_cert_cb_expect_failures,
+                                             tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    expected_failures = SERF_SSL_CERT_UNKNOWNCA;
+    tb->user_baton = &expected_failures;
+
+    Given(tb->mh)
+      GETRequest(URLEqualTo("/"), ChunkedBodyEqualTo("1"),
+                 HeaderEqualTo("Host", tb->serv_host))
+        Respond(WithCode(200), WithChunkedBody(""))
+      GETRequest(URLEqualTo("/"), ChunkedBodyEqualTo("2"),
+                 HeaderEqualTo("Host", tb->serv_host))
+        Respond(WithCode(200), WithChunkedBody(""))
+    EndGiven
+
+    create_new_request(tb, &handler_ctx[0], "GET", "/", 1);
+    create_new_request(tb, &handler_ctx[1], "GET", "/", 2);
+
+    run_client_and_mock_servers_loops_expect_ok(tc, tb, num_requests,
+                                                handler_ctx, tb->pool);
+}
+
+#if defined(SSL_MODE_ASYNC) && !defined(WIN32)
+/* How often a connection pauses its async jobs */
+#define ASYNC_PAUSES_MAX 4
+
+typedef struct async_pause_stats_t {
+    int pauses;
+    int resumes;
+} async_pause_stats_t;
+
+/* Reads from STREAM, but first pauses the async job the read runs in, like
+   an async engine does while the crypto runs elsewhere. The job waits for
+   the read end of a pipe, which is readable right away. */
+typedef struct async_pause_ctx_t {
+    serf_bucket_t *stream;
+    async_pause_stats_t *stats;
+    int fds[2];
+} async_pause_ctx_t;
+
+static void async_pause(async_pause_ctx_t *ctx)
+{
+    ASYNC_JOB *job = ASYNC_get_current_job();
+    ASYNC_WAIT_CTX *wait_ctx;
+    char c = 0;
+
+    if (!job || ctx->stats->pauses >= ASYNC_PAUSES_MAX)
+        return;
+
+    wait_ctx = ASYNC_get_wait_ctx(job);
+    if (write(ctx->fds[1], &c, 1) != 1
+        || !ASYNC_WAIT_CTX_set_wait_fd(wait_ctx, ctx, ctx->fds[0],
+                                       NULL, NULL))
+        return;
+
+    ctx->stats->pauses++;
+    ASYNC_pause_job();
+    ctx->stats->resumes++;
+
+    ASYNC_WAIT_CTX_clear_fd(wait_ctx, ctx);
+    if (read(ctx->fds[0], &c, 1) != 1)
+        return;
+}
+
+static apr_status_t async_pause_read(serf_bucket_t *bucket,
+                                     apr_size_t requested,
+                                     const char **data, apr_size_t *len)
+{
+    async_pause_ctx_t *ctx = bucket->data;
+
+    async_pause(ctx);
+
+    return serf_bucket_read(ctx->stream, requested, data, len);
+}
+
+static apr_status_t async_pause_readline(serf_bucket_t *bucket,
+                                         int acceptable, int *found,
+                                         const char **data, apr_size_t *len)
+{
+    async_pause_ctx_t *ctx = bucket->data;
+
+    return serf_bucket_readline(ctx->stream, acceptable, found, data, len);
+}
+
+static apr_status_t async_pause_peek(serf_bucket_t *bucket,
+                                     const char **data, apr_size_t *len)
+{
+    async_pause_ctx_t *ctx = bucket->data;
+
+    return serf_bucket_peek(ctx->stream, data, len);
+}
+
+static void async_pause_destroy(serf_bucket_t *bucket)
+{
+    async_pause_ctx_t *ctx = bucket->data;
+
+    close(ctx->fds[0]);
+    close(ctx->fds[1]);
+    serf_bucket_destroy(ctx->stream);
+    serf_default_destroy_and_data(bucket);
+}
+
+static apr_status_t async_pause_set_config(serf_bucket_t *bucket,
+                                           serf_config_t *config)
+{
+    async_pause_ctx_t *ctx = bucket->data;
+
+    return serf_bucket_set_config(ctx->stream, config);
+}
+
+static const serf_bucket_type_t async_pause_bucket_type = {
+    "ASYNC-PAUSE",
+    async_pause_read,
+    async_pause_readline,
+    serf_default_read_iovec,
+    serf_default_read_for_sendfile,
+    serf_buckets_are_v2,
+    async_pause_peek,
+    async_pause_destroy,
+    serf_default_read_bucket,
+    serf_default_get_remaining,
+    async_pause_set_config,
+};
+
+static apr_status_t async_pause_conn_setup(apr_socket_t *skt,
+                                           serf_bucket_t **input_bkt,
+                                           serf_bucket_t **output_bkt,
+                                           void *setup_baton,
+                                           apr_pool_t *pool)
+{
+    test_baton_t *tb = setup_baton;
+    async_pause_ctx_t *ctx;
+    apr_status_t status;
+
+    ctx = serf_bucket_mem_alloc(tb->bkt_alloc, sizeof(*ctx));
+    ctx->stream = serf_bucket_socket_create(skt, tb->bkt_alloc);
+    ctx->stats = tb->user_baton;
+    if (pipe(ctx->fds) != 0) {
+        serf_bucket_destroy(ctx->stream);
+        serf_bucket_mem_free(tb->bkt_alloc, ctx);
+        return APR_EGENERAL;
+    }
+
+    *input_bkt = serf_bucket_create(&async_pause_bucket_type,
+                                    tb->bkt_alloc, ctx);
+    *input_bkt = serf_bucket_ssl_decrypt_create(*input_bkt, NULL,
+                                                tb->bkt_alloc);
+    tb->ssl_context = serf_bucket_ssl_decrypt_context_get(*input_bkt);
+
+    *output_bkt = serf_bucket_ssl_encrypt_create(*output_bkt,
+                                                 tb->ssl_context,
+                                                 tb->bkt_alloc);
+
+    serf_ssl_server_cert_callback_set(tb->ssl_context,
+                                      ssl_server_cert_cb_accept, tb);
+    serf_ssl_set_hostname(tb->ssl_context, "localhost");
+
+    status = serf_ssl_allow_async_crypto(tb->ssl_context, 1);
+
+    return status;
+}
+#endif /* SSL_MODE_ASYNC && !WIN32 */
+
+/* Validate that a connection whose crypto waits in async jobs polls the
+   file descriptors the jobs signal, and continues them once they can run,
+   while the requests complete */
+static void test_ssl_async_crypto_pause(CuTest *tc)
+{
+#if defined(SSL_MODE_ASYNC) && !defined(WIN32)
+    test_baton_t *tb = tc->testBaton;
+    handler_baton_t handler_ctx[2];
+    const int num_requests = sizeof(handler_ctx)/sizeof(handler_ctx[0]);
+    async_pause_stats_t stats = { 0 };
+    apr_status_t status;
+    static const char *server_cert[] = { "serfservercert.pem",
+        NULL };
+
+    setup_test_mock_https_server(tb, server_key,
+                                 server_cert,
+                                 test_clientcert_none);
+    tb->user_baton = &stats;
+    status = setup_test_client_https_context(tb,
+                                             async_pause_conn_setup,
+                                             NULL,
+                                             tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    Given(tb->mh)
+      GETRequest(URLEqualTo("/"), ChunkedBodyEqualTo("1"),
+                 HeaderEqualTo("Host", tb->serv_host))
+        Respond(WithCode(200), WithChunkedBody(""))
+      GETRequest(URLEqualTo("/"), ChunkedBodyEqualTo("2"),
+                 HeaderEqualTo("Host", tb->serv_host))
+        Respond(WithCode(200), WithChunkedBody(""))
+    EndGiven
+
+    create_new_request(tb, &handler_ctx[0], "GET", "/", 1);
+    create_new_request(tb, &handler_ctx[1], "GET", "/", 2);
+
+    run_client_and_mock_servers_loops_expect_ok(tc, tb, num_requests,
+                                                handler_ctx, tb->pool);
+
+    /* The handshake can't complete unless its paused jobs were continued
+       after their descriptors were polled. A read that pauses after the
+       last response may still wait when the test ends. */
+    CuAssertTrue(tc, stats.pauses > 0);
+    CuAssertTrue(tc, stats.resumes > 0);
+    CuAssertTrue(tc, stats.resumes >= stats.pauses - 1);
+#endif /* SSL_MODE_ASYNC && !WIN32 */
+}
+
 static void test_ssl_ocsp_request_create(CuTest *tc)
 {
 #ifndef OPENSSL_NO_OCSP
@@ -2676,6 +4535,10 @@ CuSuite *test_ssl(void)
     CuSuiteSetSetupTeardownCallbacks(suite, test_setup, test_teardown);
 
     SUITE_ADD_TEST(suite, test_ssl_init);
+    SUITE_ADD_TEST(suite, test_ssl_encrypt_gather);
+    SUITE_ADD_TEST(suite, test_ssl_encrypt_retry);
+    SUITE_ADD_TEST(suite, test_ssl_encrypt_unread);
+    SUITE_ADD_TEST(suite, test_ssl_encrypt_record_ramp);
     SUITE_ADD_TEST(suite, test_ssl_load_cert_file);
     SUITE_ADD_TEST(suite, test_ssl_cert_subject);
     SUITE_ADD_TEST(suite, test_ssl_cert_issuer);
@@ -2693,9 +4556,14 @@ CuSuite *test_ssl(void)
     SUITE_ADD_TEST(suite, test_ssl_large_response);
     SUITE_ADD_TEST(suite, test_ssl_large_request);
     SUITE_ADD_TEST(suite, test_ssl_client_certificate);
+    SUITE_ADD_TEST(suite, test_ssl_client_cert_cache);
+    SUITE_ADD_TEST(suite, test_ssl_client_cert_cache_reuse);
+    SUITE_ADD_TEST(suite, test_ssl_client_cert_cache_reload);
     SUITE_ADD_TEST(suite, test_ssl_expired_server_cert);
     SUITE_ADD_TEST(suite, test_ssl_future_server_cert);
     SUITE_ADD_TEST(suite, test_ssl_revoked_server_cert);
+    SUITE_ADD_TEST(suite, test_ssl_crl_store);
+    SUITE_ADD_TEST(suite, test_ssl_crl_store_reload);
     SUITE_ADD_TEST(suite, test_setup_ssltunnel);
     SUITE_ADD_TEST(suite, test_ssltunnel_no_creds_cb);
     SUITE_ADD_TEST(suite, test_ssltunnel_basic_auth);
@@ -2715,6 +4583,20 @@ CuSuite *test_ssl(void)
     SUITE_ADD_TEST(suite, test_ssl_server_cert_with_san_and_empty_cb);
     SUITE_ADD_TEST(suite, test_ssl_renegotiate);
     SUITE_ADD_TEST(suite, test_ssl_alpn_negotiate);
+    SUITE_ADD_TEST(suite, test_ssl_session_cache_file);
+    SUITE_ADD_TEST(suite, test_ssl_session_cache_handshake_times);
+    SUITE_ADD_TEST(suite, test_ssl_session_cache_untrusted);
+    SUITE_ADD_TEST(suite, test_ssl_early_data_rejected);
+    SUITE_ADD_TEST(suite, test_ssl_early_data_accepted);
+    SUITE_ADD_TEST(suite, test_ssl_verify_cache);
+    SUITE_ADD_TEST(suite, test_ssl_verify_cache_trust);
+    SUITE_ADD_TEST(suite, test_ssl_ocsp_fetch_unreachable);
+    SUITE_ADD_TEST(suite, test_ssl_ocsp_fetch_good);
+    SUITE_ADD_TEST(suite, test_ssl_ocsp_fetch_revoked);
+    SUITE_ADD_TEST(suite, test_ssl_ocsp_fetch_shared);
+    SUITE_ADD_TEST(suite, test_ssl_ocsp_fetch_cached);
+    SUITE_ADD_TEST(suite, test_ssl_async_crypto);
+    SUITE_ADD_TEST(suite, test_ssl_async_crypto_pause);
     SUITE_ADD_TEST(suite, test_ssl_ocsp_request_create);
     SUITE_ADD_TEST(suite, test_ssl_ocsp_request_export_import);
     SUITE_ADD_TEST(suite, test_ssl_ocsp_verify_response);
@@ -180,6 +180,28 @@ serf_bucket_t* accept_response(serf_request_t *request,
     return response;
 }
 
+/* Implements test_request_setup_t: creates the same request as
+   setup_request(), and lets serf replay it without calling setup again */
+apr_status_t setup_replayable_request(serf_request_t *request,
+                                      void *setup_baton,
+                                      serf_bucket_t **req_bkt,
+                                      apr_pool_t *pool)
+{
+    handler_baton_t *ctx = setup_baton;
+    serf_bucket_alloc_t *alloc = serf_request_get_alloc(request);
+    const char *str = apr_psprintf(pool, "%d", ctx->req_id);
+
+    serf_request_set_replayable(request, 1024, NULL);
+
+    *req_bkt = serf_request_bucket_request_create(
+                        request, ctx->method, ctx->path,
+                        serf_bucket_simple_copy_create(str, strlen(str),
+                                                       alloc),
+                        alloc);
+
+    return APR_SUCCESS;
+}
+
 apr_status_t setup_request(serf_request_t *request,
                            void *setup_baton,
                            serf_bucket_t **req_bkt,
@@ -538,6 +560,46 @@ run_client_and_mock_servers_loops(test_baton_t *tb,
     return APR_SUCCESS;
 }
 
+apr_status_t
+run_client_and_mock_servers_until(test_baton_t *tb,
+                                  const int *done,
+                                  apr_pool_t *pool)
+{
+    apr_pool_t *iter_pool;
+    MockHTTP *mh = tb->mh;
+    apr_status_t status = APR_SUCCESS;
+    apr_time_t finish_time = apr_time_now() + apr_time_from_sec(15);
+
+    apr_pool_create(&iter_pool, pool);
+
+    while (!*done)
+    {
+        mhError_t err;
+        apr_pool_clear(iter_pool);
+
+        err = mhRunServerLoop(mh);
+
+        status = serf_context_run(tb->context, 0, iter_pool);
+        if (!APR_STATUS_IS_TIMEUP(status) &&
+            SERF_BUCKET_READ_ERROR(status))
+            break;
+        status = APR_SUCCESS;
+
+        if (!*done && (apr_time_now() > finish_time)) {
+            status = APR_ETIMEDOUT;
+            break;
+        }
+
+        if (err == MOCKHTTP_TEST_FAILED) {
+            status = REPORT_TEST_SUITE_ERROR();
+            break;
+        }
+    }
+    apr_pool_destroy(iter_pool);
+
+    return status;
+}
+
 void
 run_client_and_mock_servers_loops_expect_ok(CuTest *tc, test_baton_t *tb,
                                             int num_requests,